@@ -0,0 +1,321 @@
+// Copyright 2024 Luka Mihajlovic, written to pass the cpplint check
+// In-process benchmarks: every kernel, SIMD level and I/O path is timed on
+// its own, so process startup and disk time never hide inside one number
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+// For timing each run
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "libFilmMaster2000.h"
+
+// Synthetic videos, from many tiny frames to few big ones
+struct benchVideo {
+    const char* name;
+    int64_t numFrames;
+    unsigned char channels, height, width;
+};
+
+const benchVideo benchVideos[] = {
+    {"tiny_frames", 20000, 3, 32, 32},
+    {"rgb_255", 1000, 3, 255, 255},
+    {"mono_255", 2000, 1, 255, 255},
+    {"rgba_200", 500, 4, 200, 200},
+};
+
+// Each case is repeated until it has run this long, the best run counts
+const double minBenchSeconds = 0.25;
+const int minBenchRuns = 3;
+const int maxBenchRuns = 50;
+
+struct benchResult {
+    std::string video;
+    std::string group;
+    std::string name;
+    double seconds;
+    double bytes;
+    double frames;
+};
+
+static std::vector<benchResult> results;
+static std::string onlyFilter;
+
+// writeFile and friends report to std::cout, which is where the JSON goes
+static void quiet(const std::function<void()>& run) {
+    std::ostringstream discard;
+    std::streambuf* previous = std::cout.rdbuf(discard.rdbuf());
+    run();
+    std::cout.rdbuf(previous);
+}
+
+// setup runs untimed before every run, bytes is what one run touches
+static void timeCase(const benchVideo& video, const std::string& group,
+const std::string& name, double bytes, const std::function<void()>& setup,
+const std::function<void()>& run) {
+    std::string label = std::string(video.name) + " " + group + " " + name;
+    if (!onlyFilter.empty() && label.find(onlyFilter) == std::string::npos) {
+        return;
+    }
+    double best = 1e30;
+    double total = 0;
+    for (int i = 0; i < maxBenchRuns &&
+    (i < minBenchRuns || total < minBenchSeconds); i++) {
+        if (setup) {
+            quiet(setup);
+        }
+        auto start = std::chrono::steady_clock::now();
+        quiet(run);
+        double seconds = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
+    }
+    results.push_back({video.name, group, name, best, bytes,
+    static_cast<double>(video.numFrames)});
+    std::cerr << label << ": " << best * 1000 << " ms" << std::endl;
+}
+
+// xorshift keeps the pixels deterministic and the branches unpredictable
+static void fillVideo(videoData* video) {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    int64_t length = video->numFrames * video->frameSize;
+    for (int64_t i = 0; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        video->fullFrame[i] = static_cast<unsigned char>(state);
+    }
+}
+
+static void writeVideo(videoData& video, std::string path) {
+    quiet([&]() { writeFile(video, path.c_str()); });
+}
+
+static void benchKernels(const benchVideo& spec, videoData& video) {
+    const double planeBytes = static_cast<double>(video.width) *
+    video.height * video.numFrames;
+    const double videoBytes = planeBytes * video.channels;
+    const int64_t n = video.numFrames;
+
+    timeCase(spec, "chunk", "reverseChunk", videoBytes, nullptr, [&]() {
+        reverseChunk(video, 0, n / 2);
+    });
+    if (video.channels >= 2) {
+        timeCase(spec, "chunk", "swapChunk", 2 * planeBytes, nullptr, [&]() {
+            swapChunk(video, 0, n, 0, 1);
+        });
+    }
+    timeCase(spec, "chunk", "clipChunk", planeBytes, nullptr, [&]() {
+        clipChunk(video, 0, n, 0, 10, 200);
+    });
+    // Scaling down keeps the data from saturating over the repeats
+    timeCase(spec, "chunk", "scaleChunk", planeBytes, nullptr, [&]() {
+        scaleChunk(video, 0, n, 0, 0.9f);
+    });
+    if (video.channels >= 3) {
+        timeCase(spec, "chunk", "sepiaChunk", 3 * planeBytes, nullptr, [&]() {
+            sepiaChunk(video, 0, n);
+        });
+    }
+    blurParams box = makeBoxBlur(5);
+    timeCase(spec, "chunk", "blurChunk_box", videoBytes, nullptr, [&]() {
+        blurChunk(video, 0, n, box);
+    });
+    blurParams gaussian = makeGaussianBlur(2.0f);
+    timeCase(spec, "chunk", "blurChunk_gaussian", videoBytes, nullptr, [&]() {
+        blurChunk(video, 0, n, gaussian);
+    });
+    // Half size proxies, the output goes to a buffer of its own
+    for (bool bilinear : {false, true}) {
+        resizeParams half;
+        makeResize(video, (video.width + 1) / 2, (video.height + 1) / 2,
+        bilinear, &half);
+        std::vector<unsigned char> resized(n * video.channels * half.width *
+        half.height);
+        timeCase(spec, "chunk", bilinear ? "resizeChunk_bilinear" :
+        "resizeChunk_area", videoBytes, nullptr, [&]() {
+            resizeChunk(video, resized.data(), 0, n, half);
+        });
+    }
+    temporalParams average = makeTemporal(5, 255);
+    timeCase(spec, "chunk", "temporalChunk", videoBytes, nullptr, [&]() {
+        temporalChunk(video, 0, video.frameSize, average);
+    });
+    timeCase(spec, "chunk", "statsChunk", videoBytes, nullptr, [&]() {
+        videoStats stats = makeStats(video, true);
+        statsChunk(video, 0, n, &stats);
+    });
+
+    // The same work through each SIMD level the machine supports, one
+    // call over the whole video so only the kernel itself is measured
+    const int64_t length = n * video.frameSize;
+    unsigned char table[256];
+    for (int i = 0; i < 256; i++) {
+        table[i] = static_cast<unsigned char>(255 - i);
+    }
+    scaleParams scale = makeScaleParams(0.9f);
+    frameOp sepiaOp = makeSepiaOp();
+    matrixParams sepia = makeMatrixParams(sepiaOp);
+    for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+        const pixelKernels& kernels =
+        kernelsFor(static_cast<simdLevel>(level));
+        std::string group = std::string("simd_") + kernels.name;
+        unsigned char* data = video.fullFrame;
+        timeCase(spec, group, "clip", length, nullptr, [&]() {
+            kernels.clip(data, length, 10, 200);
+        });
+        timeCase(spec, group, "scale", length, nullptr, [&]() {
+            kernels.scale(data, length, scale);
+        });
+        timeCase(spec, group, "swap", length, nullptr, [&]() {
+            kernels.swap(data, data + length / 2, length / 2);
+        });
+        timeCase(spec, group, "lookup", length, nullptr, [&]() {
+            kernels.lookup(data, length, table);
+        });
+        // Frame by frame through one packed frame, as the loaders do
+        const int64_t planeSize = video.width * video.height;
+        std::vector<unsigned char> packed(video.frameSize);
+        timeCase(spec, group, "interleave", length, nullptr, [&]() {
+            for (int64_t i = 0; i < n; i++) {
+                kernels.interleave(data + i * video.frameSize, packed.data(),
+                planeSize, video.channels, 0, planeSize);
+            }
+        });
+        timeCase(spec, group, "deinterleave", length, nullptr, [&]() {
+            for (int64_t i = 0; i < n; i++) {
+                kernels.deinterleave(packed.data(), data + i * video.frameSize,
+                planeSize, video.channels, 0, planeSize);
+            }
+        });
+        if (video.channels >= 3) {
+            int64_t third = length / 3;
+            unsigned char* planes[3] = {data, data + third, data + 2 * third};
+            timeCase(spec, group, "matrix", 3 * third, nullptr, [&]() {
+                kernels.matrix(planes, third, sepia);
+            });
+        }
+    }
+}
+
+// Reading and writing with no compute, then whole ops per mode the way
+// main.cpp runs them, all on files in the bench directory
+static void benchIO(const benchVideo& spec, videoData& video,
+const std::string& directory) {
+    const double videoBytes =
+    static_cast<double>(video.numFrames) * video.frameSize + headerBytes;
+    std::string input = directory + "/fm2000_bench_in.bin";
+    std::string output = directory + "/fm2000_bench_out.bin";
+    writeVideo(video, input);
+
+    videoData loaded;
+    loadFile(&loaded, &input[0]);
+    videoData opened = loaded;
+    for (ioBackend backend : {IO_STREAM, IO_MMAP}) {
+        setIOBackend(backend);
+        std::string name = backend == IO_MMAP ? "mmap" : "stream";
+        timeCase(spec, "io", "load_" + name, videoBytes, [&]() {
+            opened = loaded;
+        }, [&]() {
+            openFrames(&opened, &input[0], output.c_str());
+            releaseFrames(&opened);
+        });
+    }
+    setIOBackend(IO_MMAP);
+    timeCase(spec, "io", "writeFile", videoBytes, nullptr, [&]() {
+        writeFile(video, output.c_str());
+    });
+    timeCase(spec, "io", "streamFrames", videoBytes, nullptr, [&]() {
+        streamFrames(loaded, input.c_str(), output.c_str(), false,
+        [](unsigned char*, int64_t) {});
+    });
+    timeCase(spec, "io", "block_reverse", videoBytes, nullptr, [&]() {
+        block_reverse(loaded, output.c_str(), input.c_str());
+    });
+    frameOp reverseOp;
+    reverseOp.code = OP_REVERSE;
+    pipelinePlan plan = compilePipeline({reverseOp}, loaded.channels);
+    std::vector<byteMove> moves = remapMoves(loaded, plan);
+    timeCase(spec, "io", "remap_reverse", videoBytes, nullptr, [&]() {
+        remapFile(input.c_str(), output.c_str(), moves);
+    });
+
+    // clip as the representative op, in the default, -S and -M modes
+    timeCase(spec, "mode", "clip_default", videoBytes, [&]() {
+        opened = loaded;
+    }, [&]() {
+        openFrames(&opened, &input[0], output.c_str());
+        clip_channel(opened, 0, 10, 200, output.c_str());
+        releaseFrames(&opened);
+    });
+    timeCase(spec, "mode", "clip_S", videoBytes, [&]() {
+        opened = loaded;
+    }, [&]() {
+        openFrames(&opened, &input[0], output.c_str());
+        speed_clip(opened, 0, 10, 200, output.c_str());
+        releaseFrames(&opened);
+    });
+    timeCase(spec, "mode", "clip_M", videoBytes, nullptr, [&]() {
+        memory_clip(loaded, 0, 10, 200, output.c_str(), input.c_str());
+    });
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+static void printResults() {
+    std::cout << "{\n  \"simd\": \"" << activeKernels().name << "\",\n"
+    << "  \"threads\": " << poolThreadCount() << ",\n"
+    << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const benchResult& result = results[i];
+        char line[512];
+        snprintf(line, sizeof(line), "    {\"video\": \"%s\", \"group\": "
+        "\"%s\", \"name\": \"%s\", \"seconds\": %.6f, \"gb_per_s\": %.3f, "
+        "\"frames_per_s\": %.1f}%s\n", result.video.c_str(),
+        result.group.c_str(), result.name.c_str(), result.seconds,
+        result.bytes / result.seconds / 1e9,
+        result.frames / result.seconds,
+        i + 1 < results.size() ? "," : "");
+        std::cout << line;
+    }
+    std::cout << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string directory = "/tmp";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--dir=", 0) == 0) {
+            directory = arg.substr(6);
+        } else if (arg.rfind("--only=", 0) == 0) {
+            onlyFilter = arg.substr(7);
+        } else {
+            std::cout << "Usage: ./benchme [--dir=path] [--only=text]"
+            << std::endl;
+            return 1;
+        }
+    }
+
+    for (const benchVideo& spec : benchVideos) {
+        videoData video;
+        video.numFrames = spec.numFrames;
+        video.channels = spec.channels;
+        video.height = spec.height;
+        video.width = spec.width;
+        video.frameSize = spec.channels * spec.height * spec.width;
+        video.fullFrame = static_cast<unsigned char*>
+        (aligned_alloc(64, (video.numFrames * video.frameSize + 63) / 64 * 64));
+        fillVideo(&video);
+
+        benchKernels(spec, video);
+        benchIO(spec, video, directory);
+        free(video.fullFrame);
+    }
+    printResults();
+    return 0;
+}
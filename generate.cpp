@@ -0,0 +1,892 @@
+// Copyright 2024 Luka Mihajlovic, written to pass the cpplint check
+// Test fixtures at the sizes we actually run: writes deterministic videos
+// of any size, hashes files, and computes the hash runme's output should
+// have by running each op through plain scalar reference code
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <functional>
+#include <string>
+#include <vector>
+// For sorting curve control points
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libFilmMaster2000.h"
+
+// HASHING
+static void printHash(uint64_t hash) {
+    printf("%016llx\n", static_cast<unsigned long long>(hash));
+}
+
+// Frames are read and hashed in batches of about this many bytes
+const int64_t generateBatchBytes = 8 * 1024 * 1024;
+
+// Raw videos with either header, the reference reads them frame by frame
+static int readHeader(int fd, videoData* video) {
+    unsigned char header[maxHeaderBytes];
+    ssize_t length = pread(fd, header, maxHeaderBytes, 0);
+    if (decodeHeader(header, length, video) != 0 || video->compressed) {
+        std::cout << "Failed to read the header." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int readFrame(int fd, const videoData& video, int64_t frame,
+unsigned char* out) {
+    if (preadAll(fd, out, video.frameSize,
+    rawHeaderBytes(video) + frame * video.frameSize) != 0) {
+        std::cout << "Failed to read frame " << frame << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Hashes the header output would have, then every frame produce fills in
+static int hashOutput(const videoData& output,
+const std::function<int(int64_t, unsigned char*)>& produce) {
+    streamHash hash;
+    unsigned char header[maxHeaderBytes];
+    hash.update(header, encodeHeader(output, header));
+    std::vector<unsigned char> frame(output.frameSize);
+    for (int64_t f = 0; f < output.numFrames; f++) {
+        if (produce(f, frame.data()) != 0) {
+            return 1;
+        }
+        hash.update(frame.data(), output.frameSize);
+    }
+    printHash(hash.finish());
+    return 0;
+}
+
+static int hashFile(const char* filePath) {
+    int fd = open(filePath, O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Failed to open " << filePath << std::endl;
+        return 1;
+    }
+    std::vector<unsigned char> buffer(generateBatchBytes);
+    streamHash hash;
+    ssize_t done;
+    while ((done = read(fd, buffer.data(), buffer.size())) > 0) {
+        hash.update(buffer.data(), done);
+    }
+    close(fd);
+    printHash(hash.finish());
+    return 0;
+}
+
+// GENERATING
+// Pattern frames are a fixed noise image xored with a per frame byte, and
+// every plane starts with its frame number and channel so a frame or plane
+// that lands in the wrong place changes the hash. Deeper samples hold the
+// two as their first two samples, cut to the bit depth
+static void stampPlane(const videoData& video, unsigned char* plane,
+int64_t frame, int channel) {
+    const int64_t planeSize = video.width * video.height * sampleBytes(video);
+    if (video.bitDepth > 8) {
+        uint16_t stamp[2] = {static_cast<uint16_t>(frame & maxSample(video)),
+        static_cast<uint16_t>(channel & maxSample(video))};
+        std::memcpy(plane, stamp, std::min<int64_t>(sizeof(stamp), planeSize));
+        return;
+    }
+    uint64_t stamp = static_cast<uint64_t>(frame) ^
+    (static_cast<uint64_t>(channel) << 56);
+    std::memcpy(plane, &stamp, std::min<int64_t>(8, planeSize));
+}
+
+static void patternFrame(const videoData& video, const unsigned char* noise,
+int64_t frame, unsigned char* out) {
+    unsigned char key = static_cast<unsigned char>(frame * 157 + 11);
+    for (int64_t i = 0; i < video.frameSize; i++) {
+        out[i] = noise[i] ^ key;
+    }
+    // Little endian samples keep the bits of their depth in the high byte
+    if (video.bitDepth > 8) {
+        const unsigned char high = maxSample(video) >> 8;
+        for (int64_t i = 1; i < video.frameSize; i += 2) {
+            out[i] &= high;
+        }
+    }
+    int64_t planeSize = video.width * video.height * sampleBytes(video);
+    for (int c = 0; c < video.channels; c++) {
+        stampPlane(video, out + c * planeSize, frame, c);
+    }
+}
+
+// Ramp planes count up through every byte value from an offset that
+// changes with the channel and the frame, repeating every 4 frames. With
+// a plane size that is a multiple of 256 every value is equally common,
+// so the histogram and the levels auto_levels picks are known in advance
+static void rampFrame(const videoData& video, int64_t frame,
+unsigned char* out) {
+    int64_t planeSize = video.width * video.height;
+    for (int c = 0; c < video.channels; c++) {
+        int offset = (frame % 4) * 64 + c * 85;
+        for (int64_t i = 0; i < planeSize; i++) {
+            out[c * planeSize + i] = static_cast<unsigned char>(i + offset);
+        }
+    }
+}
+
+// Accepts a frame count or a size in bytes with a K, M, G or T suffix
+static int64_t parseFrames(const std::string& input, int64_t frameSize,
+int64_t header) {
+    size_t used = 0;
+    int64_t value = std::stoll(input, &used);
+    std::string suffix = input.substr(used);
+    if (suffix.empty()) {
+        return value;
+    }
+    const std::string units = "KMGT";
+    size_t unit = units.find(suffix[0]);
+    if (suffix.size() != 1 || unit == std::string::npos) {
+        return -1;
+    }
+    for (size_t i = 0; i <= unit; i++) {
+        value *= 1024;
+    }
+    return std::max<int64_t>(1, (value - header) / frameSize);
+}
+
+static int writeVideo(int argc, char* argv[]) {
+    if (argc < 7 || argc > 9) {
+        std::cout << "write takes: output frames|size channels height width "
+        << "[pattern|sparse|ramp] [bit depth]" << std::endl;
+        return 1;
+    }
+    videoData video;
+    int channels = std::stoi(argv[4]);
+    int height = std::stoi(argv[5]);
+    int width = std::stoi(argv[6]);
+    std::string fill = argc >= 8 ? argv[7] : "pattern";
+    int depth = argc == 9 ? std::stoi(argv[8]) : 8;
+    if (channels < 1 || channels > 255 || height < 1 || height > 255 ||
+    width < 1 || width > 255 ||
+    (fill != "pattern" && fill != "sparse" && fill != "ramp") ||
+    depth < 8 || depth > 16 || (fill == "ramp" && depth != 8)) {
+        std::cout << "Channels, height and width go from 1 to 255, the fill "
+        << "is pattern, sparse or ramp and the bit depth from 8 to 16, "
+        << "ramps only come in 8 bits" << std::endl;
+        return 1;
+    }
+    // Deeper samples need the wide header
+    video.channels = channels;
+    video.height = height;
+    video.width = width;
+    video.bitDepth = depth;
+    video.wide = depth > 8;
+    video.frameSize =
+    static_cast<int64_t>(channels) * height * width * sampleBytes(video);
+    const int64_t header = rawHeaderBytes(video);
+    video.numFrames = parseFrames(argv[3], video.frameSize, header);
+    if (video.numFrames < 1) {
+        std::cout << "Invalid frame count or size " << argv[3] << std::endl;
+        return 1;
+    }
+
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cout << "Failed to open " << argv[2] << std::endl;
+        return 1;
+    }
+    unsigned char encoded[maxHeaderBytes];
+    encodeHeader(video, encoded);
+    int status = pwriteAll(fd, encoded, header, 0);
+    const int64_t planeSize = video.width * video.height * sampleBytes(video);
+
+    if (fill == "sparse") {
+        // Only the stamps are written, everything else stays a hole
+        status |= ftruncate(fd, header + video.numFrames * video.frameSize);
+        for (int64_t f = 0; status == 0 && f < video.numFrames; f++) {
+            for (int c = 0; status == 0 && c < video.channels; c++) {
+                unsigned char stamp[8] = {0};
+                stampPlane(video, stamp, f, c);
+                status = pwriteAll(fd, stamp, std::min<int64_t>(8, planeSize),
+                header + f * video.frameSize + c * planeSize);
+            }
+        }
+    } else {
+        std::vector<unsigned char> noise(video.frameSize);
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (unsigned char& value : noise) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            value = static_cast<unsigned char>(state);
+        }
+        int64_t batch = std::max<int64_t>(1,
+        generateBatchBytes / video.frameSize);
+        std::vector<unsigned char> buffer(batch * video.frameSize);
+        for (int64_t f = 0; status == 0 && f < video.numFrames; f += batch) {
+            int64_t count = std::min(batch, video.numFrames - f);
+            for (int64_t i = 0; i < count; i++) {
+                unsigned char* frame = buffer.data() + i * video.frameSize;
+                if (fill == "ramp") {
+                    rampFrame(video, f + i, frame);
+                } else {
+                    patternFrame(video, noise.data(), f + i, frame);
+                }
+            }
+            status = pwriteAll(fd, buffer.data(), count * video.frameSize,
+            header + f * video.frameSize);
+        }
+    }
+    close(fd);
+    if (status != 0) {
+        std::cout << "Failed to write " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cout << video.numFrames << " frames of " << video.frameSize
+    << " bytes written to " << argv[2] << std::endl;
+    return 0;
+}
+
+// REFERENCE
+// Ops use runme's syntax, parsed just enough for the test suite
+static std::vector<int> parseList(std::string input, char separator) {
+    std::vector<int> values;
+    input.erase(std::remove(input.begin(), input.end(), '['), input.end());
+    input.erase(std::remove(input.begin(), input.end(), ']'), input.end());
+    size_t start = 0;
+    while (start < input.size()) {
+        size_t end = input.find(separator, start);
+        if (end == std::string::npos) {
+            end = input.size();
+        }
+        values.push_back(std::stoi(input.substr(start, end - start)));
+        start = end + 1;
+    }
+    return values;
+}
+
+static int parseReferenceOps(int argc, char* argv[], int arg,
+std::vector<frameOp>* ops) {
+    while (arg < argc) {
+        std::string name = argv[arg];
+        frameOp op;
+        int used = 1;
+        if (name == "pipeline") {
+            arg++;
+            continue;
+        } else if (name == "reverse") {
+            op.code = OP_REVERSE;
+        } else if (name == "sepia") {
+            op = makeSepiaOp();
+        } else if (arg + 1 >= argc) {
+            std::cout << "Missing options for " << name << std::endl;
+            return 1;
+        } else if (name == "swap_channel") {
+            std::vector<int> pair = parseList(argv[arg + 1], ',');
+            op.code = OP_SWAP;
+            op.channel = pair.at(0);
+            op.channel2 = pair.at(1);
+            used = 2;
+        } else if (name == "color_matrix") {
+            op.code = OP_MATRIX;
+            std::string input = argv[arg + 1];
+            size_t start = 0;
+            while (start < input.size()) {
+                size_t end = input.find(',', start);
+                if (end == std::string::npos) {
+                    end = input.size();
+                }
+                op.coefficients.push_back(
+                    std::stof(input.substr(start, end - start)));
+                start = end + 1;
+            }
+            used = 2;
+        } else if (arg + 2 >= argc) {
+            std::cout << "Missing options for " << name << std::endl;
+            return 1;
+        } else {
+            op.channel = std::stoi(argv[arg + 1]);
+            used = 3;
+            if (name == "clip_channel") {
+                std::vector<int> range = parseList(argv[arg + 2], ',');
+                op.code = OP_CLIP;
+                op.minimum = range.at(0);
+                op.maximum = range.at(1);
+            } else if (name == "scale_channel") {
+                op.code = OP_SCALE;
+                op.scaleFactor = std::stof(argv[arg + 2]);
+            } else if (name == "gamma") {
+                op.code = OP_GAMMA;
+                op.gamma = std::stof(argv[arg + 2]);
+            } else if (name == "curves") {
+                op.code = OP_CURVES;
+                std::string input = argv[arg + 2];
+                size_t start = 0;
+                while (start < input.size()) {
+                    size_t end = input.find(',', start);
+                    if (end == std::string::npos) {
+                        end = input.size();
+                    }
+                    std::vector<int> point =
+                    parseList(input.substr(start, end - start), ':');
+                    op.curvePoints.emplace_back(point.at(0), point.at(1));
+                    start = end + 1;
+                }
+                std::sort(op.curvePoints.begin(), op.curvePoints.end());
+            } else if (name == "levels" && arg + 3 < argc) {
+                std::vector<int> input = parseList(argv[arg + 2], ',');
+                std::vector<int> output = parseList(argv[arg + 3], ',');
+                op.code = OP_LEVELS;
+                op.minimum = input.at(0);
+                op.maximum = input.at(1);
+                op.outMinimum = output.at(0);
+                op.outMaximum = output.at(1);
+                used = 4;
+            } else {
+                std::cout << "Unknown op " << name << std::endl;
+                return 1;
+            }
+        }
+        ops->push_back(op);
+        arg += used;
+    }
+    return 0;
+}
+
+// One op on one frame, written plainly rather than fast: swaps move the
+// planes, point ops go through their 256 entry table, matrices are summed
+// pixel by pixel
+static void referenceOp(const videoData& video, const frameOp& op,
+unsigned char* frame) {
+    const int64_t planeSize = video.width * video.height;
+    if (op.code == OP_SWAP) {
+        std::swap_ranges(frame + op.channel * planeSize,
+        frame + (op.channel + 1) * planeSize, frame + op.channel2 * planeSize);
+    } else if (op.code == OP_MATRIX) {
+        matrixParams params = makeMatrixParams(op);
+        std::vector<int> values(params.size);
+        for (int64_t i = 0; i < planeSize; i++) {
+            for (int k = 0; k < params.size; k++) {
+                values[k] = frame[k * planeSize + i];
+            }
+            for (int o = 0; o < params.size; o++) {
+                int sum = 0;
+                for (int k = 0; k < params.size; k++) {
+                    sum += params.coefficients[o * params.size + k] *
+                    values[k];
+                }
+                frame[o * planeSize + i] =
+                std::clamp(sum >> matrixShift, 0, 255);
+            }
+        }
+    } else if (op.code != OP_REVERSE) {
+        unsigned char table[256];
+        pointOpTable(op, table);
+        unsigned char* plane = frame + op.channel * planeSize;
+        for (int64_t i = 0; i < planeSize; i++) {
+            plane[i] = table[plane[i]];
+        }
+    }
+}
+
+// Blurs straight from the definition: every output sums its whole square
+// of clamped neighbours. The gaussian rounds to 7 fraction bits after the
+// rows like runme does, which the Q14 weights leave no other way to match
+static void referenceBlur(const videoData& video, const blurParams& params,
+unsigned char* frame) {
+    const int64_t width = video.width;
+    const int64_t height = video.height;
+    const int radius = params.radius;
+    const int rowShift = 7;
+    const int columnShift = 2 * blurShift - rowShift;
+    std::vector<int> rows(width * height);
+    for (int c = 0; c < video.channels; c++) {
+        unsigned char* plane = frame + c * width * height;
+        auto pixel = [&](int64_t x, int64_t y) {
+            return plane[std::clamp<int64_t>(y, 0, height - 1) * width +
+            std::clamp<int64_t>(x, 0, width - 1)];
+        };
+        for (int64_t y = 0; y < height; y++) {
+            for (int64_t x = 0; x < width; x++) {
+                int sum = params.gaussian ? 1 << (rowShift - 1) : 0;
+                for (int k = -radius; k <= radius; k++) {
+                    sum += (params.gaussian ? params.weights[k + radius] : 1) *
+                    pixel(x + k, y);
+                }
+                rows[y * width + x] =
+                params.gaussian ? sum >> rowShift : sum;
+            }
+        }
+        for (int64_t y = 0; y < height; y++) {
+            for (int64_t x = 0; x < width; x++) {
+                int sum = params.gaussian ? 1 << (columnShift - 1) : 0;
+                for (int k = -radius; k <= radius; k++) {
+                    sum += (params.gaussian ? params.weights[k + radius] : 1) *
+                    rows[std::clamp<int64_t>(y + k, 0, height - 1) * width +
+                    x];
+                }
+                plane[y * width + x] = params.gaussian ?
+                sum >> columnShift :
+                std::lrint(static_cast<float>(sum) * params.boxScale);
+            }
+        }
+    }
+}
+
+// The source pixels output pixel o takes along one side and their Q14
+// weights, worked out again from the definitions in the README rather than
+// taken from runme's grouped tables
+static std::vector<std::pair<int64_t, int>> resizeTaps(int64_t inSize,
+int64_t outSize, bool bilinear, int64_t o) {
+    const double scale = static_cast<double>(inSize) / outSize;
+    std::vector<std::pair<int64_t, double>> spans;
+    if (bilinear) {
+        double centre = (o + 0.5) * scale - 0.5;
+        int64_t left = std::floor(centre);
+        if (left < 0 || left >= inSize - 1) {
+            spans.emplace_back(std::clamp<int64_t>(left, 0, inSize - 1), 1.0);
+        } else {
+            spans.emplace_back(left, 1 - (centre - left));
+            spans.emplace_back(left + 1, centre - left);
+        }
+    } else {
+        double start = o * scale;
+        double end = (o + 1) * scale;
+        int64_t last = std::min<int64_t>(inSize, std::ceil(end));
+        for (int64_t i = std::floor(start); i < last; i++) {
+            spans.emplace_back(i, (std::min(end, i + 1.0) -
+            std::max(start, static_cast<double>(i))) / scale);
+        }
+    }
+    // Rounding losses go to the first of the biggest weights
+    std::vector<std::pair<int64_t, int>> taps;
+    int sum = 0;
+    size_t biggest = 0;
+    for (const auto& span : spans) {
+        taps.emplace_back(span.first, std::lround(span.second *
+        (1 << blurShift)));
+        sum += taps.back().second;
+        if (taps.back().second > taps[biggest].second) {
+            biggest = taps.size() - 1;
+        }
+    }
+    taps[biggest].second += (1 << blurShift) - sum;
+    return taps;
+}
+
+static void referenceResize(const videoData& video, const videoData& resized,
+bool bilinear, const unsigned char* frame, unsigned char* out) {
+    const int rowShift = 7;
+    const int columnShift = 2 * blurShift - rowShift;
+    std::vector<std::vector<std::pair<int64_t, int>>> across, down;
+    for (int64_t x = 0; x < resized.width; x++) {
+        across.push_back(resizeTaps(video.width, resized.width, bilinear, x));
+    }
+    for (int64_t y = 0; y < resized.height; y++) {
+        down.push_back(resizeTaps(video.height, resized.height, bilinear, y));
+    }
+    std::vector<int> rows(video.height * resized.width);
+    for (int c = 0; c < video.channels; c++) {
+        const unsigned char* plane = frame + c * video.width * video.height;
+        unsigned char* outPlane = out + c * resized.width * resized.height;
+        for (int64_t y = 0; y < video.height; y++) {
+            for (int64_t x = 0; x < resized.width; x++) {
+                int sum = 1 << (rowShift - 1);
+                for (const auto& tap : across[x]) {
+                    sum += tap.second * plane[y * video.width + tap.first];
+                }
+                rows[y * resized.width + x] = sum >> rowShift;
+            }
+        }
+        for (int64_t y = 0; y < resized.height; y++) {
+            for (int64_t x = 0; x < resized.width; x++) {
+                int sum = 1 << (columnShift - 1);
+                for (const auto& tap : down[y]) {
+                    sum += tap.second * rows[tap.first * resized.width + x];
+                }
+                outPlane[y * resized.width + x] = sum >> columnShift;
+            }
+        }
+    }
+}
+
+// Every output frame sums its whole window again, frames past either end
+// repeating the first or last. An even window has one frame more after
+// the current one than before it
+static int referenceTemporal(int fd, const videoData& video, int window,
+int threshold, int64_t f, unsigned char* out) {
+    const int64_t before = window / 2;
+    std::vector<unsigned char> frame(video.frameSize);
+    std::vector<int> sums(video.frameSize, 0);
+    for (int64_t k = f - before; k < f - before + window; k++) {
+        if (readFrame(fd, video, std::clamp<int64_t>(k, 0,
+        video.numFrames - 1), frame.data()) != 0) {
+            return 1;
+        }
+        for (int64_t i = 0; i < video.frameSize; i++) {
+            sums[i] += frame[i];
+        }
+    }
+    if (readFrame(fd, video, f, out) != 0) {
+        return 1;
+    }
+    const float scale = 1.0f / window;
+    for (int64_t i = 0; i < video.frameSize; i++) {
+        int mean = std::lrint(static_cast<float>(sums[i]) * scale);
+        if (std::abs(mean - out[i]) <= threshold) {
+            out[i] = mean;
+        }
+    }
+    return 0;
+}
+
+// Counts every channel one sample at a time
+static int referenceHistogram(int fd, const videoData& video,
+std::vector<uint64_t>* bins) {
+    const int64_t planeSize = video.width * video.height;
+    std::vector<unsigned char> frame(video.frameSize);
+    bins->assign(video.channels * 256, 0);
+    for (int64_t f = 0; f < video.numFrames; f++) {
+        if (readFrame(fd, video, f, frame.data()) != 0) {
+            return 1;
+        }
+        for (int64_t i = 0; i < video.frameSize; i++) {
+            (*bins)[i / planeSize * 256 + frame[i]]++;
+        }
+    }
+    return 0;
+}
+
+static void summaryText(std::ostringstream& json, int minimum, int maximum,
+uint64_t sum, uint64_t count) {
+    json << "\"min\": " << (count ? minimum : 0) << ", \"max\": "
+    << (count ? maximum : 0) << ", \"mean\": "
+    << (count ? static_cast<double>(sum) / count : 0.0);
+}
+
+// The JSON runme's stats should write, min, max and mean summed straight
+// from the samples rather than from the histogram
+static int expectedStats(int fd, const videoData& video, bool perFrame) {
+    const int64_t planeSize = video.width * video.height;
+    std::vector<uint64_t> bins;
+    if (referenceHistogram(fd, video, &bins) != 0) {
+        return 1;
+    }
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(6) << "{\n  \"frames\": "
+    << video.numFrames << ",\n  \"channels\": [";
+    for (int64_t c = 0; c < video.channels; c++) {
+        int minimum = 255, maximum = 0;
+        uint64_t sum = 0, count = 0;
+        for (int value = 0; value < 256; value++) {
+            uint64_t bin = bins[c * 256 + value];
+            if (bin != 0) {
+                minimum = std::min(minimum, value);
+                maximum = value;
+            }
+            sum += value * bin;
+            count += bin;
+        }
+        json << (c ? ",\n" : "\n") << "    {\"channel\": " << c << ", ";
+        summaryText(json, minimum, maximum, sum, count);
+        json << ",\n     \"histogram\": [";
+        for (int value = 0; value < 256; value++) {
+            json << (value ? ", " : "") << bins[c * 256 + value];
+        }
+        json << "]}";
+    }
+    json << "\n  ]";
+    if (perFrame) {
+        json << ",\n  \"per_frame\": [";
+        std::vector<unsigned char> frame(video.frameSize);
+        for (int64_t f = 0; f < video.numFrames; f++) {
+            if (readFrame(fd, video, f, frame.data()) != 0) {
+                return 1;
+            }
+            json << (f ? ",\n" : "\n") << "    {\"frame\": " << f
+            << ", \"channels\": [";
+            for (int64_t c = 0; c < video.channels; c++) {
+                const unsigned char* plane = frame.data() + c * planeSize;
+                int minimum = 255, maximum = 0;
+                uint64_t sum = 0;
+                for (int64_t i = 0; i < planeSize; i++) {
+                    minimum = std::min<int>(minimum, plane[i]);
+                    maximum = std::max<int>(maximum, plane[i]);
+                    sum += plane[i];
+                }
+                json << (c ? ", " : "") << "{";
+                summaryText(json, minimum, maximum, sum, planeSize);
+                json << "}";
+            }
+            json << "]}";
+        }
+        json << "\n  ]";
+    }
+    json << "\n}\n";
+    std::string text = json.str();
+    streamHash hash;
+    hash.update(reinterpret_cast<const unsigned char*>(text.data()),
+    text.size());
+    printHash(hash.finish());
+    return 0;
+}
+
+// levels for every channel from its histogram, as the README describes
+// auto_levels: the low end is the first value with more than percent of
+// the samples at or below it, the high end the same from the top
+static int autoLevels(int fd, const videoData& video, float percent,
+std::vector<frameOp>* ops) {
+    std::vector<uint64_t> bins;
+    if (referenceHistogram(fd, video, &bins) != 0) {
+        return 1;
+    }
+    for (int c = 0; c < video.channels; c++) {
+        const uint64_t* counts = bins.data() + c * 256;
+        uint64_t total = 0;
+        for (int value = 0; value < 256; value++) {
+            total += counts[value];
+        }
+        const double clipped = total * (percent / 100.0);
+        int low = 0;
+        uint64_t below = 0;
+        for (; low < 255; low++) {
+            below += counts[low];
+            if (below > clipped) {
+                break;
+            }
+        }
+        int high = 255;
+        uint64_t above = 0;
+        for (; high > 0; high--) {
+            above += counts[high];
+            if (above > clipped) {
+                break;
+            }
+        }
+        if (total == 0 || low >= high || (low == 0 && high == 255)) {
+            continue;
+        }
+        frameOp op;
+        op.code = OP_LEVELS;
+        op.channel = c;
+        op.minimum = low;
+        op.maximum = high;
+        ops->push_back(op);
+    }
+    return 0;
+}
+
+// Ops that need more than one frame at a time, or change the geometry,
+// have their own reference and can not be chained
+static int expectedWhole(int fd, const videoData& video, int argc,
+char* argv[]) {
+    std::string name = argv[3];
+    if ((name == "box_blur" || name == "gaussian_blur") && argc == 5) {
+        blurParams params = name == "box_blur" ?
+        makeBoxBlur(std::stoi(argv[4])) : makeGaussianBlur(std::stof(argv[4]));
+        return hashOutput(video, [&](int64_t f, unsigned char* out) {
+            if (readFrame(fd, video, f, out) != 0) {
+                return 1;
+            }
+            referenceBlur(video, params, out);
+            return 0;
+        });
+    }
+    if (name == "resize" && argc == 7) {
+        // The wide header takes over when a new side passes 255
+        videoData resized = video;
+        resized.width = std::stoll(argv[4]);
+        resized.height = std::stoll(argv[5]);
+        resized.wide = video.wide || resized.width > 255 ||
+        resized.height > 255;
+        resized.frameSize = resized.channels * resized.width * resized.height;
+        bool bilinear = std::string(argv[6]) == "bilinear";
+        std::vector<unsigned char> frame(video.frameSize);
+        return hashOutput(resized, [&](int64_t f, unsigned char* out) {
+            if (readFrame(fd, video, f, frame.data()) != 0) {
+                return 1;
+            }
+            referenceResize(video, resized, bilinear, frame.data(), out);
+            return 0;
+        });
+    }
+    if ((name == "frame_average" && argc == 5) ||
+    (name == "temporal_denoise" && argc == 6)) {
+        int window = std::stoi(argv[4]);
+        int threshold = argc == 6 ? std::stoi(argv[5]) : 255;
+        return hashOutput(video, [&](int64_t f, unsigned char* out) {
+            return referenceTemporal(fd, video, window, threshold, f, out);
+        });
+    }
+    if (name == "auto_levels" && argc == 5) {
+        std::vector<frameOp> ops;
+        if (autoLevels(fd, video, std::stof(argv[4]), &ops) != 0) {
+            return 1;
+        }
+        return hashOutput(video, [&](int64_t f, unsigned char* out) {
+            if (readFrame(fd, video, f, out) != 0) {
+                return 1;
+            }
+            for (const frameOp& op : ops) {
+                referenceOp(video, op, out);
+            }
+            return 0;
+        });
+    }
+    if (name == "stats" && argc == 5) {
+        return expectedStats(fd, video, std::string(argv[4]) == "frames");
+    }
+    std::cout << "Invalid options for " << name << std::endl;
+    return 1;
+}
+
+// Deeper samples only go through single ops, runme has no tables for
+// them: clips clamp, scales truncate the clamped float product and sepia
+// sums its matrix in 64 bits, all saturating at the largest sample
+static int expectedDeep(int fd, const videoData& video, int argc,
+char* argv[]) {
+    const std::string name = argv[3];
+    const int64_t planeSize = video.width * video.height;
+    const int maximum = maxSample(video);
+    std::vector<uint16_t> samples(planeSize * video.channels);
+    std::function<void()> apply = [] {};
+    if (name == "swap_channel" && argc == 5) {
+        std::vector<int> pair = parseList(argv[4], ',');
+        apply = [&, pair] {
+            std::swap_ranges(samples.begin() + pair.at(0) * planeSize,
+            samples.begin() + (pair.at(0) + 1) * planeSize,
+            samples.begin() + pair.at(1) * planeSize);
+        };
+    } else if (name == "clip_channel" && argc == 6) {
+        const int channel = std::stoi(argv[4]);
+        std::vector<int> range = parseList(argv[5], ',');
+        apply = [&, channel, range] {
+            for (int64_t i = 0; i < planeSize; i++) {
+                uint16_t& sample = samples[channel * planeSize + i];
+                sample = std::clamp<int>(sample, range.at(0), range.at(1));
+            }
+        };
+    } else if (name == "scale_channel" && argc == 6) {
+        const int channel = std::stoi(argv[4]);
+        const float factor = std::stof(argv[5]);
+        apply = [&, channel, factor] {
+            for (int64_t i = 0; i < planeSize; i++) {
+                uint16_t& sample = samples[channel * planeSize + i];
+                sample = static_cast<uint16_t>(std::clamp(sample * factor,
+                0.0f, static_cast<float>(maximum)));
+            }
+        };
+    } else if (name == "sepia" && argc == 4) {
+        matrixParams params = makeMatrixParams(makeSepiaOp());
+        apply = [&, params] {
+            std::vector<int64_t> values(params.size);
+            for (int64_t i = 0; i < planeSize; i++) {
+                for (int k = 0; k < params.size; k++) {
+                    values[k] = samples[k * planeSize + i];
+                }
+                for (int o = 0; o < params.size; o++) {
+                    int64_t sum = 0;
+                    for (int k = 0; k < params.size; k++) {
+                        sum += params.coefficients[o * params.size + k] *
+                        values[k];
+                    }
+                    samples[o * planeSize + i] = std::clamp<int64_t>(
+                        sum >> matrixShift, 0, maximum);
+                }
+            }
+        };
+    } else if (name != "reverse" || argc != 4) {
+        std::cout << "Invalid options for " << name << " on "
+        << static_cast<int>(video.bitDepth) << " bit samples" << std::endl;
+        return 1;
+    }
+    const bool reversed = name == "reverse";
+    return hashOutput(video, [&](int64_t f, unsigned char* out) {
+        if (readFrame(fd, video, reversed ? video.numFrames - 1 - f : f,
+        out) != 0) {
+            return 1;
+        }
+        std::memcpy(samples.data(), out, video.frameSize);
+        apply();
+        std::memcpy(out, samples.data(), video.frameSize);
+        return 0;
+    });
+}
+
+static int expectedHash(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cout << "expect takes: input op [options] [op [options]]..."
+        << std::endl;
+        return 1;
+    }
+    int fd = open(argv[2], O_RDONLY);
+    videoData video;
+    if (fd < 0 || readHeader(fd, &video) == 1) {
+        std::cout << "Failed to open " << argv[2] << std::endl;
+        return 1;
+    }
+    const std::string name = argv[3];
+    if (video.bitDepth > 8) {
+        int status = expectedDeep(fd, video, argc, argv);
+        close(fd);
+        return status;
+    }
+    if (name == "box_blur" || name == "gaussian_blur" || name == "resize" ||
+    name == "frame_average" || name == "temporal_denoise" ||
+    name == "auto_levels" || name == "stats") {
+        int status = expectedWhole(fd, video, argc, argv);
+        close(fd);
+        return status;
+    }
+    std::vector<frameOp> ops;
+    if (parseReferenceOps(argc, argv, 3, &ops) == 1) {
+        close(fd);
+        return 1;
+    }
+    bool reversed = false;
+    for (const frameOp& op : ops) {
+        if (op.code == OP_REVERSE) {
+            reversed = !reversed;
+        }
+    }
+    int status = hashOutput(video, [&](int64_t f, unsigned char* out) {
+        if (readFrame(fd, video, reversed ? video.numFrames - 1 - f : f,
+        out) != 0) {
+            return 1;
+        }
+        for (const frameOp& op : ops) {
+            referenceOp(video, op, out);
+        }
+        return 0;
+    });
+    close(fd);
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "write") {
+        return writeVideo(argc, argv);
+    } else if (command == "hash" && argc == 3) {
+        return hashFile(argv[2]);
+    } else if (command == "expect") {
+        return expectedHash(argc, argv);
+    }
+    std::cout << "Usage:" << std::endl
+    << "./genvideo write output frames|size channels height width "
+    << "[pattern|sparse|ramp] [bit depth]" << std::endl
+    << "./genvideo hash file" << std::endl
+    << "./genvideo expect input op [options] [op [options]]..." << std::endl
+    << "  (one of reverse, swap_channel, clip_channel, scale_channel or "
+    << "sepia above 8 bits)" << std::endl
+    << "./genvideo expect input box_blur|gaussian_blur radius|sigma"
+    << std::endl
+    << "./genvideo expect input resize width height area|bilinear"
+    << std::endl
+    << "./genvideo expect input frame_average window" << std::endl
+    << "./genvideo expect input temporal_denoise window threshold"
+    << std::endl
+    << "./genvideo expect input auto_levels percent" << std::endl
+    << "./genvideo expect input stats video|frames" << std::endl;
+    return 1;
+}
@@ -4,854 +4,6507 @@
 #include <fstream>
 // For swap, copy, and similar operations for our frames
 #include <algorithm>
+// For the gamma and curve tables
+#include <cmath>
 // For processing and working with argv[] as strings
 #include <string>
 
 // For threading and keeping track of threads
 #include <thread>
 #include <vector>
+// For handing frames between the streaming engine's threads
+#include <condition_variable>
+#include <mutex>
+// For the work-stealing pool shared by every parallel op
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+
+// For the mmap backend: open, mmap, madvise, copy_file_range
+#include <fcntl.h>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstring>
+
+// For the --stats and --trace instrumentation
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <sys/resource.h>
+
+// io_uring through its raw syscalls, no liburing needed
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define FM2000_URING 1
+#endif
+
+// SIMD intrinsics, every wider kernel is guarded by a runtime cpuid check
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FM2000_X86 1
+#endif
 
 using namespace std;
 
-int loadFile(videoData* dummyVid, char* filePath) {
-    std::ifstream binFile;
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(filePath, std::ios::binary | std::ios::in);
+// HEADERS
+int64_t rawHeaderBytes(const videoData& video) {
+    return video.wide ? wideHeaderBytes : headerBytes;
+}
 
-    if (!binFile) {
-        std::cout
-        << "Failed to open the file for metadata reading."
-        << std::endl;
-        return 1;
+int64_t encodeHeader(const videoData& video, unsigned char* header) {
+    if (!video.wide) {
+        std::memcpy(header, &video.numFrames, sizeof(int64_t));
+        header[sizeof(int64_t)] = video.channels;
+        header[sizeof(int64_t) + 1] = video.height;
+        header[sizeof(int64_t) + 2] = video.width;
+        return headerBytes;
     }
-    // file.read sends sizeof(int64_t) bytes to the first variable,
-    // which properly casts and sets them to numFrames' address
-    binFile.read(reinterpret_cast<char*>(&dummyVid->numFrames),
-    sizeof(int64_t));
+    uint32_t sizes[3] = {static_cast<uint32_t>(video.channels),
+    static_cast<uint32_t>(video.height), static_cast<uint32_t>(video.width)};
+    std::memcpy(header, &wideMagic, sizeof(int64_t));
+    std::memcpy(header + sizeof(int64_t), &video.numFrames, sizeof(int64_t));
+    std::memcpy(header + 2 * sizeof(int64_t), sizes, sizeof(sizes));
+    header[wideHeaderBytes - 2] = wideVersion;
+    header[wideHeaderBytes - 1] = video.bitDepth;
+    return wideHeaderBytes;
+}
 
-    binFile.read(reinterpret_cast<char*>(&dummyVid->channels),
-    sizeof(unsigned char));
+int decodeHeader(const unsigned char* header, int64_t length,
+videoData* video) {
+    if (length < headerBytes) {
+        return 1;
+    }
+    int64_t first;
+    std::memcpy(&first, header, sizeof(int64_t));
+    video->compressed = first == compressedMagic;
+    video->wide = first == wideMagic;
+    video->bitDepth = 8;
+    if (video->wide) {
+        uint32_t sizes[3];
+        if (length < wideHeaderBytes ||
+        header[wideHeaderBytes - 2] != wideVersion) {
+            return 1;
+        }
+        std::memcpy(&video->numFrames, header + sizeof(int64_t),
+        sizeof(int64_t));
+        std::memcpy(sizes, header + 2 * sizeof(int64_t), sizeof(sizes));
+        video->channels = sizes[0];
+        video->height = sizes[1];
+        video->width = sizes[2];
+        video->bitDepth = header[wideHeaderBytes - 1];
+    } else if (video->compressed) {
+        if (length < compressedHeaderBytes ||
+        header[compressedHeaderBytes - 1] < 1 ||
+        header[compressedHeaderBytes - 1] > compressedVersion) {
+            return 1;
+        }
+        std::memcpy(&video->numFrames, header + sizeof(int64_t),
+        sizeof(int64_t));
+        video->channels = header[2 * sizeof(int64_t)];
+        video->height = header[2 * sizeof(int64_t) + 1];
+        video->width = header[2 * sizeof(int64_t) + 2];
+    } else {
+        video->numFrames = first;
+        video->channels = header[sizeof(int64_t)];
+        video->height = header[sizeof(int64_t) + 1];
+        video->width = header[sizeof(int64_t) + 2];
+    }
+    // Frames past 2^62 bytes can not be addressed with int64_t offsets
+    double bytes = static_cast<double>(video->channels) * video->height *
+    video->width * (video->bitDepth > 8 ? 2 : 1);
+    if (video->numFrames < 0 || video->bitDepth < 8 || video->bitDepth > 16 ||
+    bytes > 4e18) {
+        return 1;
+    }
+    video->frameSize = video->channels * video->height * video->width *
+    sampleBytes(*video);
+    return 0;
+}
 
-    binFile.read(reinterpret_cast<char*>(&dummyVid->height),
-    sizeof(unsigned char));
+int64_t sampleBytes(const videoData& video) {
+    return video.bitDepth > 8 ? 2 : 1;
+}
 
-    binFile.read(reinterpret_cast<char*>(&dummyVid->width),
-    sizeof(unsigned char));
+int maxSample(const videoData& video) {
+    return (1 << video.bitDepth) - 1;
+}
 
-    dummyVid->frameSize = (dummyVid->width*dummyVid->height*dummyVid->channels);
+// INSTRUMENTATION
+static bool timersOn = false;
+static bool printStatsOn = false;
+static std::string traceFile;
+static std::atomic<int64_t> allocatedBytes{0};
+static std::atomic<int64_t> peakAllocatedBytes{0};
+
+// Totals per stage for --stats, seconds are summed over threads
+struct stageTotals {
+    int64_t calls = 0;
+    int64_t nanoseconds = 0;
+    int64_t bytes = 0;
+};
+
+// One complete event in the Chrome trace format
+struct traceEvent {
+    const char* name;
+    int thread;
+    int64_t start;
+    int64_t duration;
+    int64_t bytes;
+};
+
+static std::mutex statsLock;
+static std::vector<std::pair<const char*, stageTotals>> stageTable;
+static std::vector<traceEvent> traceEvents;
+static std::atomic<int> nextTraceThread{0};
+static thread_local int traceThread = -1;
+
+static int64_t nowNanoseconds() {
+    static const auto origin = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - origin).count();
+}
 
-    binFile.close();
-    return 0;
+void enableStats(bool printStats, const char* tracePath) {
+    printStatsOn = printStats;
+    traceFile = tracePath ? tracePath : "";
+    timersOn = printStatsOn || !traceFile.empty();
+    nowNanoseconds();
 }
 
-int loadFrames(videoData* dummyVid, char* filePath) {
-    std::ifstream binFile;
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(filePath, std::ios::binary | std::ios::in);
+bool statsEnabled() {
+    return timersOn;
+}
 
-    if (!binFile) {
-        std::cout << "Failed to open the file for frame reading." << std::endl;
-        return 1;
+scopedTimer::scopedTimer(const char* name, int64_t bytes)
+    : stage(name), stageBytes(bytes), start(0) {
+    if (timersOn) {
+        start = nowNanoseconds();
     }
+}
 
-    binFile.seekg(sizeof(int64_t)
-    + sizeof(unsigned char) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char));  // Skip the data we've collected before
+scopedTimer::~scopedTimer() {
+    stop();
+}
 
-    // Set the reading buffer to 8MB to speed up reading with memory in mind
-    binFile.rdbuf()->
-    pubsetbuf(0, 8 * 1024 * 1024);
-    dummyVid->frameSize = (dummyVid->width*dummyVid->height*dummyVid->channels);
+void scopedTimer::stop() {
+    if (!timersOn || stopped) {
+        return;
+    }
+    stopped = true;
+    int64_t duration = nowNanoseconds() - start;
+    if (traceThread < 0) {
+        traceThread = nextTraceThread++;
+    }
+    std::lock_guard<std::mutex> guard(statsLock);
+    // Stage names are string literals, a short list beats hashing them
+    auto totals = std::find_if(stageTable.begin(), stageTable.end(),
+    [&](const std::pair<const char*, stageTotals>& entry) {
+        return std::strcmp(entry.first, stage) == 0;
+    });
+    if (totals == stageTable.end()) {
+        stageTable.emplace_back(stage, stageTotals());
+        totals = stageTable.end() - 1;
+    }
+    totals->second.calls++;
+    totals->second.nanoseconds += duration;
+    totals->second.bytes += stageBytes;
+    if (!traceFile.empty()) {
+        traceEvents.push_back({stage, traceThread, start, duration,
+        stageBytes});
+    }
+}
 
-    // https://stackoverflow.com/questions/381244/purpose-of-memory-alignment
-    dummyVid->fullFrame = reinterpret_cast<unsigned char*>
-    (aligned_alloc(64, dummyVid->frameSize * dummyVid->numFrames));
+void* trackedAlloc(int64_t alignment, int64_t bytes) {
+    // aligned_alloc wants the size to be a multiple of the alignment
+    void* buffer = aligned_alloc(alignment,
+    (bytes + alignment - 1) / alignment * alignment);
+    if (buffer) {
+        int64_t now = allocatedBytes += bytes;
+        int64_t peak = peakAllocatedBytes;
+        while (now > peak && !peakAllocatedBytes.compare_exchange_weak(peak,
+        now)) {
+        }
+    }
+    return buffer;
+}
 
-    binFile.read(reinterpret_cast<char*>
-    (dummyVid->fullFrame), (dummyVid->frameSize*dummyVid->numFrames));
+void trackedFree(void* buffer, int64_t bytes) {
+    if (buffer) {
+        allocatedBytes -= bytes;
+        free(buffer);
+    }
+}
 
-    binFile.close();
-    return 0;
+void finishStats() {
+    if (!timersOn) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(statsLock);
+    if (printStatsOn) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(6)
+        << "{\n  \"total_seconds\": " << nowNanoseconds() / 1e9
+        << ",\n  \"peak_alloc_bytes\": " << peakAllocatedBytes
+        << ",\n  \"peak_rss_bytes\": "
+        << static_cast<int64_t>(usage.ru_maxrss) * 1024
+        << ",\n  \"stages\": [";
+        for (size_t i = 0; i < stageTable.size(); i++) {
+            const stageTotals& totals = stageTable[i].second;
+            double seconds = totals.nanoseconds / 1e9;
+            json << (i ? ",\n" : "\n") << "    {\"name\": \""
+            << stageTable[i].first << "\", \"calls\": " << totals.calls
+            << ", \"seconds\": " << seconds
+            << ", \"bytes\": " << totals.bytes << ", \"gb_per_s\": "
+            << (seconds > 0 ? totals.bytes / seconds / 1e9 : 0.0) << "}";
+        }
+        json << "\n  ]\n}\n";
+        std::cerr << json.str();
+    }
+
+    if (!traceFile.empty()) {
+        // https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+        std::ofstream trace(traceFile);
+        trace << "{\"traceEvents\": [";
+        for (size_t i = 0; i < traceEvents.size(); i++) {
+            const traceEvent& event = traceEvents[i];
+            trace << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << event.start / 1000.0
+            << ", \"dur\": " << event.duration / 1000.0
+            << ", \"args\": {\"bytes\": " << event.bytes << "}}";
+        }
+        trace << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
 }
 
-char getDisplayChar(int pixel) {
-    if (pixel < 32)     return('.');
-    if (pixel < 64)     return(':');
-    if (pixel < 96)     return('*');
-    if (pixel < 128)    return('+');
-    if (pixel < 160)    return('#');
-    if (pixel < 192)    return('%');
-    if (pixel < 224)    return('&');
-    return('@');
+// BUFFER POOL
+struct pooledBuffer {
+    void* buffer;
+    int64_t alignment;
+    int64_t bytes;
+};
+
+static int64_t poolIdleLimit = 0;
+static int64_t poolIdleBytes = 0;
+static int64_t poolReuses = 0;
+static std::mutex poolLock;
+// Oldest first, a batch rarely has more than a handful of geometries
+static std::deque<pooledBuffer> idleBuffers;
+
+void enableBufferPool(int64_t idleBytes) {
+    std::lock_guard<std::mutex> guard(poolLock);
+    poolIdleLimit = idleBytes;
 }
 
-// SUPPORT FUNCTIONS
-void printFrame(videoData inVid,
-int initialOffset) {
-    for (int z=0; z < inVid.channels; z++) {
-        for (int j=0; j < inVid.height; j++) {
-            for (int k=0; k < inVid.width; k++) {
-                unsigned char pixel = static_cast<int>
-                (inVid.fullFrame[
-                    initialOffset+(z*inVid.height*inVid.width)+j*inVid.width+k
-                ]);
-                std::cout << getDisplayChar(pixel) << " ";
+void* pooledAlloc(int64_t alignment, int64_t bytes) {
+    {
+        std::lock_guard<std::mutex> guard(poolLock);
+        for (auto kept = idleBuffers.begin(); kept != idleBuffers.end();
+        ++kept) {
+            if (kept->alignment == alignment && kept->bytes == bytes) {
+                void* buffer = kept->buffer;
+                idleBuffers.erase(kept);
+                poolIdleBytes -= bytes;
+                poolReuses++;
+                return buffer;
             }
-            std::cout << std::endl;
         }
-        std::cout << std::endl << "=-=-=-=" << std::endl;
     }
+    return trackedAlloc(alignment, bytes);
 }
 
-// Write inFile to the filepath, similarly to how we read data
-void writeFile(videoData& inFile,
-const char filePath[]) {
-    std::cout << "Writing file as " << filePath;
-    std::ofstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
+void pooledFree(void* buffer, int64_t alignment, int64_t bytes) {
+    if (!buffer) {
+        return;
+    }
+    std::vector<pooledBuffer> evicted;
+    {
+        std::lock_guard<std::mutex> guard(poolLock);
+        if (bytes > poolIdleLimit) {
+            evicted.push_back({buffer, alignment, bytes});
+        } else {
+            idleBuffers.push_back({buffer, alignment, bytes});
+            poolIdleBytes += bytes;
+            while (poolIdleBytes > poolIdleLimit) {
+                evicted.push_back(idleBuffers.front());
+                poolIdleBytes -= idleBuffers.front().bytes;
+                idleBuffers.pop_front();
+            }
+        }
+    }
+    // Freeing big buffers gives pages back to the kernel, not under the lock
+    for (const pooledBuffer& kept : evicted) {
+        trackedFree(kept.buffer, kept.bytes);
+    }
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
+int64_t bufferPoolReuses() {
+    std::lock_guard<std::mutex> guard(poolLock);
+    return poolReuses;
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
+// FRAME CACHE
+// A whole file as it was on disk, only valid while path still has the
+// same inode, size and modification time
+struct cachedVideo {
+    std::string path;
+    dev_t device;
+    ino_t inode;
+    int64_t size;
+    int64_t modified;
+    videoData header;
+    unsigned char* frames = 0;
+    int64_t bytes = 0;
+
+    ~cachedVideo() {
+        trackedFree(frames, bytes);
+    }
+};
+
+// Atomic so findCached and cacheFile can check it before taking the lock
+static std::atomic<int64_t> cacheCapacity{0};
+static int64_t cacheUsed = 0;
+static int64_t cacheHits = 0;
+static int64_t cacheMisses = 0;
+static std::mutex cacheLock;
+// Most recently used first. Jobs hold a shared_ptr, so an entry evicted
+// while a job still reads from it is freed once that job is done
+static std::list<std::shared_ptr<cachedVideo>> cachedVideos;
+
+void enableFrameCache(int64_t capacityBytes) {
+    cacheCapacity = capacityBytes;
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+bool frameCacheEnabled() {
+    return cacheCapacity > 0;
+}
 
-    // every frame consists of pixels with 1 as size
-    outFile.write(reinterpret_cast<const char*>
-    (inFile.fullFrame), (inFile.frameSize * inFile.numFrames));
+void frameCacheCounts(int64_t* hits, int64_t* misses, int64_t* bytes) {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    *hits = cacheHits;
+    *misses = cacheMisses;
+    *bytes = cacheUsed;
+}
 
-    outFile.close();
+static bool sameVersion(const cachedVideo& video, const struct stat& info) {
+    return video.device == info.st_dev && video.inode == info.st_ino &&
+    video.size == info.st_size && video.modified ==
+    info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
 }
 
-// REVERSE FUNCTIONS
-void reverse(videoData& inFile,
-const char* filePath) {
-    for (int64_t i=0; i < (inFile.numFrames/2); i++) {
-        unsigned char* frontFrame =  // Leftmost frame
-        inFile.fullFrame + (i*inFile.frameSize);
+// The cached copy of filePath if it is still current, a stat is the only
+// thing that touches the disk
+static std::shared_ptr<cachedVideo> findCached(const char* filePath) {
+    struct stat info;
+    if (cacheCapacity == 0 || stat(filePath, &info) != 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> guard(cacheLock);
+    for (auto entry = cachedVideos.begin(); entry != cachedVideos.end();
+    ++entry) {
+        if ((*entry)->path != filePath) {
+            continue;
+        }
+        std::shared_ptr<cachedVideo> video = *entry;
+        cachedVideos.erase(entry);
+        if (!sameVersion(*video, info)) {
+            // The file changed since, drop the stale copy
+            cacheUsed -= video->bytes;
+            return nullptr;
+        }
+        cachedVideos.push_front(video);
+        return video;
+    }
+    return nullptr;
+}
 
-        unsigned char* backFrame =  // Rightmost frame
-        inFile.fullFrame + ((inFile.numFrames - 1 - i)*inFile.frameSize);
+// Reads filePath into the cache unless it is already there, null when the
+// file is not a complete video or would not fit. Every command comes
+// through here once, so this is where hits and misses are counted
+static std::shared_ptr<cachedVideo> cacheFile(const char* filePath) {
+    std::shared_ptr<cachedVideo> video = findCached(filePath);
+    if (video) {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        cacheHits++;
+        return video;
+    }
+    if (cacheCapacity == 0) {
+        return nullptr;
+    }
+    int source = open(filePath, O_RDONLY);
+    if (source < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    unsigned char header[maxHeaderBytes];
+    ssize_t length = pread(source, header, maxHeaderBytes, 0);
+    video = std::make_shared<cachedVideo>();
+    videoData& frames = video->header;
+    if (fstat(source, &info) != 0 ||
+    decodeHeader(header, length, &frames) != 0 || frames.compressed) {
+        close(source);
+        return nullptr;
+    }
+    int64_t bytes = frames.numFrames * frames.frameSize;
+    const int64_t offset = rawHeaderBytes(frames);
+    if (bytes > cacheCapacity || info.st_size < offset + bytes) {
+        close(source);
+        return nullptr;
+    }
 
-        std::swap_ranges(frontFrame,
-        (frontFrame + inFile.frameSize), backFrame);
+    scopedTimer timer("cacheFill", bytes);
+    video->path = filePath;
+    video->device = info.st_dev;
+    video->inode = info.st_ino;
+    video->size = info.st_size;
+    video->modified = info.st_mtim.tv_sec * 1000000000ll +
+    info.st_mtim.tv_nsec;
+    video->frames = reinterpret_cast<unsigned char*>
+    (trackedAlloc(64, bytes));
+    video->bytes = bytes;
+    int status = video->frames == nullptr ||
+    preadAll(source, video->frames, bytes, offset) != 0;
+    close(source);
+    if (status != 0) {
+        return nullptr;
     }
 
-    writeFile(inFile, filePath);
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheMisses++;
+    // Another job may have read the same file meanwhile
+    for (auto entry = cachedVideos.begin(); entry != cachedVideos.end();
+    ++entry) {
+        if ((*entry)->path == video->path) {
+            cacheUsed -= (*entry)->bytes;
+            cachedVideos.erase(entry);
+            break;
+        }
+    }
+    cachedVideos.push_front(video);
+    cacheUsed += bytes;
+    while (cacheUsed > cacheCapacity) {
+        cacheUsed -= cachedVideos.back()->bytes;
+        cachedVideos.pop_back();
+    }
+    return video;
 }
 
-void memory_reverse(videoData& inFile,
-const char* filePath, const char* sourcePath) {
-    unsigned char* frontFrame = new unsigned char[inFile.frameSize];
-    unsigned char* backFrame = new unsigned char[inFile.frameSize];
-
-    // Opening this file only once to reduce overhead of non-stop open/close
-    std::fstream binFile;
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(sourcePath, std::ios::binary | std::ios::in | std::ios::out);
+// COMPRESSED CONTAINER
+static outputFormat currentFormat = FORMAT_AUTO;
 
-    std::fstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
+void setOutputFormat(outputFormat format) {
+    currentFormat = format;
+}
 
-    int metadataSize =
-    sizeof(int64_t) +
-    sizeof(unsigned char)+
-    sizeof(unsigned char) +
-    sizeof(unsigned char);
+bool writesCompressed(const videoData& inFile) {
+    return currentFormat == FORMAT_COMPRESSED ||
+    (currentFormat == FORMAT_AUTO && inFile.compressed);
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
+int64_t maxRecordBytes(int64_t frameSize) {
+    // Frames that do not get smaller are stored as they are
+    return 1 + frameSize;
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
+int64_t indexOffset(int64_t numFrames) {
+    return compressedHeaderBytes + (numFrames + 1) * sizeof(int64_t);
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
+// Every plane is stored as the difference of each byte to the one before,
+// which turns smooth areas into runs of one small value. Runs of three or
+// more equal bytes become (128 + length - 3, value), everything else is
+// copied as (length - 1, bytes), the same tokens as PackBits
+// https://en.wikipedia.org/wiki/PackBits
+int64_t compressFrame(const videoData& inFile, const unsigned char* frame,
+unsigned char* record) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t frameSize = inFile.frameSize;
+    static thread_local std::vector<unsigned char> delta;
+    delta.resize(frameSize);
+    for (int64_t plane = 0; plane < frameSize; plane += planeSize) {
+        unsigned char previous = 0;
+        for (int64_t i = plane; i < plane + planeSize; i++) {
+            delta[i] = frame[i] - previous;
+            previous = frame[i];
+        }
+    }
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+    const int64_t limit = maxRecordBytes(frameSize);
+    int64_t out = 1;
+    int64_t i = 0;
+    bool fits = true;
+    while (fits && i < frameSize) {
+        int64_t run = 1;
+        while (i + run < frameSize && run < 130 && delta[i + run] == delta[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            fits = out + 2 < limit;
+            if (!fits) {
+                break;
+            }
+            record[out++] = static_cast<unsigned char>(128 + run - 3);
+            record[out++] = delta[i];
+            i += run;
+            continue;
+        }
+        // A literal ends where the next run of three starts
+        int64_t start = i;
+        while (i < frameSize && i - start < 128 && !(i + 2 < frameSize &&
+        delta[i] == delta[i + 1] && delta[i] == delta[i + 2])) {
+            i++;
+        }
+        fits = out + 1 + (i - start) < limit;
+        if (!fits) {
+            break;
+        }
+        record[out++] = static_cast<unsigned char>(i - start - 1);
+        std::memcpy(record + out, &delta[start], i - start);
+        out += i - start;
+    }
 
-    for (int i=0; i < inFile.numFrames/2; i++) {
-        int64_t frontPos = (metadataSize+(inFile.frameSize*i));
-        int64_t backPos =
-        (metadataSize+inFile.frameSize*(inFile.numFrames-1-i));
+    if (!fits) {
+        record[0] = 0;
+        std::memcpy(record + 1, frame, frameSize);
+        return limit;
+    }
+    record[0] = 1;
+    return out;
+}
 
-        binFile.seekg(frontPos);  // Seek to the next frame (from the front)
-        binFile.read(reinterpret_cast<char*>(frontFrame), inFile.frameSize);
+int64_t recordReference(const unsigned char* record, int64_t length) {
+    int64_t reference = -1;
+    if (length == referenceRecordBytes && record[0] == 2) {
+        std::memcpy(&reference, record + 1, sizeof(int64_t));
+    }
+    return reference;
+}
 
-        binFile.seekg(backPos);  // Seek to the next frame (from the back)
-        binFile.read(reinterpret_cast<char*>(backFrame), inFile.frameSize);
+int decompressFrame(const videoData& inFile, const unsigned char* record,
+int64_t length, unsigned char* frame) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t frameSize = inFile.frameSize;
+    if (length == 1 + frameSize && record[0] == 0) {
+        std::memcpy(frame, record + 1, frameSize);
+        return 0;
+    }
+    if (length < 1 || record[0] != 1) {
+        return 1;
+    }
 
-        // Write the front and back together, this way we don't store frames
-        outFile.seekp(frontPos);
+    int64_t in = 1;
+    int64_t out = 0;
+    while (in < length) {
+        unsigned char token = record[in++];
+        if (token < 128) {
+            int64_t count = token + 1;
+            if (in + count > length || out + count > frameSize) {
+                return 1;
+            }
+            std::memcpy(frame + out, record + in, count);
+            in += count;
+            out += count;
+        } else {
+            int64_t count = token - 125;
+            if (in >= length || out + count > frameSize) {
+                return 1;
+            }
+            std::memset(frame + out, record[in++], count);
+            out += count;
+        }
+    }
+    if (out != frameSize) {
+        return 1;
+    }
+    for (int64_t plane = 0; plane < frameSize; plane += planeSize) {
+        unsigned char previous = 0;
+        for (int64_t i = plane; i < plane + planeSize; i++) {
+            previous += frame[i];
+            frame[i] = previous;
+        }
+    }
+    return 0;
+}
 
-        outFile.write(reinterpret_cast<char*>
-        (backFrame), inFile.frameSize);
-        // If we're not at the middle frame, write the back frame as well
-        if (i != (inFile.numFrames-1-i)) {
-            outFile.seekp(backPos);
-            outFile.write(reinterpret_cast<char*>
-            (frontFrame), inFile.frameSize);
+int readFrameIndex(int fd, int64_t numFrames, std::vector<int64_t>* index) {
+    index->resize(numFrames + 1);
+    if (preadAll(fd, reinterpret_cast<unsigned char*>(index->data()),
+    (numFrames + 1) * sizeof(int64_t), compressedHeaderBytes) != 0 ||
+    (*index)[0] != indexOffset(numFrames)) {
+        return 1;
+    }
+    for (int64_t i = 0; i < numFrames; i++) {
+        if ((*index)[i + 1] < (*index)[i]) {
+            return 1;
         }
     }
+    return 0;
+}
 
-    binFile.close();
-    outFile.close();
-    delete[] frontFrame;
-    delete[] backFrame;
+int writeCompressedHeader(int fd, const videoData& inFile,
+const std::vector<int64_t>& index) {
+    unsigned char header[compressedHeaderBytes];
+    std::memcpy(header, &compressedMagic, sizeof(int64_t));
+    std::memcpy(header + sizeof(int64_t), &inFile.numFrames, sizeof(int64_t));
+    header[2 * sizeof(int64_t)] = inFile.channels;
+    header[2 * sizeof(int64_t) + 1] = inFile.height;
+    header[2 * sizeof(int64_t) + 2] = inFile.width;
+    header[2 * sizeof(int64_t) + 3] = compressedVersion;
+    if (pwriteAll(fd, header, compressedHeaderBytes, 0) != 0) {
+        return 1;
+    }
+    return pwriteAll(fd, reinterpret_cast<const unsigned char*>
+    (index.data()), index.size() * sizeof(int64_t), compressedHeaderBytes);
 }
 
-// Callable instance for speed_reverse threading, essentially same as reverse()
-void reverseChunk(videoData& inFile,
-int64_t start, int64_t end) {
-    unsigned char* frontFrame =
-    inFile.fullFrame + (start * inFile.frameSize);
+// All records are read at once and decoded frame by frame on the pool
+static int loadCompressed(videoData* dummyVid, const char* filePath) {
+    int source = open(filePath, O_RDONLY);
+    if (source < 0) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+    std::vector<int64_t> index;
+    const int64_t numFrames = dummyVid->numFrames;
+    int status = readFrameIndex(source, numFrames, &index);
+    const int64_t recordBytes = status == 0 ? index[numFrames] - index[0] : 0;
+    unsigned char* records = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, recordBytes));
+    if (status == 0) {
+        status = preadAll(source, records, recordBytes, index[0]);
+    }
+    close(source);
 
-    unsigned char* backFrame =
-    inFile.fullFrame + ((inFile.numFrames - 1 - start) * inFile.frameSize);
-    while (start < end) {
-        std::swap_ranges(frontFrame, frontFrame + inFile.frameSize, backFrame);
-        start++;
-        frontFrame += inFile.frameSize;
-        backFrame -= inFile.frameSize;
+    dummyVid->fullFrame = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, dummyVid->frameSize * numFrames));
+    std::atomic<int> damaged{status};
+    auto record = [&](int64_t i) { return records + index[i] - index[0]; };
+    auto frame = [&](int64_t i) {
+        return dummyVid->fullFrame + i * dummyVid->frameSize;
+    };
+    if (status == 0) {
+        parallelFor(numFrames, dummyVid->frameSize,
+        [&](int64_t begin, int64_t end) {
+            for (int64_t i = begin; i < end; i++) {
+                int64_t length = index[i + 1] - index[i];
+                if (recordReference(record(i), length) < 0 &&
+                decompressFrame(*dummyVid, record(i), length, frame(i)) != 0) {
+                    damaged = 1;
+                }
+            }
+        });
+    }
+    // References point at an earlier frame that is stored in full
+    if (damaged == 0) {
+        parallelFor(numFrames, dummyVid->frameSize,
+        [&](int64_t begin, int64_t end) {
+            for (int64_t i = begin; i < end; i++) {
+                int64_t reference =
+                recordReference(record(i), index[i + 1] - index[i]);
+                if (reference < 0) {
+                    continue;
+                }
+                if (reference >= i || recordReference(record(reference),
+                index[reference + 1] - index[reference]) >= 0) {
+                    damaged = 1;
+                } else {
+                    std::memcpy(frame(i), frame(reference),
+                    dummyVid->frameSize);
+                }
+            }
+        });
+    }
+    pooledFree(records, 64, recordBytes);
+    if (damaged != 0) {
+        std::cout << "The compressed video is damaged." << std::endl;
+        releaseFrames(dummyVid);
+        return 1;
     }
+    return 0;
 }
 
-void speed_reverse(videoData& inFile,
-const char* filePath) {
-     // Get the max number of threads we can have running at once
-    int totalThreads = std::thread::hardware_concurrency();
-    // If can't split the frames, run the regular function to avoid overhead
-    if (inFile.numFrames < totalThreads) {
-        reverse(inFile, filePath);
-        return;
-    }
-    // Reverse functions in pairs of frames, so we go up to frames/2
-    int64_t framesInThread = (inFile.numFrames/2)/totalThreads;
-    // Vector for the threads so that we can easily join them
-    std::vector<std::thread> threads;
-
-    for (int i=0; i < totalThreads; i++) {
-        int64_t chunkStart = i*framesInThread;
-        int64_t chunkEnd;
-        if (i == (totalThreads-1)) {
-            // Last thread handles all remaining frames
-            chunkEnd = inFile.numFrames / 2;
-        } else {
-            chunkEnd = chunkStart + framesInThread;
+// Frames are compressed a batch at a time on the pool, each batch goes out
+// in one write while the index fills in, the index is written last
+static void writeCompressed(videoData& inFile, const char* filePath) {
+    int output = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        std::cout << "Failed to open the file for writing." << std::endl;
+        return;
+    }
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t recordSize = maxRecordBytes(frameSize);
+    const int64_t batchFrames =
+    std::max<int64_t>(1, streamRingBytes / recordSize);
+    unsigned char* records = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, batchFrames * recordSize));
+    std::vector<int64_t> index(numFrames + 1);
+    std::vector<int64_t> lengths(batchFrames);
+    index[0] = indexOffset(numFrames);
+    // Repeats of an earlier frame are stored as a reference to it
+    std::vector<int64_t> firstCopy;
+    if (dedupEnabled() && referenceRecordBytes <= recordSize) {
+        findDuplicates(inFile, &firstCopy);
+    }
+    int status = 0;
+    for (int64_t first = 0; first < numFrames && status == 0;
+    first += batchFrames) {
+        int64_t count = std::min(batchFrames, numFrames - first);
+        parallelFor(count, frameSize, [&](int64_t begin, int64_t end) {
+            for (int64_t k = begin; k < end; k++) {
+                unsigned char* record = records + k * recordSize;
+                int64_t frame = first + k;
+                if (!firstCopy.empty() && firstCopy[frame] != frame) {
+                    record[0] = 2;
+                    std::memcpy(record + 1, &firstCopy[frame], sizeof(int64_t));
+                    lengths[k] = referenceRecordBytes;
+                } else {
+                    lengths[k] = compressFrame(inFile,
+                    inFile.fullFrame + frame * frameSize, record);
+                }
+            }
+        });
+        // Records move down next to each other for a single write
+        int64_t packed = 0;
+        for (int64_t k = 0; k < count; k++) {
+            std::memmove(records + packed, records + k * recordSize,
+            lengths[k]);
+            packed += lengths[k];
+            index[first + k + 1] = index[first + k] + lengths[k];
         }
-        // Inspired by https://en.cppreference.com/w/cpp/container/vector/emplace_back
-        threads.emplace_back
-        (reverseChunk, std::ref(inFile), chunkStart, chunkEnd);
+        scopedTimer timer("write", packed);
+        status = pwriteAll(output, records, packed, index[first]);
     }
-
-    // https://stackoverflow.com/questions/15027282/c-for-each-pulling-from-vector-elements
-    for (auto& thread : threads) {
-        thread.join();
+    pooledFree(records, 64, batchFrames * recordSize);
+    if (status == 0) {
+        status = writeCompressedHeader(output, inFile, index);
+    }
+    close(output);
+    if (status != 0) {
+        std::cout << "Failed to write the compressed video." << std::endl;
     }
-    writeFile(inFile, filePath);
 }
 
-// SWAP CHANNEL FUNCTIONS
-void swap_channel(videoData& inFile,
-unsigned char ch1, unsigned char ch2, const char filePath[]) {
-    // Move through frames, swapping their chanenls
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        unsigned char* ch1Start =
-        (inFile.fullFrame + frame*inFile.frameSize)
-        + (ch1*inFile.width*inFile.height);
-
-        unsigned char* ch2Start =
-        (inFile.fullFrame + frame*inFile.frameSize)
-        + (ch2*inFile.width*inFile.height);
-
-        std::swap_ranges(ch1Start,
-        (ch1Start+(inFile.width*inFile.height)),
-        ch2Start);
+int convert_video(videoData& inFile, const char* filePath,
+const char* sourcePath) {
+    scopedTimer timer("convert", inFile.frameSize * inFile.numFrames);
+    if (sameFile(sourcePath, filePath)) {
+        std::cout << "convert needs a different output file." << std::endl;
+        return 1;
     }
-    writeFile(inFile, filePath);
+    // Finding repeats needs every frame at hand, the stream only sees a few
+    if (dedupEnabled() && writesCompressed(inFile)) {
+        if (loadFrames(&inFile, const_cast<char*>(sourcePath)) != 0) {
+            return 1;
+        }
+        timer.stop();
+        writeFile(inFile, filePath);
+        releaseFrames(&inFile);
+        return 0;
+    }
+    if (streamFrames(inFile, sourcePath, filePath, false,
+    [](unsigned char*, int64_t) {}) != 0) {
+        return 1;
+    }
+    std::cout << "Writing file as " << filePath;
+    return 0;
 }
 
-void memory_swap(videoData& inFile,
-unsigned char ch1, unsigned char ch2,
-const char filePath[], const char sourcePath[]) {
-    unsigned char* tempFrame = new unsigned char[inFile.frameSize];
-
-    // Opening this file once to reduce overhead of non-stop calling open/close
-    std::fstream binFile;
+// FRAME LAYOUT
+static frameLayout inputLayout = LAYOUT_PLANAR;
+static frameLayout outputLayout = LAYOUT_AUTO;
 
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(sourcePath, std::ios::binary | std::ios::in);
+void setFrameLayouts(frameLayout input, frameLayout output) {
+    inputLayout = input == LAYOUT_INTERLEAVED ? input : LAYOUT_PLANAR;
+    outputLayout = output;
+}
 
-    std::fstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
+// The compressed container always holds planar frames
+bool writesInterleaved(const videoData& inFile) {
+    return !writesCompressed(inFile) && (outputLayout == LAYOUT_INTERLEAVED ||
+    (outputLayout == LAYOUT_AUTO && inFile.interleaved));
+}
 
-    int metadataSize =
-    sizeof(int64_t) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char);
+void interleaveFrames(const videoData& inFile, const unsigned char* planar,
+unsigned char* packed, int64_t count) {
+    parallelFor(count, inFile.frameSize, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            packFrame(inFile, planar + i * inFile.frameSize,
+            packed + i * inFile.frameSize);
+        }
+    });
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
+void deinterleaveFrames(const videoData& inFile, const unsigned char* packed,
+unsigned char* planar, int64_t count) {
+    parallelFor(count, inFile.frameSize, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            unpackFrame(inFile, packed + i * inFile.frameSize,
+            planar + i * inFile.frameSize);
+        }
+    });
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
+// Each task packs its frames into a buffer of its own and writes them at
+// their offset, so the packed bytes go out while they are still in cache
+static void writeInterleaved(videoData& inFile, const char* filePath) {
+    int output = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        std::cout << "Failed to open the file for writing." << std::endl;
+        return;
+    }
+    const int64_t frameSize = inFile.frameSize;
+    unsigned char header[maxHeaderBytes];
+    const int64_t offset = encodeHeader(inFile, header);
+    std::atomic<int> failed{pwriteAll(output, header, offset, 0)};
+    parallelFor(inFile.numFrames, frameSize, [&](int64_t begin, int64_t end) {
+        static thread_local std::vector<unsigned char> staging;
+        staging.resize((end - begin) * frameSize);
+        for (int64_t i = begin; i < end; i++) {
+            packFrame(inFile, inFile.fullFrame + i * frameSize,
+            &staging[(i - begin) * frameSize]);
+        }
+        if (pwriteAll(output, staging.data(), staging.size(),
+        offset + begin * frameSize) != 0) {
+            failed = 1;
+        }
+    });
+    close(output);
+    if (failed != 0) {
+        std::cout << "Failed to write the interleaved frames." << std::endl;
+    }
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
+int loadFile(videoData* dummyVid, char* filePath) {
+    scopedTimer timer("loadFile", maxHeaderBytes);
+    // With the cache on the frames are read now, loadFrames copies them
+    std::shared_ptr<cachedVideo> cached = cacheFile(filePath);
+    if (cached) {
+        dummyVid->numFrames = cached->header.numFrames;
+        dummyVid->channels = cached->header.channels;
+        dummyVid->height = cached->header.height;
+        dummyVid->width = cached->header.width;
+        dummyVid->frameSize = cached->header.frameSize;
+        dummyVid->wide = cached->header.wide;
+        dummyVid->bitDepth = cached->header.bitDepth;
+        dummyVid->interleaved = inputLayout == LAYOUT_INTERLEAVED;
+        return 0;
+    }
+    std::ifstream binFile;
+    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
+    binFile.open(filePath, std::ios::binary | std::ios::in);
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+    if (!binFile) {
+        std::cout
+        << "Failed to open the file for metadata reading."
+        << std::endl;
+        return 1;
+    }
+    // The longest header is read at once, the first int64_t tells which
+    // of the legacy, compressed or wide layouts follows
+    unsigned char header[maxHeaderBytes];
+    binFile.read(reinterpret_cast<char*>(header), maxHeaderBytes);
+    int status = decodeHeader(header, binFile.gcount(), dummyVid);
+    binFile.close();
+    if (status != 0) {
+        std::cout << "Damaged or unsupported video header." << std::endl;
+        return 1;
+    }
+    dummyVid->interleaved =
+    !dummyVid->compressed && inputLayout == LAYOUT_INTERLEAVED;
+    return 0;
+}
 
-    for (int i=0; i < inFile.numFrames; i++) {
-        int64_t framePos = (metadataSize+(inFile.frameSize*i));
-        binFile.seekg(framePos);  // Seek to the current frame
-        binFile.read(reinterpret_cast<char*>(tempFrame), inFile.frameSize);
+// MMAP BACKEND
+static ioBackend currentBackend = IO_MMAP;
 
-        unsigned char* ch1Start = tempFrame + (ch1*inFile.width*inFile.height);
-        unsigned char* ch2Start = tempFrame + (ch2*inFile.width*inFile.height);
+void setIOBackend(ioBackend backend) {
+    currentBackend = backend;
+}
 
-        std::swap_ranges(ch1Start,
-        (ch1Start+(inFile.width*inFile.height)),
-        ch2Start);
+ioBackend getIOBackend() {
+    return currentBackend;
+}
 
-        outFile.seekp(framePos);  // Write the frame to the output file
-        outFile.write(reinterpret_cast<char*>
-        (tempFrame), inFile.frameSize);
+// Frames are walked front to back by almost every op, so ask for readahead
+static unsigned char* mapVideo(int fd, int64_t length, int flags) {
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
     }
+    madvise(base, length, MADV_WILLNEED);
+    madvise(base, length, MADV_SEQUENTIAL);
+    return static_cast<unsigned char*>(base);
+}
+
+static void useMapping(videoData* dummyVid, unsigned char* base,
+int64_t length) {
+    dummyVid->mappedBase = base;
+    dummyVid->mappedLength = length;
+    dummyVid->fullFrame = base + rawHeaderBytes(*dummyVid);
+}
+
+// Private mapping of the source, pages are only copied once a kernel writes
+// to them so read-mostly ops never hold the video twice
+static int mapInput(videoData* dummyVid, const char* filePath) {
+    int64_t length = rawHeaderBytes(*dummyVid) +
+    dummyVid->frameSize * dummyVid->numFrames;
+    int source = open(filePath, O_RDONLY);
+    if (source < 0) {
+        return 1;
+    }
+    struct stat info;
+    if (fstat(source, &info) != 0 || info.st_size < length) {
+        close(source);
+        return 1;
+    }
+    unsigned char* base = mapVideo(source, length, MAP_PRIVATE);
+    close(source);
+    if (base == nullptr) {
+        return 1;
+    }
+    useMapping(dummyVid, base, length);
+    return 0;
+}
+
+// Copy inside the kernel, which can reflink or do a server side copy when
+// the filesystem supports it, sendfile covers kernels without it
+static int copyRange(int source, int output, int64_t length) {
+    off_t inOffset = 0;
+    off_t outOffset = 0;
+    while (inOffset < length) {
+        ssize_t copied = copy_file_range(source, &inOffset, output, &outOffset,
+        length - inOffset, 0);
+        if (copied <= 0) {
+            break;
+        }
+    }
+    while (inOffset < length) {
+        ssize_t copied = sendfile(output, source, &inOffset, length - inOffset);
+        if (copied <= 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The output starts as a copy of the source and is mapped shared, so
+// kernels edit the destination in place and nothing passes through userspace
+static int mapOutput(videoData* dummyVid, const char* filePath,
+const char* outputPath) {
+    int64_t length = rawHeaderBytes(*dummyVid) +
+    dummyVid->frameSize * dummyVid->numFrames;
+    // Mostly the in-kernel copy of the source to the output
+    scopedTimer timer("mapOutput", length);
+    int source = open(filePath, O_RDONLY);
+    if (source < 0) {
+        return 1;
+    }
+    struct stat sourceInfo;
+    if (fstat(source, &sourceInfo) != 0 || sourceInfo.st_size < length) {
+        close(source);
+        return 1;
+    }
+
+    // Writing back over the source needs no copy at all
+    struct stat outputInfo;
+    bool sameFile = stat(outputPath, &outputInfo) == 0 &&
+    outputInfo.st_dev == sourceInfo.st_dev &&
+    outputInfo.st_ino == sourceInfo.st_ino;
+
+    int output = open(outputPath,
+    sameFile ? O_RDWR : (O_RDWR | O_CREAT | O_TRUNC), 0644);
+    if (output >= 0 && !sameFile &&
+    (copyRange(source, output, length) != 0 ||
+    ftruncate(output, length) != 0)) {
+        close(output);
+        output = -1;
+    }
+    close(source);
+    if (output < 0) {
+        return 1;
+    }
+
+    unsigned char* base = mapVideo(output, length, MAP_SHARED);
+    close(output);
+    if (base == nullptr) {
+        return 1;
+    }
+    useMapping(dummyVid, base, length);
+    dummyVid->mappedPath = outputPath;
+    dummyVid->mappedOutput = true;
+    return 0;
+}
+
+// Raw planar frames read onto the heap, whatever the backend
+static int readFrames(videoData* dummyVid, const char* filePath) {
+    std::ifstream binFile;
+    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
+    binFile.open(filePath, std::ios::binary | std::ios::in);
+
+    if (!binFile) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+
+    // Skip the data we've collected before
+    binFile.seekg(rawHeaderBytes(*dummyVid));
+
+    // Set the reading buffer to 8MB to speed up reading with memory in mind
+    binFile.rdbuf()->
+    pubsetbuf(0, 8 * 1024 * 1024);
+
+    // https://stackoverflow.com/questions/381244/purpose-of-memory-alignment
+    dummyVid->fullFrame = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, dummyVid->frameSize * dummyVid->numFrames));
+
+    binFile.read(reinterpret_cast<char*>
+    (dummyVid->fullFrame), (dummyVid->frameSize*dummyVid->numFrames));
 
-    delete[] tempFrame;
     binFile.close();
+    return 0;
+}
+
+// Frames for an op that writes to outputPath, falls back to a heap copy
+int openFrames(videoData* dummyVid, char* filePath, const char* outputPath) {
+    // A cached input is copied from memory rather than from the file, a
+    // compressed or interleaved input or output can not be edited inside
+    // the file
+    if (currentBackend == IO_MMAP && !frameCacheEnabled() &&
+    !dummyVid->compressed && !writesCompressed(*dummyVid) &&
+    !dummyVid->interleaved && !writesInterleaved(*dummyVid) &&
+    mapOutput(dummyVid, filePath, outputPath) == 0) {
+        return 0;
+    }
+    // The compressed and interleaved writers truncate the output first, so
+    // a raw planar input they write over is read onto the heap rather than
+    // mapped
+    if ((writesCompressed(*dummyVid) || writesInterleaved(*dummyVid)) &&
+    !dummyVid->compressed &&
+    !dummyVid->interleaved &&
+    sameFile(filePath, outputPath)) {
+        return readFrames(dummyVid, filePath);
+    }
+    return loadFrames(dummyVid, filePath);
+}
+
+void releaseFrames(videoData* dummyVid) {
+    if (dummyVid->mappedBase != 0) {
+        munmap(dummyVid->mappedBase, dummyVid->mappedLength);
+    } else {
+        pooledFree(dummyVid->fullFrame, 64,
+        dummyVid->frameSize * dummyVid->numFrames);
+    }
+    dummyVid->fullFrame = 0;
+    dummyVid->mappedBase = 0;
+    dummyVid->mappedLength = 0;
+    dummyVid->mappedPath = 0;
+    dummyVid->mappedOutput = false;
+}
+
+// Planes are filled straight from a mapping of the file, or with the
+// stream backend every task reads its frames into a buffer of its own and
+// spreads them over the planes while they are still in cache
+static int loadInterleaved(videoData* dummyVid, const char* filePath) {
+    const int64_t frameSize = dummyVid->frameSize;
+    const int64_t offset = rawHeaderBytes(*dummyVid);
+    const int64_t length = offset + frameSize * dummyVid->numFrames;
+    int source = open(filePath, O_RDONLY);
+    struct stat info;
+    if (source < 0 || fstat(source, &info) != 0 || info.st_size < length) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        if (source >= 0) {
+            close(source);
+        }
+        return 1;
+    }
+    dummyVid->fullFrame = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, frameSize * dummyVid->numFrames));
+    unsigned char* mapped = currentBackend == IO_MMAP ?
+    mapVideo(source, length, MAP_PRIVATE) : nullptr;
+    if (mapped != nullptr) {
+        close(source);
+        deinterleaveFrames(*dummyVid, mapped + offset,
+        dummyVid->fullFrame, dummyVid->numFrames);
+        munmap(mapped, length);
+        return 0;
+    }
+
+    posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::atomic<int> failed{0};
+    parallelFor(dummyVid->numFrames, frameSize,
+    [&](int64_t begin, int64_t end) {
+        static thread_local std::vector<unsigned char> staging;
+        staging.resize((end - begin) * frameSize);
+        if (preadAll(source, staging.data(), staging.size(),
+        offset + begin * frameSize) != 0) {
+            failed = 1;
+            return;
+        }
+        for (int64_t i = begin; i < end; i++) {
+            unpackFrame(*dummyVid, &staging[(i - begin) * frameSize],
+            dummyVid->fullFrame + i * frameSize);
+        }
+    });
+    close(source);
+    if (failed != 0) {
+        std::cout << "Failed to read the interleaved frames." << std::endl;
+        releaseFrames(dummyVid);
+        return 1;
+    }
+    return 0;
+}
+
+int loadFrames(videoData* dummyVid, char* filePath) {
+    dummyVid->frameSize = dummyVid->width * dummyVid->height *
+    dummyVid->channels * sampleBytes(*dummyVid);
+    scopedTimer timer("loadFrames", dummyVid->frameSize * dummyVid->numFrames);
+    std::shared_ptr<cachedVideo> cached = findCached(filePath);
+    if (cached && cached->bytes == dummyVid->frameSize * dummyVid->numFrames) {
+        unsigned char* frames = reinterpret_cast<unsigned char*>
+        (pooledAlloc(64, cached->bytes));
+        if (dummyVid->interleaved) {
+            deinterleaveFrames(*dummyVid, cached->frames, frames,
+            dummyVid->numFrames);
+        } else {
+            parallelFor(cached->bytes, 1, [&](int64_t begin, int64_t end) {
+                std::memcpy(frames + begin, cached->frames + begin,
+                end - begin);
+            });
+        }
+        dummyVid->fullFrame = frames;
+        return 0;
+    }
+    if (dummyVid->compressed) {
+        return loadCompressed(dummyVid, filePath);
+    }
+    if (dummyVid->interleaved) {
+        return loadInterleaved(dummyVid, filePath);
+    }
+    if (currentBackend == IO_MMAP && mapInput(dummyVid, filePath) == 0) {
+        return 0;
+    }
+    return readFrames(dummyVid, filePath);
+}
+
+char getDisplayChar(int pixel) {
+    if (pixel < 32)     return('.');
+    if (pixel < 64)     return(':');
+    if (pixel < 96)     return('*');
+    if (pixel < 128)    return('+');
+    if (pixel < 160)    return('#');
+    if (pixel < 192)    return('%');
+    if (pixel < 224)    return('&');
+    return('@');
+}
+
+// SUPPORT FUNCTIONS
+void printFrame(videoData inVid,
+int64_t initialOffset) {
+    std::string text;
+    renderFrame(inVid, initialOffset, displayParams(), &text);
+    std::cout.write(text.data(), text.size());
+    std::cout.flush();
+}
+
+// DISPLAY FUNCTIONS
+// getDisplayChar for every 8 bit value, deeper samples use their top 8 bits
+static const char* displayTable() {
+    static const std::string table = []() {
+        std::string chars(256, ' ');
+        for (int pixel = 0; pixel < 256; pixel++) {
+            chars[pixel] = getDisplayChar(pixel);
+        }
+        return chars;
+    }();
+    return table.data();
+}
+
+// Pixels per side of the blocks the characters stand for
+static int64_t displayBlock(const videoData& inVid, int64_t planes,
+const displayParams& params) {
+    if (params.columns <= 0 || params.rows <= 0 || planes == 0) {
+        return 1;
+    }
+    // Every pixel takes a character and a space, every plane a separator
+    // line and an empty one, and each frame its FRAME line
+    int64_t across = std::max<int64_t>(1, params.columns / 2);
+    int64_t down = std::max<int64_t>(1, (params.rows - 1) / planes - 2);
+    return std::max<int64_t>({1, (inVid.width + across - 1) / across,
+    (inVid.height + down - 1) / down});
+}
+
+// Channels first to last of the frame averaged over blocks of block by
+// block pixels, the blocks on the right and bottom edges may be smaller
+template <typename sample>
+static char* renderPlane(const sample* frame, const videoData& inVid,
+int64_t first, int64_t last, int64_t block, int shift, char* out) {
+    const char* table = displayTable();
+    const int64_t width = inVid.width;
+    const int64_t height = inVid.height;
+    const int64_t planeSize = width * height;
+    const int64_t outWidth = (width + block - 1) / block;
+    std::vector<uint64_t> sums(outWidth);
+    for (int64_t y0 = 0; y0 < height; y0 += block) {
+        if (block == 1 && last == first + 1) {
+            const sample* row = frame + first * planeSize + y0 * width;
+            for (int64_t x = 0; x < width; x++) {
+                *out++ = table[row[x] >> shift];
+                *out++ = ' ';
+            }
+            *out++ = '\n';
+            continue;
+        }
+        const int64_t y1 = std::min(height, y0 + block);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int64_t c = first; c < last; c++) {
+            for (int64_t y = y0; y < y1; y++) {
+                const sample* row = frame + c * planeSize + y * width;
+                for (int64_t x = 0; x < width; x++) {
+                    sums[x / block] += row[x];
+                }
+            }
+        }
+        for (int64_t x = 0; x < outWidth; x++) {
+            uint64_t count = (last - first) * (y1 - y0) *
+            (std::min(width, (x + 1) * block) - x * block);
+            *out++ = table[(sums[x] + count / 2) / count >> shift];
+            *out++ = ' ';
+        }
+        *out++ = '\n';
+    }
+    return out;
+}
+
+void renderFrame(const videoData& inVid, int64_t offset,
+const displayParams& params, std::string* text) {
+    const int64_t planes = params.combine ?
+    std::min<int64_t>(1, inVid.channels) : inVid.channels;
+    const int64_t block = displayBlock(inVid, planes, params);
+    const int64_t outWidth = (inVid.width + block - 1) / block;
+    const int64_t outHeight = (inVid.height + block - 1) / block;
+    const char separator[] = "\n=-=-=-=\n";
+    const int64_t separatorLength = sizeof(separator) - 1;
+
+    // The whole frame is laid out in place, no per character appends
+    size_t start = text->size();
+    text->resize(start + planes *
+    (outHeight * (2 * outWidth + 1) + separatorLength));
+    char* out = text->data() + start;
+    const int shift = inVid.bitDepth > 8 ? inVid.bitDepth - 8 : 0;
+    for (int64_t p = 0; p < planes; p++) {
+        int64_t first = params.combine ? 0 : p;
+        int64_t last = params.combine ? inVid.channels : p + 1;
+        if (sampleBytes(inVid) == 2) {
+            out = renderPlane(reinterpret_cast<const uint16_t*>
+            (inVid.fullFrame + offset), inVid, first, last, block, shift,
+            out);
+        } else {
+            out = renderPlane(inVid.fullFrame + offset, inVid, first, last,
+            block, shift, out);
+        }
+        std::memcpy(out, separator, separatorLength);
+        out += separatorLength;
+    }
+}
+
+// Frames are due at fixed times from the first, so slow frames do not push
+// back the ones after them
+void show_video(const videoData& inVid, const frameRange& range,
+const displayParams& params, double fps) {
+    scopedTimer timer("show_video", inVid.frameSize * rangeCount(range));
+    const auto start = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> period(fps > 0 ? 1.0 / fps : 0.0);
+    std::string text;
+    int64_t shown = 0;
+    for (int64_t i = range.begin; i < range.end; i += range.step) {
+        text.clear();
+        if (fps > 0) {
+            // Clear once, then go back to the top left for every frame
+            text += shown == 0 ? "\x1b[2J\x1b[H" : "\x1b[H";
+        }
+        text += "FRAME #" + std::to_string(i) + "\n";
+        renderFrame(inVid, i * inVid.frameSize, params, &text);
+        if (fps > 0) {
+            std::this_thread::sleep_until(start +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            period * shown));
+        }
+        std::cout.write(text.data(), text.size());
+        std::cout.flush();
+        shown++;
+    }
+}
+
+// Write inFile to the filepath, similarly to how we read data
+void writeFile(videoData& inFile,
+const char filePath[]) {
+    std::cout << "Writing file as " << filePath;
+    scopedTimer timer("writeFile", rawHeaderBytes(inFile));
+    if (writesCompressed(inFile)) {
+        writeCompressed(inFile, filePath);
+        return;
+    }
+    if (writesInterleaved(inFile)) {
+        timer.addBytes(inFile.frameSize * inFile.numFrames);
+        writeInterleaved(inFile, filePath);
+        return;
+    }
+
+    // Frames already live in the mapped output, only the header is left
+    if (inFile.mappedOutput && std::strcmp(inFile.mappedPath, filePath) == 0 &&
+    inFile.fullFrame == inFile.mappedBase + rawHeaderBytes(inFile) &&
+    inFile.mappedLength ==
+    rawHeaderBytes(inFile) + inFile.frameSize * inFile.numFrames) {
+        encodeHeader(inFile, inFile.mappedBase);
+        return;
+    }
+
+    std::ofstream outFile;
+    outFile.open(filePath, std::ios::binary | std::ios::out);
+
+    unsigned char header[maxHeaderBytes];
+    outFile.write(reinterpret_cast<const char*>
+    (header), encodeHeader(inFile, header));
+
+    // every frame consists of samples of sampleBytes each
+    timer.addBytes(inFile.frameSize * inFile.numFrames);
+    outFile.write(reinterpret_cast<const char*>
+    (inFile.fullFrame), (inFile.frameSize * inFile.numFrames));
+
     outFile.close();
 }
 
-// Same logic as the functionality of the base function, with a chunk of frames
-void swapChunk(videoData& inFile,
-int64_t chunkStart, int64_t chunkEnd,
-unsigned char ch1, unsigned char ch2) {
-    for (int64_t frame=chunkStart; frame < chunkEnd; frame++) {
-        unsigned char* ch1Start =
-        (inFile.fullFrame + frame * inFile.frameSize)
-        + (ch1 * inFile.width * inFile.height);
+// SIMD KERNELS
+// Reference result of scale_channel for one byte, the fixed point version
+// has to reproduce this exactly to be used
+static unsigned char scaleReference(unsigned char value, float scaleFactor) {
+    return std::clamp(value * scaleFactor, 0.0f, 255.0f);
+}
+
+static unsigned char scaleFixed(unsigned char value,
+const scaleParams& params) {
+    if (value > params.satBelow) {
+        return 255;
+    }
+    return value * params.whole + ((value * params.fraction) >> 16);
+}
+
+scaleParams makeScaleParams(float scaleFactor) {
+    scaleParams params;
+    params.factor = scaleFactor;
+    params.exact = false;
+    params.whole = 0;
+    params.fraction = 0;
+    params.satBelow = 255;
+    // Past 255 everything but 0 saturates, not worth a fixed point form
+    if (!(scaleFactor >= 0.0f && scaleFactor < 255.0f)) {
+        return params;
+    }
+
+    // First byte value that reaches 255, everything above it saturates
+    int saturatesAt = 256;
+    for (int value = 0; value < 256; value++) {
+        if (scaleReference(value, scaleFactor) == 255) {
+            saturatesAt = value;
+            break;
+        }
+    }
+    if (saturatesAt == 0) {
+        return params;
+    }
+    params.satBelow = saturatesAt - 1;
+    params.whole = static_cast<uint16_t>(scaleFactor);
+
+    // Float rounding can land either side of the truncated fraction, so try
+    // the neighbours and keep the first that matches every byte value
+    double fraction = (scaleFactor - params.whole) * 65536.0;
+    for (int64_t candidate = static_cast<int64_t>(fraction) - 1;
+    candidate <= static_cast<int64_t>(fraction) + 1; candidate++) {
+        if (candidate < 0 || candidate > 65535) {
+            continue;
+        }
+        params.fraction = candidate;
+        bool matches = true;
+        for (int value = 0; value < 256 && matches; value++) {
+            matches = scaleFixed(value, params) ==
+            scaleReference(value, scaleFactor);
+        }
+        if (matches) {
+            params.exact = true;
+            return params;
+        }
+    }
+    return params;
+}
+
+static void clipScalar(unsigned char* data, int64_t length,
+unsigned char minimum, unsigned char maximum) {
+    for (int64_t i = 0; i < length; i++) {
+        // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
+        data[i] = std::clamp(data[i], minimum, maximum);
+    }
+}
+
+// Factors without an exact fixed point form go through a table instead
+static void scaleTable(float scaleFactor, unsigned char table[256]) {
+    for (int value = 0; value < 256; value++) {
+        table[value] = scaleReference(value, scaleFactor);
+    }
+}
+
+static void lookupScalar(unsigned char* data, int64_t length,
+const unsigned char* table) {
+    for (int64_t i = 0; i < length; i++) {
+        data[i] = table[data[i]];
+    }
+}
+
+static void scaleScalar(unsigned char* data, int64_t length,
+const scaleParams& params) {
+    if (!params.exact) {
+        unsigned char table[256];
+        scaleTable(params.factor, table);
+        lookupScalar(data, length, table);
+        return;
+    }
+    for (int64_t i = 0; i < length; i++) {
+        data[i] = scaleFixed(data[i], params);
+    }
+}
+
+static void swapScalar(unsigned char* first, unsigned char* second,
+int64_t length) {
+    std::swap_ranges(first, first + length, second);
+}
+
+// Every output needs every input, so outputs are only written once the
+// whole pixel has been computed
+static void matrixScalar(unsigned char* const* planes, int64_t length,
+const matrixParams& params) {
+    const int size = params.size;
+    const int16_t* coefficients = params.coefficients.data();
+    int values[256];
+    for (int64_t i = 0; i < length; i++) {
+        for (int k = 0; k < size; k++) {
+            values[k] = planes[k][i];
+        }
+        for (int o = 0; o < size; o++) {
+            int sum = 0;
+            for (int k = 0; k < size; k++) {
+                sum += coefficients[o * size + k] * values[k];
+            }
+            planes[o][i] = std::clamp(sum >> matrixShift, 0, 255);
+        }
+    }
+}
+
+// Gaussian rows keep 7 fraction bits, so a filtered pixel fits int16_t
+// and columns can use the same 16 bit multiply-adds as rows
+const int blurRowShift = 7;
+const int blurColumnShift = 2 * blurShift - blurRowShift;
+
+static void gaussianRowScalar(const unsigned char* padded,
+uint16_t* filtered, int64_t width, const blurParams& params) {
+    const int taps = 2 * params.radius + 1;
+    const int16_t* weights = params.weights.data();
+    for (int64_t x = 0; x < width; x++) {
+        int sum = 1 << (blurRowShift - 1);
+        for (int k = 0; k < taps; k++) {
+            sum += weights[k] * padded[x + k];
+        }
+        filtered[x] = sum >> blurRowShift;
+    }
+}
+
+static void weightedColumnsScalar(const uint16_t* const* rows,
+const int16_t* weights, int taps, unsigned char* out, int64_t width) {
+    for (int64_t x = 0; x < width; x++) {
+        int sum = 1 << (blurColumnShift - 1);
+        for (int k = 0; k < taps; k++) {
+            sum += weights[k] * rows[k][x];
+        }
+        out[x] = sum >> blurColumnShift;
+    }
+}
+
+// Sums stay below 2^24, so the float product is the same in every width
+// and rounding to nearest matches _mm_cvtps_epi32
+static void boxColumnsScalar(uint32_t* sums, const uint16_t* add,
+const uint16_t* remove, unsigned char* out, int64_t width, float scale) {
+    for (int64_t x = 0; x < width; x++) {
+        out[x] = std::lrint(static_cast<float>(sums[x]) * scale);
+        sums[x] += add[x] - remove[x];
+    }
+}
+
+// Running sum along a padded row, one add and one subtract per pixel
+// whatever the radius. The sum of up to 255 bytes fits uint16_t
+static void boxRow(const unsigned char* padded, uint16_t* filtered,
+int64_t width, int radius) {
+    int sum = 0;
+    for (int k = 0; k < 2 * radius; k++) {
+        sum += padded[k];
+    }
+    for (int64_t x = 0; x < width; x++) {
+        sum += padded[x + 2 * radius];
+        filtered[x] = sum;
+        sum -= padded[x];
+    }
+}
+
+// Output pixels [begin, end) of a resized row. Taps past the source row
+// have zero weights and read the padding
+static void resizeRowPart(const unsigned char* padded, uint16_t* filtered,
+int64_t begin, int64_t end, const resizeAxis& axis) {
+    const int64_t outputs = axis.first.size();
+    for (int64_t x = begin; x < end; x++) {
+        const unsigned char* at = padded + axis.first[x];
+        int sum = 1 << (blurRowShift - 1);
+        for (int k = 0; k < axis.taps; k++) {
+            sum += axis.weights[(k / 4 * outputs + x) * 4 + k % 4] * at[k];
+        }
+        filtered[x] = sum >> blurRowShift;
+    }
+}
+
+static void resizeRowScalar(const unsigned char* padded, uint16_t* filtered,
+int64_t width, const resizeAxis& axis) {
+    resizeRowPart(padded, filtered, 0, width, axis);
+}
+
+// Sums stay below 2^16, so the mean rounds the same as boxColumnsScalar's
+static void temporalMeanScalar(uint16_t* sums, const unsigned char* add,
+const unsigned char* remove, const unsigned char* current,
+unsigned char* out, int64_t length, const temporalParams& params) {
+    for (int64_t i = 0; i < length; i++) {
+        int mean = std::lrint(static_cast<float>(sums[i]) * params.scale);
+        int pixel = current[i];
+        out[i] = std::abs(mean - pixel) <= params.threshold ? mean : pixel;
+        sums[i] += add[i] - remove[i];
+    }
+}
+
+// Four partial histograms take turns, so a run of one value does not wait
+// on its own increments. Vector loads feeding the same byte extraction
+// measured no faster, so every table uses this one
+static void histogramScalar(const unsigned char* data, int64_t length,
+uint32_t* counts) {
+    uint32_t partial[4][256] = {};
+    int64_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t bytes;
+        std::memcpy(&bytes, data + i, 8);
+        for (int k = 0; k < 8; k++) {
+            partial[k % 4][(bytes >> (8 * k)) & 0xFF]++;
+        }
+    }
+    for (; i < length; i++) {
+        partial[0][data[i]]++;
+    }
+    for (int value = 0; value < 256; value++) {
+        counts[value] += partial[0][value] + partial[1][value] +
+        partial[2][value] + partial[3][value];
+    }
+}
+
+// Weights k and k+1 share a 32 bit lane for madd, like matrixPair
+static int32_t weightPair(const int16_t* weights, int taps, int k) {
+    uint16_t first = weights[k];
+    uint16_t second = (k + 1 < taps) ? weights[k + 1] : 0;
+    return static_cast<int32_t>(first | (static_cast<uint32_t>(second) << 16));
+}
+
+// Pixels go through in tiles whose packed bytes stay in L1, so every plane
+// is read front to back and the strided side never leaves the cache
+const int64_t layoutTileBytes = 16 * 1024;
+
+// Templated on the sample so 16 bit frames share the same tiling
+template <typename sample>
+static void interleaveTiled(const sample* planar, sample* packed,
+int64_t planeSize, int channels, int64_t first, int64_t last) {
+    // One channel looks the same in both layouts
+    if (channels == 1) {
+        std::memcpy(packed + first, planar + first,
+        (last - first) * sizeof(sample));
+        return;
+    }
+    const int64_t tile = std::max<int64_t>(1,
+    layoutTileBytes / sizeof(sample) / std::max(1, channels));
+    for (int64_t start = first; start < last; start += tile) {
+        int64_t end = std::min(last, start + tile);
+        for (int c = 0; c < channels; c++) {
+            const sample* plane = planar + c * planeSize;
+            for (int64_t p = start; p < end; p++) {
+                packed[p * channels + c] = plane[p];
+            }
+        }
+    }
+}
+
+template <typename sample>
+static void deinterleaveTiled(const sample* packed, sample* planar,
+int64_t planeSize, int channels, int64_t first, int64_t last) {
+    // One channel looks the same in both layouts
+    if (channels == 1) {
+        std::memcpy(planar + first, packed + first,
+        (last - first) * sizeof(sample));
+        return;
+    }
+    const int64_t tile = std::max<int64_t>(1,
+    layoutTileBytes / sizeof(sample) / std::max(1, channels));
+    for (int64_t start = first; start < last; start += tile) {
+        int64_t end = std::min(last, start + tile);
+        for (int c = 0; c < channels; c++) {
+            sample* plane = planar + c * planeSize;
+            for (int64_t p = start; p < end; p++) {
+                plane[p] = packed[p * channels + c];
+            }
+        }
+    }
+}
+
+static void interleaveScalar(const unsigned char* planar,
+unsigned char* packed, int64_t planeSize, int channels, int64_t first,
+int64_t last) {
+    interleaveTiled(planar, packed, planeSize, channels, first, last);
+}
+
+static void deinterleaveScalar(const unsigned char* packed,
+unsigned char* planar, int64_t planeSize, int channels, int64_t first,
+int64_t last) {
+    deinterleaveTiled(packed, planar, planeSize, channels, first, last);
+}
+
+// 16 BIT KERNELS
+static void clip16Scalar(uint16_t* data, int64_t length, uint16_t minimum,
+uint16_t maximum) {
+    for (int64_t i = 0; i < length; i++) {
+        data[i] = std::clamp(data[i], minimum, maximum);
+    }
+}
+
+// Same rounding as scaleReference: float product, clamped, truncated
+static void scale16Scalar(uint16_t* data, int64_t length, float scaleFactor,
+uint16_t maximum) {
+    const float highest = maximum;
+    for (int64_t i = 0; i < length; i++) {
+        data[i] = std::clamp(data[i] * scaleFactor, 0.0f, highest);
+    }
+}
+
+// Q12 coefficients times 16 bit samples can pass 2^31, so sums are 64 bit
+static void matrix16Scalar(uint16_t* const* planes, int64_t length,
+const matrixParams& params, uint16_t maximum) {
+    const int size = params.size;
+    const int16_t* coefficients = params.coefficients.data();
+    int64_t values[256];
+    for (int64_t i = 0; i < length; i++) {
+        for (int k = 0; k < size; k++) {
+            values[k] = planes[k][i];
+        }
+        for (int o = 0; o < size; o++) {
+            int64_t sum = 0;
+            for (int k = 0; k < size; k++) {
+                sum += coefficients[o * size + k] * values[k];
+            }
+            planes[o][i] = std::clamp<int64_t>(sum >> matrixShift, 0,
+            maximum);
+        }
+    }
+}
+
+// Coefficients for channels k and k+1 of one output row share a 32 bit lane,
+// so madd on interleaved pixels of two planes does two terms at once
+static int32_t matrixPair(const matrixParams& params, int output, int pair) {
+    int k = pair * 2;
+    uint16_t first = params.coefficients[output * params.size + k];
+    uint16_t second = (k + 1 < params.size) ?
+    params.coefficients[output * params.size + k + 1] : 0;
+    return static_cast<int32_t>(first | (static_cast<uint32_t>(second) << 16));
+}
+
+#ifdef FM2000_X86
+// Each width gets the same body: clip is one max/min pair, scale widens to
+// 16 bits for whole*v + (fraction*v)>>16 and ORs in a saturation mask
+static void clipSSE2(unsigned char* data, int64_t length,
+unsigned char minimum, unsigned char maximum) {
+    const __m128i low = _mm_set1_epi8(minimum);
+    const __m128i high = _mm_set1_epi8(maximum);
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i* at = reinterpret_cast<__m128i*>(data + i);
+        __m128i pixels = _mm_loadu_si128(at);
+        _mm_storeu_si128(at, _mm_min_epu8(_mm_max_epu8(pixels, low), high));
+    }
+    clipScalar(data + i, length - i, minimum, maximum);
+}
+
+static void scaleSSE2(unsigned char* data, int64_t length,
+const scaleParams& params) {
+    if (!params.exact) {
+        scaleScalar(data, length, params);
+        return;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i whole = _mm_set1_epi16(params.whole);
+    const __m128i fraction = _mm_set1_epi16(params.fraction);
+    const __m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i limit = _mm_set1_epi8(params.satBelow ^ 0x80);
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i* at = reinterpret_cast<__m128i*>(data + i);
+        __m128i pixels = _mm_loadu_si128(at);
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, whole),
+        _mm_mulhi_epu16(lo, fraction));
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, whole),
+        _mm_mulhi_epu16(hi, fraction));
+        __m128i saturated =
+        _mm_cmpgt_epi8(_mm_xor_si128(pixels, flip), limit);
+        _mm_storeu_si128(at, _mm_or_si128(_mm_packus_epi16(lo, hi), saturated));
+    }
+    scaleScalar(data + i, length - i, params);
+}
+
+static void swapSSE2(unsigned char* first, unsigned char* second,
+int64_t length) {
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i* a = reinterpret_cast<__m128i*>(first + i);
+        __m128i* b = reinterpret_cast<__m128i*>(second + i);
+        __m128i aPixels = _mm_loadu_si128(a);
+        _mm_storeu_si128(a, _mm_loadu_si128(b));
+        _mm_storeu_si128(b, aPixels);
+    }
+    swapScalar(first + i, second + i, length - i);
+}
+
+// Planes are interleaved pairwise and widened to 16 bits, each output is a
+// sum of madds, then shifted and packed back down with saturation
+static void matrixSSE2(unsigned char* const* planes, int64_t length,
+const matrixParams& params) {
+    const int size = params.size;
+    if (size > maxSimdMatrix) {
+        matrixScalar(planes, length, params);
+        return;
+    }
+    const int pairs = (size + 1) / 2;
+    __m128i weights[maxSimdMatrix][maxSimdMatrix / 2];
+    for (int o = 0; o < size; o++) {
+        for (int p = 0; p < pairs; p++) {
+            weights[o][p] = _mm_set1_epi32(matrixPair(params, o, p));
+        }
+    }
+    const __m128i zero = _mm_setzero_si128();
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i words[maxSimdMatrix / 2][4];
+        for (int p = 0; p < pairs; p++) {
+            __m128i a = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(planes[2*p] + i));
+            __m128i b = (2*p + 1 < size) ? _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(planes[2*p + 1] + i)) : zero;
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            words[p][0] = _mm_unpacklo_epi8(lo, zero);
+            words[p][1] = _mm_unpackhi_epi8(lo, zero);
+            words[p][2] = _mm_unpacklo_epi8(hi, zero);
+            words[p][3] = _mm_unpackhi_epi8(hi, zero);
+        }
+        __m128i results[maxSimdMatrix];
+        for (int o = 0; o < size; o++) {
+            __m128i sums[4];
+            for (int q = 0; q < 4; q++) {
+                sums[q] = _mm_madd_epi16(words[0][q], weights[o][0]);
+                for (int p = 1; p < pairs; p++) {
+                    sums[q] = _mm_add_epi32(sums[q],
+                    _mm_madd_epi16(words[p][q], weights[o][p]));
+                }
+                sums[q] = _mm_srai_epi32(sums[q], matrixShift);
+            }
+            results[o] = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]),
+            _mm_packs_epi32(sums[2], sums[3]));
+        }
+        for (int o = 0; o < size; o++) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[o] + i),
+            results[o]);
+        }
+    }
+
+    unsigned char* rest[maxSimdMatrix];
+    for (int k = 0; k < size; k++) {
+        rest[k] = planes[k] + i;
+    }
+    matrixScalar(rest, length - i, params);
+}
+
+// Rows and columns alike interleave neighbouring taps so one madd does
+// two of them, 8 pixels per vector. The padded row has a spare byte for
+// the zero weight after an odd last tap
+static void gaussianRowSSE2(const unsigned char* padded, uint16_t* filtered,
+int64_t width, const blurParams& params) {
+    const int taps = 2 * params.radius + 1;
+    const int pairs = (taps + 1) / 2;
+    __m128i paired[maxBlurRadius + 1];
+    for (int p = 0; p < pairs; p++) {
+        paired[p] = _mm_set1_epi32(
+        weightPair(params.weights.data(), taps, 2 * p));
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (blurRowShift - 1));
+    int64_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i low = round;
+        __m128i high = round;
+        for (int p = 0; p < pairs; p++) {
+            const unsigned char* at = padded + x + 2 * p;
+            __m128i a = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(at)), zero);
+            __m128i b = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(at + 1)), zero);
+            low = _mm_add_epi32(low,
+            _mm_madd_epi16(_mm_unpacklo_epi16(a, b), paired[p]));
+            high = _mm_add_epi32(high,
+            _mm_madd_epi16(_mm_unpackhi_epi16(a, b), paired[p]));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(filtered + x),
+        _mm_packs_epi32(_mm_srai_epi32(low, blurRowShift),
+        _mm_srai_epi32(high, blurRowShift)));
+    }
+    gaussianRowScalar(padded + x, filtered + x, width - x, params);
+}
+
+static void weightedColumnsSSE2(const uint16_t* const* rows,
+const int16_t* weights, int taps, unsigned char* out, int64_t width) {
+    const int pairs = (taps + 1) / 2;
+    __m128i paired[maxBlurRadius + 1];
+    for (int p = 0; p < pairs; p++) {
+        paired[p] = _mm_set1_epi32(weightPair(weights, taps, 2 * p));
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (blurColumnShift - 1));
+    int64_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i low = round;
+        __m128i high = round;
+        for (int p = 0; p < pairs; p++) {
+            __m128i a = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(rows[2 * p] + x));
+            __m128i b = (2 * p + 1 < taps) ? _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(rows[2 * p + 1] + x)) : zero;
+            low = _mm_add_epi32(low,
+            _mm_madd_epi16(_mm_unpacklo_epi16(a, b), paired[p]));
+            high = _mm_add_epi32(high,
+            _mm_madd_epi16(_mm_unpackhi_epi16(a, b), paired[p]));
+        }
+        __m128i words = _mm_packs_epi32(_mm_srai_epi32(low, blurColumnShift),
+        _mm_srai_epi32(high, blurColumnShift));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x),
+        _mm_packus_epi16(words, words));
+    }
+    const uint16_t* rest[2 * maxBlurRadius + 1];
+    for (int k = 0; k < taps; k++) {
+        rest[k] = rows[k] + x;
+    }
+    weightedColumnsScalar(rest, weights, taps, out + x, width - x);
+}
+
+static void boxColumnsSSE2(uint32_t* sums, const uint16_t* add,
+const uint16_t* remove, unsigned char* out, int64_t width, float scale) {
+    const __m128 factor = _mm_set1_ps(scale);
+    const __m128i zero = _mm_setzero_si128();
+    int64_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i* at = reinterpret_cast<__m128i*>(sums + x);
+        __m128i low = _mm_loadu_si128(at);
+        __m128i high = _mm_loadu_si128(at + 1);
+        __m128i words = _mm_packs_epi32(
+        _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(low), factor)),
+        _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(high), factor)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x),
+        _mm_packus_epi16(words, words));
+        __m128i added =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(add + x));
+        __m128i removed =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(remove + x));
+        low = _mm_add_epi32(low, _mm_sub_epi32(
+        _mm_unpacklo_epi16(added, zero), _mm_unpacklo_epi16(removed, zero)));
+        high = _mm_add_epi32(high, _mm_sub_epi32(
+        _mm_unpackhi_epi16(added, zero), _mm_unpackhi_epi16(removed, zero)));
+        _mm_storeu_si128(at, low);
+        _mm_storeu_si128(at + 1, high);
+    }
+    boxColumnsScalar(sums + x, add + x, remove + x, out + x, width - x,
+    scale);
+}
+
+// 4 output pixels per vector, every group of 4 taps is one 32 bit load
+// per pixel and a multiply-add per two pixels. The two halves of each
+// pixel's sum end up in neighbouring lanes and are added at the end
+static void resizeRowSSE2(const unsigned char* padded, uint16_t* filtered,
+int64_t width, const resizeAxis& axis) {
+    const int groups = axis.taps / 4;
+    const int64_t outputs = axis.first.size();
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (blurRowShift - 1));
+    int64_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i low = zero;
+        __m128i high = zero;
+        for (int g = 0; g < groups; g++) {
+            int32_t taps[4];
+            for (int i = 0; i < 4; i++) {
+                std::memcpy(&taps[i], padded + axis.first[x + i] + 4 * g,
+                sizeof(int32_t));
+            }
+            __m128i bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps));
+            const __m128i* weights = reinterpret_cast<const __m128i*>
+            (&axis.weights[(g * outputs + x) * 4]);
+            low = _mm_add_epi32(low, _mm_madd_epi16(
+            _mm_unpacklo_epi8(bytes, zero), _mm_loadu_si128(weights)));
+            high = _mm_add_epi32(high, _mm_madd_epi16(
+            _mm_unpackhi_epi8(bytes, zero), _mm_loadu_si128(weights + 1)));
+        }
+        __m128 lowHalves = _mm_castsi128_ps(low);
+        __m128 highHalves = _mm_castsi128_ps(high);
+        __m128i sums = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(
+        lowHalves, highHalves, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(lowHalves, highHalves,
+        _MM_SHUFFLE(3, 1, 3, 1))));
+        sums = _mm_srai_epi32(_mm_add_epi32(sums, round), blurRowShift);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(filtered + x),
+        _mm_packs_epi32(sums, sums));
+    }
+    resizeRowPart(padded, filtered, x, width, axis);
+}
+
+// 8 sums to 8 rounded means
+static __m128i temporalWordsSSE2(__m128i sums, __m128 factor) {
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(
+    _mm_cvtepi32_ps(_mm_unpacklo_epi16(sums, zero)), factor)),
+    _mm_cvtps_epi32(_mm_mul_ps(
+    _mm_cvtepi32_ps(_mm_unpackhi_epi16(sums, zero)), factor)));
+}
+
+// 16 pixels per vector, the distance to the mean is the OR of the two
+// saturated differences, like a byte absdiff
+static void temporalMeanSSE2(uint16_t* sums, const unsigned char* add,
+const unsigned char* remove, const unsigned char* current,
+unsigned char* out, int64_t length, const temporalParams& params) {
+    const __m128 factor = _mm_set1_ps(params.scale);
+    const __m128i threshold =
+    _mm_set1_epi8(static_cast<char>(params.threshold));
+    const __m128i zero = _mm_setzero_si128();
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i* at = reinterpret_cast<__m128i*>(sums + i);
+        __m128i low = _mm_loadu_si128(at);
+        __m128i high = _mm_loadu_si128(at + 1);
+        __m128i means = _mm_packus_epi16(temporalWordsSSE2(low, factor),
+        temporalWordsSSE2(high, factor));
+        __m128i pixels =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(current + i));
+        __m128i distance = _mm_or_si128(_mm_subs_epu8(means, pixels),
+        _mm_subs_epu8(pixels, means));
+        __m128i close = _mm_cmpeq_epi8(_mm_max_epu8(distance, threshold),
+        threshold);
+        __m128i added =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(add + i));
+        __m128i removed =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(remove + i));
+        _mm_storeu_si128(at, _mm_sub_epi16(_mm_add_epi16(low,
+        _mm_unpacklo_epi8(added, zero)), _mm_unpacklo_epi8(removed, zero)));
+        _mm_storeu_si128(at + 1, _mm_sub_epi16(_mm_add_epi16(high,
+        _mm_unpackhi_epi8(added, zero)), _mm_unpackhi_epi8(removed, zero)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+        _mm_or_si128(_mm_and_si128(close, means),
+        _mm_andnot_si128(close, pixels)));
+    }
+    temporalMeanScalar(sums + i, add + i, remove + i, current + i, out + i,
+    length - i, params);
+}
+
+__attribute__((target("avx2")))
+static void clipAVX2(unsigned char* data, int64_t length,
+unsigned char minimum, unsigned char maximum) {
+    const __m256i low = _mm256_set1_epi8(minimum);
+    const __m256i high = _mm256_set1_epi8(maximum);
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* at = reinterpret_cast<__m256i*>(data + i);
+        __m256i pixels = _mm256_loadu_si256(at);
+        _mm256_storeu_si256(at,
+        _mm256_min_epu8(_mm256_max_epu8(pixels, low), high));
+    }
+    clipSSE2(data + i, length - i, minimum, maximum);
+}
+
+// 256 entry lookup as 16 pshufb lookups of 16 entries each, the high
+// nibble picks which of the 16 results each byte keeps
+__attribute__((target("avx2")))
+static void lookupAVX2(unsigned char* data, int64_t length,
+const unsigned char* table) {
+    __m256i rows[16];
+    for (int row = 0; row < 16; row++) {
+        rows[row] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(table + row * 16)));
+    }
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* at = reinterpret_cast<__m256i*>(data + i);
+        __m256i pixels = _mm256_loadu_si256(at);
+        __m256i low = _mm256_and_si256(pixels, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(pixels, 4), nibble);
+        __m256i result = _mm256_shuffle_epi8(rows[0], low);
+        for (int row = 1; row < 16; row++) {
+            __m256i match = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(row));
+            result = _mm256_blendv_epi8(result,
+            _mm256_shuffle_epi8(rows[row], low), match);
+        }
+        _mm256_storeu_si256(at, result);
+    }
+    lookupScalar(data + i, length - i, table);
+}
+
+__attribute__((target("avx2")))
+static void scaleAVX2(unsigned char* data, int64_t length,
+const scaleParams& params) {
+    if (!params.exact) {
+        unsigned char table[256];
+        scaleTable(params.factor, table);
+        lookupAVX2(data, length, table);
+        return;
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i whole = _mm256_set1_epi16(params.whole);
+    const __m256i fraction = _mm256_set1_epi16(params.fraction);
+    const __m256i flip = _mm256_set1_epi8(static_cast<char>(0x80));
+    const __m256i limit = _mm256_set1_epi8(params.satBelow ^ 0x80);
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* at = reinterpret_cast<__m256i*>(data + i);
+        __m256i pixels = _mm256_loadu_si256(at);
+        // Unpack and pack both work per 128 bit lane, so order is kept
+        __m256i lo = _mm256_unpacklo_epi8(pixels, zero);
+        __m256i hi = _mm256_unpackhi_epi8(pixels, zero);
+        lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, whole),
+        _mm256_mulhi_epu16(lo, fraction));
+        hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, whole),
+        _mm256_mulhi_epu16(hi, fraction));
+        __m256i saturated =
+        _mm256_cmpgt_epi8(_mm256_xor_si256(pixels, flip), limit);
+        _mm256_storeu_si256(at,
+        _mm256_or_si256(_mm256_packus_epi16(lo, hi), saturated));
+    }
+    scaleSSE2(data + i, length - i, params);
+}
+
+__attribute__((target("avx2")))
+static void swapAVX2(unsigned char* first, unsigned char* second,
+int64_t length) {
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* a = reinterpret_cast<__m256i*>(first + i);
+        __m256i* b = reinterpret_cast<__m256i*>(second + i);
+        __m256i aPixels = _mm256_loadu_si256(a);
+        _mm256_storeu_si256(a, _mm256_loadu_si256(b));
+        _mm256_storeu_si256(b, aPixels);
+    }
+    swapSSE2(first + i, second + i, length - i);
+}
+
+// Unpacks and packs stay inside 128 bit lanes, which keeps pixel order
+__attribute__((target("avx2")))
+static void matrixAVX2(unsigned char* const* planes, int64_t length,
+const matrixParams& params) {
+    const int size = params.size;
+    if (size > maxSimdMatrix) {
+        matrixScalar(planes, length, params);
+        return;
+    }
+    const int pairs = (size + 1) / 2;
+    __m256i weights[maxSimdMatrix][maxSimdMatrix / 2];
+    for (int o = 0; o < size; o++) {
+        for (int p = 0; p < pairs; p++) {
+            weights[o][p] = _mm256_set1_epi32(matrixPair(params, o, p));
+        }
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i words[maxSimdMatrix / 2][4];
+        for (int p = 0; p < pairs; p++) {
+            __m256i a = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(planes[2*p] + i));
+            __m256i b = (2*p + 1 < size) ? _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(planes[2*p + 1] + i)) : zero;
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            words[p][0] = _mm256_unpacklo_epi8(lo, zero);
+            words[p][1] = _mm256_unpackhi_epi8(lo, zero);
+            words[p][2] = _mm256_unpacklo_epi8(hi, zero);
+            words[p][3] = _mm256_unpackhi_epi8(hi, zero);
+        }
+        __m256i results[maxSimdMatrix];
+        for (int o = 0; o < size; o++) {
+            __m256i sums[4];
+            for (int q = 0; q < 4; q++) {
+                sums[q] = _mm256_madd_epi16(words[0][q], weights[o][0]);
+                for (int p = 1; p < pairs; p++) {
+                    sums[q] = _mm256_add_epi32(sums[q],
+                    _mm256_madd_epi16(words[p][q], weights[o][p]));
+                }
+                sums[q] = _mm256_srai_epi32(sums[q], matrixShift);
+            }
+            results[o] = _mm256_packus_epi16(
+            _mm256_packs_epi32(sums[0], sums[1]),
+            _mm256_packs_epi32(sums[2], sums[3]));
+        }
+        for (int o = 0; o < size; o++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(planes[o] + i),
+            results[o]);
+        }
+    }
+
+    unsigned char* rest[maxSimdMatrix];
+    for (int k = 0; k < size; k++) {
+        rest[k] = planes[k] + i;
+    }
+    matrixSSE2(rest, length - i, params);
+}
+
+// 16 pixels per vector. unpack and pack both work inside 128 bit lanes,
+// so the two cancel out and only the final narrowing needs a permute
+__attribute__((target("avx2")))
+static void gaussianRowAVX2(const unsigned char* padded, uint16_t* filtered,
+int64_t width, const blurParams& params) {
+    const int taps = 2 * params.radius + 1;
+    const int pairs = (taps + 1) / 2;
+    __m256i paired[maxBlurRadius + 1];
+    for (int p = 0; p < pairs; p++) {
+        paired[p] = _mm256_set1_epi32(
+        weightPair(params.weights.data(), taps, 2 * p));
+    }
+    const __m256i round = _mm256_set1_epi32(1 << (blurRowShift - 1));
+    int64_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i low = round;
+        __m256i high = round;
+        for (int p = 0; p < pairs; p++) {
+            const unsigned char* at = padded + x + 2 * p;
+            __m256i a = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(at)));
+            __m256i b = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(at + 1)));
+            low = _mm256_add_epi32(low,
+            _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), paired[p]));
+            high = _mm256_add_epi32(high,
+            _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), paired[p]));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(filtered + x),
+        _mm256_packs_epi32(_mm256_srai_epi32(low, blurRowShift),
+        _mm256_srai_epi32(high, blurRowShift)));
+    }
+    gaussianRowSSE2(padded + x, filtered + x, width - x, params);
+}
+
+// Bytes 0-7 of each lane hold the 16 output pixels after packus
+__attribute__((target("avx2")))
+static void storeNarrowAVX2(unsigned char* out, __m256i words) {
+    __m256i bytes = _mm256_packus_epi16(words, words);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+    _mm256_castsi256_si128(_mm256_permute4x64_epi64(bytes, 0x08)));
+}
+
+__attribute__((target("avx2")))
+static void weightedColumnsAVX2(const uint16_t* const* rows,
+const int16_t* weights, int taps, unsigned char* out, int64_t width) {
+    const int pairs = (taps + 1) / 2;
+    __m256i paired[maxBlurRadius + 1];
+    for (int p = 0; p < pairs; p++) {
+        paired[p] = _mm256_set1_epi32(weightPair(weights, taps, 2 * p));
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (blurColumnShift - 1));
+    int64_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i low = round;
+        __m256i high = round;
+        for (int p = 0; p < pairs; p++) {
+            __m256i a = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(rows[2 * p] + x));
+            __m256i b = (2 * p + 1 < taps) ? _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(rows[2 * p + 1] + x)) : zero;
+            low = _mm256_add_epi32(low,
+            _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), paired[p]));
+            high = _mm256_add_epi32(high,
+            _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), paired[p]));
+        }
+        storeNarrowAVX2(out + x, _mm256_packs_epi32(
+        _mm256_srai_epi32(low, blurColumnShift),
+        _mm256_srai_epi32(high, blurColumnShift)));
+    }
+    const uint16_t* rest[2 * maxBlurRadius + 1];
+    for (int k = 0; k < taps; k++) {
+        rest[k] = rows[k] + x;
+    }
+    weightedColumnsSSE2(rest, weights, taps, out + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void boxColumnsAVX2(uint32_t* sums, const uint16_t* add,
+const uint16_t* remove, unsigned char* out, int64_t width, float scale) {
+    const __m256 factor = _mm256_set1_ps(scale);
+    int64_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i* at = reinterpret_cast<__m256i*>(sums + x);
+        __m256i low = _mm256_loadu_si256(at);
+        __m256i high = _mm256_loadu_si256(at + 1);
+        __m256i words = _mm256_packs_epi32(
+        _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(low), factor)),
+        _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(high), factor)));
+        storeNarrowAVX2(out + x, _mm256_permute4x64_epi64(words, 0xD8));
+        __m256i added =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(add + x));
+        __m256i removed =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(remove + x));
+        low = _mm256_add_epi32(low, _mm256_sub_epi32(
+        _mm256_cvtepu16_epi32(_mm256_castsi256_si128(added)),
+        _mm256_cvtepu16_epi32(_mm256_castsi256_si128(removed))));
+        high = _mm256_add_epi32(high, _mm256_sub_epi32(
+        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(added, 1)),
+        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(removed, 1))));
+        _mm256_storeu_si256(at, low);
+        _mm256_storeu_si256(at + 1, high);
+    }
+    boxColumnsSSE2(sums + x, add + x, remove + x, out + x, width - x, scale);
+}
+
+// 8 output pixels per vector, each group of 4 taps is a single gather
+__attribute__((target("avx2")))
+static void resizeRowAVX2(const unsigned char* padded, uint16_t* filtered,
+int64_t width, const resizeAxis& axis) {
+    const int groups = axis.taps / 4;
+    const int64_t outputs = axis.first.size();
+    const __m256i round = _mm256_set1_epi32(1 << (blurRowShift - 1));
+    int64_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i starts =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&axis.first[x]));
+        __m256i low = _mm256_setzero_si256();
+        __m256i high = _mm256_setzero_si256();
+        for (int g = 0; g < groups; g++) {
+            __m256i bytes = _mm256_i32gather_epi32(
+            reinterpret_cast<const int*>(padded + 4 * g), starts, 1);
+            const __m256i* weights = reinterpret_cast<const __m256i*>
+            (&axis.weights[(g * outputs + x) * 4]);
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(
+            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)),
+            _mm256_loadu_si256(weights)));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(
+            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)),
+            _mm256_loadu_si256(weights + 1)));
+        }
+        // hadd leaves the pixels in the order 0 1 4 5 2 3 6 7
+        __m256i sums = _mm256_permute4x64_epi64(
+        _mm256_hadd_epi32(low, high), 0xD8);
+        sums = _mm256_srai_epi32(_mm256_add_epi32(sums, round), blurRowShift);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(filtered + x),
+        _mm_packs_epi32(_mm256_castsi256_si128(sums),
+        _mm256_extracti128_si256(sums, 1)));
+    }
+    resizeRowPart(padded, filtered, x, width, axis);
+}
+
+// 16 sums to 16 rounded means, in order
+__attribute__((target("avx2")))
+static __m256i temporalWordsAVX2(__m256i sums, __m256 factor) {
+    __m256i low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(
+    _mm256_cvtepu16_epi32(_mm256_castsi256_si128(sums))), factor));
+    __m256i high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(
+    _mm256_cvtepu16_epi32(_mm256_extracti128_si256(sums, 1))), factor));
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+}
+
+// 32 pixels per vector, the packs work per lane so each needs one permute
+__attribute__((target("avx2")))
+static void temporalMeanAVX2(uint16_t* sums, const unsigned char* add,
+const unsigned char* remove, const unsigned char* current,
+unsigned char* out, int64_t length, const temporalParams& params) {
+    const __m256 factor = _mm256_set1_ps(params.scale);
+    const __m256i threshold =
+    _mm256_set1_epi8(static_cast<char>(params.threshold));
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* at = reinterpret_cast<__m256i*>(sums + i);
+        __m256i low = _mm256_loadu_si256(at);
+        __m256i high = _mm256_loadu_si256(at + 1);
+        __m256i means = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+        temporalWordsAVX2(low, factor), temporalWordsAVX2(high, factor)),
+        0xD8);
+        __m256i pixels =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(current + i));
+        __m256i distance = _mm256_or_si256(_mm256_subs_epu8(means, pixels),
+        _mm256_subs_epu8(pixels, means));
+        __m256i close = _mm256_cmpeq_epi8(
+        _mm256_max_epu8(distance, threshold), threshold);
+        __m128i added[2];
+        __m128i removed[2];
+        for (int h = 0; h < 2; h++) {
+            added[h] = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(add + i + 16 * h));
+            removed[h] = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(remove + i + 16 * h));
+        }
+        _mm256_storeu_si256(at, _mm256_sub_epi16(_mm256_add_epi16(low,
+        _mm256_cvtepu8_epi16(added[0])), _mm256_cvtepu8_epi16(removed[0])));
+        _mm256_storeu_si256(at + 1, _mm256_sub_epi16(_mm256_add_epi16(high,
+        _mm256_cvtepu8_epi16(added[1])), _mm256_cvtepu8_epi16(removed[1])));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+        _mm256_blendv_epi8(pixels, means, close));
+    }
+    temporalMeanSSE2(sums + i, add + i, remove + i, current + i, out + i,
+    length - i, params);
+}
+
+// 16 pixels of 2 to 4 channels are C vectors on either side. Packed vector
+// k takes byte j from plane (16k + j) % C, so each vector is the OR of one
+// byte shuffle per vector of the other side
+template <int channels>
+struct layoutShuffles {
+    alignas(16) unsigned char pack[channels][channels][16];
+    alignas(16) unsigned char unpack[channels][channels][16];
+
+    layoutShuffles() {
+        for (int k = 0; k < channels; k++) {
+            for (int c = 0; c < channels; c++) {
+                for (int j = 0; j < 16; j++) {
+                    int packedByte = 16 * k + j;
+                    pack[k][c][j] = packedByte % channels == c ?
+                    packedByte / channels : 0x80;
+                    int planarByte = channels * j + c;
+                    unpack[c][k][j] = planarByte / 16 == k ?
+                    planarByte % 16 : 0x80;
+                }
+            }
+        }
+    }
+};
+
+template <int channels>
+__attribute__((target("avx2")))
+static int64_t interleaveShuffle(const unsigned char* planar,
+unsigned char* packed, int64_t planeSize, int64_t first, int64_t last) {
+    static const layoutShuffles<channels> shuffles;
+    __m128i masks[channels][channels];
+    for (int k = 0; k < channels; k++) {
+        for (int c = 0; c < channels; c++) {
+            masks[k][c] = _mm_load_si128(
+            reinterpret_cast<const __m128i*>(shuffles.pack[k][c]));
+        }
+    }
+    int64_t p = first;
+    for (; p + 16 <= last; p += 16) {
+        __m128i planes[channels];
+        for (int c = 0; c < channels; c++) {
+            planes[c] = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(planar + c * planeSize + p));
+        }
+        for (int k = 0; k < channels; k++) {
+            __m128i out = _mm_shuffle_epi8(planes[0], masks[k][0]);
+            for (int c = 1; c < channels; c++) {
+                out = _mm_or_si128(out,
+                _mm_shuffle_epi8(planes[c], masks[k][c]));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>
+            (packed + p * channels + 16 * k), out);
+        }
+    }
+    return p;
+}
+
+template <int channels>
+__attribute__((target("avx2")))
+static int64_t deinterleaveShuffle(const unsigned char* packed,
+unsigned char* planar, int64_t planeSize, int64_t first, int64_t last) {
+    static const layoutShuffles<channels> shuffles;
+    __m128i masks[channels][channels];
+    for (int c = 0; c < channels; c++) {
+        for (int k = 0; k < channels; k++) {
+            masks[c][k] = _mm_load_si128(
+            reinterpret_cast<const __m128i*>(shuffles.unpack[c][k]));
+        }
+    }
+    int64_t p = first;
+    for (; p + 16 <= last; p += 16) {
+        __m128i pixels[channels];
+        for (int k = 0; k < channels; k++) {
+            pixels[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>
+            (packed + p * channels + 16 * k));
+        }
+        for (int c = 0; c < channels; c++) {
+            __m128i out = _mm_shuffle_epi8(pixels[0], masks[c][0]);
+            for (int k = 1; k < channels; k++) {
+                out = _mm_or_si128(out,
+                _mm_shuffle_epi8(pixels[k], masks[c][k]));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>
+            (planar + c * planeSize + p), out);
+        }
+    }
+    return p;
+}
+
+// Wider channel counts and the last few pixels take the tiled scalar path
+__attribute__((target("avx2")))
+static void interleaveAVX2(const unsigned char* planar,
+unsigned char* packed, int64_t planeSize, int channels, int64_t first,
+int64_t last) {
+    int64_t p = first;
+    if (channels == 2) {
+        p = interleaveShuffle<2>(planar, packed, planeSize, first, last);
+    } else if (channels == 3) {
+        p = interleaveShuffle<3>(planar, packed, planeSize, first, last);
+    } else if (channels == 4) {
+        p = interleaveShuffle<4>(planar, packed, planeSize, first, last);
+    }
+    interleaveScalar(planar, packed, planeSize, channels, p, last);
+}
+
+__attribute__((target("avx2")))
+static void deinterleaveAVX2(const unsigned char* packed,
+unsigned char* planar, int64_t planeSize, int channels, int64_t first,
+int64_t last) {
+    int64_t p = first;
+    if (channels == 2) {
+        p = deinterleaveShuffle<2>(packed, planar, planeSize, first, last);
+    } else if (channels == 3) {
+        p = deinterleaveShuffle<3>(packed, planar, planeSize, first, last);
+    } else if (channels == 4) {
+        p = deinterleaveShuffle<4>(packed, planar, planeSize, first, last);
+    }
+    deinterleaveScalar(packed, planar, planeSize, channels, p, last);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void clipAVX512(unsigned char* data, int64_t length,
+unsigned char minimum, unsigned char maximum) {
+    const __m512i low = _mm512_set1_epi8(minimum);
+    const __m512i high = _mm512_set1_epi8(maximum);
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i pixels = _mm512_loadu_si512(data + i);
+        _mm512_storeu_si512(data + i,
+        _mm512_min_epu8(_mm512_max_epu8(pixels, low), high));
+    }
+    clipAVX2(data + i, length - i, minimum, maximum);
+}
+
+// Same nibble split as AVX2, but the byte masks make each row two ops
+__attribute__((target("avx512f,avx512bw")))
+static void lookupAVX512(unsigned char* data, int64_t length,
+const unsigned char* table) {
+    __m512i rows[16];
+    for (int row = 0; row < 16; row++) {
+        // Every 128 bit lane needs its own copy of the row for the shuffle
+        unsigned char repeated[64];
+        for (int lane = 0; lane < 4; lane++) {
+            std::copy(table + row * 16, table + row * 16 + 16,
+            repeated + lane * 16);
+        }
+        rows[row] = _mm512_loadu_si512(repeated);
+    }
+    const __m512i nibble = _mm512_set1_epi8(0x0F);
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i pixels = _mm512_loadu_si512(data + i);
+        __m512i low = _mm512_and_si512(pixels, nibble);
+        __m512i high = _mm512_and_si512(_mm512_srli_epi16(pixels, 4), nibble);
+        __m512i result = _mm512_shuffle_epi8(rows[0], low);
+        for (int row = 1; row < 16; row++) {
+            __mmask64 match =
+            _mm512_cmpeq_epi8_mask(high, _mm512_set1_epi8(row));
+            result = _mm512_mask_shuffle_epi8(result, match, rows[row], low);
+        }
+        _mm512_storeu_si512(data + i, result);
+    }
+    lookupAVX2(data + i, length - i, table);
+}
+
+// With VBMI a 128 entry permute covers half the table in one instruction
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void lookupVBMI(unsigned char* data, int64_t length,
+const unsigned char* table) {
+    const __m512i quarter0 = _mm512_loadu_si512(table);
+    const __m512i quarter1 = _mm512_loadu_si512(table + 64);
+    const __m512i quarter2 = _mm512_loadu_si512(table + 128);
+    const __m512i quarter3 = _mm512_loadu_si512(table + 192);
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i pixels = _mm512_loadu_si512(data + i);
+        __m512i low = _mm512_permutex2var_epi8(quarter0, pixels, quarter1);
+        __m512i high = _mm512_permutex2var_epi8(quarter2, pixels, quarter3);
+        _mm512_storeu_si512(data + i,
+        _mm512_mask_blend_epi8(_mm512_movepi8_mask(pixels), low, high));
+    }
+    lookupAVX2(data + i, length - i, table);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scaleAVX512(unsigned char* data, int64_t length,
+const scaleParams& params) {
+    if (!params.exact) {
+        unsigned char table[256];
+        scaleTable(params.factor, table);
+        lookupAVX512(data, length, table);
+        return;
+    }
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i whole = _mm512_set1_epi16(params.whole);
+    const __m512i fraction = _mm512_set1_epi16(params.fraction);
+    const __m512i limit = _mm512_set1_epi8(params.satBelow);
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i pixels = _mm512_loadu_si512(data + i);
+        __m512i lo = _mm512_unpacklo_epi8(pixels, zero);
+        __m512i hi = _mm512_unpackhi_epi8(pixels, zero);
+        lo = _mm512_add_epi16(_mm512_mullo_epi16(lo, whole),
+        _mm512_mulhi_epu16(lo, fraction));
+        hi = _mm512_add_epi16(_mm512_mullo_epi16(hi, whole),
+        _mm512_mulhi_epu16(hi, fraction));
+        // AVX-512 has unsigned byte compares, so no sign flip needed
+        __mmask64 saturated = _mm512_cmpgt_epu8_mask(pixels, limit);
+        _mm512_storeu_si512(data + i, _mm512_mask_blend_epi8(saturated,
+        _mm512_packus_epi16(lo, hi), _mm512_set1_epi8(-1)));
+    }
+    scaleAVX2(data + i, length - i, params);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void swapAVX512(unsigned char* first, unsigned char* second,
+int64_t length) {
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i aPixels = _mm512_loadu_si512(first + i);
+        _mm512_storeu_si512(first + i, _mm512_loadu_si512(second + i));
+        _mm512_storeu_si512(second + i, aPixels);
+    }
+    swapAVX2(first + i, second + i, length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void matrixAVX512(unsigned char* const* planes, int64_t length,
+const matrixParams& params) {
+    const int size = params.size;
+    if (size > maxSimdMatrix) {
+        matrixScalar(planes, length, params);
+        return;
+    }
+    const int pairs = (size + 1) / 2;
+    __m512i weights[maxSimdMatrix][maxSimdMatrix / 2];
+    for (int o = 0; o < size; o++) {
+        for (int p = 0; p < pairs; p++) {
+            weights[o][p] = _mm512_set1_epi32(matrixPair(params, o, p));
+        }
+    }
+    const __m512i zero = _mm512_setzero_si512();
+    int64_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m512i words[maxSimdMatrix / 2][4];
+        for (int p = 0; p < pairs; p++) {
+            __m512i a = _mm512_loadu_si512(planes[2*p] + i);
+            __m512i b = (2*p + 1 < size) ?
+            _mm512_loadu_si512(planes[2*p + 1] + i) : zero;
+            __m512i lo = _mm512_unpacklo_epi8(a, b);
+            __m512i hi = _mm512_unpackhi_epi8(a, b);
+            words[p][0] = _mm512_unpacklo_epi8(lo, zero);
+            words[p][1] = _mm512_unpackhi_epi8(lo, zero);
+            words[p][2] = _mm512_unpacklo_epi8(hi, zero);
+            words[p][3] = _mm512_unpackhi_epi8(hi, zero);
+        }
+        __m512i results[maxSimdMatrix];
+        for (int o = 0; o < size; o++) {
+            __m512i sums[4];
+            for (int q = 0; q < 4; q++) {
+                sums[q] = _mm512_madd_epi16(words[0][q], weights[o][0]);
+                for (int p = 1; p < pairs; p++) {
+                    sums[q] = _mm512_add_epi32(sums[q],
+                    _mm512_madd_epi16(words[p][q], weights[o][p]));
+                }
+                // The masked form avoids a GCC 12 uninitialized warning
+                sums[q] =
+                _mm512_maskz_srai_epi32(0xFFFF, sums[q], matrixShift);
+            }
+            results[o] = _mm512_packus_epi16(
+            _mm512_packs_epi32(sums[0], sums[1]),
+            _mm512_packs_epi32(sums[2], sums[3]));
+        }
+        for (int o = 0; o < size; o++) {
+            _mm512_storeu_si512(planes[o] + i, results[o]);
+        }
+    }
+
+    unsigned char* rest[maxSimdMatrix];
+    for (int k = 0; k < size; k++) {
+        rest[k] = planes[k] + i;
+    }
+    matrixAVX2(rest, length - i, params);
+}
+
+// 16 bit samples: SSE2 only has signed 16 bit min/max, so clip flips the
+// sign bit around them, and scaling packs through the signed range too
+static void clip16SSE2(uint16_t* data, int64_t length, uint16_t minimum,
+uint16_t maximum) {
+    const __m128i flip = _mm_set1_epi16(static_cast<int16_t>(0x8000));
+    const __m128i low = _mm_set1_epi16(static_cast<int16_t>(minimum ^ 0x8000));
+    const __m128i high = _mm_set1_epi16(static_cast<int16_t>(maximum ^ 0x8000));
+    int64_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i* at = reinterpret_cast<__m128i*>(data + i);
+        __m128i samples = _mm_xor_si128(_mm_loadu_si128(at), flip);
+        samples = _mm_min_epi16(_mm_max_epi16(samples, low), high);
+        _mm_storeu_si128(at, _mm_xor_si128(samples, flip));
+    }
+    clip16Scalar(data + i, length - i, minimum, maximum);
+}
+
+static void scale16SSE2(uint16_t* data, int64_t length, float scaleFactor,
+uint16_t maximum) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    const __m128i flip = _mm_set1_epi16(static_cast<int16_t>(0x8000));
+    const __m128 factor = _mm_set1_ps(scaleFactor);
+    const __m128 highest = _mm_set1_ps(maximum);
+    const __m128 lowest = _mm_setzero_ps();
+    int64_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i* at = reinterpret_cast<__m128i*>(data + i);
+        __m128i samples = _mm_loadu_si128(at);
+        __m128i halves[2] = {_mm_unpacklo_epi16(samples, zero),
+        _mm_unpackhi_epi16(samples, zero)};
+        for (__m128i& half : halves) {
+            __m128 scaled = _mm_mul_ps(_mm_cvtepi32_ps(half), factor);
+            scaled = _mm_min_ps(_mm_max_ps(scaled, lowest), highest);
+            half = _mm_sub_epi32(_mm_cvttps_epi32(scaled), bias);
+        }
+        _mm_storeu_si128(at,
+        _mm_xor_si128(_mm_packs_epi32(halves[0], halves[1]), flip));
+    }
+    scale16Scalar(data + i, length - i, scaleFactor, maximum);
+}
+
+__attribute__((target("avx2")))
+static void clip16AVX2(uint16_t* data, int64_t length, uint16_t minimum,
+uint16_t maximum) {
+    const __m256i low = _mm256_set1_epi16(static_cast<int16_t>(minimum));
+    const __m256i high = _mm256_set1_epi16(static_cast<int16_t>(maximum));
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i* at = reinterpret_cast<__m256i*>(data + i);
+        __m256i samples = _mm256_loadu_si256(at);
+        _mm256_storeu_si256(at,
+        _mm256_min_epu16(_mm256_max_epu16(samples, low), high));
+    }
+    clip16SSE2(data + i, length - i, minimum, maximum);
+}
+
+// packus works per 128 bit lane, the permute puts the halves back in order
+__attribute__((target("avx2")))
+static __m256i pack16AVX2(__m256i low, __m256i high) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8);
+}
+
+__attribute__((target("avx2")))
+static void scale16AVX2(uint16_t* data, int64_t length, float scaleFactor,
+uint16_t maximum) {
+    const __m256 factor = _mm256_set1_ps(scaleFactor);
+    const __m256 highest = _mm256_set1_ps(maximum);
+    const __m256 lowest = _mm256_setzero_ps();
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i* at = reinterpret_cast<__m256i*>(data + i);
+        __m256i samples = _mm256_loadu_si256(at);
+        __m256i halves[2] = {
+            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(samples)),
+            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(samples, 1))};
+        for (__m256i& half : halves) {
+            __m256 scaled = _mm256_mul_ps(_mm256_cvtepi32_ps(half), factor);
+            scaled = _mm256_min_ps(_mm256_max_ps(scaled, lowest), highest);
+            half = _mm256_cvttps_epi32(scaled);
+        }
+        _mm256_storeu_si256(at, pack16AVX2(halves[0], halves[1]));
+    }
+    scale16SSE2(data + i, length - i, scaleFactor, maximum);
+}
+
+// Samples are widened to 32 bits, which only holds the sums when the
+// coefficients times the largest sample stay under 2^31
+__attribute__((target("avx2")))
+static void matrix16AVX2(uint16_t* const* planes, int64_t length,
+const matrixParams& params, uint16_t maximum) {
+    const int size = params.size;
+    int64_t largest = 0;
+    for (int o = 0; o < size; o++) {
+        int64_t sum = 0;
+        for (int k = 0; k < size; k++) {
+            sum += std::abs(params.coefficients[o * size + k]) * maximum;
+        }
+        largest = std::max(largest, sum);
+    }
+    if (size > maxSimdMatrix || largest >= (int64_t(1) << 31)) {
+        matrix16Scalar(planes, length, params, maximum);
+        return;
+    }
+    __m256i weights[maxSimdMatrix][maxSimdMatrix];
+    for (int o = 0; o < size; o++) {
+        for (int k = 0; k < size; k++) {
+            weights[o][k] = _mm256_set1_epi32(params.coefficients[o*size + k]);
+        }
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i highest = _mm256_set1_epi32(maximum);
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i values[maxSimdMatrix][2];
+        for (int k = 0; k < size; k++) {
+            __m256i samples = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(planes[k] + i));
+            values[k][0] =
+            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(samples));
+            values[k][1] =
+            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(samples, 1));
+        }
+        __m256i results[maxSimdMatrix];
+        for (int o = 0; o < size; o++) {
+            __m256i sums[2];
+            for (int h = 0; h < 2; h++) {
+                sums[h] = _mm256_mullo_epi32(values[0][h], weights[o][0]);
+                for (int k = 1; k < size; k++) {
+                    sums[h] = _mm256_add_epi32(sums[h],
+                    _mm256_mullo_epi32(values[k][h], weights[o][k]));
+                }
+                sums[h] = _mm256_min_epi32(_mm256_max_epi32(
+                _mm256_srai_epi32(sums[h], matrixShift), zero), highest);
+            }
+            results[o] = pack16AVX2(sums[0], sums[1]);
+        }
+        for (int o = 0; o < size; o++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(planes[o] + i),
+            results[o]);
+        }
+    }
+
+    uint16_t* rest[maxSimdMatrix];
+    for (int k = 0; k < size; k++) {
+        rest[k] = planes[k] + i;
+    }
+    matrix16Scalar(rest, length - i, params, maximum);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void clip16AVX512(uint16_t* data, int64_t length, uint16_t minimum,
+uint16_t maximum) {
+    const __m512i low = _mm512_set1_epi16(static_cast<int16_t>(minimum));
+    const __m512i high = _mm512_set1_epi16(static_cast<int16_t>(maximum));
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m512i samples = _mm512_loadu_si512(data + i);
+        _mm512_storeu_si512(data + i,
+        _mm512_min_epu16(_mm512_max_epu16(samples, low), high));
+    }
+    clip16AVX2(data + i, length - i, minimum, maximum);
+}
+#endif
+
+simdLevel detectSimdLevel() {
+#ifdef FM2000_X86
+    // https://gcc.gnu.org/onlinedocs/gcc/x86-Built-in-Functions.html
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+const pixelKernels& kernelsFor(simdLevel level) {
+    static const pixelKernels scalar =
+    {"scalar", clipScalar, scaleScalar, swapScalar, lookupScalar,
+    matrixScalar, interleaveScalar, deinterleaveScalar, gaussianRowScalar,
+    weightedColumnsScalar, boxColumnsScalar, resizeRowScalar,
+    temporalMeanScalar, histogramScalar};
+#ifdef FM2000_X86
+    // SSE2 has no byte shuffle, so its table lookups and layout conversion
+    // stay scalar. 16 pixels already fill a cache line per plane, so
+    // AVX-512 converts layouts, blurs, resizes and averages frames with the
+    // AVX2 kernels
+    static const pixelKernels sse2 =
+    {"sse2", clipSSE2, scaleSSE2, swapSSE2, lookupScalar, matrixSSE2,
+    interleaveScalar, deinterleaveScalar, gaussianRowSSE2,
+    weightedColumnsSSE2, boxColumnsSSE2, resizeRowSSE2, temporalMeanSSE2,
+    histogramScalar};
+    static const pixelKernels avx2 =
+    {"avx2", clipAVX2, scaleAVX2, swapAVX2, lookupAVX2, matrixAVX2,
+    interleaveAVX2, deinterleaveAVX2, gaussianRowAVX2, weightedColumnsAVX2,
+    boxColumnsAVX2, resizeRowAVX2, temporalMeanAVX2, histogramScalar};
+    static const pixelKernels avx512 =
+    {"avx512", clipAVX512, scaleAVX512, swapAVX512,
+    __builtin_cpu_supports("avx512vbmi") ? lookupVBMI : lookupAVX512,
+    matrixAVX512, interleaveAVX2, deinterleaveAVX2, gaussianRowAVX2,
+    weightedColumnsAVX2, boxColumnsAVX2, resizeRowAVX2, temporalMeanAVX2,
+    histogramScalar};
+
+    if (level == SIMD_AVX512) return avx512;
+    if (level == SIMD_AVX2) return avx2;
+    if (level == SIMD_SSE2) return sse2;
+#endif
+    return scalar;
+}
+
+// Resolved once before any work starts, every mode goes through the same
+// table
+static simdLevel activeLevel = detectSimdLevel();
+
+void setSimdLevel(simdLevel level) {
+    activeLevel = std::min(level, detectSimdLevel());
+}
+
+const pixelKernels& activeKernels() {
+    return kernelsFor(activeLevel);
+}
+
+const pixelKernels16& kernels16For(simdLevel level) {
+    static const pixelKernels16 scalar =
+    {"scalar", clip16Scalar, scale16Scalar, matrix16Scalar};
+#ifdef FM2000_X86
+    // The matrix needs 32 bit multiplies, which SSE2 does not have, and
+    // AVX-512 gains little over AVX2 past clipping
+    static const pixelKernels16 sse2 =
+    {"sse2", clip16SSE2, scale16SSE2, matrix16Scalar};
+    static const pixelKernels16 avx2 =
+    {"avx2", clip16AVX2, scale16AVX2, matrix16AVX2};
+    static const pixelKernels16 avx512 =
+    {"avx512", clip16AVX512, scale16AVX2, matrix16AVX2};
+
+    if (level == SIMD_AVX512) return avx512;
+    if (level == SIMD_AVX2) return avx2;
+    if (level == SIMD_SSE2) return sse2;
+#endif
+    return scalar;
+}
+
+const pixelKernels16& activeKernels16() {
+    return kernels16For(activeLevel);
+}
+
+// One whole frame between layouts, with the conversion for its sample size
+void packFrame(const videoData& video, const unsigned char* planar,
+unsigned char* packed) {
+    const int64_t planeSize = video.width * video.height;
+    if (sampleBytes(video) == 2) {
+        interleaveTiled(reinterpret_cast<const uint16_t*>(planar),
+        reinterpret_cast<uint16_t*>(packed), planeSize, video.channels, 0,
+        planeSize);
+        return;
+    }
+    activeKernels().interleave(planar, packed, planeSize, video.channels, 0,
+    planeSize);
+}
+
+void unpackFrame(const videoData& video, const unsigned char* packed,
+unsigned char* planar) {
+    const int64_t planeSize = video.width * video.height;
+    if (sampleBytes(video) == 2) {
+        deinterleaveTiled(reinterpret_cast<const uint16_t*>(packed),
+        reinterpret_cast<uint16_t*>(planar), planeSize, video.channels, 0,
+        planeSize);
+        return;
+    }
+    activeKernels().deinterleave(packed, planar, planeSize, video.channels,
+    0, planeSize);
+}
+
+// THREAD POOL
+// Each worker owns a deque, takes from its front and steals from the back
+// of the others, so uneven tasks even out without a central queue
+struct workerQueue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+};
+
+// Index of the current thread in the pool, -1 for threads outside it
+static thread_local int poolWorkerIndex = -1;
+
+class workStealingPool {
+ public:
+    workStealingPool(int threads, bool pinThreads) {
+        for (int i = 0; i < threads; i++) {
+            queues.emplace_back(new workerQueue());
+        }
+        int cpus = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(&workStealingPool::workerLoop, this, i);
+            if (pinThreads) {
+                // https://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+                cpu_set_t cpus_set;
+                CPU_ZERO(&cpus_set);
+                CPU_SET(i % cpus, &cpus_set);
+                pthread_setaffinity_np(workers.back().native_handle(),
+                sizeof(cpu_set_t), &cpus_set);
+            }
+        }
+    }
+
+    ~workStealingPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(workers.size());
+    }
+
+    // Workers push onto their own deque, everyone else spreads tasks out
+    void submit(std::function<void()> task) {
+        int target = poolWorkerIndex >= 0 ? poolWorkerIndex :
+        static_cast<int>(nextQueue++ % queues.size());
+        {
+            std::lock_guard<std::mutex> guard(queues[target]->lock);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Run one queued task on the calling thread, false if there was none
+    bool runOne() {
+        std::function<void()> task;
+        if (!take(poolWorkerIndex, &task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+ private:
+    bool take(int self, std::function<void()>* task) {
+        int count = static_cast<int>(queues.size());
+        for (int k = 0; k < count; k++) {
+            int victim = (self < 0 ? 0 : self) + k;
+            workerQueue& queue = *queues[victim % count];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0 && self >= 0) {
+                *task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                *task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            std::lock_guard<std::mutex> counter(sleepLock);
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int self) {
+        poolWorkerIndex = self;
+        while (true) {
+            if (runOne()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wake.wait(guard, [&]() { return queued > 0 || stopping; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<workerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    int64_t queued = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> nextQueue{0};
+};
+
+static int configuredThreads = 0;
+static bool configuredPinning = false;
+
+void configureThreadPool(int threads, bool pinThreads) {
+    configuredThreads = threads;
+    configuredPinning = pinThreads;
+}
+
+// Created on first use and kept for the rest of the process
+static workStealingPool& sharedPool() {
+    static workStealingPool pool(configuredThreads > 0 ? configuredThreads :
+    std::max(1u, std::thread::hardware_concurrency()), configuredPinning);
+    return pool;
+}
+
+int poolThreadCount() {
+    return sharedPool().size();
+}
+
+void submitTask(std::function<void()> task) {
+    sharedPool().submit(std::move(task));
+}
+
+// Split [0, units) into tasks of about taskBytes each and wait for them.
+// A pool worker calling this keeps running tasks while it waits, so
+// nesting parallelFor inside a task can not deadlock the pool
+void parallelFor(int64_t units, int64_t bytesPerUnit,
+const std::function<void(int64_t begin, int64_t end)>& task) {
+    if (units <= 0) {
+        return;
+    }
+    int64_t grain = std::max<int64_t>(1,
+    taskBytes / std::max<int64_t>(1, bytesPerUnit));
+    int64_t tasks = (units + grain - 1) / grain;
+    if (tasks == 1 || poolThreadCount() == 1) {
+        scopedTimer timer("task", units * bytesPerUnit);
+        task(0, units);
+        return;
+    }
+
+    std::mutex lock;
+    std::condition_variable finished;
+    int64_t remaining = tasks;
+    for (int64_t t = 0; t < tasks; t++) {
+        int64_t begin = t * grain;
+        int64_t end = std::min(units, begin + grain);
+        submitTask([&, begin, end]() {
+            {
+                scopedTimer timer("task", (end - begin) * bytesPerUnit);
+                task(begin, end);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (--remaining == 0) {
+                finished.notify_all();
+            }
+        });
+    }
+
+    scopedTimer timer("join");
+    if (poolWorkerIndex >= 0) {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (remaining == 0) {
+                    return;
+                }
+            }
+            if (!sharedPool().runOne()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&]() { return remaining == 0; });
+}
+
+// Walks units laid out as items of itemSize end to end, calling
+// span(item, first, last) for the part of each item inside [begin, end)
+template <typename spanFunction>
+static void forEachSpan(int64_t begin, int64_t end, int64_t itemSize,
+const spanFunction& span) {
+    while (begin < end) {
+        int64_t item = begin / itemSize;
+        int64_t first = begin % itemSize;
+        int64_t last = std::min(itemSize, first + (end - begin));
+        span(item, first, last);
+        begin += last - first;
+    }
+}
+
+// STREAMING ENGINE
+// pread/pwrite until everything is transferred, they may stop short
+int preadAll(int fd, unsigned char* buffer, int64_t length, int64_t offset) {
+    while (length > 0) {
+        ssize_t done = pread(fd, buffer, length, offset);
+        if (done <= 0) {
+            return 1;
+        }
+        buffer += done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+int pwriteAll(int fd, const unsigned char* buffer, int64_t length,
+int64_t offset) {
+    while (length > 0) {
+        ssize_t done = pwrite(fd, buffer, length, offset);
+        if (done <= 0) {
+            return 1;
+        }
+        buffer += done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+// ASYNC IO
+static asyncIO asyncMode = ASYNC_SYNC;
+static int asyncDepth = defaultQueueDepth;
+
+void setAsyncIO(asyncIO mode, int queueDepth) {
+    asyncMode = mode;
+    asyncDepth = std::max(1, queueDepth);
+}
+
+// Transfers are cut into requests of at most this many bytes, so a single
+// big block still keeps several requests in flight
+const int64_t ioRequestBytes = 1024 * 1024;
+
+// Reads and writes queued together on one thread, each transfer finishing
+// with the tag it was queued with once all of its requests are done. With
+// io_uring up to asyncDepth requests are in flight and short transfers are
+// requeued for the rest, otherwise every transfer is a preadAll or
+// pwriteAll done when it is queued and reported by the next reap
+class ioQueue {
+ public:
+    ioQueue();
+    ~ioQueue();
+    ioQueue(const ioQueue&) = delete;
+    ioQueue& operator=(const ioQueue&) = delete;
+
+    bool async() const {
+        return ringFd >= 0;
+    }
+
+    // Requests inside these buffers use the kernel's pinned copies of their
+    // pages. Refused registrations only cost the per-request pinning
+    void registerBuffers(
+    const std::vector<std::pair<unsigned char*, int64_t>>& buffers);
+
+    // With toEnd a read stopping at the end of the file still counts as
+    // done, the rest of the buffer is left as it was
+    void read(int fd, unsigned char* buffer, int64_t length, int64_t offset,
+    uint64_t tag, bool toEnd = false);
+
+    void write(int fd, const unsigned char* buffer, int64_t length,
+    int64_t offset, uint64_t tag);
+
+    // Hands each finished transfer's tag and status (0 or 1) to done,
+    // first waiting for one when wait is set and any are outstanding
+    void reap(bool wait,
+    const std::function<void(uint64_t tag, int status)>& done);
+
+    // Waits for every transfer, returns 1 when any of them failed
+    int finish();
+
+    int64_t outstanding() const {
+        return transfers.size() + finished.size();
+    }
+
+ private:
+    struct request {
+        int fd;
+        unsigned char* buffer;
+        int64_t length;
+        int64_t offset;
+        bool writing;
+        bool toEnd;
+        uint64_t transfer;
+    };
+    struct transferState {
+        uint64_t tag;
+        int64_t requests;
+        int status;
+    };
+
+    void queueTransfer(int fd, unsigned char* buffer, int64_t length,
+    int64_t offset, bool writing, bool toEnd, uint64_t tag);
+    void submit(int slot);
+    void enter(unsigned wanted);
+    int takeCompletions();
+    void complete(int slot, int result);
+    void teardown();
+
+    int ringFd = -1;
+    // Set when io_uring_enter itself fails, every transfer then fails
+    bool broken = false;
+    std::vector<request> requests;
+    std::vector<int> freeSlots;
+    unsigned toSubmit = 0;
+    uint64_t nextTransfer = 0;
+    std::unordered_map<uint64_t, transferState> transfers;
+    std::deque<std::pair<uint64_t, int>> finished;
+    std::vector<std::pair<unsigned char*, int64_t>> registered;
+#ifdef FM2000_URING
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingBytes = 0;
+    size_t cqRingBytes = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqeBytes = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+#endif
+};
+
+// The rings are mapped from the io_uring fd, the kernel and the queue each
+// move one end of them
+// https://kernel.dk/io_uring.pdf
+ioQueue::ioQueue() {
+#ifdef FM2000_URING
+    if (asyncMode != ASYNC_URING) {
+        return;
+    }
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, asyncDepth, &params);
+    if (fd < 0) {
+        return;
+    }
+    ringFd = fd;
+    // Plain reads and writes came with 5.6, the release that added this
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        teardown();
+        return;
+    }
+    sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingBytes =
+    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+    }
+    sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : mmap(nullptr, cqRingBytes,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_CQ_RING);
+    sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqeBytes,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_SQES));
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        teardown();
+        return;
+    }
+    char* sq = static_cast<char*>(sqRing);
+    char* cq = static_cast<char*>(cqRing);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    requests.resize(asyncDepth);
+    for (int slot = asyncDepth - 1; slot >= 0; slot--) {
+        freeSlots.push_back(slot);
+    }
+#endif
+}
+
+ioQueue::~ioQueue() {
+    // Requests still in flight point into the caller's buffers
+    while (ringFd >= 0 && !broken && !transfers.empty()) {
+        enter(1);
+    }
+    teardown();
+}
+
+void ioQueue::teardown() {
+#ifdef FM2000_URING
+    if (ringFd < 0) {
+        return;
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqeBytes);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+        munmap(cqRing, cqRingBytes);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingBytes);
+    }
+    close(ringFd);
+    ringFd = -1;
+#endif
+}
+
+void ioQueue::registerBuffers(
+const std::vector<std::pair<unsigned char*, int64_t>>& buffers) {
+#ifdef FM2000_URING
+    if (ringFd < 0 || !registered.empty()) {
+        return;
+    }
+    std::vector<struct iovec> pieces;
+    for (const auto& [buffer, length] : buffers) {
+        if (buffer && length > 0) {
+            pieces.push_back({buffer, static_cast<size_t>(length)});
+            registered.emplace_back(buffer, length);
+        }
+    }
+    if (pieces.empty() || syscall(__NR_io_uring_register, ringFd,
+    IORING_REGISTER_BUFFERS, pieces.data(), pieces.size()) != 0) {
+        registered.clear();
+    }
+#else
+    (void)buffers;
+#endif
+}
+
+void ioQueue::read(int fd, unsigned char* buffer, int64_t length,
+int64_t offset, uint64_t tag, bool toEnd) {
+    if (ringFd >= 0) {
+        queueTransfer(fd, buffer, length, offset, false, toEnd, tag);
+        return;
+    }
+    int status = 0;
+    if (toEnd) {
+        for (int64_t got = 0; got < length;) {
+            ssize_t done = pread(fd, buffer + got, length - got,
+            offset + got);
+            if (done <= 0) {
+                status = done < 0;
+                break;
+            }
+            got += done;
+        }
+    } else {
+        status = preadAll(fd, buffer, length, offset);
+    }
+    finished.emplace_back(tag, status);
+}
+
+void ioQueue::write(int fd, const unsigned char* buffer, int64_t length,
+int64_t offset, uint64_t tag) {
+    if (ringFd >= 0) {
+        queueTransfer(fd, const_cast<unsigned char*>(buffer), length, offset,
+        true, false, tag);
+        return;
+    }
+    finished.emplace_back(tag, pwriteAll(fd, buffer, length, offset));
+}
+
+void ioQueue::queueTransfer(int fd, unsigned char* buffer, int64_t length,
+int64_t offset, bool writing, bool toEnd, uint64_t tag) {
+    if (broken) {
+        finished.emplace_back(tag, 1);
+        return;
+    }
+    uint64_t id = nextTransfer++;
+    int64_t pieces = std::max<int64_t>(1,
+    (length + ioRequestBytes - 1) / ioRequestBytes);
+    transfers[id] = {tag, pieces, 0};
+    for (int64_t piece = 0; piece < pieces; piece++) {
+        while (freeSlots.empty() && !broken) {
+            enter(1);
+        }
+        if (broken) {
+            return;
+        }
+        int slot = freeSlots.back();
+        freeSlots.pop_back();
+        int64_t start = piece * ioRequestBytes;
+        requests[slot] = {fd, buffer + start,
+        std::min(ioRequestBytes, length - start), offset + start, writing,
+        toEnd, id};
+        submit(slot);
+    }
+    enter(0);
+}
+
+void ioQueue::submit(int slot) {
+#ifdef FM2000_URING
+    const request& work = requests[slot];
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = work.writing ? IORING_OP_WRITE : IORING_OP_READ;
+    for (size_t i = 0; i < registered.size(); i++) {
+        if (work.buffer >= registered[i].first && work.buffer + work.length <=
+        registered[i].first + registered[i].second) {
+            sqe->opcode =
+            work.writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = i;
+            break;
+        }
+    }
+    sqe->fd = work.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(work.buffer);
+    sqe->len = work.length;
+    sqe->off = work.offset;
+    sqe->user_data = slot;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+#else
+    (void)slot;
+#endif
+}
+
+// Submits what was queued, then with wanted set waits for that many
+// completions. Completions can requeue the rest of a short transfer, so
+// this goes on until nothing is left to submit
+void ioQueue::enter(unsigned wanted) {
+#ifdef FM2000_URING
+    for (;;) {
+        int done;
+        {
+            scopedTimer timer(wanted > 0 ? "ioWait" : "ioSubmit", 0);
+            done = syscall(__NR_io_uring_enter, ringFd, toSubmit, wanted,
+            wanted > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        }
+        if (done >= 0) {
+            toSubmit -= std::min<unsigned>(toSubmit, done);
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            broken = true;
+            for (auto& [id, state] : transfers) {
+                finished.emplace_back(state.tag, 1);
+            }
+            transfers.clear();
+            return;
+        }
+        if (takeCompletions() > 0) {
+            wanted = 0;
+        }
+        if (toSubmit == 0 && wanted == 0) {
+            return;
+        }
+    }
+#else
+    (void)wanted;
+#endif
+}
+
+int ioQueue::takeCompletions() {
+    int taken = 0;
+#ifdef FM2000_URING
+    unsigned head = *cqHead;
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe cqe = cqes[head & *cqMask];
+        __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+        complete(static_cast<int>(cqe.user_data), cqe.res);
+        taken++;
+    }
+#endif
+    return taken;
+}
+
+void ioQueue::complete(int slot, int result) {
+    request& work = requests[slot];
+    if (result == -EINTR || result == -EAGAIN) {
+        submit(slot);
+        return;
+    }
+    bool failed = result < 0 || (result == 0 && !work.toEnd);
+    if (!failed && result < work.length && !(work.toEnd && !work.writing)) {
+        // Short transfer, the rest goes back in from the same slot
+        work.buffer += result;
+        work.length -= result;
+        work.offset += result;
+        submit(slot);
+        return;
+    }
+    freeSlots.push_back(slot);
+    auto state = transfers.find(work.transfer);
+    state->second.status |= failed;
+    if (--state->second.requests == 0) {
+        finished.emplace_back(state->second.tag, state->second.status);
+        transfers.erase(state);
+    }
+}
+
+void ioQueue::reap(bool wait,
+const std::function<void(uint64_t tag, int status)>& done) {
+    if (ringFd >= 0 && !broken) {
+        bool block = wait && finished.empty() && !transfers.empty();
+        if (block || toSubmit > 0) {
+            enter(block ? 1 : 0);
+        } else {
+            takeCompletions();
+        }
+    }
+    while (!finished.empty()) {
+        auto [tag, status] = finished.front();
+        finished.pop_front();
+        done(tag, status);
+    }
+}
+
+int ioQueue::finish() {
+    int status = 0;
+    while (outstanding() > 0) {
+        reap(true, [&](uint64_t, int failed) {
+            status |= failed;
+        });
+    }
+    return status;
+}
+
+// A reference record is replaced by the record of the frame it points to
+static int readReference(int source, const std::vector<int64_t>& index,
+unsigned char* record, int64_t* recordBytes, int64_t recordSlot) {
+    int64_t reference = recordReference(record, *recordBytes);
+    if (reference < 0) {
+        return 0;
+    }
+    if (reference >= static_cast<int64_t>(index.size()) - 1) {
+        return 1;
+    }
+    *recordBytes = index[reference + 1] - index[reference];
+    if (*recordBytes > recordSlot) {
+        return 1;
+    }
+    return preadAll(source, record, *recordBytes, index[reference]);
+}
+
+// One reader thread fills a ring of frame buffers, the worker threads run
+// the kernel on whatever has been read, and the calling thread writes the
+// finished frames out in order. Memory use is the ring, not the video
+int streamFrames(videoData& inFile, const char* sourcePath,
+const char* outputPath, bool reverseOrder, const frameKernel& kernel,
+const videoData* outputVideo) {
+    // The output is truncated before the first frame is read
+    if (sameFile(sourcePath, outputPath)) {
+        std::cout << "-M needs a different output file." << std::endl;
+        return 1;
+    }
+    int source = open(sourcePath, O_RDONLY);
+    if (source < 0) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+    int output = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        std::cout << "Failed to open the file for writing." << std::endl;
+        close(source);
+        return 1;
+    }
+    posix_fadvise(source, 0, 0,
+    reverseOrder ? POSIX_FADV_NORMAL : POSIX_FADV_SEQUENTIAL);
+    // Frames of a cached source are copied out of memory instead of read
+    std::shared_ptr<cachedVideo> cached = findCached(sourcePath);
+    if (cached && cached->bytes != inFile.frameSize * inFile.numFrames) {
+        cached = nullptr;
+    }
+
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t frameOffset = rawHeaderBytes(inFile);
+    // Without an output video the frames keep the input's geometry
+    const videoData& outFile = outputVideo ? *outputVideo : inFile;
+    const int64_t outputSize = outFile.frameSize;
+    // Compressed frames are found through the index and decoded by the
+    // frame's task, which also encodes the result for a compressed output
+    const bool compressedInput = inFile.compressed;
+    const bool compressedOutput = writesCompressed(outFile);
+    // Interleaved frames pass through the record buffer the same way and
+    // change layout inside the frame's task
+    const bool interleavedInput = inFile.interleaved;
+    const bool interleavedOutput = writesInterleaved(outFile);
+    std::vector<int64_t> inputIndex;
+    std::vector<int64_t> outputIndex(compressedOutput ? numFrames + 1 : 0);
+    if (compressedInput &&
+    readFrameIndex(source, numFrames, &inputIndex) != 0) {
+        std::cout << "The compressed video is damaged." << std::endl;
+        close(source);
+        close(output);
+        return 1;
+    }
+    // The threads below stop at their first check when the header failed
+    bool failed = false;
+    if (compressedOutput) {
+        outputIndex[0] = indexOffset(numFrames);
+    } else {
+        unsigned char header[maxHeaderBytes];
+        failed = pwriteAll(output, header, encodeHeader(outFile, header), 0)
+        != 0;
+    }
+
+    // Slots are rounded up to a cache line so SIMD kernels start aligned
+    const int64_t slotSize = (std::max(frameSize, outputSize) + 63) / 64 * 64;
+    const int workers = poolThreadCount();
+    // Two frames per worker keeps them busy while the reader and writer wait
+    // on the disk, the budget keeps huge frames from growing the ring. With
+    // io_uring the ring also has room for a full queue of reads
+    const int64_t wanted = asyncMode == ASYNC_URING ?
+    asyncDepth + workers + 2 : 2 * workers + 2;
+    const int64_t ring = std::max<int64_t>(2,
+    std::min<int64_t>(wanted, streamRingBytes / slotSize));
+
+    unsigned char* buffers = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, ring * slotSize));
+    // One record per slot, read into before and encoded into after the
+    // kernel, the slot is not reused before its record is written
+    const bool records = compressedInput || compressedOutput ||
+    interleavedInput || interleavedOutput;
+    const int64_t recordSlot =
+    (maxRecordBytes(std::max(frameSize, outputSize)) + 63) / 64 * 64;
+    unsigned char* recordBuffers = reinterpret_cast<unsigned char*>
+    (records ? pooledAlloc(64, ring * recordSlot) : nullptr);
+    std::vector<int64_t> recordLength(ring, 0);
+
+    std::mutex lock;
+    std::condition_variable changed;
+    int64_t writtenCount = 0;
+    int64_t inFlight = 0;
+    // doneIndex[slot] is the frame that slot last finished, so a slot that
+    // has been reused never looks done for an older frame
+    std::vector<int64_t> doneIndex(ring, -1);
+
+    // Both ends register the same buffers, with io_uring reads and writes
+    // then skip pinning their pages on every request
+    const std::vector<std::pair<unsigned char*, int64_t>> ioBuffers = {
+        {buffers, ring * slotSize},
+        {recordBuffers, records ? ring * recordSlot : 0}
+    };
+    auto fail = [&]() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+        }
+        changed.notify_all();
+    };
+
+    std::thread reader([&]() {
+        // Raw frames are read straight into their slots, so with io_uring
+        // a queue of them can be in flight at once
+        ioQueue reads;
+        const bool queued = reads.async() && !cached && !compressedInput;
+        if (queued) {
+            reads.registerBuffers(ioBuffers);
+        }
+
+        // Each frame becomes one task on the shared pool
+        auto launch = [&](int64_t i, int64_t recordBytes) {
+            int64_t frame = reverseOrder ? (numFrames - 1 - i) : i;
+            unsigned char* slot = buffers + (i % ring) * slotSize;
+            unsigned char* record =
+            records ? recordBuffers + (i % ring) * recordSlot : nullptr;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                inFlight++;
+            }
+            submitTask([&, i, frame, slot, record, recordBytes]() {
+                bool damaged = compressedInput &&
+                decompressFrame(inFile, record, recordBytes, slot) != 0;
+                if (interleavedInput) {
+                    unpackFrame(inFile, cached ?
+                    cached->frames + frame * frameSize : record, slot);
+                }
+                if (!damaged) {
+                    scopedTimer kernelTimer("kernel", frameSize);
+                    kernel(slot, i);
+                }
+                if (!damaged && compressedOutput) {
+                    recordLength[i % ring] =
+                    compressFrame(outFile, slot, record);
+                } else if (!damaged && interleavedOutput) {
+                    packFrame(outFile, slot, record);
+                }
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    doneIndex[i % ring] = i;
+                    failed = failed || damaged;
+                    inFlight--;
+                }
+                changed.notify_all();
+            });
+        };
+        auto arrived = [&](uint64_t i, int status) {
+            if (status != 0) {
+                fail();
+            } else {
+                launch(i, 0);
+            }
+        };
+
+        for (int64_t i = 0; i < numFrames; i++) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                // Frames already read have to reach the pool before the
+                // writer can free any slot
+                while (i - writtenCount >= ring && !failed &&
+                reads.outstanding() > 0) {
+                    guard.unlock();
+                    reads.reap(true, arrived);
+                    guard.lock();
+                }
+                changed.wait(guard,
+                [&]() { return i - writtenCount < ring || failed; });
+                if (failed) {
+                    break;
+                }
+            }
+            int64_t frame = reverseOrder ? (numFrames - 1 - i) : i;
+            unsigned char* slot = buffers + (i % ring) * slotSize;
+            unsigned char* record =
+            records ? recordBuffers + (i % ring) * recordSlot : nullptr;
+            if (queued) {
+                reads.read(source, interleavedInput ? record : slot,
+                frameSize, frameOffset + frame * frameSize, i);
+                reads.reap(false, arrived);
+                continue;
+            }
+            int64_t recordBytes = compressedInput ?
+            inputIndex[frame + 1] - inputIndex[frame] : 0;
+            scopedTimer readTimer("read", frameSize);
+            if (cached) {
+                if (!interleavedInput) {
+                    std::memcpy(slot, cached->frames + frame * frameSize,
+                    frameSize);
+                }
+            } else if (compressedInput ? (recordBytes > recordSlot ||
+            preadAll(source, record, recordBytes, inputIndex[frame]) != 0 ||
+            readReference(source, inputIndex, record, &recordBytes,
+            recordSlot) != 0) :
+            preadAll(source, interleavedInput ? record : slot, frameSize,
+            frameOffset + frame * frameSize) != 0) {
+                fail();
+                break;
+            }
+            readTimer.stop();
+            launch(i, recordBytes);
+        }
+        // Reads still in flight point into the ring
+        while (reads.outstanding() > 0) {
+            reads.reap(true, arrived);
+        }
+    });
+
+    // With io_uring every finished frame gets its own write and the next
+    // ones are not held up waiting for it. A slot is free once its write
+    // and every write before it are done
+    ioQueue writes;
+    const bool queuedWrites = writes.async();
+    if (queuedWrites) {
+        writes.registerBuffers(ioBuffers);
+    }
+    std::vector<int64_t> writtenIndex(ring, -1);
+    auto wrote = [&](uint64_t i, int status) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = failed || status != 0;
+            writtenIndex[i % ring] = i;
+            while (writtenCount < numFrames &&
+            writtenIndex[writtenCount % ring] == writtenCount) {
+                writtenCount++;
+            }
+        }
+        changed.notify_all();
+    };
+    int64_t queuedOffset =
+    compressedOutput ? outputIndex[0] : rawHeaderBytes(outFile);
+    for (int64_t i = 0; queuedWrites && i < numFrames; i++) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (doneIndex[i % ring] != i && !failed &&
+            writes.outstanding() > 0) {
+                guard.unlock();
+                writes.reap(true, wrote);
+                guard.lock();
+            }
+            changed.wait(guard,
+            [&]() { return doneIndex[i % ring] == i || failed; });
+            if (failed) {
+                break;
+            }
+        }
+        int64_t slot = i % ring;
+        int64_t length = compressedOutput ? recordLength[slot] : outputSize;
+        writes.write(output, compressedOutput || interleavedOutput ?
+        recordBuffers + slot * recordSlot : buffers + slot * slotSize,
+        length, queuedOffset, i);
+        if (compressedOutput) {
+            outputIndex[i + 1] = queuedOffset + length;
+        }
+        queuedOffset += length;
+        writes.reap(false, wrote);
+    }
+    while (writes.outstanding() > 0) {
+        writes.reap(true, wrote);
+    }
+
+    // Frames that finish together go out in one writev
+    const int maxBatch = 16;
+    int64_t outputOffset =
+    compressedOutput ? outputIndex[0] : rawHeaderBytes(outFile);
+    for (int64_t i = 0; !queuedWrites && i < numFrames;) {
+        int batch = 0;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard,
+            [&]() { return doneIndex[i % ring] == i || failed; });
+            while (!failed && i + batch < numFrames && batch < maxBatch &&
+            doneIndex[(i + batch) % ring] == i + batch) {
+                batch++;
+            }
+        }
+        if (batch == 0) {
+            break;
+        }
+
+        struct iovec pieces[maxBatch];
+        int64_t offsets[maxBatch];
+        int64_t remaining = 0;
+        for (int b = 0; b < batch; b++) {
+            int64_t slot = (i + b) % ring;
+            pieces[b].iov_base = compressedOutput || interleavedOutput ?
+            recordBuffers + slot * recordSlot : buffers + slot * slotSize;
+            pieces[b].iov_len = compressedOutput ?
+            recordLength[slot] : outputSize;
+            offsets[b] = outputOffset + remaining;
+            remaining += pieces[b].iov_len;
+            if (compressedOutput) {
+                outputIndex[i + b + 1] = offsets[b] + pieces[b].iov_len;
+            }
+        }
+        scopedTimer writeTimer("write", remaining);
+        ssize_t written = pwritev(output, pieces, batch, outputOffset);
+        if (written != remaining) {
+            // Partial writev, finish the batch frame by frame
+            for (int b = 0; b < batch && written >= 0; b++) {
+                if (pwriteAll(output, reinterpret_cast<unsigned char*>
+                (pieces[b].iov_base), pieces[b].iov_len, offsets[b]) != 0) {
+                    written = -1;
+                }
+            }
+        }
+        writeTimer.stop();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (written < 0) {
+                failed = true;
+            }
+            writtenCount = i + batch;
+        }
+        changed.notify_all();
+        outputOffset += remaining;
+        i += batch;
+    }
+
+    reader.join();
+    {
+        // Tasks still running after a failure point into the ring
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return inFlight == 0; });
+    }
+    pooledFree(buffers, 64, ring * slotSize);
+    if (records) {
+        pooledFree(recordBuffers, 64, ring * recordSlot);
+    }
+    if (compressedOutput && !failed &&
+    writeCompressedHeader(output, outFile, outputIndex) != 0) {
+        failed = true;
+    }
+    close(source);
+    close(output);
+
+    if (failed) {
+        std::cout << "Failed to stream frames from " << sourcePath
+        << " to " << outputPath << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// REVERSE FUNCTIONS
+void reverse(videoData& inFile,
+const char* filePath) {
+    scopedTimer timer("reverse", inFile.frameSize * inFile.numFrames);
+    for (int64_t i=0; i < (inFile.numFrames/2); i++) {
+        unsigned char* frontFrame =  // Leftmost frame
+        inFile.fullFrame + (i*inFile.frameSize);
+
+        unsigned char* backFrame =  // Rightmost frame
+        inFile.fullFrame + ((inFile.numFrames - 1 - i)*inFile.frameSize);
+
+        std::swap_ranges(frontFrame,
+        (frontFrame + inFile.frameSize), backFrame);
+    }
+
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_reverse(videoData& inFile,
+const char* filePath, const char* sourcePath) {
+    // A cached source is already in memory, the frames only need writing
+    if (!sameFile(sourcePath, filePath) && findCached(sourcePath)) {
+        return streamFrames(inFile, sourcePath, filePath, true,
+        [](unsigned char*, int64_t) {});
+    }
+    // Nothing to compute, so whole blocks of frames move per syscall
+    return block_reverse(inFile, filePath, sourcePath);
+}
+
+// Callable instance for speed_reverse threading, essentially same as reverse()
+void reverseChunk(videoData& inFile,
+int64_t start, int64_t end) {
+    unsigned char* frontFrame =
+    inFile.fullFrame + (start * inFile.frameSize);
+
+    unsigned char* backFrame =
+    inFile.fullFrame + ((inFile.numFrames - 1 - start) * inFile.frameSize);
+    while (start < end) {
+        std::swap_ranges(frontFrame, frontFrame + inFile.frameSize, backFrame);
+        start++;
+        frontFrame += inFile.frameSize;
+        backFrame -= inFile.frameSize;
+    }
+}
+
+void speed_reverse(videoData& inFile,
+const char* filePath) {
+    scopedTimer timer("speed_reverse", inFile.frameSize * inFile.numFrames);
+    // Units are the bytes of the front half, each swapped with the same byte
+    // of the mirrored frame, so even two huge frames split across the pool
+    int64_t pairs = inFile.numFrames / 2;
+    parallelFor(pairs * inFile.frameSize, 2, [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, inFile.frameSize,
+        [&](int64_t pair, int64_t first, int64_t last) {
+            unsigned char* frontFrame =
+            inFile.fullFrame + pair * inFile.frameSize;
+            unsigned char* backFrame = inFile.fullFrame +
+            (inFile.numFrames - 1 - pair) * inFile.frameSize;
+            activeKernels().swap(frontFrame + first,
+            backFrame + first, last - first);
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// BLOCK REVERSE
+static int64_t blockBudget = defaultBlockBytes;
+static bool blockDirect = false;
+
+void setBlockIO(int64_t blockBytes, bool directIO) {
+    blockBudget = blockBytes;
+    blockDirect = directIO;
+}
+
+bool sameFile(const char* firstPath, const char* secondPath) {
+    struct stat first, second;
+    if (stat(firstPath, &first) != 0 || stat(secondPath, &second) != 0) {
+        return false;
+    }
+    return first.st_dev == second.st_dev && first.st_ino == second.st_ino;
+}
+
+// Where data for a file offset starts inside a block buffer, O_DIRECT
+// buffers begin at the sector holding the offset rather than the offset
+static int64_t blockLead(int64_t offset, bool direct) {
+    return direct ? offset % directAlignment : 0;
+}
+
+// Reads one sector, zero filling past the end of the file
+static int readSector(int fd, unsigned char* sector, int64_t offset) {
+    std::memset(sector, 0, directAlignment);
+    int64_t got = 0;
+    while (got < directAlignment) {
+        ssize_t done = pread(fd, sector + got, directAlignment - got,
+        offset + got);
+        if (done < 0) {
+            return 1;
+        }
+        if (done == 0) {
+            break;
+        }
+        got += done;
+    }
+    return 0;
+}
+
+// Queues the read of [offset, offset + length) to buffer +
+// blockLead(offset). With O_DIRECT whole sectors are read, the last one
+// short when the file does not end on a boundary
+static int readBlock(ioQueue& queue, int fd, unsigned char* buffer,
+int64_t offset, int64_t length, bool direct) {
+    if (!direct) {
+        queue.read(fd, buffer, length, offset, 0);
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || offset + length > info.st_size) {
+        return 1;
+    }
+    int64_t start = offset - blockLead(offset, true);
+    int64_t end = (offset + length + directAlignment - 1) /
+    directAlignment * directAlignment;
+    queue.read(fd, buffer, end - start, start, 0, true);
+    return 0;
+}
+
+// Queues the write of buffer + blockLead(offset) to [offset, offset +
+// length). With O_DIRECT the partial sectors at each end are filled from
+// the file first, so the bytes around the range are written back
+// unchanged. Writes sharing a sector have to finish one after the other
+static int writeBlock(ioQueue& queue, int fd, unsigned char* buffer,
+unsigned char* sector, int64_t offset, int64_t length, bool direct) {
+    if (!direct) {
+        queue.write(fd, buffer, length, offset, 0);
+        return 0;
+    }
+    int64_t lead = blockLead(offset, true);
+    int64_t start = offset - lead;
+    int64_t end = (offset + length + directAlignment - 1) /
+    directAlignment * directAlignment;
+    if (lead != 0) {
+        if (readSector(fd, sector, start) != 0) {
+            return 1;
+        }
+        std::memcpy(buffer, sector, lead);
+    }
+    int64_t tail = end - (offset + length);
+    if (tail != 0) {
+        if (readSector(fd, sector, end - directAlignment) != 0) {
+            return 1;
+        }
+        std::memcpy(buffer + (end - start) - tail,
+        sector + directAlignment - tail, tail);
+    }
+    queue.write(fd, buffer, end - start, start, 0);
+    return 0;
+}
+
+// Reverses the order of count frames sitting back to back in memory
+static void reverseBlock(unsigned char* frames, int64_t count,
+int64_t frameSize) {
+    for (int64_t i = 0; i < count / 2; i++) {
+        activeKernels().swap(frames + i * frameSize,
+        frames + (count - 1 - i) * frameSize, frameSize);
+    }
+}
+
+// Buffered writes skip the reordering copy, one iovec per frame taken
+// from the back of the block. With io_uring each frame is its own queued
+// write instead
+static int writeReversed(ioQueue& queue, int fd, unsigned char* frames,
+int64_t count, int64_t frameSize, int64_t offset) {
+    scopedTimer timer("blockWrite", count * frameSize);
+    if (queue.async()) {
+        for (int64_t i = 0; i < count; i++) {
+            queue.write(fd, frames + (count - 1 - i) * frameSize, frameSize,
+            offset + i * frameSize, 0);
+        }
+        return queue.finish();
+    }
+    const int64_t batch = IOV_MAX;
+    std::vector<struct iovec> parts(std::min(count, batch));
+    for (int64_t first = 0; first < count; first += batch) {
+        int64_t used = std::min(batch, count - first);
+        for (int64_t i = 0; i < used; i++) {
+            parts[i].iov_base = frames + (count - 1 - first - i) * frameSize;
+            parts[i].iov_len = frameSize;
+        }
+        int64_t length = used * frameSize;
+        if (pwritev(fd, parts.data(), used, offset) != length) {
+            // Partial writev, finish the batch frame by frame
+            for (int64_t i = 0; i < used; i++) {
+                if (pwriteAll(fd, static_cast<unsigned char*>
+                (parts[i].iov_base), frameSize,
+                offset + i * frameSize) != 0) {
+                    return 1;
+                }
+            }
+        }
+        offset += length;
+    }
+    return 0;
+}
+
+// O_DIRECT is only a request, filesystems such as tmpfs refuse it
+static int openBlockFile(const char* filePath, int flags, bool* direct) {
+    if (*direct) {
+        int fd = open(filePath, flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            return fd;
+        }
+        *direct = false;
+    }
+    return open(filePath, flags, 0644);
+}
+
+int block_reverse(videoData& inFile, const char* filePath,
+const char* sourcePath) {
+    const bool inPlace = sameFile(sourcePath, filePath);
+    if (inFile.compressed || writesCompressed(inFile) ||
+    inFile.interleaved != writesInterleaved(inFile)) {
+        // Records differ in length and layouts need converting, so blocks
+        // can not trade places as they are
+        if (inPlace) {
+            std::cout << "In place reversal needs a raw video that keeps its"
+            << " layout." << std::endl;
+            return 1;
+        }
+        return streamFrames(inFile, sourcePath, filePath, true,
+        [](unsigned char*, int64_t) {});
+    }
+    bool direct = blockDirect;
+    int source = openBlockFile(sourcePath, inPlace ? O_RDWR : O_RDONLY,
+    &direct);
+    if (source < 0) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+    int output = source;
+    if (!inPlace) {
+        bool outputDirect = direct;
+        output = openBlockFile(filePath, O_RDWR | O_CREAT | O_TRUNC,
+        &outputDirect);
+        if (output < 0) {
+            std::cout << "Failed to open the file for writing." << std::endl;
+            close(source);
+            return 1;
+        }
+        // Both ends have to agree, the block buffers assume one layout
+        if (outputDirect != direct) {
+            close(source);
+            direct = false;
+            source = open(sourcePath, O_RDONLY);
+        }
+    }
+
+    struct stat sourceInfo;
+    fstat(source, &sourceInfo);
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t frameOffset = rawHeaderBytes(inFile);
+    // K frames per block, the budget holds two blocks
+    const int64_t blockFrames =
+    std::max<int64_t>(1, blockBudget / 2 / std::max<int64_t>(1, frameSize));
+    const int64_t bufferSize = (blockFrames * frameSize +
+    3 * directAlignment - 1) / directAlignment * directAlignment;
+    unsigned char* front = reinterpret_cast<unsigned char*>
+    (pooledAlloc(directAlignment, bufferSize));
+    unsigned char* back = reinterpret_cast<unsigned char*>
+    (pooledAlloc(directAlignment, bufferSize));
+    unsigned char* sector = reinterpret_cast<unsigned char*>
+    (pooledAlloc(directAlignment, directAlignment));
+    int status = 0;
+    // Every block transfer is cut into requests the queue keeps in flight
+    // together, both blocks' reads at once when editing in place
+    ioQueue queue;
+    queue.registerBuffers({{front, bufferSize}, {back, bufferSize}});
+    auto timed = [&](const char* stage, int64_t bytes, int queued) {
+        scopedTimer timer(stage, bytes);
+        return queue.finish() | queued;
+    };
+
+    if (inPlace) {
+        // The header stays, the outermost unswapped blocks trade places and
+        // each is reversed on the way, meeting in the middle
+        int64_t low = 0;
+        int64_t high = numFrames;
+        while (status == 0 && high - low > 1) {
+            int64_t count = std::min(blockFrames, (high - low) / 2);
+            int64_t frontOffset = frameOffset + low * frameSize;
+            int64_t backOffset = frameOffset + (high - count) * frameSize;
+            unsigned char* frontData =
+            front + blockLead(frontOffset, direct);
+            unsigned char* backData = back + blockLead(backOffset, direct);
+            status = timed("blockRead", 2 * count * frameSize,
+            readBlock(queue, source, front, frontOffset, count * frameSize,
+            direct) | readBlock(queue, source, back, backOffset,
+            count * frameSize, direct));
+            if (status != 0) {
+                break;
+            }
+            activeKernels().swap(frontData, backData, count * frameSize);
+            reverseBlock(frontData, count, frameSize);
+            reverseBlock(backData, count, frameSize);
+            // The blocks can meet inside one sector, the back block reads
+            // it after the front block is written
+            status = timed("blockWrite", count * frameSize,
+            writeBlock(queue, source, front, sector, frontOffset,
+            count * frameSize, direct));
+            status |= timed("blockWrite", count * frameSize,
+            writeBlock(queue, source, back, sector, backOffset,
+            count * frameSize, direct));
+            low += count;
+            high -= count;
+        }
+        // Direct writes are padded out to a whole sector
+        if (status == 0 && direct) {
+            status = ftruncate(source, sourceInfo.st_size);
+        }
+    } else {
+        unsigned char* header = front + blockLead(0, direct);
+        encodeHeader(inFile, header);
+        status = timed("blockWrite", frameOffset,
+        writeBlock(queue, output, front, sector, 0, frameOffset, direct));
+
+        // Blocks are read from the end of the source and written to the
+        // output front to back, reversed while copied between the buffers
+        for (int64_t done = 0; status == 0 && done < numFrames;) {
+            int64_t count = std::min(blockFrames, numFrames - done);
+            int64_t readOffset =
+            frameOffset + (numFrames - done - count) * frameSize;
+            int64_t writeOffset = frameOffset + done * frameSize;
+            status = timed("blockRead", count * frameSize,
+            readBlock(queue, source, back, readOffset, count * frameSize,
+            direct));
+            if (status != 0) {
+                break;
+            }
+            unsigned char* readData = back + blockLead(readOffset, direct);
+            if (direct) {
+                unsigned char* writeData =
+                front + blockLead(writeOffset, direct);
+                for (int64_t i = 0; i < count; i++) {
+                    std::memcpy(writeData + i * frameSize,
+                    readData + (count - 1 - i) * frameSize, frameSize);
+                }
+                status = timed("blockWrite", count * frameSize,
+                writeBlock(queue, output, front, sector, writeOffset,
+                count * frameSize, direct));
+            } else {
+                status = writeReversed(queue, output, readData, count,
+                frameSize, writeOffset);
+            }
+            done += count;
+        }
+        // Direct writes are padded out to a whole sector
+        if (status == 0 && direct) {
+            status = ftruncate(output, frameOffset + numFrames * frameSize);
+        }
+        close(output);
+    }
+
+    pooledFree(sector, directAlignment, directAlignment);
+    pooledFree(back, directAlignment, bufferSize);
+    pooledFree(front, directAlignment, bufferSize);
+    close(source);
+    if (status != 0) {
+        std::cout << "Failed to move frames while reversing." << std::endl;
+        return 1;
+    }
+    std::cout << "Writing file as " << filePath;
+    return 0;
+}
+
+// SAMPLE WIDTHS
+// The channel ops are written once over the sample type, planeKernels
+// gives each width its kernel table. Each op picks its instantiation once
+template <typename sample>
+struct planeKernels;
+
+template <>
+struct planeKernels<unsigned char> {
+    static void clip(unsigned char* data, int64_t length, int minimum,
+    int maximum, int) {
+        activeKernels().clip(data, length, minimum, maximum);
+    }
+    static void scale(unsigned char* data, int64_t length,
+    const scaleParams& params, int) {
+        activeKernels().scale(data, length, params);
+    }
+    static void matrix(unsigned char* const* planes, int64_t length,
+    const matrixParams& params, int) {
+        activeKernels().matrix(planes, length, params);
+    }
+};
+
+template <>
+struct planeKernels<uint16_t> {
+    static void clip(uint16_t* data, int64_t length, int minimum,
+    int maximum, int) {
+        activeKernels16().clip(data, length, minimum, maximum);
+    }
+    static void scale(uint16_t* data, int64_t length,
+    const scaleParams& params, int highest) {
+        activeKernels16().scale(data, length, params.factor, highest);
+    }
+    static void matrix(uint16_t* const* planes, int64_t length,
+    const matrixParams& params, int highest) {
+        activeKernels16().matrix(planes, length, params, highest);
+    }
+};
+
+template <typename sample>
+static sample* samplePlane(const videoData& video, unsigned char* frame,
+int64_t channel) {
+    return reinterpret_cast<sample*>(frame) +
+    channel * video.width * video.height;
+}
+
+// Samples [first, last) of one plane, or of the first three for sepia
+template <typename sample>
+static void swapSpan(const videoData& video, unsigned char* frame, int ch1,
+int ch2, int64_t first, int64_t last) {
+    activeKernels().swap(
+    reinterpret_cast<unsigned char*>(samplePlane<sample>(video, frame, ch1) +
+    first),
+    reinterpret_cast<unsigned char*>(samplePlane<sample>(video, frame, ch2) +
+    first), (last - first) * sizeof(sample));
+}
+
+template <typename sample>
+static void clipSpan(const videoData& video, unsigned char* frame,
+int channel, int minimum, int maximum, int64_t first, int64_t last) {
+    planeKernels<sample>::clip(samplePlane<sample>(video, frame, channel) +
+    first, last - first, minimum, maximum, maxSample(video));
+}
+
+template <typename sample>
+static void scaleSpan(const videoData& video, unsigned char* frame,
+int channel, const scaleParams& params, int64_t first, int64_t last) {
+    planeKernels<sample>::scale(samplePlane<sample>(video, frame, channel) +
+    first, last - first, params, maxSample(video));
+}
+
+template <typename sample>
+static void sepiaSpan(const videoData& video, unsigned char* frame,
+const matrixParams& sepia, int64_t first, int64_t last) {
+    sample* planes[3] = {
+        samplePlane<sample>(video, frame, 0) + first,
+        samplePlane<sample>(video, frame, 1) + first,
+        samplePlane<sample>(video, frame, 2) + first
+    };
+    planeKernels<sample>::matrix(planes, last - first, sepia,
+    maxSample(video));
+}
+
+// SWAP CHANNEL FUNCTIONS
+void swap_channel(videoData& inFile,
+int ch1, int ch2, const char filePath[]) {
+    scopedTimer timer("swap_channel", 2 * inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    auto swap = sampleBytes(inFile) == 2 ?
+    &swapSpan<uint16_t> : &swapSpan<unsigned char>;
+    // Move through frames, swapping their chanenls
+    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
+        swap(inFile, inFile.fullFrame + frame*inFile.frameSize, ch1, ch2, 0,
+        inFile.width*inFile.height);
+    }
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_swap(videoData& inFile,
+int ch1, int ch2,
+const char filePath[], const char sourcePath[]) {
+    int64_t planeSize = inFile.width * inFile.height;
+    auto swap = sampleBytes(inFile) == 2 ?
+    &swapSpan<uint16_t> : &swapSpan<unsigned char>;
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        swap(inFile, frame, ch1, ch2, 0, planeSize);
+    });
+}
+
+// Same logic as the functionality of the base function, with a chunk of frames
+void swapChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd,
+int ch1, int ch2) {
+    auto swap = sampleBytes(inFile) == 2 ?
+    &swapSpan<uint16_t> : &swapSpan<unsigned char>;
+    for (int64_t frame=chunkStart; frame < chunkEnd; frame++) {
+        swap(inFile, inFile.fullFrame + frame * inFile.frameSize, ch1, ch2, 0,
+        inFile.width * inFile.height);
+    }
+}
+
+void speed_swap(videoData& inFile,
+int ch1, int ch2, const char filePath[]) {
+    scopedTimer timer("speed_swap", 2 * inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    auto swap = sampleBytes(inFile) == 2 ?
+    &swapSpan<uint16_t> : &swapSpan<unsigned char>;
+    // Units are pixels of one plane in every frame, two samples move per pixel
+    int64_t planeSize = inFile.width * inFile.height;
+    parallelFor(inFile.numFrames * planeSize, 2 * sampleBytes(inFile),
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t frame, int64_t first, int64_t last) {
+            swap(inFile, inFile.fullFrame + frame * inFile.frameSize, ch1, ch2,
+            first, last);
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// CLIP CHANNEL FUNCTIONS
+void clip_channel(videoData& inFile,
+int targetChannel, int minimum,
+int maximum, const char filePath[]) {
+    scopedTimer timer("clip_channel", inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    auto clip = sampleBytes(inFile) == 2 ?
+    &clipSpan<uint16_t> : &clipSpan<unsigned char>;
+    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
+        // Clamp the whole channel plane at once with the SIMD kernel
+        clip(inFile, inFile.fullFrame + frame*inFile.frameSize, targetChannel,
+        minimum, maximum, 0, inFile.width*inFile.height);
+    }
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_clip(videoData& inFile,
+int targetChannel, int minimum,
+int maximum, const char filePath[], const char sourcePath[]) {
+    int64_t planeSize = inFile.width * inFile.height;
+    auto clip = sampleBytes(inFile) == 2 ?
+    &clipSpan<uint16_t> : &clipSpan<unsigned char>;
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        clip(inFile, frame, targetChannel, minimum, maximum, 0, planeSize);
+    });
+}
+
+// Callable instance for speed_reverse threading, essentially same as reverse()
+void clipChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd,
+int targetChannel, int minimum, int maximum) {
+    auto clip = sampleBytes(inFile) == 2 ?
+    &clipSpan<uint16_t> : &clipSpan<unsigned char>;
+    for (int64_t i=chunkStart; i < chunkEnd; i++) {
+        // Clamp the whole channel plane at once with the SIMD kernel
+        clip(inFile, inFile.fullFrame + (i * inFile.frameSize), targetChannel,
+        minimum, maximum, 0, inFile.width * inFile.height);
+    }
+}
+
+void speed_clip(videoData& inFile,
+int targetChannel, int minimum,
+int maximum, const char filePath[]) {
+    scopedTimer timer("speed_clip", inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    auto clip = sampleBytes(inFile) == 2 ?
+    &clipSpan<uint16_t> : &clipSpan<unsigned char>;
+    int64_t planeSize = inFile.width * inFile.height;
+    parallelFor(inFile.numFrames * planeSize, sampleBytes(inFile),
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t frame, int64_t first, int64_t last) {
+            clip(inFile, inFile.fullFrame + frame * inFile.frameSize,
+            targetChannel, minimum, maximum, first, last);
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// SCALE CHANNEL FUNCTIONS
+void scale_channel(videoData& inFile,
+int targetChannel, float scaleFactor, const char filePath[]) {
+    scopedTimer timer("scale_channel", inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    scaleParams params = makeScaleParams(scaleFactor);
+    auto scale = sampleBytes(inFile) == 2 ?
+    &scaleSpan<uint16_t> : &scaleSpan<unsigned char>;
+    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
+        // Fixed point multiply with saturation over the whole plane
+        scale(inFile, inFile.fullFrame + frame*inFile.frameSize,
+        targetChannel, params, 0, inFile.width*inFile.height);
+    }
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_scale(videoData& inFile,
+int targetChannel, float scaleFactor,
+const char filePath[], const char sourcePath[]) {
+    scaleParams params = makeScaleParams(scaleFactor);
+    auto scale = sampleBytes(inFile) == 2 ?
+    &scaleSpan<uint16_t> : &scaleSpan<unsigned char>;
+    int64_t planeSize = inFile.width * inFile.height;
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        scale(inFile, frame, targetChannel, params, 0, planeSize);
+    });
+}
+
+// Callable instance for speed_reverse threading, essentially same as reverse()
+void scaleChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd,
+int targetChannel, float scaleFactor) {
+    scaleParams params = makeScaleParams(scaleFactor);
+    auto scale = sampleBytes(inFile) == 2 ?
+    &scaleSpan<uint16_t> : &scaleSpan<unsigned char>;
+    for (int64_t i=chunkStart; i < chunkEnd; i++) {
+        // Fixed point multiply with saturation over the whole plane
+        scale(inFile, inFile.fullFrame + (i * inFile.frameSize),
+        targetChannel, params, 0, inFile.width * inFile.height);
+    }
+}
+
+void speed_scale(videoData& inFile,
+int targetChannel, float scaleFactor, const char filePath[]) {
+    scopedTimer timer("speed_scale", inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    scaleParams params = makeScaleParams(scaleFactor);
+    auto scale = sampleBytes(inFile) == 2 ?
+    &scaleSpan<uint16_t> : &scaleSpan<unsigned char>;
+    int64_t planeSize = inFile.width * inFile.height;
+    parallelFor(inFile.numFrames * planeSize, sampleBytes(inFile),
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t frame, int64_t first, int64_t last) {
+            scale(inFile, inFile.fullFrame + frame * inFile.frameSize,
+            targetChannel, params, first, last);
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// SEPIA FUNCTIONS
+// Sepia is the colour matrix preset below, run on the first three planes
+static void sepiaFrame(videoData& inFile, unsigned char* frame,
+const matrixParams& sepia) {
+    // All values are stored as r,r,r,r,...g,g,g,...b,b,b - so channel1 is R
+    int64_t planeSize = inFile.width * inFile.height;
+    if (sampleBytes(inFile) == 2) {
+        sepiaSpan<uint16_t>(inFile, frame, sepia, 0, planeSize);
+    } else {
+        sepiaSpan<unsigned char>(inFile, frame, sepia, 0, planeSize);
+    }
+}
+
+void sepia_filter(videoData& inFile,
+const char filePath[]) {
+    scopedTimer timer("sepia_filter", 3 * inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    matrixParams sepia = makeMatrixParams(makeSepiaOp());
+    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
+        sepiaFrame(inFile, inFile.fullFrame + frame*inFile.frameSize, sepia);
+    }
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+void sepiaChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd) {
+    matrixParams sepia = makeMatrixParams(makeSepiaOp());
+    for (int64_t frame = chunkStart; frame < chunkEnd; frame++) {
+        sepiaFrame(inFile, inFile.fullFrame + frame*inFile.frameSize, sepia);
+    }
+}
+
+void speed_sepia(videoData& inFile,
+const char filePath[]) {
+    scopedTimer timer("speed_sepia", 3 * inFile.width * inFile.height *
+    sampleBytes(inFile) * inFile.numFrames);
+    matrixParams sepia = makeMatrixParams(makeSepiaOp());
+    auto matrix = sampleBytes(inFile) == 2 ?
+    &sepiaSpan<uint16_t> : &sepiaSpan<unsigned char>;
+    int64_t planeSize = inFile.width * inFile.height;
+    parallelFor(inFile.numFrames * planeSize, 3 * sampleBytes(inFile),
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t frame, int64_t first, int64_t last) {
+            matrix(inFile, inFile.fullFrame + frame * inFile.frameSize, sepia,
+            first, last);
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_sepia(videoData& inFile,
+const char filePath[], const char sourcePath[]) {
+    matrixParams sepia = makeMatrixParams(makeSepiaOp());
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        sepiaFrame(inFile, frame, sepia);
+    });
+}
+
+// BLUR FUNCTIONS
+blurParams makeBoxBlur(int radius) {
+    blurParams params;
+    params.radius = radius;
+    const int taps = 2 * radius + 1;
+    params.boxScale = 1.0f / (taps * taps);
+    return params;
+}
+
+// Three sigmas either side, rounded to Q14 with the centre taking what
+// rounding lost so the weights always sum to one
+blurParams makeGaussianBlur(float sigma) {
+    blurParams params;
+    params.gaussian = true;
+    params.radius = std::clamp(static_cast<int>(std::ceil(3 * sigma)), 1,
+    maxBlurRadius);
+    std::vector<double> curve;
+    double total = 0;
+    for (int k = -params.radius; k <= params.radius; k++) {
+        curve.push_back(std::exp(-k * k / (2.0 * sigma * sigma)));
+        total += curve.back();
+    }
+    int sum = 0;
+    for (double value : curve) {
+        params.weights.push_back(std::lround(value / total * (1 << blurShift)));
+        sum += params.weights.back();
+    }
+    params.weights[params.radius] += (1 << blurShift) - sum;
+    return params;
+}
+
+// Rows [y0, y1) of a plane, blurred in place top to bottom. Filtered rows
+// go through a ring of 2*radius+2 rows, so however big the plane is only
+// a band of rows is worked on at once and it stays in cache. A source row
+// is always filtered before the output row it could be overwritten by.
+// Rows past the band come from above and below, copies taken before the
+// neighbouring bands started, or from the plane when those are null
+static void blurBand(unsigned char* plane, int64_t width, int64_t height,
+int64_t y0, int64_t y1, const unsigned char* above,
+const unsigned char* below, const blurParams& params) {
+    const int radius = params.radius;
+    const int slots = 2 * radius + 2;
+    static thread_local std::vector<uint16_t> ring;
+    static thread_local std::vector<unsigned char> padded;
+    static thread_local std::vector<uint32_t> sums;
+    static thread_local std::vector<const uint16_t*> rows;
+    ring.resize(slots * width);
+    padded.resize(width + 2 * radius + 16);
+    rows.resize(2 * radius + 1);
+
+    auto source = [&](int64_t y) {
+        y = std::clamp<int64_t>(y, 0, height - 1);
+        if (y < y0 && above) {
+            return above + (y - (y0 - radius)) * width;
+        }
+        if (y >= y1 && below) {
+            return below + (y - y1) * width;
+        }
+        return static_cast<const unsigned char*>(plane + y * width);
+    };
+    auto filtered = [&](int64_t y) {
+        return ring.data() + (y - y0 + radius) % slots * width;
+    };
+    auto filterRow = [&](int64_t y) {
+        const unsigned char* row = source(y);
+        std::memset(padded.data(), row[0], radius);
+        std::memcpy(padded.data() + radius, row, width);
+        std::memset(padded.data() + radius + width, row[width - 1],
+        radius + 16);
+        if (params.gaussian) {
+            activeKernels().gaussianRow(padded.data(), filtered(y), width,
+            params);
+        } else {
+            boxRow(padded.data(), filtered(y), width, radius);
+        }
+    };
+
+    for (int64_t y = y0 - radius; y <= y0 + radius; y++) {
+        filterRow(y);
+    }
+    if (!params.gaussian) {
+        sums.assign(width, 0);
+        for (int64_t y = y0 - radius; y <= y0 + radius; y++) {
+            const uint16_t* row = filtered(y);
+            for (int64_t x = 0; x < width; x++) {
+                sums[x] += row[x];
+            }
+        }
+    }
+    for (int64_t y = y0; y < y1; y++) {
+        bool more = y + 1 < y1;
+        if (more) {
+            filterRow(y + radius + 1);
+        }
+        if (params.gaussian) {
+            for (int k = 0; k <= 2 * radius; k++) {
+                rows[k] = filtered(y - radius + k);
+            }
+            activeKernels().weightedColumns(rows.data(),
+            params.weights.data(), 2 * radius + 1, plane + y * width, width);
+        } else {
+            // The last row leaves the sums as they are
+            const uint16_t* add = filtered(more ? y + radius + 1 : y);
+            const uint16_t* remove = filtered(more ? y - radius : y);
+            activeKernels().boxColumns(sums.data(), add, remove,
+            plane + y * width, width, params.boxScale);
+        }
+    }
+}
+
+static void blurFrame(const videoData& inFile, unsigned char* frame,
+const blurParams& params) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    if (planeSize == 0) {
+        return;
+    }
+    for (int c = 0; c < inFile.channels; c++) {
+        blurBand(frame + c * planeSize, inFile.width, inFile.height, 0,
+        inFile.height, nullptr, nullptr, params);
+    }
+}
+
+void blur_filter(videoData& inFile, const blurParams& params,
+const char filePath[]) {
+    scopedTimer timer("blur_filter", inFile.frameSize * inFile.numFrames);
+    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
+        blurFrame(inFile, inFile.fullFrame + frame*inFile.frameSize, params);
+    }
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+void blurChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd, const blurParams& params) {
+    for (int64_t frame = chunkStart; frame < chunkEnd; frame++) {
+        blurFrame(inFile, inFile.fullFrame + frame*inFile.frameSize, params);
+    }
+}
+
+// Units are bands of rows of every plane. Planes are only cut into bands
+// when there are too few of them to keep the workers busy, and the rows
+// either side of each cut are copied first, since the band owning them
+// overwrites them while its neighbour may still need the originals
+void speed_blur(videoData& inFile, const blurParams& params,
+const char filePath[]) {
+    scopedTimer timer("speed_blur", inFile.frameSize * inFile.numFrames);
+    const int64_t width = inFile.width;
+    const int64_t height = inFile.height;
+    const int64_t planeSize = width * height;
+    const int64_t planes = inFile.numFrames * inFile.channels;
+    const int64_t radius = params.radius;
+    const int64_t wanted = 4 * poolThreadCount();
+    int64_t bands = 1;
+    if (planes > 0 && planes < wanted) {
+        bands = std::min((wanted + planes - 1) / planes,
+        std::max<int64_t>(1, height / std::max<int64_t>(radius, 16)));
+    }
+    const int64_t bandRows = std::max<int64_t>(1, (height + bands - 1) / bands);
+    bands = planeSize > 0 ? (height + bandRows - 1) / bandRows : 0;
+    const int64_t cutBytes = 2 * radius * width;
+    std::vector<unsigned char> cuts(bands > 1 ?
+    planes * (bands - 1) * cutBytes : 0);
+    if (bands > 1) {
+        parallelFor(planes * (bands - 1), cutBytes, [&](int64_t begin,
+        int64_t end) {
+            for (int64_t i = begin; i < end; i++) {
+                const unsigned char* plane =
+                inFile.fullFrame + i / (bands - 1) * planeSize;
+                int64_t cut = (i % (bands - 1) + 1) * bandRows;
+                for (int64_t r = 0; r < 2 * radius; r++) {
+                    int64_t y = std::min(height - 1, cut - radius + r);
+                    std::memcpy(&cuts[i * cutBytes + r * width],
+                    plane + y * width, width);
+                }
+            }
+        });
+    }
+    parallelFor(planes * bands, bandRows * width,
+    [&](int64_t begin, int64_t end) {
+        for (int64_t unit = begin; unit < end; unit++) {
+            int64_t plane = unit / bands;
+            int64_t band = unit % bands;
+            int64_t y0 = band * bandRows;
+            unsigned char* planeCuts =
+            cuts.data() + plane * (bands - 1) * cutBytes;
+            blurBand(inFile.fullFrame + plane * planeSize, width, height, y0,
+            std::min(height, y0 + bandRows),
+            band > 0 ? planeCuts + (band - 1) * cutBytes : nullptr,
+            band + 1 < bands ? planeCuts + band * cutBytes + radius * width :
+            nullptr, params);
+        }
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+int memory_blur(videoData& inFile, const blurParams& params,
+const char filePath[], const char sourcePath[]) {
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        blurFrame(inFile, frame, params);
+    });
+}
+
+// RESIZE FUNCTIONS
+// Source pixel i covers [i, i + 1) and output pixel o the scaled span
+// [o * scale, (o + 1) * scale). area weighs each source pixel by how much
+// of that span it covers, bilinear the two around the span's centre. An
+// empty side has no pixels to weigh, so it is refused
+static int makeResizeAxis(int64_t inSize, int64_t outSize, bool bilinear,
+bool grouped, resizeAxis* axis) {
+    if (inSize < 1 || outSize < 1) {
+        return 1;
+    }
+    const double scale = static_cast<double>(inSize) / outSize;
+    std::vector<int64_t> firsts(outSize);
+    std::vector<std::vector<double>> spans(outSize);
+    size_t longest = 1;
+    for (int64_t o = 0; o < outSize; o++) {
+        if (bilinear) {
+            double centre = (o + 0.5) * scale - 0.5;
+            int64_t left = std::floor(centre);
+            double right = centre - left;
+            // Past either edge the outermost pixel takes all the weight
+            if (left < 0 || left >= inSize - 1) {
+                left = std::clamp<int64_t>(left, 0, inSize - 1);
+                right = 0;
+            }
+            firsts[o] = left;
+            spans[o] = {1 - right, right};
+        } else {
+            double start = o * scale;
+            double end = (o + 1) * scale;
+            firsts[o] = std::floor(start);
+            int64_t last = std::min<int64_t>(inSize, std::ceil(end));
+            for (int64_t i = firsts[o]; i < last; i++) {
+                spans[o].push_back((std::min(end, i + 1.0) -
+                std::max(start, static_cast<double>(i))) / scale);
+            }
+        }
+        longest = std::max(longest, spans[o].size());
+    }
+
+    axis->taps = grouped ? (longest + 3) / 4 * 4 : longest;
+    axis->first.assign(firsts.begin(), firsts.end());
+    axis->weights.assign(outSize * axis->taps, 0);
+    for (int64_t o = 0; o < outSize; o++) {
+        // Rounded to Q14 with the biggest weight taking what rounding lost
+        std::vector<int> weights;
+        int sum = 0;
+        for (double value : spans[o]) {
+            weights.push_back(std::lround(value * (1 << blurShift)));
+            sum += weights.back();
+        }
+        *std::max_element(weights.begin(), weights.end()) +=
+        (1 << blurShift) - sum;
+        for (size_t k = 0; k < weights.size(); k++) {
+            axis->weights[grouped ? (k / 4 * outSize + o) * 4 + k % 4 :
+            o * axis->taps + k] = weights[k];
+        }
+    }
+    return 0;
+}
+
+int makeResize(const videoData& inFile, int64_t width, int64_t height,
+bool bilinear, resizeParams* params) {
+    params->width = width;
+    params->height = height;
+    params->bilinear = bilinear;
+    return makeResizeAxis(inFile.width, width, bilinear, true,
+    &params->across) | makeResizeAxis(inFile.height, height, bilinear,
+    false, &params->down);
+}
+
+// The resized video has the input's format and layout, and the wide
+// header when the new sides do not fit in the original one
+static videoData resizedVideo(const videoData& inFile,
+const resizeParams& params) {
+    videoData resized;
+    resized.numFrames = inFile.numFrames;
+    resized.channels = inFile.channels;
+    resized.height = params.height;
+    resized.width = params.width;
+    resized.frameSize = resized.channels * resized.height * resized.width *
+    sampleBytes(inFile);
+    resized.compressed = inFile.compressed;
+    resized.interleaved = inFile.interleaved;
+    resized.wide = inFile.wide || params.width > 255 || params.height > 255;
+    resized.bitDepth = inFile.bitDepth;
+    return resized;
+}
+
+// Output rows [y0, y1) of one plane. Source rows are resized across into
+// a ring of down.taps rows as the taps of the output rows move down, so
+// each is filtered once per band and only a few rows are worked on at once
+static void resizeBand(const unsigned char* source, unsigned char* output,
+int64_t inWidth, int64_t inHeight, int64_t y0, int64_t y1,
+const resizeParams& params) {
+    const int64_t width = params.width;
+    const int slots = params.down.taps;
+    static thread_local std::vector<uint16_t> ring;
+    static thread_local std::vector<unsigned char> padded;
+    static thread_local std::vector<const uint16_t*> rows;
+    ring.resize(slots * width);
+    padded.resize(inWidth + params.across.taps);
+    rows.resize(slots);
+
+    int64_t next = 0;
+    for (int64_t y = y0; y < y1; y++) {
+        const int64_t top = params.down.first[y];
+        const int64_t bottom = std::min(inHeight, top + slots);
+        for (next = std::max(next, top); next < bottom; next++) {
+            const unsigned char* row = source + next * inWidth;
+            std::memcpy(padded.data(), row, inWidth);
+            std::memset(padded.data() + inWidth, row[inWidth - 1],
+            params.across.taps);
+            activeKernels().resizeRow(padded.data(),
+            ring.data() + next % slots * width, width, params.across);
+        }
+        // Taps below the last row have no weight, any filtered row will do
+        for (int k = 0; k < slots; k++) {
+            rows[k] = ring.data() +
+            std::min(top + k, inHeight - 1) % slots * width;
+        }
+        activeKernels().weightedColumns(rows.data(),
+        &params.down.weights[y * slots], slots, output + y * width, width);
+    }
+}
+
+static void resizeFrame(const videoData& inFile, const unsigned char* frame,
+unsigned char* resized, const resizeParams& params) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t resizedPlane = params.width * params.height;
+    for (int c = 0; c < inFile.channels; c++) {
+        resizeBand(frame + c * planeSize, resized + c * resizedPlane,
+        inFile.width, inFile.height, 0, params.height, params);
+    }
+}
+
+void resize_video(videoData& inFile, const resizeParams& params,
+const char filePath[]) {
+    scopedTimer timer("resize", inFile.frameSize * inFile.numFrames);
+    videoData resized = resizedVideo(inFile, params);
+    resized.fullFrame = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, resized.frameSize * resized.numFrames));
+    resizeChunk(inFile, resized.fullFrame, 0, inFile.numFrames, params);
+    timer.stop();
+    writeFile(resized, filePath);
+    releaseFrames(&resized);
+}
+
+void resizeChunk(videoData& inFile, unsigned char* resized,
+int64_t chunkStart, int64_t chunkEnd, const resizeParams& params) {
+    const int64_t resizedSize =
+    inFile.channels * params.width * params.height;
+    for (int64_t frame = chunkStart; frame < chunkEnd; frame++) {
+        resizeFrame(inFile, inFile.fullFrame + frame * inFile.frameSize,
+        resized + frame * resizedSize, params);
+    }
+}
+
+// Units are bands of output rows of every plane, cut like speed_blur's.
+// Bands write rows of their own and only read the input, so no rows have
+// to be kept aside at the cuts
+void speed_resize(videoData& inFile, const resizeParams& params,
+const char filePath[]) {
+    scopedTimer timer("speed_resize", inFile.frameSize * inFile.numFrames);
+    videoData resized = resizedVideo(inFile, params);
+    resized.fullFrame = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, resized.frameSize * resized.numFrames));
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t resizedPlane = params.width * params.height;
+    const int64_t planes = inFile.numFrames * inFile.channels;
+    const int64_t wanted = 4 * poolThreadCount();
+    int64_t bands = 1;
+    if (planes > 0 && planes < wanted) {
+        bands = std::min((wanted + planes - 1) / planes,
+        std::max<int64_t>(1, params.height / 16));
+    }
+    const int64_t bandRows = (params.height + bands - 1) / bands;
+    bands = (params.height + bandRows - 1) / bandRows;
+    parallelFor(planes * bands, (planeSize + resizedPlane) / bands,
+    [&](int64_t begin, int64_t end) {
+        for (int64_t unit = begin; unit < end; unit++) {
+            int64_t plane = unit / bands;
+            int64_t y0 = unit % bands * bandRows;
+            resizeBand(inFile.fullFrame + plane * planeSize,
+            resized.fullFrame + plane * resizedPlane, inFile.width,
+            inFile.height, y0, std::min(params.height, y0 + bandRows),
+            params);
+        }
+    });
+    timer.stop();
+    writeFile(resized, filePath);
+    releaseFrames(&resized);
+}
+
+// Each frame is resized next to its slot and copied back into it
+int memory_resize(videoData& inFile, const resizeParams& params,
+const char filePath[], const char sourcePath[]) {
+    videoData resized = resizedVideo(inFile, params);
+    return streamFrames(inFile, sourcePath, filePath, false,
+    [&](unsigned char* frame, int64_t) {
+        static thread_local std::vector<unsigned char> staging;
+        staging.resize(resized.frameSize);
+        resizeFrame(inFile, frame, staging.data(), params);
+        std::memcpy(frame, staging.data(), resized.frameSize);
+    }, &resized);
+}
+
+// TEMPORAL FUNCTIONS
+temporalParams makeTemporal(int window, int threshold) {
+    temporalParams params;
+    params.window = window;
+    params.threshold = threshold;
+    params.scale = 1.0f / window;
+    return params;
+}
+
+// The window of frame i runs from i - windowBefore to i + windowAfter
+static int64_t windowBefore(const temporalParams& params) {
+    return params.window / 2;
+}
+
+static int64_t windowAfter(const temporalParams& params) {
+    return params.window - 1 - windowBefore(params);
+}
+
+// Bytes of the frames are worked on in pieces whose ring of original
+// values stays in L2, each frame's piece is copied to the ring before the
+// output overwrites it, as later windows still need it
+void temporalChunk(videoData& inFile, int64_t chunkStart, int64_t chunkEnd,
+const temporalParams& params) {
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t window = params.window;
+    const int64_t before = windowBefore(params);
+    const int64_t after = windowAfter(params);
+    const int64_t piece =
+    std::clamp<int64_t>(taskBytes / window / 64 * 64, 64, 64 * 1024);
+    if (numFrames == 0) {
+        return;
+    }
+    static thread_local std::vector<unsigned char> ring;
+    static thread_local std::vector<uint16_t> sums;
+    ring.resize(window * piece);
+    sums.resize(piece);
+
+    for (int64_t start = chunkStart; start < chunkEnd; start += piece) {
+        const int64_t length = std::min(piece, chunkEnd - start);
+        // Frames up to i are only left in the ring
+        auto original = [&](int64_t frame, int64_t i) {
+            frame = std::clamp<int64_t>(frame, 0, numFrames - 1);
+            return frame <= i ? ring.data() + frame % window * piece :
+            inFile.fullFrame + frame * frameSize + start;
+        };
+        std::fill(sums.begin(), sums.begin() + length, 0);
+        for (int64_t k = -before; k <= after; k++) {
+            const unsigned char* frame = original(k, -1);
+            for (int64_t x = 0; x < length; x++) {
+                sums[x] += frame[x];
+            }
+        }
+        for (int64_t i = 0; i < numFrames; i++) {
+            unsigned char* frame = inFile.fullFrame + i * frameSize + start;
+            unsigned char* kept = ring.data() + i % window * piece;
+            std::memcpy(kept, frame, length);
+            activeKernels().temporalMean(sums.data(),
+            original(i + after + 1, i), original(i - before, i), kept, frame,
+            length, params);
+        }
+    }
+}
+
+void temporal_filter(videoData& inFile, const temporalParams& params,
+const char filePath[]) {
+    scopedTimer timer("temporal_filter", inFile.frameSize * inFile.numFrames);
+    temporalChunk(inFile, 0, inFile.frameSize, params);
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// Every pixel's window is independent of the others, so tasks take cache
+// lines of the frame through all the frames
+void speed_temporal(videoData& inFile, const temporalParams& params,
+const char filePath[]) {
+    scopedTimer timer("speed_temporal", inFile.frameSize * inFile.numFrames);
+    const int64_t frameSize = inFile.frameSize;
+    parallelFor((frameSize + 63) / 64, 64 * inFile.numFrames,
+    [&](int64_t begin, int64_t end) {
+        temporalChunk(inFile, begin * 64, std::min(frameSize, end * 64),
+        params);
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
+
+// One input frame, planar, whatever the format and layout of the file
+static int readPlanarFrame(int source, const videoData& inFile,
+const std::vector<int64_t>& index, int64_t frame, unsigned char* planar,
+std::vector<unsigned char>* record) {
+    const int64_t frameSize = inFile.frameSize;
+    if (inFile.compressed) {
+        const int64_t recordSlot = maxRecordBytes(frameSize);
+        int64_t recordBytes = index[frame + 1] - index[frame];
+        record->resize(recordSlot);
+        return recordBytes > recordSlot ||
+        preadAll(source, record->data(), recordBytes, index[frame]) != 0 ||
+        readReference(source, index, record->data(), &recordBytes,
+        recordSlot) != 0 ||
+        decompressFrame(inFile, record->data(), recordBytes, planar) != 0;
+    }
+    const int64_t offset = rawHeaderBytes(inFile) + frame * frameSize;
+    if (!inFile.interleaved) {
+        return preadAll(source, planar, frameSize, offset);
+    }
+    record->resize(frameSize);
+    if (preadAll(source, record->data(), frameSize, offset) != 0) {
+        return 1;
+    }
+    unpackFrame(inFile, record->data(), planar);
+    return 0;
+}
+
+// Frames go through a ring of window + 1, the window of the output frame
+// and the frame that enters it next. Output frames are computed across the
+// pool one at a time, since each needs the sums the one before left, and
+// read and written in between
+int memory_temporal(videoData& inFile, const temporalParams& params,
+const char filePath[], const char sourcePath[]) {
+    if (sameFile(sourcePath, filePath)) {
+        std::cout << "-M needs a different output file for temporal filters."
+        << std::endl;
+        return 1;
+    }
+    int source = open(sourcePath, O_RDONLY);
+    if (source < 0) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+    int output = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        std::cout << "Failed to open the file for writing." << std::endl;
+        close(source);
+        return 1;
+    }
+    posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t before = windowBefore(params);
+    const int64_t after = windowAfter(params);
+    const bool compressedOutput = writesCompressed(inFile);
+    const bool interleavedOutput = writesInterleaved(inFile);
+    std::vector<int64_t> inputIndex;
+    std::vector<int64_t> outputIndex(compressedOutput ? numFrames + 1 : 0);
+    int status = inFile.compressed ?
+    readFrameIndex(source, numFrames, &inputIndex) : 0;
+    int64_t outputOffset = rawHeaderBytes(inFile);
+    if (compressedOutput) {
+        outputOffset = outputIndex[0] = indexOffset(numFrames);
+    } else if (status == 0) {
+        unsigned char header[maxHeaderBytes];
+        status = pwriteAll(output, header, encodeHeader(inFile, header), 0);
+    }
+
+    const int64_t slots = params.window + 1;
+    unsigned char* frames = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, (slots + 1) * frameSize));
+    unsigned char* out = frames + slots * frameSize;
+    std::vector<uint16_t> sums(frameSize, 0);
+    std::vector<unsigned char> record;
+    auto slot = [&](int64_t frame) {
+        frame = std::clamp<int64_t>(frame, 0, numFrames - 1);
+        return frames + frame % slots * frameSize;
+    };
+    int64_t nextRead = 0;
+    auto readUpTo = [&](int64_t last) {
+        for (; nextRead <= std::min(last, numFrames - 1) && status == 0;
+        nextRead++) {
+            scopedTimer timer("read", frameSize);
+            status = readPlanarFrame(source, inFile, inputIndex, nextRead,
+            slot(nextRead), &record);
+        }
+    };
+    // Spans of a frame for the pool, a cache line at least
+    auto acrossFrame = [&](const std::function<void(int64_t, int64_t)>& f) {
+        parallelFor((frameSize + 63) / 64, 64, [&](int64_t begin,
+        int64_t end) {
+            f(begin * 64, std::min(frameSize, end * 64));
+        });
+    };
+
+    readUpTo(after);
+    if (numFrames > 0 && status == 0) {
+        acrossFrame([&](int64_t begin, int64_t end) {
+            for (int64_t k = -before; k <= after; k++) {
+                const unsigned char* frame = slot(k);
+                for (int64_t x = begin; x < end; x++) {
+                    sums[x] += frame[x];
+                }
+            }
+        });
+    }
+    for (int64_t i = 0; i < numFrames && status == 0; i++) {
+        readUpTo(i + after + 1);
+        if (status != 0) {
+            break;
+        }
+        {
+            scopedTimer timer("kernel", frameSize);
+            const unsigned char* add = slot(i + after + 1);
+            const unsigned char* remove = slot(i - before);
+            const unsigned char* current = slot(i);
+            acrossFrame([&](int64_t begin, int64_t end) {
+                activeKernels().temporalMean(sums.data() + begin,
+                add + begin, remove + begin, current + begin, out + begin,
+                end - begin, params);
+            });
+        }
+        scopedTimer timer("write", frameSize);
+        if (compressedOutput) {
+            record.resize(maxRecordBytes(frameSize));
+            int64_t length = compressFrame(inFile, out, record.data());
+            status = pwriteAll(output, record.data(), length, outputOffset);
+            outputOffset += length;
+            outputIndex[i + 1] = outputOffset;
+        } else if (interleavedOutput) {
+            record.resize(frameSize);
+            packFrame(inFile, out, record.data());
+            status = pwriteAll(output, record.data(), frameSize, outputOffset);
+            outputOffset += frameSize;
+        } else {
+            status = pwriteAll(output, out, frameSize, outputOffset);
+            outputOffset += frameSize;
+        }
+    }
+    pooledFree(frames, 64, (slots + 1) * frameSize);
+    if (compressedOutput && status == 0) {
+        status = writeCompressedHeader(output, inFile, outputIndex);
+    }
+    close(source);
+    close(output);
+    if (status != 0) {
+        std::cout << "Failed to stream frames from " << sourcePath
+        << " to " << filePath << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// COLOUR MATRIX FUNCTIONS
+// Round the float matrix to Q12, the range of int16_t bounds it to [-8, 8)
+matrixParams makeMatrixParams(const frameOp& op) {
+    matrixParams params;
+    params.size = std::lround(std::sqrt(op.coefficients.size()));
+    for (float coefficient : op.coefficients) {
+        long fixed = std::lround(coefficient * (1 << matrixShift));
+        params.coefficients.push_back(std::clamp(fixed, -32768L, 32767L));
+    }
+    return params;
+}
+
+// All sepia values are calculated according to findings in https://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
+// This post also motivated the creation of this functionality
+frameOp makeSepiaOp() {
+    frameOp op;
+    op.code = OP_MATRIX;
+    op.coefficients = {
+        0.393f, 0.769f, 0.189f,
+        0.349f, 0.686f, 0.168f,
+        0.272f, 0.534f, 0.131f
+    };
+    return op;
+}
+
+// LOOKUP TABLE FUNCTIONS
+// Monotone cubic through the control points (Fritsch-Carlson), so a curve
+// never overshoots between two points the way a plain spline would
+// https://en.wikipedia.org/wiki/Monotone_cubic_interpolation
+static void curveTable(const std::vector<std::pair<int, int>>& points,
+unsigned char table[256]) {
+    size_t count = points.size();
+    std::vector<double> slopes(count, 0.0);
+    std::vector<double> secants(count, 0.0);
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        secants[i] = static_cast<double>(points[i+1].second - points[i].second)
+        / (points[i+1].first - points[i].first);
+    }
+    if (count > 1) {
+        slopes[0] = secants[0];
+        slopes[count-1] = secants[count-2];
+    }
+    for (size_t i = 1; i + 1 < count; i++) {
+        if (secants[i-1] * secants[i] > 0) {
+            slopes[i] = (secants[i-1] + secants[i]) / 2;
+        }
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        if (secants[i] == 0) {
+            slopes[i] = 0;
+            slopes[i+1] = 0;
+            continue;
+        }
+        double a = slopes[i] / secants[i];
+        double b = slopes[i+1] / secants[i];
+        if (a * a + b * b > 9) {
+            double t = 3 / std::sqrt(a * a + b * b);
+            slopes[i] = t * a * secants[i];
+            slopes[i+1] = t * b * secants[i];
+        }
+    }
+
+    size_t segment = 0;
+    for (int value = 0; value < 256; value++) {
+        double result;
+        if (value <= points.front().first) {
+            result = points.front().second;
+        } else if (value >= points.back().first) {
+            result = points.back().second;
+        } else {
+            while (points[segment+1].first < value) {
+                segment++;
+            }
+            double width = points[segment+1].first - points[segment].first;
+            double t = (value - points[segment].first) / width;
+            double t2 = t * t;
+            double t3 = t2 * t;
+            result =
+            (2*t3 - 3*t2 + 1) * points[segment].second +
+            (t3 - 2*t2 + t) * width * slopes[segment] +
+            (-2*t3 + 3*t2) * points[segment+1].second +
+            (t3 - t2) * width * slopes[segment+1];
+        }
+        table[value] = std::clamp(std::lround(result), 0L, 255L);
+    }
+}
+
+// The 256 outputs of a single point op
+void pointOpTable(const frameOp& op, unsigned char table[256]) {
+    for (int value = 0; value < 256; value++) {
+        table[value] = value;
+    }
+
+    if (op.code == OP_CLIP) {
+        for (int value = 0; value < 256; value++) {
+            table[value] = std::clamp(table[value], op.minimum, op.maximum);
+        }
+    } else if (op.code == OP_SCALE) {
+        scaleTable(op.scaleFactor, table);
+    } else if (op.code == OP_GAMMA) {
+        for (int value = 0; value < 256; value++) {
+            table[value] = std::lround(
+                255.0 * std::pow(value / 255.0, 1.0 / op.gamma));
+        }
+    } else if (op.code == OP_LEVELS) {
+        for (int value = 0; value < 256; value++) {
+            if (op.maximum <= op.minimum) {
+                table[value] =
+                value >= op.maximum ? op.outMaximum : op.outMinimum;
+                continue;
+            }
+            double position =
+            static_cast<double>(std::clamp<int>(value, op.minimum, op.maximum)
+            - op.minimum) / (op.maximum - op.minimum);
+            table[value] = std::lround(op.outMinimum +
+            position * (op.outMaximum - op.outMinimum));
+        }
+    } else if (op.code == OP_CURVES) {
+        curveTable(op.curvePoints, table);
+    }
+}
+
+// Apply next after table, so a whole chain collapses into one table
+void composeTable(unsigned char table[256], const unsigned char next[256]) {
+    for (int value = 0; value < 256; value++) {
+        table[value] = next[table[value]];
+    }
+}
+
+// PIPELINE FUNCTIONS
+// A lone clip or scale has a faster dedicated kernel, anything else on
+// a plane is folded into one table so it costs one lookup per byte
+static void finishPrograms(std::vector<planeProgram>* programs) {
+    for (planeProgram& program : *programs) {
+        if (program.ops.empty()) {
+            continue;
+        }
+        const frameOp& first = program.ops.front();
+        if (program.ops.size() == 1 && (first.code == OP_CLIP ||
+        (first.code == OP_SCALE && first.scale.exact))) {
+            continue;
+        }
+        program.useTable = true;
+        pointOpTable(first, program.table);
+        for (size_t i = 1; i < program.ops.size(); i++) {
+            unsigned char next[256];
+            pointOpTable(program.ops[i], next);
+            composeTable(program.table, next);
+        }
+    }
+}
+
+// Turn the ordered op list into a plan that touches every byte once per
+// stage, a new stage only starts after an op that mixes channels
+pipelinePlan compilePipeline(const std::vector<frameOp>& ops, int channels) {
+    pipelinePlan plan;
+    plan.stages.emplace_back();
+    plan.stages.back().planes.resize(channels);
+
+    // where[c] is the plane currently holding logical channel c, swaps only
+    // move these labels around instead of moving any pixel data
+    std::vector<int> where(channels);
+    for (int c = 0; c < channels; c++) {
+        where[c] = c;
+    }
+
+    for (const frameOp& op : ops) {
+        pipelineStage& stage = plan.stages.back();
+        if (op.code == OP_REVERSE) {
+            plan.reverseFrames = !plan.reverseFrames;
+        } else if (op.code == OP_SWAP) {
+            std::swap(where[op.channel], where[op.channel2]);
+        } else if (op.code == OP_MATRIX) {
+            // The matrix reads and writes channels wherever they sit now,
+            // so pending swaps never have to be carried out before it
+            stage.hasMatrix = true;
+            stage.matrix = makeMatrixParams(op);
+            for (int c = 0; c < stage.matrix.size; c++) {
+                stage.matrixPlanes.push_back(where[c]);
+            }
+            plan.stages.emplace_back();
+            plan.stages.back().planes.resize(channels);
+        } else {
+            frameOp planeOp = op;
+            if (planeOp.code == OP_SCALE) {
+                planeOp.scale = makeScaleParams(op.scaleFactor);
+            }
+            stage.planes[where[op.channel]].ops.push_back(planeOp);
+        }
+    }
 
-        unsigned char* ch2Start =
-        (inFile.fullFrame
-        + frame * inFile.frameSize) + (ch2 * inFile.width * inFile.height);
+    for (pipelineStage& stage : plan.stages) {
+        finishPrograms(&stage.planes);
+    }
 
-        std::swap_ranges(ch1Start,
-        ch1Start + (inFile.width * inFile.height),
-        ch2Start);
+    // Work out the plane swaps that put every channel back in its slot
+    std::vector<int> holder(channels);
+    for (int c = 0; c < channels; c++) {
+        holder[where[c]] = c;
     }
+    for (int c = 0; c < channels; c++) {
+        int plane = where[c];
+        if (plane == c) {
+            continue;
+        }
+        plan.planeSwaps.emplace_back(c, plane);
+        int displaced = holder[c];
+        where[displaced] = plane;
+        holder[plane] = displaced;
+        where[c] = c;
+        holder[c] = c;
+    }
+    return plan;
 }
 
-void speed_swap(videoData& inFile,
-unsigned char ch1, unsigned char ch2, const char filePath[]) {
-    // Hardware_concurrency(); gets the number of threads we can max run at once
-    int totalThreads = std::thread::hardware_concurrency();
-    // If we can't split the frames, run regular function to avoid overhead
-    if (inFile.numFrames < totalThreads) {
-        swap_channel(inFile, (ch1+1), (ch2+1), filePath);
-        return;
-    }
-
-    // Swap functions in pairs of frames, so we go up to frames/2
-    int64_t framesInThread = (inFile.numFrames/2/totalThreads);
-    // Vector for the threads so that we can easily join them in the end
-    std::vector<std::thread> threads;
-
-    for  (int i=0; i < totalThreads; i++) {
-        int64_t chunkStart = i*framesInThread;
-        int64_t chunkEnd;
-        if (i == (totalThreads-1)) {
-            // Last thread handles all remaining frames
-            chunkEnd = inFile.numFrames;
-        } else {
-            chunkEnd = chunkStart + framesInThread;
+// Run the plan over one frame, every plane is walked by one kernel per stage
+void pipelineFrame(videoData& inFile, unsigned char* frame,
+const pipelinePlan& plan) {
+    pipelineSpan(inFile, frame, 0, inFile.width * inFile.height, plan);
+}
+
+// Runs the plan over pixels [first, last) of every plane in the frame, the
+// ops are per pixel so any split of a frame gives the same result
+void pipelineSpan(videoData& inFile, unsigned char* frame,
+int64_t first, int64_t last, const pipelinePlan& plan) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t length = last - first;
+    const pixelKernels& kernels = activeKernels();
+    frame += first;
+
+    for (const pipelineStage& stage : plan.stages) {
+        for (size_t plane = 0; plane < stage.planes.size(); plane++) {
+            const planeProgram& program = stage.planes[plane];
+            unsigned char* planeStart = frame + plane * planeSize;
+
+            if (program.useTable) {
+                kernels.lookup(planeStart, length, program.table);
+            } else if (!program.ops.empty()) {
+                const frameOp& op = program.ops.front();
+                if (op.code == OP_CLIP) {
+                    kernels.clip(planeStart, length,
+                    op.minimum, op.maximum);
+                } else {
+                    kernels.scale(planeStart, length, op.scale);
+                }
+            }
+        }
+
+        if (stage.hasMatrix) {
+            std::vector<unsigned char*> planes;
+            for (int plane : stage.matrixPlanes) {
+                planes.push_back(frame + plane * planeSize);
+            }
+            kernels.matrix(planes.data(), length, stage.matrix);
         }
-        // Inspired by https://en.cppreference.com/w/cpp/container/vector/emplace_back
-        threads.emplace_back
-        (swapChunk, std::ref(inFile),
-        chunkStart, chunkEnd,
-        ch1, ch2);
     }
 
-    // https://stackoverflow.com/questions/15027282/c-for-each-pulling-from-vector-elements
-    for (auto& thread : threads) {
-        thread.join();
+    for (const std::pair<int, int>& planes : plan.planeSwaps) {
+        kernels.swap(frame + planes.first * planeSize,
+        frame + planes.second * planeSize, length);
     }
-    writeFile(inFile, filePath);
 }
 
-// CLIP CHANNEL FUNCTIONS
-void clip_channel(videoData& inFile,
-int targetChannel, unsigned char minimum,
-unsigned char maximum, const char filePath[]) {
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        unsigned char* channelStart =
-        (inFile.fullFrame + frame*inFile.frameSize) +
-        (targetChannel*inFile.width*inFile.height);
+// Without reversal a chunk is a range of frames, with reversal it is a range
+// of front/back frame pairs, both finished while they are still in cache
+void pipelineChunk(videoData& inFile,
+int64_t chunkStart, int64_t chunkEnd, const pipelinePlan& plan) {
+    for (int64_t i = chunkStart; i < chunkEnd; i++) {
+        unsigned char* frontFrame = inFile.fullFrame + i * inFile.frameSize;
+        pipelineFrame(inFile, frontFrame, plan);
 
-        // Loop through each pixel in a channel to manipulate them
-        for (int i=0; i < (inFile.width*inFile.height); i++) {
-            // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
-            channelStart[i] = std::clamp(
-                channelStart[i],
-                minimum,
-                maximum);
+        if (!plan.reverseFrames) {
+            continue;
+        }
+        int64_t back = inFile.numFrames - 1 - i;
+        if (back != i) {
+            unsigned char* backFrame =
+            inFile.fullFrame + back * inFile.frameSize;
+            pipelineFrame(inFile, backFrame, plan);
+            std::swap_ranges(frontFrame,
+            frontFrame + inFile.frameSize, backFrame);
         }
     }
-    writeFile(inFile, filePath);
 }
 
-void memory_clip(videoData& inFile,
-int targetChannel, unsigned char minimum,
-unsigned char maximum, const char filePath[], const char sourcePath[]) {
-    unsigned char* tempFrame = new unsigned char[inFile.frameSize];
+void run_pipeline(videoData& inFile,
+const std::vector<frameOp>& ops, const char filePath[]) {
+    scopedTimer timer("run_pipeline", inFile.frameSize * inFile.numFrames);
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+    int64_t units = plan.reverseFrames ?
+    (inFile.numFrames + 1) / 2 : inFile.numFrames;
 
-    // Opening this file once to reduce overhead of non-stop calling open/close
-    std::fstream binFile;
+    pipelineChunk(inFile, 0, units, plan);
+    timer.stop();
+    writeFile(inFile, filePath);
+}
 
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(sourcePath, std::ios::binary | std::ios::in);
+int memory_pipeline(videoData& inFile,
+const std::vector<frameOp>& ops,
+const char filePath[], const char sourcePath[]) {
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+
+    // Output is always written front to back, a reversal only changes
+    // which source frame gets read for each output slot
+    return streamFrames(inFile, sourcePath, filePath, plan.reverseFrames,
+    [&](unsigned char* frame, int64_t) {
+        pipelineFrame(inFile, frame, plan);
+    });
+}
 
-    std::fstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
+void speed_pipeline(videoData& inFile,
+const std::vector<frameOp>& ops, const char filePath[]) {
+    scopedTimer timer("speed_pipeline", inFile.frameSize * inFile.numFrames);
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+    int64_t planeSize = inFile.width * inFile.height;
+    int64_t units = plan.reverseFrames ?
+    (inFile.numFrames + 1) / 2 : inFile.numFrames;
+
+    // Units are pixel columns through every plane, with reversal the
+    // same columns of the mirrored frame ride along in the same task
+    int64_t bytesPerUnit = inFile.channels * (plan.reverseFrames ? 2 : 1);
+    parallelFor(units * planeSize, bytesPerUnit,
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t i, int64_t first, int64_t last) {
+            unsigned char* frontFrame =
+            inFile.fullFrame + i * inFile.frameSize;
+            pipelineSpan(inFile, frontFrame, first, last, plan);
+
+            int64_t back = inFile.numFrames - 1 - i;
+            if (!plan.reverseFrames || back == i) {
+                return;
+            }
+            unsigned char* backFrame =
+            inFile.fullFrame + back * inFile.frameSize;
+            pipelineSpan(inFile, backFrame, first, last, plan);
+            for (int c = 0; c < inFile.channels; c++) {
+                activeKernels().swap(frontFrame + c * planeSize + first,
+                backFrame + c * planeSize + first, last - first);
+            }
+        });
+    });
+    timer.stop();
+    writeFile(inFile, filePath);
+}
 
-    int metadataSize =
-    sizeof(int64_t) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char);
+// STATS FUNCTIONS
+videoStats makeStats(const videoData& inFile, bool perFrame) {
+    videoStats stats;
+    stats.channels = inFile.channels;
+    stats.histogram.assign(inFile.channels * 256, 0);
+    stats.perFrame = perFrame;
+    if (perFrame) {
+        stats.planes.resize(inFile.numFrames * inFile.channels);
+    }
+    return stats;
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
+static void mergeSummary(planeSummary* into, const planeSummary& part) {
+    into->minimum = std::min(into->minimum, part.minimum);
+    into->maximum = std::max(into->maximum, part.maximum);
+    into->sum += part.sum;
+    into->count += part.count;
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
+// Bytes begin to end of a run of whole frames starting at firstFrame. The
+// counts go into totals of the caller's own, only the merge takes the lock
+static void countBytes(const videoData& inFile, const unsigned char* frames,
+int64_t firstFrame, int64_t begin, int64_t end, videoStats* stats,
+std::mutex* lock) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    const int64_t channels = inFile.channels;
+    std::vector<uint64_t> totals(channels * 256, 0);
+    std::vector<std::pair<int64_t, planeSummary>> summaries;
+    uint32_t counts[256];
+    for (int64_t at = begin; at < end;) {
+        const int64_t plane = at / planeSize;
+        const int64_t stop = std::min({end, (plane + 1) * planeSize,
+        at + maxHistogramRun});
+        std::fill(counts, counts + 256, 0);
+        activeKernels().histogram(frames + at, stop - at, counts);
+        uint64_t* bins = totals.data() + plane % channels * 256;
+        planeSummary summary;
+        for (int value = 0; value < 256; value++) {
+            if (counts[value] == 0) {
+                continue;
+            }
+            bins[value] += counts[value];
+            summary.minimum = std::min<int>(summary.minimum, value);
+            summary.maximum = value;
+            summary.sum += static_cast<uint64_t>(value) * counts[value];
+            summary.count += counts[value];
+        }
+        const int64_t planeIndex = firstFrame * channels + plane;
+        if (stats->perFrame) {
+            if (!summaries.empty() && summaries.back().first == planeIndex) {
+                mergeSummary(&summaries.back().second, summary);
+            } else {
+                summaries.emplace_back(planeIndex, summary);
+            }
+        }
+        at = stop;
+    }
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
+    std::lock_guard<std::mutex> guard(*lock);
+    for (size_t i = 0; i < totals.size(); i++) {
+        stats->histogram[i] += totals[i];
+    }
+    for (const auto& [planeIndex, summary] : summaries) {
+        mergeSummary(&stats->planes[planeIndex], summary);
+    }
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+void statsChunk(videoData& inFile, int64_t chunkStart, int64_t chunkEnd,
+videoStats* stats) {
+    if (inFile.frameSize == 0) {
+        return;
+    }
+    std::mutex lock;
+    countBytes(inFile, inFile.fullFrame, 0, chunkStart * inFile.frameSize,
+    chunkEnd * inFile.frameSize, stats, &lock);
+}
 
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        int64_t framePos = metadataSize + (inFile.frameSize*frame);
-        binFile.seekg(framePos);  // Seek to the current frame
-        binFile.read(reinterpret_cast<char*>(tempFrame), inFile.frameSize);
+void stats_video(videoData& inFile, videoStats* stats) {
+    scopedTimer timer("stats_video", inFile.frameSize * inFile.numFrames);
+    statsChunk(inFile, 0, inFile.numFrames, stats);
+}
 
-        unsigned char* channelStart =
-        tempFrame + (targetChannel*inFile.width*inFile.height);
+// The pass only reads, so tasks are plain byte ranges of the whole video
+// regardless of where frames and planes start
+void speed_stats(videoData& inFile, videoStats* stats) {
+    scopedTimer timer("speed_stats", inFile.frameSize * inFile.numFrames);
+    if (inFile.frameSize == 0) {
+        return;
+    }
+    std::mutex lock;
+    parallelFor(inFile.frameSize * inFile.numFrames, 1,
+    [&](int64_t begin, int64_t end) {
+        countBytes(inFile, inFile.fullFrame, 0, begin, end, stats, &lock);
+    });
+}
 
-        for (int i=0; i < (inFile.width*inFile.height); i++) {
-            channelStart[i] = std::clamp(channelStart[i], minimum, maximum);
+// Two batches of frames take turns, a reader thread fills one while the
+// pool counts the other, so memory use stays at streamRingBytes
+int memory_stats(videoData& inFile, const char sourcePath[],
+videoStats* stats) {
+    int source = open(sourcePath, O_RDONLY);
+    if (source < 0) {
+        std::cout << "Failed to open the file for frame reading." << std::endl;
+        return 1;
+    }
+    posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    std::vector<int64_t> index;
+    int status = inFile.compressed ?
+    readFrameIndex(source, numFrames, &index) : 0;
+    if (frameSize == 0 || numFrames == 0 || status != 0) {
+        close(source);
+        if (status != 0) {
+            std::cout << "The compressed video is damaged." << std::endl;
         }
-
-        // Seek back to where the frame would be located, for output
-        outFile.seekp(framePos);
-        outFile.write(reinterpret_cast<char*>
-        (tempFrame), inFile.frameSize);
+        return status;
     }
 
-    delete[] tempFrame;
-    binFile.close();
-    outFile.close();
+    const int64_t batch = std::clamp<int64_t>(streamRingBytes / 2 / frameSize,
+    1, numFrames);
+    unsigned char* buffers = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, 2 * batch * frameSize));
+    std::vector<unsigned char> record;
+    // Raw planar batches are one transfer, cut into requests kept in
+    // flight together with io_uring. One reader uses the queue at a time
+    ioQueue queue;
+    queue.registerBuffers({{buffers, 2 * batch * frameSize}});
+    auto readBatch = [&](int64_t first, unsigned char* into) {
+        scopedTimer timer("read", 0);
+        if (!inFile.compressed && !inFile.interleaved) {
+            int64_t count = std::min(batch, numFrames - first);
+            timer.addBytes(count * frameSize);
+            queue.read(source, into, count * frameSize,
+            rawHeaderBytes(inFile) + first * frameSize, 0);
+            return queue.finish();
+        }
+        int result = 0;
+        for (int64_t i = first; i < std::min(numFrames, first + batch) &&
+        result == 0; i++) {
+            result = readPlanarFrame(source, inFile, index, i,
+            into + (i - first) * frameSize, &record);
+            timer.addBytes(frameSize);
+        }
+        return result;
+    };
+
+    std::mutex lock;
+    status = readBatch(0, buffers);
+    for (int64_t first = 0; first < numFrames && status == 0;
+    first += batch) {
+        unsigned char* current = buffers + first / batch % 2 * batch *
+        frameSize;
+        unsigned char* next = buffers + (first / batch + 1) % 2 * batch *
+        frameSize;
+        int nextStatus = 0;
+        std::thread reader;
+        if (first + batch < numFrames) {
+            reader = std::thread([&]() {
+                nextStatus = readBatch(first + batch, next);
+            });
+        }
+        {
+            const int64_t count = std::min(batch, numFrames - first);
+            scopedTimer timer("kernel", count * frameSize);
+            parallelFor(count * frameSize, 1, [&](int64_t begin,
+            int64_t end) {
+                countBytes(inFile, current, first, begin, end, stats, &lock);
+            });
+        }
+        if (reader.joinable()) {
+            reader.join();
+        }
+        status = nextStatus;
+    }
+    pooledFree(buffers, 64, 2 * batch * frameSize);
+    close(source);
+    if (status != 0) {
+        std::cout << "Failed to read frames from " << sourcePath << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
-// Callable instance for speed_reverse threading, essentially same as reverse()
-void clipChunk(videoData& inFile,
-int64_t chunkStart, int64_t chunkEnd,
-int targetChannel, unsigned char minimum, unsigned char maximum) {
-    for (int64_t i=chunkStart; i < chunkEnd; i++) {
-        unsigned char* channelStart =
-        inFile.fullFrame + (i * inFile.frameSize) +
-        (targetChannel * inFile.width * inFile.height);
+static void summaryJson(std::ostringstream& json, const planeSummary& summary) {
+    json << "\"min\": " << (summary.count ? summary.minimum : 0)
+    << ", \"max\": " << static_cast<int>(summary.maximum)
+    << ", \"mean\": " << (summary.count ?
+    static_cast<double>(summary.sum) / summary.count : 0.0);
+}
 
-        // Loop through each pixel in a channel to manipulate them
-        for (int j = 0; j < (inFile.width * inFile.height); j++) {
-            // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
-            channelStart[j] = std::clamp(
-                channelStart[j],
-                minimum,
-                maximum);
+int writeStats(const videoData& inFile, const videoStats& stats,
+const char filePath[]) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(6)
+    << "{\n  \"frames\": " << inFile.numFrames
+    << ",\n  \"channels\": [";
+    for (int64_t c = 0; c < stats.channels; c++) {
+        const uint64_t* bins = stats.histogram.data() + c * 256;
+        planeSummary summary;
+        for (int value = 0; value < 256; value++) {
+            if (bins[value] == 0) {
+                continue;
+            }
+            summary.minimum = std::min<int>(summary.minimum, value);
+            summary.maximum = value;
+            summary.sum += value * bins[value];
+            summary.count += bins[value];
+        }
+        json << (c ? ",\n" : "\n") << "    {\"channel\": " << c << ", ";
+        summaryJson(json, summary);
+        json << ",\n     \"histogram\": [";
+        for (int value = 0; value < 256; value++) {
+            json << (value ? ", " : "") << bins[value];
         }
+        json << "]}";
     }
-}
-
-void speed_clip(videoData& inFile,
-int targetChannel, unsigned char minimum,
-unsigned char maximum, const char filePath[]) {
-    // Hardware_concurrency(); gets the number of threads we can max run at once
-    int totalThreads = std::thread::hardware_concurrency();
-    // If we can't split the frames, run regular function to avoid overhead
-    if (inFile.numFrames < totalThreads) {
-        clip_channel(inFile, (targetChannel+1), minimum, maximum, filePath);
-        return;
-    }
-
-    int64_t framesInThread = (inFile.numFrames/totalThreads);
-    // Vector for the threads so that we can easily join them in the end
-    std::vector<std::thread> threads;
-
-    for (int i=0; i < totalThreads; i++) {
-        int64_t chunkStart = i*framesInThread;
-        int64_t chunkEnd;
-        if (i == (totalThreads-1)) {
-            // Last thread handles all remaining frames
-            chunkEnd = inFile.numFrames;
-        } else {
-            chunkEnd = chunkStart + framesInThread;
+    json << "\n  ]";
+    if (stats.perFrame) {
+        json << ",\n  \"per_frame\": [";
+        for (int64_t i = 0; i < inFile.numFrames; i++) {
+            json << (i ? ",\n" : "\n") << "    {\"frame\": " << i
+            << ", \"channels\": [";
+            for (int64_t c = 0; c < stats.channels; c++) {
+                json << (c ? ", " : "") << "{";
+                summaryJson(json, stats.planes[i * stats.channels + c]);
+                json << "}";
+            }
+            json << "]}";
         }
-        // Inspired by https://en.cppreference.com/w/cpp/container/vector/emplace_back
-        threads.emplace_back
-        (clipChunk, std::ref(inFile),
-        chunkStart, chunkEnd,
-        targetChannel, minimum, maximum);
+        json << "\n  ]";
     }
+    json << "\n}\n";
 
-    // https://stackoverflow.com/questions/15027282/c-for-each-pulling-from-vector-elements
-    for (auto& thread : threads) {
-        thread.join();
+    std::ofstream report(filePath);
+    report << json.str();
+    if (!report) {
+        std::cout << "Failed to write the stats to " << filePath << std::endl;
+        return 1;
     }
-    writeFile(inFile, filePath);
+    std::cout << "Writing stats as " << filePath;
+    return 0;
 }
 
-// SCALE CHANNEL FUNCTIONS
-void scale_channel(videoData& inFile,
-int targetChannel, float scaleFactor, const char filePath[]) {
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-            unsigned char* channelStart =
-            (inFile.fullFrame + frame*inFile.frameSize) +
-            (targetChannel*inFile.width*inFile.height);
+// The low end is the first value with more than clipPercent of the pixels
+// at or below it, the high end the same from the top
+std::vector<frameOp> autoLevelsOps(const videoStats& stats,
+float clipPercent) {
+    std::vector<frameOp> ops;
+    for (int64_t c = 0; c < stats.channels; c++) {
+        const uint64_t* bins = stats.histogram.data() + c * 256;
+        uint64_t total = 0;
+        for (int value = 0; value < 256; value++) {
+            total += bins[value];
+        }
+        const double clipped = total * (clipPercent / 100.0);
+        int low = 0;
+        for (uint64_t below = bins[0]; low < 255 && below <= clipped;) {
+            below += bins[++low];
+        }
+        int high = 255;
+        for (uint64_t above = bins[255]; high > 0 && above <= clipped;) {
+            above += bins[--high];
+        }
+        if (total == 0 || low >= high || (low == 0 && high == 255)) {
+            continue;
+        }
+        frameOp op;
+        op.code = OP_LEVELS;
+        op.channel = c;
+        op.minimum = low;
+        op.maximum = high;
+        ops.push_back(op);
+    }
+    return ops;
+}
 
-            // Loop through each pixel in a channel to manipulate them
-            for (int i=0; i < (inFile.width*inFile.height); i++) {
-                // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
-                channelStart[i] = std::clamp(
-                    (channelStart[i]) * scaleFactor,
-                    0.0f,
-                    255.0f);
+// REMAP ENGINE
+bool planIsRemap(const pipelinePlan& plan) {
+    for (const pipelineStage& stage : plan.stages) {
+        if (stage.hasMatrix) {
+            return false;
+        }
+        for (const planeProgram& program : stage.planes) {
+            if (program.useTable || !program.ops.empty()) {
+                return false;
             }
         }
-    writeFile(inFile, filePath);
+    }
+    return true;
 }
 
-void memory_scale(videoData& inFile,
-int targetChannel, float scaleFactor,
-const char filePath[], const char sourcePath[]) {
-    unsigned char* tempFrame = new unsigned char[inFile.frameSize];
-
-    // Opening this file once to reduce overhead of non-stop calling open/close
-    std::fstream binFile;
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(sourcePath, std::ios::binary | std::ios::in);
-
-    std::fstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
-
-    int metadataSize =
-    sizeof(int64_t) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char) +
-    sizeof(unsigned char);
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
+// Neighbouring moves that continue each other in both files become one
+static void addMove(std::vector<byteMove>* moves, int64_t source,
+int64_t output, int64_t length) {
+    if (!moves->empty()) {
+        byteMove& last = moves->back();
+        if (last.source + last.length == source &&
+        last.output + last.length == output) {
+            last.length += length;
+            return;
+        }
+    }
+    moves->push_back({source, output, length});
+}
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
+std::vector<byteMove> remapMoves(const videoData& inFile,
+const pipelinePlan& plan) {
+    const int64_t planeSize =
+    inFile.width * inFile.height * sampleBytes(inFile);
+    const int64_t frameOffset = rawHeaderBytes(inFile);
+    // plane[i] is the source plane that ends up in output plane i
+    std::vector<int> plane(inFile.channels);
+    for (int c = 0; c < inFile.channels; c++) {
+        plane[c] = c;
+    }
+    for (const std::pair<int, int>& swap : plan.planeSwaps) {
+        std::swap(plane[swap.first], plane[swap.second]);
+    }
 
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+    std::vector<byteMove> moves;
+    addMove(&moves, 0, 0, frameOffset);
+    for (int64_t frame = 0; frame < inFile.numFrames; frame++) {
+        int64_t source = plan.reverseFrames ?
+        inFile.numFrames - 1 - frame : frame;
+        int64_t sourceFrame = frameOffset + source * inFile.frameSize;
+        int64_t outputFrame = frameOffset + frame * inFile.frameSize;
+        for (int c = 0; c < inFile.channels; c++) {
+            addMove(&moves, sourceFrame + plane[c] * planeSize,
+            outputFrame + c * planeSize, planeSize);
+        }
+    }
+    return moves;
+}
 
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        int64_t framePos = metadataSize + (inFile.frameSize*frame);
-        binFile.seekg(framePos);  // Seek to the current frame
-        binFile.read(reinterpret_cast<char*>(tempFrame), inFile.frameSize);
+// copy_file_range lets the filesystem share extents (reflink) or copy on
+// the server, otherwise the kernel still copies without a userspace trip
+// https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+static size_t copyMoves(int source, int output,
+const std::vector<byteMove>& moves) {
+    scopedTimer timer("copy_file_range");
+    for (size_t i = 0; i < moves.size(); i++) {
+        off_t inOffset = moves[i].source;
+        off_t outOffset = moves[i].output;
+        int64_t end = moves[i].source + moves[i].length;
+        while (inOffset < end) {
+            ssize_t copied = copy_file_range(source, &inOffset,
+            output, &outOffset, end - inOffset, 0);
+            if (copied <= 0) {
+                // Unsupported here, the rest goes through the fallback
+                return i;
+            }
+            timer.addBytes(copied);
+        }
+    }
+    return moves.size();
+}
 
-        unsigned char* channelStart =
-        tempFrame + (targetChannel*inFile.width*inFile.height);
+// Fallback: the source is mapped and the moves, which are in output order,
+// are gathered straight from the mapping into pwritev calls
+static int writeMoves(int source, int output,
+const std::vector<byteMove>& moves, size_t first) {
+    scopedTimer timer("writev");
+    struct stat sourceInfo;
+    if (fstat(source, &sourceInfo) != 0 || sourceInfo.st_size == 0) {
+        return 1;
+    }
+    unsigned char* base = mapVideo(source, sourceInfo.st_size, MAP_PRIVATE);
+    if (!base) {
+        return 1;
+    }
 
-        // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
-        for (int i=0; i < (inFile.width*inFile.height); i++) {
-            channelStart[i] = std::clamp((
-                channelStart[i]) * scaleFactor,
-                0.0f,
-                255.0f);
+    std::vector<struct iovec> parts;
+    int status = 0;
+    size_t i = first;
+    while (status == 0 && i < moves.size()) {
+        // One batch is a run of moves that is contiguous in the output
+        int64_t offset = moves[i].output;
+        int64_t length = 0;
+        size_t batchStart = i;
+        parts.clear();
+        while (i < moves.size() && static_cast<int>(parts.size()) < IOV_MAX &&
+        moves[i].output == offset + length) {
+            parts.push_back({base + moves[i].source,
+            static_cast<size_t>(moves[i].length)});
+            length += moves[i].length;
+            i++;
         }
+        timer.addBytes(length);
+        if (pwritev(output, parts.data(), parts.size(), offset) != length) {
+            // Partial writev, finish the batch move by move
+            for (size_t m = batchStart; m < i && status == 0; m++) {
+                status = pwriteAll(output, base + moves[m].source,
+                moves[m].length, moves[m].output);
+            }
+        }
+    }
+    munmap(base, sourceInfo.st_size);
+    return status;
+}
 
-        // Seek back to where the frame would be located, for output
-        outFile.seekp(framePos);
+int remapFile(const char* sourcePath, const char* outputPath,
+const std::vector<byteMove>& moves) {
+    if (sameFile(sourcePath, outputPath)) {
+        return 1;
+    }
+    int source = open(sourcePath, O_RDONLY);
+    if (source < 0) {
+        return 1;
+    }
+    int output = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        close(source);
+        return 1;
+    }
 
-        outFile.write(reinterpret_cast<char*>
-        (tempFrame), inFile.frameSize);
+    int64_t total = 0;
+    for (const byteMove& move : moves) {
+        total += move.length;
+    }
+    size_t copied = 0;
+    if (!moves.empty() &&
+    total / static_cast<int64_t>(moves.size()) >= remapMinCopy) {
+        copied = copyMoves(source, output, moves);
+    }
+    int status = 0;
+    if (copied < moves.size()) {
+        status = writeMoves(source, output, moves, copied);
     }
+    close(output);
+    close(source);
+    return status;
+}
 
-    delete[] tempFrame;
-    binFile.close();
-    outFile.close();
+int remap_pipeline(videoData& inFile,
+const std::vector<frameOp>& ops, const char filePath[],
+const char sourcePath[]) {
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+    if (!planIsRemap(plan) || inFile.compressed || writesCompressed(inFile)) {
+        return 1;
+    }
+    // Whole frames move the same in either layout, planes only when planar
+    if ((inFile.interleaved || writesInterleaved(inFile)) &&
+    (inFile.interleaved != writesInterleaved(inFile) ||
+    !plan.planeSwaps.empty())) {
+        return 1;
+    }
+    if (remapFile(sourcePath, filePath, remapMoves(inFile, plan)) != 0) {
+        return 1;
+    }
+    std::cout << "Writing file as " << filePath;
+    return 0;
 }
 
-// Callable instance for speed_reverse threading, essentially same as reverse()
-void scaleChunk(videoData& inFile,
-int64_t chunkStart, int64_t chunkEnd,
-int targetChannel, float scaleFactor) {
-    for (int64_t i=chunkStart; i < chunkEnd; i++) {
-        unsigned char* channelStart =
-        inFile.fullFrame +
-        (i * inFile.frameSize) +
-        (targetChannel * inFile.width * inFile.height);
+// FRAME RANGES
+int64_t rangeCount(const frameRange& range) {
+    if (range.end <= range.begin) {
+        return 0;
+    }
+    return (range.end - range.begin + range.step - 1) / range.step;
+}
 
-        // Loop through each pixel in a channel to manipulate them
-        for (int j = 0; j < (inFile.width * inFile.height); j++) {
-            // Adapted from https://stackoverflow.com/questions/9323903/most-efficient-elegant-way-to-clip-a-number
-            channelStart[j] = std::clamp(
-                (channelStart[j]) * scaleFactor,
-                0.0f,
-                255.0f);
+// Selected frames [first, last) of the range from or to the file, one
+// transfer when they sit next to each other. With io_uring the frames of
+// a strided range are all in flight together
+static int transferSelected(ioQueue& queue, int fd, unsigned char* frames,
+const videoData& inFile, const frameRange& range, int64_t first,
+int64_t last, bool writing) {
+    const int64_t frameSize = inFile.frameSize;
+    int64_t frameCount = range.step == 1 ? last - first : 1;
+    for (int64_t k = first; k < last; k += frameCount) {
+        int64_t offset = rawHeaderBytes(inFile) +
+        (range.begin + k * range.step) * frameSize;
+        unsigned char* buffer = frames + (k - first) * frameSize;
+        if (writing) {
+            queue.write(fd, buffer, frameCount * frameSize, offset, 0);
+        } else {
+            queue.read(fd, buffer, frameCount * frameSize, offset, 0);
         }
     }
+    return queue.finish();
 }
 
-void speed_scale(videoData& inFile,
-int targetChannel, float scaleFactor, const char filePath[]) {
-    // Hardware_concurrency(); gets the number of threads we can max run at once
-    int totalThreads = std::thread::hardware_concurrency();
-    // If we can't split the frames, run regular function to avoid overhead
-    if (inFile.numFrames < totalThreads) {
-        scale_channel(inFile, targetChannel + 1, scaleFactor, filePath);
-        return;
+// Point ops and plane swaps on count frames at frames, reversal is done
+// by the caller since it moves frames between blocks
+static void processBlock(videoData& inFile, unsigned char* frames,
+int64_t count, const pipelinePlan& plan) {
+    const int64_t planeSize = inFile.width * inFile.height;
+    if (inFile.interleaved) {
+        // Each frame is made planar, processed and packed again in cache
+        parallelFor(count, inFile.frameSize, [&](int64_t begin, int64_t end) {
+            static thread_local std::vector<unsigned char> planar;
+            planar.resize(inFile.frameSize);
+            for (int64_t i = begin; i < end; i++) {
+                unsigned char* frame = frames + i * inFile.frameSize;
+                unpackFrame(inFile, frame, planar.data());
+                pipelineSpan(inFile, planar.data(), 0, planeSize, plan);
+                packFrame(inFile, planar.data(), frame);
+            }
+        });
+    } else {
+        parallelFor(count * planeSize, inFile.channels,
+        [&](int64_t begin, int64_t end) {
+            forEachSpan(begin, end, planeSize,
+            [&](int64_t i, int64_t first, int64_t last) {
+                pipelineSpan(inFile, frames + i * inFile.frameSize,
+                first, last, plan);
+            });
+        });
+    }
+    if (plan.reverseFrames) {
+        videoData block = inFile;
+        block.fullFrame = frames;
+        block.numFrames = count;
+        reverseChunk(block, 0, count / 2);
     }
+}
 
-    int64_t framesInThread = (inFile.numFrames/totalThreads);
-    // Vector for the threads so that we can easily join them in the end
-    std::vector<std::thread> threads;
+// Identity moves for the header and every frame the range leaves alone
+static std::vector<byteMove> unselectedMoves(const videoData& inFile,
+const frameRange& range) {
+    std::vector<byteMove> moves;
+    addMove(&moves, 0, 0, rawHeaderBytes(inFile));
+    for (int64_t frame = 0; frame < inFile.numFrames; frame++) {
+        bool selected = frame >= range.begin && frame < range.end &&
+        (frame - range.begin) % range.step == 0;
+        if (!selected) {
+            int64_t offset = rawHeaderBytes(inFile) + frame * inFile.frameSize;
+            addMove(&moves, offset, offset, inFile.frameSize);
+        }
+    }
+    return moves;
+}
 
-    for (int i=0; i < totalThreads; i++) {
-        int64_t chunkStart = i*framesInThread;
-        int64_t chunkEnd;
-        if (i == (totalThreads-1)) {
-            // Last thread handles all remaining frames
-            chunkEnd = inFile.numFrames;
-        } else {
-            chunkEnd = chunkStart + framesInThread;
+int range_pipeline(videoData& inFile, const std::vector<frameOp>& ops,
+const frameRange& range, const char filePath[], const char sourcePath[]) {
+    const int64_t count = rangeCount(range);
+    const int64_t frameSize = inFile.frameSize;
+    if (inFile.compressed || writesCompressed(inFile)) {
+        std::cout << "Frame ranges need raw videos, convert them first."
+        << std::endl;
+        return 1;
+    }
+    if (inFile.interleaved != writesInterleaved(inFile)) {
+        std::cout << "Frame ranges keep the video's layout, convert it first."
+        << std::endl;
+        return 1;
+    }
+    scopedTimer timer("range_pipeline", count * frameSize);
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+
+    // Frames outside the range are copied file to file, or stay where they
+    // are when the op edits its input in place
+    bool inPlace = sameFile(sourcePath, filePath);
+    if (!inPlace &&
+    remapFile(sourcePath, filePath, unselectedMoves(inFile, range)) != 0) {
+        std::cout << "Failed to copy the frames outside the range."
+        << std::endl;
+        return 1;
+    }
+    int source = open(sourcePath, inPlace ? O_RDWR : O_RDONLY);
+    int output = inPlace ? source : open(filePath, O_WRONLY);
+    if (source < 0 || output < 0) {
+        std::cout << "Failed to open the files for the frame range."
+        << std::endl;
+        if (source >= 0) {
+            close(source);
         }
-        // Inspired by https://en.cppreference.com/w/cpp/container/vector/emplace_back
-        threads.emplace_back
-        (scaleChunk, std::ref(inFile),
-        chunkStart, chunkEnd, targetChannel, scaleFactor);
+        return 1;
     }
 
-    // https://stackoverflow.com/questions/15027282/c-for-each-pulling-from-vector-elements
-    for (auto& thread : threads) {
-        thread.join();
+    // Two blocks of the selection are held at a time. A reversed range
+    // reads a block from each end and writes each to the other end, so
+    // editing in place never overwrites a frame that is still to be read
+    const int64_t blockFrames =
+    std::max<int64_t>(1, streamRingBytes / 2 / std::max<int64_t>(1, frameSize));
+    unsigned char* front = reinterpret_cast<unsigned char*>
+    (pooledAlloc(64, 2 * blockFrames * frameSize));
+    unsigned char* back = front + blockFrames * frameSize;
+    int status = 0;
+    ioQueue queue;
+    queue.registerBuffers({{front, 2 * blockFrames * frameSize}});
+    if (!plan.reverseFrames) {
+        for (int64_t k = 0; k < count && status == 0; k += blockFrames) {
+            int64_t last = std::min(count, k + blockFrames);
+            status = transferSelected(queue, source, front, inFile, range, k,
+            last, false);
+            if (status == 0) {
+                processBlock(inFile, front, last - k, plan);
+                status = transferSelected(queue, output, front, inFile, range,
+                k, last, true);
+            }
+        }
     }
-    writeFile(inFile, filePath);
+    for (int64_t k = 0; plan.reverseFrames && k < count - k && status == 0;
+    k += blockFrames) {
+        int64_t middle = count - 2 * k;
+        if (middle <= 2 * blockFrames) {
+            // What is left fits at once and is reversed onto itself
+            status = transferSelected(queue, source, front, inFile, range,
+            k, k + middle, false);
+            if (status == 0) {
+                processBlock(inFile, front, middle, plan);
+                status = transferSelected(queue, output, front, inFile, range,
+                k, k + middle, true);
+            }
+            break;
+        }
+        int64_t backFirst = count - k - blockFrames;
+        status = transferSelected(queue, source, front, inFile, range, k,
+        k + blockFrames, false) | transferSelected(queue, source, back,
+        inFile, range, backFirst, count - k, false);
+        if (status == 0) {
+            processBlock(inFile, front, blockFrames, plan);
+            processBlock(inFile, back, blockFrames, plan);
+            status = transferSelected(queue, output, back, inFile, range, k,
+            k + blockFrames, true) | transferSelected(queue, output, front,
+            inFile, range, backFirst, count - k, true);
+        }
+    }
+    pooledFree(front, 64, 2 * blockFrames * frameSize);
+    if (!inPlace) {
+        close(output);
+    }
+    close(source);
+    if (status != 0) {
+        std::cout << "Failed to move frames inside the range." << std::endl;
+        return 1;
+    }
+    std::cout << "Writing file as " << filePath;
+    return 0;
 }
 
-// SEPIA FUNCTIONS
-void sepia_filter(videoData& inFile,
-const char filePath[]) {
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        // All values are stored as r,r,r,r,...g,g,g,...b,b,b - so channel1 is R
-        int64_t redStart = frame*inFile.frameSize;
-        int64_t greenStart = redStart+(inFile.width*inFile.height);
-        int64_t blueStart = redStart+2*(inFile.width*inFile.height);
-
-        for (int i=0; i < inFile.width*inFile.height; i++) {
-            unsigned char redValue = inFile.fullFrame[redStart+i];
-            unsigned char greenValue = inFile.fullFrame[greenStart+i];
-            unsigned char blueValue = inFile.fullFrame[blueStart+i];
-
-            // All sepia values are calculated according to findings in https://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
-            // This post also motivated the creation of this functionality
-            unsigned char newRed =
-            std::clamp(
-                ((redValue*0.393)+(greenValue*0.769)+(blueValue*0.189)),
-                0.0,
-                255.0);
-
-            unsigned char newGreen =
-            std::clamp(
-                ((redValue*0.349)+(greenValue*0.686)+(blueValue*0.168)),
-                0.0,
-                255.0);
-
-            unsigned char newBlue =
-            std::clamp(
-                ((redValue*0.272)+(greenValue*0.534)+(blueValue*0.131)),
-                0.0,
-                255.0);
-
-            inFile.fullFrame[redStart + i] = newRed;
-            inFile.fullFrame[greenStart + i] = newGreen;
-            inFile.fullFrame[blueStart + i] = newBlue;
+int trim_frames(videoData& inFile, const frameRange& range,
+const char filePath[], const char sourcePath[]) {
+    const int64_t count = rangeCount(range);
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t frameOffset = rawHeaderBytes(inFile);
+    if (inFile.compressed || writesCompressed(inFile)) {
+        std::cout << "trim needs raw videos, convert them first." << std::endl;
+        return 1;
+    }
+    if (inFile.interleaved != writesInterleaved(inFile)) {
+        std::cout << "trim keeps the video's layout, convert it first."
+        << std::endl;
+        return 1;
+    }
+    scopedTimer timer("trim", count * frameSize);
+    int status = 0;
+    int output;
+    if (sameFile(sourcePath, filePath)) {
+        // Every kept frame moves towards the start, never past one that is
+        // still to be read, then the tail is cut off
+        output = open(filePath, O_RDWR);
+        if (output < 0) {
+            std::cout << "Failed to open the file for trimming." << std::endl;
+            return 1;
+        }
+        const int64_t blockFrames = std::max<int64_t>(1,
+        streamRingBytes / std::max<int64_t>(1, frameSize));
+        unsigned char* block = reinterpret_cast<unsigned char*>
+        (pooledAlloc(64, blockFrames * frameSize));
+        ioQueue queue;
+        queue.registerBuffers({{block, blockFrames * frameSize}});
+        frameRange kept = {0, count, 1};
+        for (int64_t k = 0; k < count && status == 0 &&
+        (range.begin != 0 || range.step != 1); k += blockFrames) {
+            int64_t last = std::min(count, k + blockFrames);
+            status = transferSelected(queue, output, block, inFile, range, k,
+            last, false);
+            if (status == 0) {
+                status = transferSelected(queue, output, block, inFile, kept,
+                k, last, true);
+            }
+        }
+        pooledFree(block, 64, blockFrames * frameSize);
+        if (status == 0) {
+            status = ftruncate(output, frameOffset + count * frameSize);
+        }
+    } else {
+        // The kept frames are byte ranges of the input, copied file to file
+        std::vector<byteMove> moves;
+        addMove(&moves, 0, 0, frameOffset);
+        for (int64_t k = 0; k < count; k++) {
+            addMove(&moves, frameOffset + (range.begin + k * range.step) *
+            frameSize, frameOffset + k * frameSize, frameSize);
+        }
+        if (remapFile(sourcePath, filePath, moves) != 0) {
+            std::cout << "Failed to copy the frames in the range." << std::endl;
+            return 1;
+        }
+        output = open(filePath, O_WRONLY);
+        if (output < 0) {
+            std::cout << "Failed to open the file for trimming." << std::endl;
+            return 1;
         }
     }
-    writeFile(inFile, filePath);
+    if (status == 0) {
+        videoData trimmed = inFile;
+        trimmed.numFrames = count;
+        unsigned char header[maxHeaderBytes];
+        status = pwriteAll(output, header, encodeHeader(trimmed, header), 0);
+    }
+    close(output);
+    if (status != 0) {
+        std::cout << "Failed to trim the video." << std::endl;
+        return 1;
+    }
+    std::cout << "Writing file as " << filePath;
+    return 0;
 }
 
-void sepiaChunk(videoData& inFile,
-int64_t chunkStart, int64_t chunkEnd) {
-    for (int64_t frame = chunkStart; frame < chunkEnd; frame++) {
-        // All values are stored as r,r,r,r,...g,g,g,...b,b,b - so channel1 is R
-        int64_t redStart = frame*inFile.frameSize;
-        int64_t greenStart = redStart+(inFile.width*inFile.height);
-        int64_t blueStart = redStart+2*(inFile.width*inFile.height);
+// FRAME DEDUPLICATION
+static bool dedupOn = false;
 
-        for (int i = 0; i < inFile.width * inFile.height; i++) {
-            unsigned char redValue = inFile.fullFrame[redStart+i];
-            unsigned char greenValue = inFile.fullFrame[greenStart+i];
-            unsigned char blueValue = inFile.fullFrame[blueStart+i];
+void setDedup(bool enabled) {
+    dedupOn = enabled;
+}
 
-            // All sepia values are calculated according to findings in https://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
-            // This post also motivated the creation of this functionality
-            unsigned char newRed =
-            std::clamp(
-                ((redValue*0.393)+(greenValue*0.769)+(blueValue*0.189)),
-                0.0,
-                255.0);
+bool dedupEnabled() {
+    return dedupOn;
+}
 
-            unsigned char newGreen =
-            std::clamp(
-                ((redValue*0.349)+(greenValue*0.686)+(blueValue*0.168)),
-                0.0,
-                255.0);
+static uint64_t hashMix(uint64_t lane, uint64_t word) {
+    lane ^= word * 0xC2B2AE3D27D4EB4Full;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * 0x9E3779B97F4A7C15ull;
+}
 
-            unsigned char newBlue =
-            std::clamp(
-                ((redValue*0.272)+(greenValue*0.534)+(blueValue*0.131)),
-                0.0,
-                255.0);
+void streamHash::block(const unsigned char* data) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t word;
+        std::memcpy(&word, data + i * 8, 8);
+        lanes[i] = hashMix(lanes[i], word);
+    }
+}
 
-            inFile.fullFrame[redStart + i] = newRed;
-            inFile.fullFrame[greenStart + i] = newGreen;
-            inFile.fullFrame[blueStart + i] = newBlue;
+void streamHash::update(const unsigned char* data, int64_t size) {
+    length += size;
+    if (pendingBytes > 0) {
+        int64_t take = std::min<int64_t>(32 - pendingBytes, size);
+        std::memcpy(pending + pendingBytes, data, take);
+        pendingBytes += take;
+        data += take;
+        size -= take;
+        if (pendingBytes < 32) {
+            return;
         }
+        block(pending);
+        pendingBytes = 0;
     }
+    for (; size >= 32; size -= 32, data += 32) {
+        block(data);
+    }
+    std::memcpy(pending, data, size);
+    pendingBytes = size;
 }
 
-void speed_sepia(videoData& inFile,
-const char filePath[]) {
-    // Hardware_concurrency(); gets the number of threads we can max run at once
-    int totalThreads = std::thread::hardware_concurrency();
-    // If we can't split the frames, run regular function to avoid overhead
-    if (inFile.numFrames < totalThreads) {
-        sepia_filter(inFile, filePath);
-        return;
+uint64_t streamHash::finish() {
+    std::memset(pending + pendingBytes, 0, 32 - pendingBytes);
+    block(pending);
+    uint64_t result = length;
+    for (int i = 0; i < 4; i++) {
+        result = hashMix(result, lanes[i]);
     }
+    result ^= result >> 29;
+    result *= 0xBF58476D1CE4E5B9ull;
+    return result ^ (result >> 32);
+}
 
-    int64_t framesInThread = (inFile.numFrames/totalThreads);
-    // Vector for the threads so that we can easily join them in the end
-    std::vector<std::thread> threads;
+uint64_t frameHash(const unsigned char* frame, int64_t length) {
+    streamHash hash;
+    hash.update(frame, length);
+    return hash.finish();
+}
 
-    for (int i=0; i < totalThreads; i++) {
-        int64_t chunkStart = i*framesInThread;
-        int64_t chunkEnd;
-        if (i == (totalThreads-1)) {
-             // Last thread handles all remaining frames
-            chunkEnd = inFile.numFrames;
-        } else {
-            chunkEnd = chunkStart + framesInThread;
+int64_t findDuplicates(const videoData& inFile,
+std::vector<int64_t>* firstCopy) {
+    const int64_t numFrames = inFile.numFrames;
+    const int64_t frameSize = inFile.frameSize;
+    scopedTimer timer("dedup", numFrames * frameSize);
+    std::vector<uint64_t> hashes(numFrames);
+    parallelFor(numFrames, frameSize, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            hashes[i] = frameHash(inFile.fullFrame + i * frameSize, frameSize);
         }
-        // Inspired by https://en.cppreference.com/w/cpp/container/vector/emplace_back
-        threads.emplace_back
-        (sepiaChunk, std::ref(inFile), chunkStart, chunkEnd);
-    }
+    });
 
-    // https://stackoverflow.com/questions/15027282/c-for-each-pulling-from-vector-elements
-    for (auto& thread : threads) {
-        thread.join();
+    firstCopy->resize(numFrames);
+    std::unordered_map<uint64_t, int64_t> seen;
+    seen.reserve(numFrames);
+    for (int64_t i = 0; i < numFrames; i++) {
+        (*firstCopy)[i] = seen.emplace(hashes[i], i).first->second;
     }
-    writeFile(inFile, filePath);
+    // Equal hashes are only candidates, the bytes decide. A collision
+    // leaves the frame to be processed on its own
+    std::atomic<int64_t> unique{0};
+    parallelFor(numFrames, frameSize, [&](int64_t begin, int64_t end) {
+        int64_t found = 0;
+        for (int64_t i = begin; i < end; i++) {
+            int64_t copy = (*firstCopy)[i];
+            if (copy != i && std::memcmp(inFile.fullFrame + i * frameSize,
+            inFile.fullFrame + copy * frameSize, frameSize) != 0) {
+                (*firstCopy)[i] = i;
+            }
+            found += (*firstCopy)[i] == i;
+        }
+        unique += found;
+    });
+    return unique;
 }
 
-void memory_sepia(videoData& inFile,
-const char filePath[], const char sourcePath[]) {
-    unsigned char* tempFrame = new unsigned char[inFile.frameSize];
-
-    // Opening this file once to reduce overhead of non-stop calling open/close
-    std::fstream binFile;
-    // Adapted from https://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
-    binFile.open(sourcePath, std::ios::binary | std::ios::in);
-
-    std::fstream outFile;
-    outFile.open(filePath, std::ios::binary | std::ios::out);
-
-    int metadataSize = sizeof(int64_t) +
-    sizeof(unsigned char) + sizeof(unsigned char) + sizeof(unsigned char);
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.numFrames), sizeof(int64_t));
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.channels), sizeof(unsigned char));
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.height), sizeof(unsigned char));
-
-    outFile.write(reinterpret_cast<const char*>
-    (&inFile.width), sizeof(unsigned char));
+int dedup_pipeline(videoData& inFile, const std::vector<frameOp>& ops,
+const char filePath[]) {
+    scopedTimer timer("dedup_pipeline", inFile.frameSize * inFile.numFrames);
+    const int64_t frameSize = inFile.frameSize;
+    const int64_t planeSize = inFile.width * inFile.height;
+    pipelinePlan plan = compilePipeline(ops, inFile.channels);
+    std::vector<int64_t> firstCopy;
+    findDuplicates(inFile, &firstCopy);
+    std::vector<int64_t> unique;
+    std::vector<int64_t> copies;
+    for (int64_t i = 0; i < inFile.numFrames; i++) {
+        (firstCopy[i] == i ? unique : copies).push_back(i);
+    }
 
-    for (int64_t frame=0; frame < inFile.numFrames; frame++) {
-        int64_t framePos = metadataSize + (inFile.frameSize*frame);
-        binFile.seekg(framePos);  // Seek to the current frame
-        binFile.read(reinterpret_cast<char*>(tempFrame), inFile.frameSize);
-
-        // All values are stored as r,r,r,r,...g,g,g,...b,b,b - so channel1 is R
-        int64_t redStart = 0;
-        // channel2 is G
-        int64_t greenStart = redStart+(inFile.width*inFile.height);
-        // channel3 is B
-        int64_t blueStart = redStart+2*(inFile.width*inFile.height);
-
-        for (int i = 0; i < inFile.width * inFile.height; i++) {
-            unsigned char redValue = tempFrame[redStart+i];
-            unsigned char greenValue = tempFrame[greenStart+i];
-            unsigned char blueValue = tempFrame[blueStart+i];
-
-            // All sepia values are calculated according to findings in https://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
-            // This post also motivated the creation of this functionality
-            unsigned char newRed =
-            std::clamp(
-                ((redValue*0.393)+(greenValue*0.769)+(blueValue*0.189)),
-                0.0,
-                255.0);
-
-            unsigned char newGreen =
-            std::clamp(
-                ((redValue*0.349)+(greenValue*0.686)+(blueValue*0.168)),
-                0.0,
-                255.0);
-
-            unsigned char newBlue =
-            std::clamp(
-                ((redValue*0.272)+(greenValue*0.534)+(blueValue*0.131)),
-                0.0,
-                255.0);
-
-            tempFrame[redStart + i] = newRed;
-            tempFrame[greenStart + i] = newGreen;
-            tempFrame[blueStart + i] = newBlue;
-        }
-
-        // Seek back to where the frame would be located, for output
-        outFile.seekp(framePos);
-        outFile.write(reinterpret_cast<char*>(tempFrame), inFile.frameSize);
-    }
-
-    delete[] tempFrame;
-    binFile.close();
-    outFile.close();
+    // Kernels only see the first copy of every frame, the other copies
+    // then take the processed frame, which sits earlier in the video
+    parallelFor(unique.size() * planeSize, inFile.channels,
+    [&](int64_t begin, int64_t end) {
+        forEachSpan(begin, end, planeSize,
+        [&](int64_t k, int64_t first, int64_t last) {
+            pipelineSpan(inFile, inFile.fullFrame + unique[k] * frameSize,
+            first, last, plan);
+        });
+    });
+    parallelFor(copies.size(), frameSize, [&](int64_t begin, int64_t end) {
+        for (int64_t k = begin; k < end; k++) {
+            std::memcpy(inFile.fullFrame + copies[k] * frameSize,
+            inFile.fullFrame + firstCopy[copies[k]] * frameSize, frameSize);
+        }
+    });
+    if (plan.reverseFrames) {
+        parallelFor(inFile.numFrames / 2, 2 * frameSize,
+        [&](int64_t begin, int64_t end) {
+            reverseChunk(inFile, begin, end);
+        });
+    }
+    std::cout << "Processed " << unique.size() << " unique frames of "
+    << inFile.numFrames << std::endl;
+    timer.stop();
+    writeFile(inFile, filePath);
+    return 0;
 }
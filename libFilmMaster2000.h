@@ -4,72 +4,499 @@
 
 // For int64_t instead of long
 #include <cstdint>
+// For the per-frame kernels handed to the streaming engine
+#include <functional>
+// For the operation lists used by the pipeline
+#include <utility>
+#include <vector>
+// For the frame text show_video builds
+#include <string>
 
 // Ordering based on size, to avoid padding out memory assigned in the struct
 struct videoData{
     unsigned char* fullFrame = 0;
+    // Set when fullFrame points into an mmap of a file instead of the heap
+    unsigned char* mappedBase = 0;
+    int64_t mappedLength = 0;
     int64_t numFrames;
-    int frameSize;
-    unsigned char channels;
-    unsigned char height;
-    unsigned char width;
+    // In bytes, samples above 8 bits take two
+    int64_t frameSize;
+    int64_t channels;
+    int64_t height;
+    int64_t width;
+    // The mapping is the output file at mappedPath, edits land in it
+    // directly and writeFile only has to refresh the header
+    const char* mappedPath = 0;
+    bool mappedOutput = false;
+    // The file is the compressed container, frames are decoded on loading
+    bool compressed = false;
+    // The raw file keeps each pixel's channels together, frames are made
+    // planar on loading
+    bool interleaved = false;
+    // The raw file has the wide header, which the output keeps
+    bool wide = false;
+    // 8, or 9 to 16 for samples stored in two bytes, little endian
+    unsigned char bitDepth = 8;
 };
 
+// numFrames, channels, height, width
+const int64_t headerBytes = sizeof(int64_t) + 3 * sizeof(unsigned char);
+
+// The wide header starts with wideMagic where the legacy one has numFrames,
+// then come numFrames, 32 bit channels, height and width, the version and
+// the bits per sample. It is only written for videos read with it
+const int64_t wideMagic = -0x3144574D;
+const unsigned char wideVersion = 1;
+const int64_t wideHeaderBytes =
+2 * sizeof(int64_t) + 3 * sizeof(uint32_t) + 2;
+// Enough for any header, the compressed container's included
+const int64_t maxHeaderBytes = wideHeaderBytes;
+
+// The compressed container starts with compressedMagic where the raw
+// format has numFrames, a negative count no raw video can have. Then come
+// numFrames, channels, height, width, the version and an index of
+// numFrames + 1 file offsets, frame i being the record between entries i
+// and i + 1. A record is a mode byte, 0 for a raw frame and 1 for a
+// delta + run length coded one, followed by the frame. Mode 2 is followed
+// by the index of an earlier frame with the same bytes, stored in full.
+// Version 2 added mode 2, version 1 files are still read
+const int64_t compressedMagic = -0x315A4D46;
+const unsigned char compressedVersion = 2;
+const int64_t compressedHeaderBytes = 2 * sizeof(int64_t) + 4;
+const int64_t referenceRecordBytes = 1 + sizeof(int64_t);
+
+// HEADERS
+// Where the frames of the raw file start
+int64_t rawHeaderBytes(const videoData& video);
+
+// Writes the raw header of the video, returns its length
+int64_t encodeHeader(const videoData& video, unsigned char* header);
+
+// Fills the video from a legacy, wide or compressed header. Returns 1 when
+// length is too short, the version is unknown or the sizes are impossible
+int decodeHeader(const unsigned char* header, int64_t length,
+videoData* video);
+
+int64_t sampleBytes(const videoData& video);
+
+// Largest sample value the bit depth allows
+int maxSample(const videoData& video);
+
+// INSTRUMENTATION
+// A timer measures from construction to destruction and files the time
+// under its stage name, bytes is how much data the stage moved. While
+// neither --stats nor --trace is on a timer costs one branch
+class scopedTimer {
+ public:
+    explicit scopedTimer(const char* name, int64_t bytes = 0);
+    ~scopedTimer();
+    void addBytes(int64_t bytes) { stageBytes += bytes; }
+    // Ends the stage early, so a following writeFile is not counted twice
+    void stop();
+
+ private:
+    const char* stage;
+    int64_t stageBytes;
+    int64_t start;
+    bool stopped = false;
+};
+
+// tracePath may be null, stats and trace are written by finishStats()
+void enableStats(bool printStats, const char* tracePath);
+
+bool statsEnabled();
+
+// Big buffers go through these so --stats can report the peak
+void* trackedAlloc(int64_t alignment, int64_t bytes);
+
+void trackedFree(void* buffer, int64_t bytes);
+
+// Prints the --stats JSON to stderr and writes the --trace file
+void finishStats();
+
+// BUFFER POOL
+// With the pool on, freed frame buffers are kept for the next request of
+// the same size and alignment, so jobs of one geometry stop paying for a
+// fresh allocation each. Up to idleBytes stay kept, the oldest go first
+void enableBufferPool(int64_t idleBytes);
+
+void* pooledAlloc(int64_t alignment, int64_t bytes);
+
+void pooledFree(void* buffer, int64_t alignment, int64_t bytes);
+
+// Number of pooledAlloc calls served from a kept buffer
+int64_t bufferPoolReuses();
+
+// How frames get from and to disk in the default and -S modes
+enum ioBackend {
+    IO_STREAM,
+    IO_MMAP
+};
+
+// How the -M streams, block reversal and frame ranges wait on the disk.
+// ASYNC_SYNC has one pread or pwrite at a time, ASYNC_URING keeps up to the
+// queue depth of requests in flight through io_uring
+enum asyncIO {
+    ASYNC_SYNC,
+    ASYNC_URING
+};
+
+// SIMD KERNELS
+// Instruction sets the kernels are compiled for, picked at runtime via cpuid
+enum simdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+// scale_channel as fixed point: whole + fraction/65536, anything above
+// satBelow saturates to 255. Not exact means the fixed point form does not
+// reproduce the float result for every byte, so the float path is used
+struct scaleParams {
+    float factor;
+    uint16_t whole;
+    uint16_t fraction;
+    unsigned char satBelow;
+    bool exact;
+};
+
+// color_matrix in Q12 fixed point: out[o] = sum(coefficients[o*size+k] *
+// in[k]) >> 12, saturated to 0-255. Up to maxSimdMatrix channels stay in
+// vector registers, bigger matrices use the scalar kernel
+const int matrixShift = 12;
+const int maxSimdMatrix = 8;
+
+struct matrixParams {
+    int size = 0;
+    std::vector<int16_t> coefficients;
+};
+
+// Separable blurs, with edges repeating the outermost pixels. box sums
+// the 2*radius+1 pixels along each row with a running sum, then the rows
+// down each column the same way, and divides. gaussian convolves rows and
+// then columns with Q14 weights, keeping 7 fraction bits in between
+const int blurShift = 14;
+const int maxBlurRadius = 127;
+
+struct blurParams {
+    bool gaussian = false;
+    int radius = 0;
+    // 2*radius+1 taps summing to 1 << blurShift, gaussian only
+    std::vector<int16_t> weights;
+    // 1/(2*radius+1)^2, box only
+    float boxScale = 0;
+};
+
+// Both axes of a resize, with Q14 weights and the 7 fraction bits between
+// the passes of the blurs. area averages the source pixels an output pixel
+// covers, bilinear blends the two nearest ones, which is cheaper but skips
+// pixels when shrinking by more than half. Each side can grow up to
+// maxResizeSide and shrink at most maxResizeShrink times
+const int64_t maxResizeSide = 65535;
+const int maxResizeShrink = 64;
+
+// Output pixel i takes taps source pixels from first[i]. Across a row the
+// weights come in groups of 4 taps, each group holding those taps of every
+// output pixel in turn, so a vector of outputs loads its weights at once.
+// Down the columns each output row has its taps next to each other
+struct resizeAxis {
+    int taps = 0;
+    std::vector<int32_t> first;
+    std::vector<int16_t> weights;
+};
+
+struct resizeParams {
+    int64_t width = 0;
+    int64_t height = 0;
+    bool bilinear = false;
+    // across is a multiple of 4 taps long
+    resizeAxis across;
+    resizeAxis down;
+};
+
+// Temporal filters average each pixel over a window of frames around the
+// current one, the first and last frames repeating past the ends. The
+// window moves with a running sum per pixel, which stays in 16 bits for
+// up to maxTemporalWindow frames. threshold keeps the average only where
+// it is that close to the pixel, so moving edges are not smeared
+const int maxTemporalWindow = 255;
+
+struct temporalParams {
+    int window = 1;
+    // 255 averages every pixel
+    int threshold = 255;
+    // 1/window
+    float scale = 1;
+};
+
+// Histogram counts are 32 bit, longer runs are counted in pieces
+const int64_t maxHistogramRun = int64_t(1) << 30;
+
+struct pixelKernels {
+    const char* name;
+    void (*clip)(unsigned char* data, int64_t length,
+    unsigned char minimum, unsigned char maximum);
+    void (*scale)(unsigned char* data, int64_t length,
+    const scaleParams& params);
+    void (*swap)(unsigned char* first, unsigned char* second, int64_t length);
+    void (*lookup)(unsigned char* data, int64_t length,
+    const unsigned char* table);
+    void (*matrix)(unsigned char* const* planes, int64_t length,
+    const matrixParams& params);
+    // Pixels [first, last) of one frame between the planar and packed forms
+    void (*interleave)(const unsigned char* planar, unsigned char* packed,
+    int64_t planeSize, int channels, int64_t first, int64_t last);
+    void (*deinterleave)(const unsigned char* packed, unsigned char* planar,
+    int64_t planeSize, int channels, int64_t first, int64_t last);
+    // One row of a blur or resize each. gaussianRow filters a row padded
+    // with radius repeated pixels on either side, weightedColumns combines
+    // taps filtered rows into an output row, boxColumns rounds the running
+    // column sums to a row and moves them down by one. resizeRow filters a
+    // row padded with axis.taps repeated pixels at the end to width pixels
+    void (*gaussianRow)(const unsigned char* padded, uint16_t* filtered,
+    int64_t width, const blurParams& params);
+    void (*weightedColumns)(const uint16_t* const* rows,
+    const int16_t* weights, int taps, unsigned char* out, int64_t width);
+    void (*boxColumns)(uint32_t* sums, const uint16_t* add,
+    const uint16_t* remove, unsigned char* out, int64_t width, float scale);
+    void (*resizeRow)(const unsigned char* padded, uint16_t* filtered,
+    int64_t width, const resizeAxis& axis);
+    // Writes the rounded mean of sums, or current where it is further off
+    // than the threshold, then moves the sums on by one frame
+    void (*temporalMean)(uint16_t* sums, const unsigned char* add,
+    const unsigned char* remove, const unsigned char* current,
+    unsigned char* out, int64_t length, const temporalParams& params);
+    // Adds how often each byte value occurs to counts[256], length is at
+    // most maxHistogramRun
+    void (*histogram)(const unsigned char* data, int64_t length,
+    uint32_t* counts);
+};
+
+// The same ops on samples of 9 to 16 bits, saturating at maximum. Scaling
+// is done in float, the matrix keeps the Q12 coefficients of the 8 bit one
+struct pixelKernels16 {
+    const char* name;
+    void (*clip)(uint16_t* data, int64_t length, uint16_t minimum,
+    uint16_t maximum);
+    void (*scale)(uint16_t* data, int64_t length, float scaleFactor,
+    uint16_t maximum);
+    void (*matrix)(uint16_t* const* planes, int64_t length,
+    const matrixParams& params, uint16_t maximum);
+};
+
+scaleParams makeScaleParams(float scaleFactor);
+
+simdLevel detectSimdLevel();
+
+// Caps the level the active kernels are picked from, so the narrower ones
+// can be checked on a machine that has wider ones. Higher than the CPU
+// supports stays at what it supports
+void setSimdLevel(simdLevel level);
+
+const pixelKernels& kernelsFor(simdLevel level);
+
+const pixelKernels& activeKernels();
+
+const pixelKernels16& kernels16For(simdLevel level);
+
+const pixelKernels16& activeKernels16();
+
 // IO
 int loadFile(videoData* videoPath, char* filePath);
 
 int loadFrames(videoData* videoPath, char* filePath);
 
+void setIOBackend(ioBackend backend);
+
+ioBackend getIOBackend();
+
+int openFrames(videoData* videoPath, char* filePath, const char* outputPath);
+
+void releaseFrames(videoData* videoPath);
+
+// FRAME CACHE
+// Keeps up to capacityBytes of whole input files in memory, least recently
+// used first out. loadFile reads a file into it, loadFrames and the -M
+// streams then copy from memory as long as the file is unchanged on disk
+void enableFrameCache(int64_t capacityBytes);
+
+bool frameCacheEnabled();
+
+void frameCacheCounts(int64_t* hits, int64_t* misses, int64_t* bytes);
+
+// COMPRESSED CONTAINER
+// What writeFile and the streams produce: the input's own format, or
+// always one of the two
+enum outputFormat {
+    FORMAT_AUTO,
+    FORMAT_RAW,
+    FORMAT_COMPRESSED
+};
+
+void setOutputFormat(outputFormat format);
+
+bool writesCompressed(const videoData& inputVideo);
+
+int64_t maxRecordBytes(int64_t frameSize);
+
+// File offset of the first record
+int64_t indexOffset(int64_t numFrames);
+
+// Returns the record length, at most maxRecordBytes(frameSize)
+int64_t compressFrame(const videoData& inputVideo, const unsigned char* frame,
+unsigned char* record);
+
+// The frame a mode 2 record points to, -1 for any other record
+int64_t recordReference(const unsigned char* record, int64_t length);
+
+// Returns 1 when the record is damaged or a reference
+int decompressFrame(const videoData& inputVideo, const unsigned char* record,
+int64_t length, unsigned char* frame);
+
+int readFrameIndex(int fd, int64_t numFrames, std::vector<int64_t>* index);
+
+int writeCompressedHeader(int fd, const videoData& inputVideo,
+const std::vector<int64_t>& index);
+
+// Rewrites the video in the format setOutputFormat picked
+int convert_video(videoData& inputVideo, const char* outputPath,
+const char* fileSourcePath);
+
+// FRAME LAYOUT
+// A raw file stores frames planar, one channel after the other, or
+// interleaved, every pixel's channels next to each other. Frames in memory
+// are always planar, the conversion happens while they are read or written
+enum frameLayout {
+    LAYOUT_AUTO,
+    LAYOUT_PLANAR,
+    LAYOUT_INTERLEAVED
+};
+
+// The header does not say which layout the input has, so loadFile takes it
+// from here. The output keeps the input's layout when left on auto
+void setFrameLayouts(frameLayout input, frameLayout output);
+
+bool writesInterleaved(const videoData& inputVideo);
+
+// count whole frames from one layout into the other, spread over the pool
+void interleaveFrames(const videoData& inputVideo, const unsigned char* planar,
+unsigned char* packed, int64_t count);
+
+void deinterleaveFrames(const videoData& inputVideo,
+const unsigned char* packed, unsigned char* planar, int64_t count);
+
+// One frame from one layout into the other, for 8 or 16 bit samples
+void packFrame(const videoData& inputVideo, const unsigned char* planar,
+unsigned char* packed);
+
+void unpackFrame(const videoData& inputVideo, const unsigned char* packed,
+unsigned char* planar);
+
+// THREAD POOL
+// Parallel work is cut into tasks of roughly this many bytes so a few huge
+// frames spread across workers as well as many small ones
+const int64_t taskBytes = 256 * 1024;
+
+// Must be called before the first parallel op, 0 threads means one per core
+void configureThreadPool(int threads, bool pinThreads);
+
+int poolThreadCount();
+
+void submitTask(std::function<void()> task);
+
+void parallelFor(int64_t units, int64_t bytesPerUnit,
+const std::function<void(int64_t begin, int64_t end)>& task);
+
+// STREAMING ENGINE
+// Upper bound on the frame ring the -M mode keeps in memory
+const int64_t streamRingBytes = 64 * 1024 * 1024;
+
+// Work done on one frame in place, index is its position in the output
+typedef std::function<void(unsigned char* frame, int64_t index)> frameKernel;
+
+int preadAll(int fd, unsigned char* buffer, int64_t length, int64_t offset);
+
+int pwriteAll(int fd, const unsigned char* buffer, int64_t length,
+int64_t offset);
+
+const int defaultQueueDepth = 32;
+
+// Kernels without io_uring, or that refuse it, get pread and pwrite
+void setAsyncIO(asyncIO mode, int queueDepth);
+
+// With outputVideo the output frames get its geometry, the kernel leaves
+// each one at the start of the slot it was handed the input frame in.
+// Returns 1 when the output is the source file or a read or write fails
+int streamFrames(videoData& inputVideo, const char* sourcePath,
+const char* outputPath, bool reverseOrder, const frameKernel& kernel,
+const videoData* outputVideo = nullptr);
+
 // SUPPORT FUNCTIONS
 char getDisplayChar(int pixelValue);
 
-void printFrame(videoData targetVideo, int offset);
+void printFrame(videoData targetVideo, int64_t offset);
 
 void writeFile(videoData& outputVideo, const char outputPath[]);
 
 // REVERSE
 void reverse(videoData& inputVideo, const char* outputPath);
 
-void memory_reverse(videoData& inputVideo,
+int memory_reverse(videoData& inputVideo,
 const char* outputPath, const char* fileSourcePath);
 
 void reverseChunk(videoData& inputVideo, int64_t start, int64_t end);
 
 void speed_reverse(videoData& inputVideo, const char* outputPath);
 
+// BLOCK REVERSE
+// Memory the block reverse may use, split between its two block buffers
+const int64_t defaultBlockBytes = 16 * 1024 * 1024;
+// O_DIRECT transfers have to start and end on this boundary
+const int64_t directAlignment = 4096;
+
+void setBlockIO(int64_t blockBytes, bool directIO);
+
+bool sameFile(const char* firstPath, const char* secondPath);
+
+// Moves blocks of frames from both ends of the file with pread/pwrite,
+// reverses inside the source itself when outputPath is the same file
+int block_reverse(videoData& inputVideo, const char* outputPath,
+const char* fileSourcePath);
+
 // SWAP
-void swap_channel(videoData& inputVideo, unsigned char Channel1,
-unsigned char Channel2, const char outputPath[]);
+void swap_channel(videoData& inputVideo, int Channel1, int Channel2,
+const char outputPath[]);
 
-void memory_swap(videoData& inputVideo, unsigned char Channel1,
-unsigned char Channel2, const char outputPath[], const char fileSourcePath[]);
+int memory_swap(videoData& inputVideo, int Channel1, int Channel2,
+const char outputPath[], const char fileSourcePath[]);
 
 void swapChunk(videoData& inputVideo, int64_t chunkStart,
-int64_t chunkEnd, unsigned char Channel1, unsigned char Channel2);
+int64_t chunkEnd, int Channel1, int Channel2);
 
-void speed_swap(videoData& inputVideo, unsigned char Channel1,
-unsigned char Channel2, const char outputPath[]);
+void speed_swap(videoData& inputVideo, int Channel1, int Channel2,
+const char outputPath[]);
 
 // CLIP
+// minimum and maximum go up to maxSample() of the video
 void clip_channel(videoData& inputVideo, int targetChannel,
-unsigned char minimum, unsigned char maximum, const char outputPath[]);
+int minimum, int maximum, const char outputPath[]);
 
-void memory_clip(videoData& inputVideo, int targetChannel,
-unsigned char minimum, unsigned char maximum, const char outputPath[],
+int memory_clip(videoData& inputVideo, int targetChannel,
+int minimum, int maximum, const char outputPath[],
 const char fileSourcePath[]);
 
 void clipChunk(videoData& inputVideo, int64_t chunkStart,
-int64_t chunkEnd, int targetChannel, unsigned char minimum,
-unsigned char maximum);
+int64_t chunkEnd, int targetChannel, int minimum, int maximum);
 
 void speed_clip(videoData& inputVideo, int targetChannel,
-unsigned char minimum, unsigned char maximum, const char outputPath[]);
+int minimum, int maximum, const char outputPath[]);
 
 // SCALE
 void scale_channel(videoData& inputVideo, int targetChannel,
 float scaleFactor, const char outputPath[]);
 
-void memory_scale(videoData& inputVideo, int targetChannel,
+int memory_scale(videoData& inputVideo, int targetChannel,
 float scaleFactor, const char outputPath[], const char fileSourcePath[]);
 
 void scaleChunk(videoData& inputVideo, int64_t chunkStart,
@@ -84,7 +511,299 @@ void sepiaChunk(videoData& inputVideo, int64_t chunkStart, int64_t chunkEnd);
 
 void speed_sepia(videoData& inputVideo, const char* outputPath);
 
-void memory_sepia(videoData& inputVideo, const char* outputPath,
+int memory_sepia(videoData& inputVideo, const char* outputPath,
 const char* fileSourcePath);
 
+// BLUR
+// radius from 1 to maxBlurRadius, sigma up to maxBlurRadius / 3
+blurParams makeBoxBlur(int radius);
+
+blurParams makeGaussianBlur(float sigma);
+
+void blur_filter(videoData& inputVideo, const blurParams& params,
+const char outputPath[]);
+
+void blurChunk(videoData& inputVideo, int64_t chunkStart, int64_t chunkEnd,
+const blurParams& params);
+
+void speed_blur(videoData& inputVideo, const blurParams& params,
+const char outputPath[]);
+
+int memory_blur(videoData& inputVideo, const blurParams& params,
+const char outputPath[], const char fileSourcePath[]);
+
+// RESIZE
+// width and height from 1 to maxResizeSide, the caller checks the limits.
+// Returns 1 when either the input or the output has an empty side
+int makeResize(const videoData& inputVideo, int64_t width, int64_t height,
+bool bilinear, resizeParams* params);
+
+// The output goes to a new file, never the input's
+void resize_video(videoData& inputVideo, const resizeParams& params,
+const char outputPath[]);
+
+// resized holds the output frames, those from chunkStart to chunkEnd are
+// filled
+void resizeChunk(videoData& inputVideo, unsigned char* resized,
+int64_t chunkStart, int64_t chunkEnd, const resizeParams& params);
+
+void speed_resize(videoData& inputVideo, const resizeParams& params,
+const char outputPath[]);
+
+int memory_resize(videoData& inputVideo, const resizeParams& params,
+const char outputPath[], const char fileSourcePath[]);
+
+// TEMPORAL
+// window from 1 to maxTemporalWindow, threshold from 0 to 255
+temporalParams makeTemporal(int window, int threshold);
+
+void temporal_filter(videoData& inputVideo, const temporalParams& params,
+const char outputPath[]);
+
+// Bytes chunkStart to chunkEnd of every frame, the window runs over all
+// the frames
+void temporalChunk(videoData& inputVideo, int64_t chunkStart,
+int64_t chunkEnd, const temporalParams& params);
+
+void speed_temporal(videoData& inputVideo, const temporalParams& params,
+const char outputPath[]);
+
+// Needs a different output file, only window + 1 frames stay in memory
+int memory_temporal(videoData& inputVideo, const temporalParams& params,
+const char outputPath[], const char fileSourcePath[]);
+
+// PIPELINE
+// Operations that can be chained on the command line and run in one pass
+enum opCode {
+    OP_REVERSE,
+    OP_SWAP,
+    OP_CLIP,
+    OP_SCALE,
+    OP_GAMMA,
+    OP_LEVELS,
+    OP_CURVES,
+    OP_MATRIX
+};
+
+struct frameOp {
+    opCode code;
+    int channel = 0;
+    int channel2 = 0;
+    unsigned char minimum = 0;
+    unsigned char maximum = 255;
+    float scaleFactor = 1.0f;
+    scaleParams scale = {};
+    float gamma = 1.0f;
+    // levels maps [minimum, maximum] onto [outMinimum, outMaximum]
+    unsigned char outMinimum = 0;
+    unsigned char outMaximum = 255;
+    // curves control points as (input, output), sorted by input
+    std::vector<std::pair<int, int>> curvePoints;
+    // color_matrix coefficients, row major over the first N channels
+    std::vector<float> coefficients;
+};
+
+// What one plane goes through in a pass: nothing, a single dedicated
+// kernel, or one lookup table that every point op on it was folded into
+struct planeProgram {
+    std::vector<frameOp> ops;
+    bool useTable = false;
+    unsigned char table[256];
+};
+
+// Point ops per plane, then optionally a matrix mixing the planes listed
+// in matrixPlanes (logical channel order)
+struct pipelineStage {
+    std::vector<planeProgram> planes;
+    bool hasMatrix = false;
+    matrixParams matrix;
+    std::vector<int> matrixPlanes;
+};
+
+// Swaps are folded into one final plane permutation, point ops are grouped
+// by the plane they end up touching so each plane is walked once per stage
+struct pipelinePlan {
+    bool reverseFrames = false;
+    std::vector<pipelineStage> stages;
+    std::vector<std::pair<int, int>> planeSwaps;
+};
+
+// COLOUR MATRIX
+matrixParams makeMatrixParams(const frameOp& op);
+
+frameOp makeSepiaOp();
+
+// LOOKUP TABLES
+void pointOpTable(const frameOp& op, unsigned char table[256]);
+
+void composeTable(unsigned char table[256], const unsigned char next[256]);
+
+pipelinePlan compilePipeline(const std::vector<frameOp>& ops, int channels);
+
+void pipelineFrame(videoData& inputVideo, unsigned char* frame,
+const pipelinePlan& plan);
+
+void pipelineSpan(videoData& inputVideo, unsigned char* frame,
+int64_t first, int64_t last, const pipelinePlan& plan);
+
+void pipelineChunk(videoData& inputVideo, int64_t chunkStart,
+int64_t chunkEnd, const pipelinePlan& plan);
+
+void run_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const char outputPath[]);
+
+int memory_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const char outputPath[], const char fileSourcePath[]);
+
+void speed_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const char outputPath[]);
+
+// STATS
+// One histogram per channel over the whole video, and with perFrame the
+// min, max and sum of every plane. Min, max and mean all follow from the
+// counts, so a single pass over the frames fills everything
+struct planeSummary {
+    unsigned char minimum = 255;
+    unsigned char maximum = 0;
+    uint64_t sum = 0;
+    uint64_t count = 0;
+};
+
+struct videoStats {
+    int64_t channels = 0;
+    // 256 bins per channel
+    std::vector<uint64_t> histogram;
+    bool perFrame = false;
+    // channels planes per frame, in file order
+    std::vector<planeSummary> planes;
+};
+
+videoStats makeStats(const videoData& inputVideo, bool perFrame);
+
+// Frames chunkStart to chunkEnd of the loaded video, on the calling thread
+void statsChunk(videoData& inputVideo, int64_t chunkStart, int64_t chunkEnd,
+videoStats* stats);
+
+void stats_video(videoData& inputVideo, videoStats* stats);
+
+// Every task counts into histograms of its own and merges them once
+void speed_stats(videoData& inputVideo, videoStats* stats);
+
+// Reads the frames in batches, the next batch while the pool counts one
+int memory_stats(videoData& inputVideo, const char fileSourcePath[],
+videoStats* stats);
+
+// The stats as JSON
+int writeStats(const videoData& inputVideo, const videoStats& stats,
+const char outputPath[]);
+
+// levels for every channel, from the values clipPercent of its pixels are
+// below and above onto the full range. Flat channels are left alone
+std::vector<frameOp> autoLevelsOps(const videoStats& stats,
+float clipPercent);
+
+// REMAP ENGINE
+// Output bytes [output, output + length) are a copy of source bytes
+// [source, source + length)
+struct byteMove {
+    int64_t source;
+    int64_t output;
+    int64_t length;
+};
+
+// Below this average move size one copy_file_range call per move costs
+// more than gathering the moves into writev calls over a mapping
+const int64_t remapMinCopy = 64 * 1024;
+
+// True when the plan only reorders frames and planes
+bool planIsRemap(const pipelinePlan& plan);
+
+std::vector<byteMove> remapMoves(const videoData& inputVideo,
+const pipelinePlan& plan);
+
+int remapFile(const char* sourcePath, const char* outputPath,
+const std::vector<byteMove>& moves);
+
+// Returns 1 when the ops change pixel values or the files can not be
+// remapped, the regular path then has to produce the output
+int remap_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const char outputPath[], const char fileSourcePath[]);
+
+// FRAME RANGES
+// Frames begin, begin + step, ... up to but not including end. Only these
+// are read, processed and written, the other frames of the output are a
+// file to file copy of the input, or are left alone when editing in place
+struct frameRange {
+    int64_t begin;
+    int64_t end;
+    int64_t step;
+};
+
+int64_t rangeCount(const frameRange& range);
+
+int range_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const frameRange& range, const char outputPath[], const char fileSourcePath[]);
+
+// Keeps only the frames in the range, in place when both paths are the same
+int trim_frames(videoData& inputVideo, const frameRange& range,
+const char outputPath[], const char fileSourcePath[]);
+
+// DISPLAY
+// How show_video draws a frame. With columns and rows set, each character
+// is the average of a square block of pixels, the smallest block that fits
+// the frame in that many terminal columns and rows. combine averages the
+// channels into one picture instead of drawing one per channel
+struct displayParams {
+    int64_t columns = 0;
+    int64_t rows = 0;
+    bool combine = false;
+};
+
+// Appends the text of the frame at offset
+void renderFrame(const videoData& targetVideo, int64_t offset,
+const displayParams& params, std::string* text);
+
+// Each selected frame goes out in one write. With fps above 0 frames are
+// drawn over each other from the top of the screen at that rate instead of
+// scrolling
+void show_video(const videoData& targetVideo, const frameRange& range,
+const displayParams& params, double fps);
+
+// FRAME DEDUPLICATION
+// With dedup on, ops in the default and -S modes process each distinct
+// frame once and writeFile stores repeats in the compressed container as
+// references to the first copy
+void setDedup(bool enabled);
+
+bool dedupEnabled();
+
+// Four independent 64 bit lanes over 32 byte blocks, fast enough that
+// hashing costs about as much as reading the data. genvideo hashes whole
+// files with it, so dedup and the scale tests share one mixer
+class streamHash {
+ public:
+    void update(const unsigned char* data, int64_t size);
+    uint64_t finish();
+
+ private:
+    void block(const unsigned char* data);
+
+    uint64_t lanes[4] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+    0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull};
+    unsigned char pending[32];
+    int pendingBytes = 0;
+    uint64_t length = 0;
+};
+
+// streamHash of a single buffer
+uint64_t frameHash(const unsigned char* frame, int64_t length);
+
+// firstCopy[i] is the earliest frame with the same bytes as frame i, i for
+// the first copy itself. Returns the number of distinct frames
+int64_t findDuplicates(const videoData& inputVideo,
+std::vector<int64_t>* firstCopy);
+
+int dedup_pipeline(videoData& inputVideo, const std::vector<frameOp>& ops,
+const char outputPath[]);
+
 #endif  // LIBFILMMASTER2000_H_
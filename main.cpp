@@ -2,10 +2,531 @@
 #include <iostream>
 // For processing and working with argv[] as strings
 #include <string>
+// For sorting curve control points
+#include <algorithm>
+#include <vector>
+// For the batch mode: manifest reading, job threads and per-job output
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+// For the daemon mode's Unix domain socket
+#include <climits>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "libFilmMaster2000.h"
 
+// ARGUMENT PARSING
+// Each parser prints its own error and returns 1, same as loadFile
+int parseChannel(const std::string& input, const videoData& inVid,
+int* channel) {
+    *channel = std::stoi(input);
+    // Convert the channel to an int, compare with channel number
+    if (*channel >= inVid.channels || *channel < 0) {
+        std::cout
+        << "Channel out of bounds error. "
+        << static_cast<unsigned int>(inVid.channels)-1
+        << "  is the highest channel index in the video. Input was "
+        << *channel << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int parseChannelPair(const std::string& input, const videoData& inVid,
+int* channelA, int* channelB) {
+    // Find where the comma is, take everything before/after as min/max
+    size_t splitter = input.find(',');
+    if (splitter == std::string::npos) {
+        std::cout
+        << "Range format incorrect. [min, max] should be of type x,y"
+        << std::endl;
+        return 1;
+    }
+
+    *channelA = std::stoi(input.substr(0, splitter));
+    *channelB = std::stoi(input.substr(splitter+1));
+
+    // Convert the channel to an int, compare with channel number
+    if (*channelA >= inVid.channels ||
+        *channelB >= inVid.channels ||
+        *channelA < 0 ||
+        *channelB < 0) {
+        std::cout
+        << "Channel out of bounds error. "
+        << static_cast<unsigned int>(inVid.channels)-1
+        << " is the highest channel index in the video. Input was "
+        << *channelA << " and " << *channelB << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int parseRange(std::string rangeInput, int* min, int* max,
+int highest = 255) {
+    if (rangeInput.at(0) != '[' ||
+    rangeInput.at(rangeInput.size()-1) != ']') {
+        std::cout
+        << "Missing brackets on range. Input should be of type [min, max]"
+        << std::endl;
+        return 1;
+    }
+
+    // Find where the comma is, take everything before/after as the min/max
+    size_t splitter = (rangeInput.find(','));
+    if (splitter == std::string::npos || rangeInput.size() < 5) {
+        std::cout
+        << "Range format incorrect. [min, max] should be of type [x,y]"
+        << std::endl;
+        return 1;
+    }
+
+    // https://stackoverflow.com/questions/23834624/remove-first-and-last-character-c
+    rangeInput = rangeInput.substr(1, rangeInput.size() - 2);
+    *min = stoi((rangeInput).substr(0, splitter));
+    *max = stoi((rangeInput).substr(splitter));
+    if (*min < 0 || *max > highest) {
+        std::cout
+        << "Range format incorrect. [min, max] range "
+        << "should be between 0 and " << highest
+        << std::endl;
+        return 1;
+    }
+    if (*min > *max) {
+        std::cout
+        << "Range format incorrect. min can not be above max"
+        << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int parseFactor(const std::string& input, float* scaleFactor) {
+    *scaleFactor = std::stof(input);
+    if (*scaleFactor < 0) {
+        std::cout
+        << "Can not scale channel by negative number!"
+        << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// box_blur takes a radius in pixels, gaussian_blur a sigma
+int parseBlur(const std::string& command, const std::string& input,
+blurParams* params) {
+    float value = std::stof(input);
+    if (command == "box_blur") {
+        if (!(value >= 1 && value <= maxBlurRadius) ||
+        value != static_cast<int>(value)) {
+            std::cout << "Blur radius should be a whole number from 1 to "
+            << maxBlurRadius << std::endl;
+            return 1;
+        }
+        *params = makeBoxBlur(value);
+    } else {
+        if (!(value > 0 && value <= maxBlurRadius / 3.0f)) {
+            std::cout << "Blur sigma should be above 0 and at most "
+            << maxBlurRadius / 3 << std::endl;
+            return 1;
+        }
+        *params = makeGaussianBlur(value);
+    }
+    return 0;
+}
+
+// resize takes the new width and height and the filter, area or bilinear
+int parseResize(const videoData& inVid, const std::string& width,
+const std::string& height, const std::string& filter,
+resizeParams* params) {
+    int64_t sides[2] = {std::stoll(width), std::stoll(height)};
+    int64_t oldSides[2] = {inVid.width, inVid.height};
+    for (int i = 0; i < 2; i++) {
+        if (sides[i] < 1 || sides[i] > maxResizeSide ||
+        oldSides[i] > sides[i] * maxResizeShrink) {
+            std::cout << "New sizes go from 1 to " << maxResizeSide
+            << " and at most " << maxResizeShrink
+            << " times below the old ones." << std::endl;
+            return 1;
+        }
+    }
+    if (filter != "area" && filter != "bilinear") {
+        std::cout << "The resize filter is area or bilinear." << std::endl;
+        return 1;
+    }
+    return makeResize(inVid, sides[0], sides[1], filter == "bilinear",
+    params);
+}
+
+// frame_average takes the window in frames, temporal_denoise also the
+// threshold
+int parseTemporal(const std::string& window, const std::string& threshold,
+temporalParams* params) {
+    int frames = std::stoi(window);
+    int limit = threshold.empty() ? 255 : std::stoi(threshold);
+    if (frames < 1 || frames > maxTemporalWindow) {
+        std::cout << "The window goes from 1 to " << maxTemporalWindow
+        << " frames." << std::endl;
+        return 1;
+    }
+    if (limit < 0 || limit > 255) {
+        std::cout << "The threshold goes from 0 to 255." << std::endl;
+        return 1;
+    }
+    *params = makeTemporal(frames, limit);
+    return 0;
+}
+
+// --fit takes COLSxROWS, on its own the size of the terminal the output
+// goes to, 80x24 when it is not a terminal. --fps goes up to 1000
+int parseDisplay(const std::vector<std::string>& options,
+displayParams* params, double* fps) {
+    for (const std::string& option : options) {
+        size_t equals = option.find('=');
+        std::string name = option.substr(0, equals);
+        std::string value =
+        (equals == std::string::npos) ? "" : option.substr(equals + 1);
+        size_t cross = value.find('x');
+        if (name == "--combine") {
+            params->combine = true;
+        } else if (name == "--fit" && value.empty()) {
+            struct winsize size;
+            bool terminal = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 &&
+            size.ws_col > 0 && size.ws_row > 0;
+            params->columns = terminal ? size.ws_col : 80;
+            params->rows = terminal ? size.ws_row : 24;
+        } else if (name == "--fit" && cross != std::string::npos) {
+            params->columns = std::stoll(value.substr(0, cross));
+            params->rows = std::stoll(value.substr(cross + 1));
+            if (params->columns < 2 || params->rows < 4) {
+                std::cout << "--fit needs at least 2 columns and 4 rows."
+                << std::endl;
+                return 1;
+            }
+        } else if (name == "--fps") {
+            *fps = std::stod(value);
+            if (!(*fps > 0 && *fps <= 1000)) {
+                std::cout << "--fps goes from above 0 to 1000." << std::endl;
+                return 1;
+            }
+        } else {
+            std::cout << "Invalid display option " << option << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int parseGamma(const std::string& input, float* gamma) {
+    *gamma = std::stof(input);
+    if (!(*gamma > 0)) {
+        std::cout << "Gamma has to be a positive number!" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Control points come as in:out pairs, e.g. 0:0,64:40,192:220,255:255
+int parseCurve(const std::string& input,
+std::vector<std::pair<int, int>>* points) {
+    size_t start = 0;
+    while (start < input.size()) {
+        size_t end = input.find(',', start);
+        if (end == std::string::npos) {
+            end = input.size();
+        }
+        std::string point = input.substr(start, end - start);
+        size_t splitter = point.find(':');
+        if (splitter == std::string::npos) {
+            std::cout
+            << "Curve format incorrect. Points should be of type in:out"
+            << std::endl;
+            return 1;
+        }
+        int in = std::stoi(point.substr(0, splitter));
+        int out = std::stoi(point.substr(splitter + 1));
+        if (in < 0 || in > 255 || out < 0 || out > 255) {
+            std::cout
+            << "Curve points should be between 0 and 255" << std::endl;
+            return 1;
+        }
+        points->emplace_back(in, out);
+        start = end + 1;
+    }
+
+    std::sort(points->begin(), points->end());
+    for (size_t i = 1; i < points->size(); i++) {
+        if ((*points)[i].first == (*points)[i-1].first) {
+            std::cout << "Curve has two points with the same input "
+            << (*points)[i].first << std::endl;
+            return 1;
+        }
+    }
+    if (points->size() < 2) {
+        std::cout << "Curve needs at least two points." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Row major NxN coefficients, e.g. 0.3,0.6,0.1,... for the first N channels
+int parseMatrix(const std::string& input, const videoData& inVid,
+std::vector<float>* coefficients) {
+    size_t start = 0;
+    while (start < input.size()) {
+        size_t end = input.find(',', start);
+        if (end == std::string::npos) {
+            end = input.size();
+        }
+        float coefficient = std::stof(input.substr(start, end - start));
+        // Coefficients are stored as 16 bit fixed point with 12 fraction bits
+        if (coefficient < -8.0f || coefficient >= 8.0f) {
+            std::cout
+            << "Matrix coefficients should be between -8 and 8" << std::endl;
+            return 1;
+        }
+        coefficients->push_back(coefficient);
+        start = end + 1;
+    }
+
+    size_t size = 1;
+    while (size * size < coefficients->size()) {
+        size++;
+    }
+    // Wide headers allow more channels than a matrix kernel holds
+    const int64_t largest = std::min<int64_t>(inVid.channels, 255);
+    if (size * size != coefficients->size() ||
+    static_cast<int64_t>(size) > largest) {
+        std::cout
+        << "Matrix should have NxN coefficients, with N at most "
+        << largest << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// a:b[:step] selects frames a, a+step, ... below b. Either end may be left
+// out, a defaults to the first frame and b to one past the last
+int parseFrameRange(const std::string& input, const videoData& inVid,
+frameRange* range) {
+    std::vector<std::string> parts(1);
+    for (char character : input) {
+        if (character == ':') {
+            parts.emplace_back();
+        } else {
+            parts.back().push_back(character);
+        }
+    }
+    if (parts.size() < 2 || parts.size() > 3 ||
+    input.find_first_not_of("0123456789:") != std::string::npos) {
+        std::cout
+        << "Frame range format incorrect. Ranges should be of type a:b or"
+        << " a:b:step" << std::endl;
+        return 1;
+    }
+    const std::string& begin = parts[0];
+    const std::string& end = parts[1];
+    std::string step = parts.size() == 3 ? parts[2] : "";
+    range->begin = begin.empty() ? 0 : std::stoll(begin);
+    range->end = end.empty() ? inVid.numFrames :
+    std::min<int64_t>(std::stoll(end), inVid.numFrames);
+    range->step = step.empty() ? 1 : std::stoll(step);
+    if (range->step < 1 || rangeCount(*range) == 0) {
+        std::cout
+        << "Frame range selects no frames, the video has "
+        << inVid.numFrames << " frames." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int checkSepiaChannels(const videoData& inVid) {
+    if (inVid.channels < 3) {
+        std::cout
+        << "Sepia command requires three channels, input video contains "
+        << static_cast<unsigned int>(inVid.channels)
+        << " channels."
+        << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Reads "op args op args ..." from argv[first] onwards into an op list,
+// using the same argument formats as the standalone commands
+int parsePipeline(int argc, char* argv[], int first, const videoData& inVid,
+std::vector<frameOp>* ops) {
+    int arg = first;
+    while (arg < argc) {
+        std::string name = argv[arg];
+        frameOp op;
+
+        if (name == "reverse") {
+            op.code = OP_REVERSE;
+            arg += 1;
+        } else if (name == "swap_channel" && arg + 1 < argc) {
+            op.code = OP_SWAP;
+            if (parseChannelPair(argv[arg+1], inVid,
+            &op.channel, &op.channel2) == 1) {
+                return 1;
+            }
+            arg += 2;
+        } else if (name == "clip_channel" && arg + 2 < argc) {
+            op.code = OP_CLIP;
+            int min, max;
+            if (parseChannel(argv[arg+1], inVid, &op.channel) == 1 ||
+            parseRange(argv[arg+2], &min, &max) == 1) {
+                return 1;
+            }
+            op.minimum = min;
+            op.maximum = max;
+            arg += 3;
+        } else if (name == "scale_channel" && arg + 2 < argc) {
+            op.code = OP_SCALE;
+            if (parseChannel(argv[arg+1], inVid, &op.channel) == 1 ||
+            parseFactor(argv[arg+2], &op.scaleFactor) == 1) {
+                return 1;
+            }
+            arg += 3;
+        } else if (name == "gamma" && arg + 2 < argc) {
+            op.code = OP_GAMMA;
+            if (parseChannel(argv[arg+1], inVid, &op.channel) == 1 ||
+            parseGamma(argv[arg+2], &op.gamma) == 1) {
+                return 1;
+            }
+            arg += 3;
+        } else if (name == "levels" && arg + 3 < argc) {
+            op.code = OP_LEVELS;
+            int inMin, inMax, outMin, outMax;
+            if (parseChannel(argv[arg+1], inVid, &op.channel) == 1 ||
+            parseRange(argv[arg+2], &inMin, &inMax) == 1 ||
+            parseRange(argv[arg+3], &outMin, &outMax) == 1) {
+                return 1;
+            }
+            op.minimum = inMin;
+            op.maximum = inMax;
+            op.outMinimum = outMin;
+            op.outMaximum = outMax;
+            arg += 4;
+        } else if (name == "color_matrix" && arg + 1 < argc) {
+            op.code = OP_MATRIX;
+            if (parseMatrix(argv[arg+1], inVid, &op.coefficients) == 1) {
+                return 1;
+            }
+            arg += 2;
+        } else if (name == "sepia") {
+            if (checkSepiaChannels(inVid) == 1) {
+                return 1;
+            }
+            op = makeSepiaOp();
+            arg += 1;
+        } else if (name == "curves" && arg + 2 < argc) {
+            op.code = OP_CURVES;
+            if (parseChannel(argv[arg+1], inVid, &op.channel) == 1 ||
+            parseCurve(argv[arg+2], &op.curvePoints) == 1) {
+                return 1;
+            }
+            arg += 3;
+        } else {
+            std::cout
+            << "Invalid pipeline operation or missing arguments: "
+            << name << std::endl;
+            return 1;
+        }
+        ops->push_back(op);
+    }
+
+    if (ops->empty()) {
+        std::cout << "pipeline needs at least one operation." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Ops that only reorder frames and planes are done as byte range copies
+// between the files when the frames would otherwise be mapped
+bool remapOps(videoData& inVid, const std::vector<frameOp>& ops,
+unsigned char offset, char* argv[]) {
+    if (getIOBackend() != IO_MMAP ||
+    (offset == 1 && std::string(argv[3]) == "-M")) {
+        return false;
+    }
+    return remap_pipeline(inVid, ops, argv[2], argv[1]) == 0;
+}
+
+// Op lists go through the pipeline functions for the requested mode
+int runOps(videoData& inVid, const std::vector<frameOp>& ops,
+unsigned char offset, char* argv[]) {
+    if (remapOps(inVid, ops, offset, argv)) {
+        return 0;
+    }
+    if (offset == 1) {
+        if (std::string(argv[3]) == "-M") {
+            if (memory_pipeline(inVid, ops, argv[2], argv[1]) == 1) {
+                return 1;
+            }
+        } else {
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
+            speed_pipeline(inVid, ops, argv[2]);
+        }
+    } else {
+        if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+            return 1;
+        }
+        run_pipeline(inVid, ops, argv[2]);
+    }
+    return 0;
+}
+
+// The counting pass of stats and auto_levels, -M streams the frames and
+// the other modes count the frames already in memory
+int gatherStats(videoData& inVid, unsigned char offset, char* argv[],
+videoStats* stats) {
+    if (offset == 1 && std::string(argv[3]) == "-M") {
+        return memory_stats(inVid, argv[1], stats);
+    }
+    if (offset == 1) {
+        speed_stats(inVid, stats);
+    } else {
+        stats_video(inVid, stats);
+    }
+    return 0;
+}
+
 // MAIN FUNCTIONS
 int handleFunctions(int argc, char* argv[]) {
+    // --frames belongs to the command rather than the process, so it stays
+    // in argv for batch lines and daemon clients and is taken out here
+    std::string frameSelection;
+    std::vector<std::string> displayOptions;
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--frames=", 0) == 0) {
+            frameSelection = arg.substr(9);
+        } else if (arg.rfind("--fit", 0) == 0 || arg == "--combine" ||
+        arg.rfind("--fps=", 0) == 0) {
+            displayOptions.push_back(arg);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    if (argc < 4) {
+        std::cout << "Invalid number of parameters." << std::endl;
+        return 1;
+    }
+
     unsigned char offset = 0;
     std::string flagSetting = argv[3];
     if ((flagSetting == "-S") || (flagSetting == "-M")) {
@@ -21,6 +542,97 @@ int handleFunctions(int argc, char* argv[]) {
     // Wanted to use a switch, using if-else instead: https://cplusplus.com/forum/beginner/70619/
     std::string command = argv[3 + offset];
 
+    frameRange range = {0, inVid.numFrames, 1};
+    bool ranged = !frameSelection.empty();
+    if (ranged && parseFrameRange(frameSelection, inVid, &range) == 1) {
+        return 1;
+    }
+    if (!displayOptions.empty() && command != "show_video") {
+        std::cout << "--fit, --combine and --fps only apply to show_video."
+        << std::endl;
+        return 1;
+    }
+    // The compressed container, the lookup tables behind the pipeline ops
+    // and the ranged block engine only know 8 bit samples
+    bool blurOp = command == "box_blur" || command == "gaussian_blur";
+    bool temporalOp =
+    command == "frame_average" || command == "temporal_denoise";
+    bool statsOp = command == "stats" || command == "auto_levels";
+    bool tableOp = command == "color_matrix" || command == "gamma" ||
+    command == "levels" || command == "curves" || command == "pipeline" ||
+    blurOp || command == "resize" || temporalOp || statsOp;
+    if (inVid.wide && writesCompressed(inVid)) {
+        std::cout << "The compressed container holds 8 bit videos with up to "
+        << "255 channels, rows and columns." << std::endl;
+        return 1;
+    }
+    if (inVid.bitDepth > 8 && (tableOp ||
+    (ranged && command != "show_video"))) {
+        std::cout << command << (ranged ? " on a frame range" : "")
+        << " needs 8 bit samples, this video has "
+        << static_cast<unsigned int>(inVid.bitDepth) << "." << std::endl;
+        return 1;
+    }
+    if (command == "convert") {
+        if (argc != 4 + offset || ranged) {
+            std::cout
+            << "convert takes 3 mandatory arguments in the type:"
+            << " input output convert, with --format=raw|compressed"
+            << " and --input-layout/--output-layout=planar|interleaved"
+            << std::endl;
+            return 1;
+        }
+        return convert_video(inVid, argv[2], argv[1]);
+    }
+    if (command == "trim") {
+        if (argc != 5 + offset || ranged ||
+        parseFrameRange(argv[4 + offset], inVid, &range) == 1) {
+            std::cout
+            << "trim takes 4 mandatory arguments in the type:"
+            << " input output trim a:b[:step]" << std::endl;
+            return 1;
+        }
+        return trim_frames(inVid, range, argv[2], argv[1]);
+    }
+    // Ops that compute pixels run once per distinct frame with --dedup,
+    // -M never holds the frames needed to find the repeats
+    bool pixelOp = command == "clip_channel" || command == "scale_channel" ||
+    command == "sepia" || command == "color_matrix" || command == "gamma" ||
+    command == "levels" || command == "curves" || command == "pipeline";
+    if (dedupEnabled() && pixelOp && !ranged && inVid.bitDepth == 8 &&
+    !(offset == 1 && std::string(argv[3]) == "-M")) {
+        std::vector<frameOp> ops;
+        int first = (command == "pipeline") ? 4 + offset : 3 + offset;
+        if (parsePipeline(argc, argv, first, inVid, &ops) == 1) {
+            std::cout << "Invalid parameters for " << command << std::endl;
+            return 1;
+        }
+        if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+            return 1;
+        }
+        dedup_pipeline(inVid, ops, argv[2]);
+        releaseFrames(&inVid);
+        return 0;
+    }
+    if (ranged && (blurOp || command == "resize" || temporalOp ||
+    statsOp)) {
+        std::cout << command << " works on whole videos, --frames does not "
+        << "apply." << std::endl;
+        return 1;
+    }
+    if (ranged && command != "show_video") {
+        // Every op is a one element pipeline on the selected frames, which
+        // are processed in blocks whatever the -S/-M flag
+        std::vector<frameOp> ops;
+        int first = (command == "pipeline") ? 4 + offset : 3 + offset;
+        if (parsePipeline(argc, argv, first, inVid, &ops) == 1) {
+            std::cout << "Invalid parameters for " << command
+            << " on a frame range." << std::endl;
+            return 1;
+        }
+        return range_pipeline(inVid, ops, range, argv[2], argv[1]);
+    }
+
     if (command == "reverse") {
         if (argc != 4 + offset) {
             std::cout << "Invalid number of parameters." << std::endl;
@@ -30,16 +642,31 @@ int handleFunctions(int argc, char* argv[]) {
             << std::endl;
             return 1;
         }
+        frameOp reverseOp;
+        reverseOp.code = OP_REVERSE;
         // From now on, for checking flags, I'll check the offset number
-        if (offset == 1) {
+        if (sameFile(argv[1], argv[2])) {
+            // Every mode reverses in place rather than copying over itself
+            if (block_reverse(inVid, argv[2], argv[1]) == 1) {
+                return 1;
+            }
+        } else if (remapOps(inVid, {reverseOp}, offset, argv)) {
+            // Frames were copied across in reverse order, nothing to load
+        } else if (offset == 1) {
             if (std::string(argv[3]) == "-M") {
-                memory_reverse(inVid, argv[2], argv[1]);
+                if (memory_reverse(inVid, argv[2], argv[1]) == 1) {
+                    return 1;
+                }
             } else {
-                loadFrames(&inVid, argv[1]);
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
                 speed_reverse(inVid, argv[2]);
             }
         } else {
-            loadFrames(&inVid, argv[1]);
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
             reverse(inVid, argv[2]);
         }
 
@@ -52,45 +679,35 @@ int handleFunctions(int argc, char* argv[]) {
             return 1;
         }
 
-        // Find where the comma is, take everything before/after as min/max
-        size_t splitter = (std::string(argv[4 + offset]).find(','));
-        if (splitter == std::string::npos) {
-            std::cout
-            << "Range format incorrect. [min, max] should be of type x,y"
-            << std::endl;
-            return 1;
-        }
-
+        int channelAInput, channelBInput;
         // Everything after position 2 requires offset for optional flags
-        int channelAInput = std::stoi(std::string(argv[4 + offset])
-        .substr(0, splitter));
-
-        int channelBInput = std::stoi(std::string(argv[4 + offset])
-        .substr(splitter+1));
-
-        // Convert the channel to an int, compare with channel number
-        if (channelAInput >= inVid.channels ||
-            channelBInput >= inVid.channels ||
-            channelAInput < 0 ||
-            channelBInput < 0) {
-            std::cout
-            << "Channel out of bounds error. "
-            << static_cast<unsigned int>(inVid.channels)-1
-            << " is the highest channel index in the video. Input was "
-            << channelAInput << " and " << channelBInput << std::endl;
+        if (parseChannelPair(argv[4 + offset], inVid,
+        &channelAInput, &channelBInput) == 1) {
             return 1;
         }
-        if (offset == 1) {
+        frameOp swapOp;
+        swapOp.code = OP_SWAP;
+        swapOp.channel = channelAInput;
+        swapOp.channel2 = channelBInput;
+        if (remapOps(inVid, {swapOp}, offset, argv)) {
+            // Planes were copied across in their new order, nothing to load
+        } else if (offset == 1) {
             if (std::string(argv[3]) == "-M") {
-                memory_swap(inVid, channelAInput,
-                channelBInput, argv[2], argv[1]);
+                if (memory_swap(inVid, channelAInput,
+                channelBInput, argv[2], argv[1]) == 1) {
+                    return 1;
+                }
             } else {
-                loadFrames(&inVid, argv[1]);
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
                 speed_swap(inVid, channelAInput, channelBInput, argv[2]);
             }
 
         } else {
-            loadFrames(&inVid, argv[1]);
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
             swap_channel(inVid, channelAInput, channelBInput, argv[2]);
         }
 
@@ -104,54 +721,27 @@ int handleFunctions(int argc, char* argv[]) {
             return 1;
         }
 
-        int channelInput = std::stoi(argv[4 + offset]);
-        // Convert the channel to an int, compare with channel number
-        if (channelInput >= inVid.channels || channelInput < 0) {
-            std::cout
-            << "Channel out of bounds error. "
-            << static_cast<unsigned int>(inVid.channels)-1
-            << "  is the highest channel index in the video. Input was "
-            << channelInput << std::endl;
-            return 1;
-        }
-
-        std::string rangeInput = argv[5 + offset];
-        if (rangeInput.at(0) != '[' ||
-        rangeInput.at(rangeInput.size()-1) != ']') {
-            std::cout
-            << "Missing brackets on range. Input should be of type [min, max]"
-            << std::endl;
-            return 1;
-        }
-
-        // Find where the comma is, take everything before/after as the min/max
-        size_t splitter = (rangeInput.find(','));
-        if (splitter == std::string::npos || rangeInput.size() < 5) {
-            std::cout
-            << "Range format incorrect. [min, max] should be of type [x,y]"
-            << std::endl;
+        int channelInput, min, max;
+        if (parseChannel(argv[4 + offset], inVid, &channelInput) == 1 ||
+        parseRange(argv[5 + offset], &min, &max, maxSample(inVid)) == 1) {
             return 1;
         }
-
-        // https://stackoverflow.com/questions/23834624/remove-first-and-last-character-c
-        rangeInput = rangeInput.substr(1, rangeInput.size() - 2);
-        int min = stoi((rangeInput).substr(0, splitter));
-        int max = stoi((rangeInput).substr(splitter));
-        if (min < 0 || max > 255) {
-            std::cout
-            << "Range format incorrect. [min, max] range "
-            << "should be between 0 and 255"
-            << std::endl;
-        }
         if (offset == 1) {
             if (std::string(argv[3]) == "-M") {
-                memory_clip(inVid, channelInput, min, max, argv[2], argv[1]);
+                if (memory_clip(inVid, channelInput, min, max,
+                argv[2], argv[1]) == 1) {
+                    return 1;
+                }
             } else {
-                loadFrames(&inVid, argv[1]);
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
                 speed_clip(inVid, channelInput, min, max, argv[2]);
             }
         } else {
-            loadFrames(&inVid, argv[1]);
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
             clip_channel(inVid, channelInput, min, max, argv[2]);
         }
 
@@ -164,88 +754,776 @@ int handleFunctions(int argc, char* argv[]) {
             << std::endl;
             return 1;
         }
-        int channelInput = std::stoi(argv[4 + offset]);
-        if (channelInput >= inVid.channels ||
-            channelInput < 0) {
+        int channelInput;
+        float scaleFactor;
+        if (parseChannel(argv[4 + offset], inVid, &channelInput) == 1 ||
+        parseFactor(argv[5 + offset], &scaleFactor) == 1) {
+            return 1;
+        }
+        if (offset == 1) {
+            if (std::string(argv[3]) == "-M") {
+                if (memory_scale(inVid, channelInput, scaleFactor,
+                argv[2], argv[1]) == 1) {
+                    return 1;
+                }
+            } else {
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
+                speed_scale(inVid, channelInput, scaleFactor, argv[2]);
+            }
+        } else {
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
+            scale_channel(inVid, channelInput, scaleFactor, argv[2]);
+        }
+    } else if (command == "pipeline") {
+        std::vector<frameOp> ops;
+        if (parsePipeline(argc, argv, 4 + offset, inVid, &ops) == 1) {
             std::cout
-            << "Channel out of bounds error. "
-            << static_cast<unsigned int>(inVid.channels)-1
-            << "  is the highest channel index in the video. Input was "
-            << channelInput << std::endl;
+            << "pipeline takes a list of operations in the type:"
+            << " input output -S/-M(OPTIONAL) pipeline op [args] op [args]..."
+            << std::endl;
+            return 1;
+        }
+        if (runOps(inVid, ops, offset, argv) == 1) {
             return 1;
         }
-        float scaleFactor = std::stof(argv[5+offset]);
-        if (scaleFactor < 0) {
+    } else if (command == "gamma" || command == "levels" ||
+    command == "curves") {
+        // Single point ops are a one element pipeline on the table engine
+        int expected = (command == "levels") ? 7 : 6;
+        std::vector<frameOp> ops;
+        if (argc != expected + offset ||
+        parsePipeline(argc, argv, 3 + offset, inVid, &ops) == 1) {
+            std::cout << "Invalid parameters." << std::endl;
             std::cout
-            << "Can not scale channel by negative number!"
+            << "Use input output -S/-M(OPTIONAL) followed by one of:"
+            << std::endl
+            << "gamma channel value" << std::endl
+            << "levels channel [in_min,in_max] [out_min,out_max]" << std::endl
+            << "curves channel in:out,in:out,..." << std::endl;
+            return 1;
+        }
+        if (runOps(inVid, ops, offset, argv) == 1) {
+            return 1;
+        }
+    } else if (command == "show_video") {
+        displayParams params;
+        double fps = 0;
+        if (parseDisplay(displayOptions, &params, &fps) == 1 ||
+        loadFrames(&inVid, argv[1]) == 1) {
+            return 1;
+        }
+        show_video(inVid, range, params, fps);
+    } else if (command == "sepia") {
+        if (argc != 4+offset) {
+            std::cout << "Invalid number of parameters." << std::endl;
+            std::cout
+            << "sepia takes 3 mandatory arguments in the type:"
+            << "input output -S/-M(OPTIONAL) sepia"
             << std::endl;
             return 1;
         }
+
+        if (checkSepiaChannels(inVid) == 1) {
+            return 1;
+        }
+
         if (offset == 1) {
             if (std::string(argv[3]) == "-M") {
-                memory_scale(inVid, channelInput, scaleFactor,
-                argv[2], argv[1]);
+                if (memory_sepia(inVid, argv[2], argv[1]) == 1) {
+                    return 1;
+                }
             } else {
-                loadFrames(&inVid, argv[1]);
-                speed_scale(inVid, channelInput, scaleFactor, argv[2]);
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
+                speed_sepia(inVid, argv[2]);
             }
         } else {
-            loadFrames(&inVid, argv[1]);
-            scale_channel(inVid, channelInput, scaleFactor, argv[2]);
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
+            sepia_filter(inVid, argv[2]);
+        }
+    } else if (blurOp) {
+        blurParams params;
+        if (argc != 5 + offset ||
+        parseBlur(command, argv[4 + offset], &params) == 1) {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << command << " takes 4 mandatory arguments in the type:"
+            << " input output -S/-M(OPTIONAL) " << command
+            << (command == "box_blur" ? " radius" : " sigma") << std::endl;
+            return 1;
+        }
+        if (offset == 1) {
+            if (std::string(argv[3]) == "-M") {
+                if (memory_blur(inVid, params, argv[2], argv[1]) == 1) {
+                    return 1;
+                }
+            } else {
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
+                speed_blur(inVid, params, argv[2]);
+            }
+        } else {
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
+            blur_filter(inVid, params, argv[2]);
+        }
+    } else if (temporalOp) {
+        temporalParams params;
+        bool denoise = command == "temporal_denoise";
+        if (argc != (denoise ? 6 : 5) + offset ||
+        parseTemporal(argv[4 + offset], denoise ? argv[5 + offset] : "",
+        &params) == 1) {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << command << " takes " << (denoise ? 5 : 4)
+            << " mandatory arguments in the type:"
+            << " input output -S/-M(OPTIONAL) " << command << " window"
+            << (denoise ? " threshold" : "") << std::endl;
+            return 1;
+        }
+        if (offset == 1) {
+            if (std::string(argv[3]) == "-M") {
+                return memory_temporal(inVid, params, argv[2], argv[1]);
+            } else {
+                if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                    return 1;
+                }
+                speed_temporal(inVid, params, argv[2]);
+            }
+        } else {
+            if (openFrames(&inVid, argv[1], argv[2]) == 1) {
+                return 1;
+            }
+            temporal_filter(inVid, params, argv[2]);
+        }
+    } else if (command == "resize") {
+        // Checked first, the filter weights need pixels to spread over
+        if (inVid.width == 0 || inVid.height == 0) {
+            std::cout << "The video has no pixels to resize." << std::endl;
+            return 1;
+        }
+        resizeParams params;
+        if (argc != 7 + offset || parseResize(inVid, argv[4 + offset],
+        argv[5 + offset], argv[6 + offset], &params) == 1) {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << "resize takes 6 mandatory arguments in the type:"
+            << " input output -S/-M(OPTIONAL) resize width height "
+            << "area|bilinear" << std::endl;
+            return 1;
+        }
+        if (sameFile(argv[1], argv[2])) {
+            std::cout << "resize needs a different output file." << std::endl;
+            return 1;
+        }
+        if (writesCompressed(inVid) &&
+        (params.width > 255 || params.height > 255)) {
+            std::cout << "The compressed container holds videos with up to "
+            << "255 rows and columns." << std::endl;
+            return 1;
+        }
+        // The output file gets the new geometry, so the frames are never
+        // mapped from it
+        if (offset == 1 && std::string(argv[3]) == "-M") {
+            if (memory_resize(inVid, params, argv[2], argv[1]) == 1) {
+                return 1;
+            }
+        } else {
+            if (loadFrames(&inVid, argv[1]) == 1) {
+                return 1;
+            }
+            if (offset == 1) {
+                speed_resize(inVid, params, argv[2]);
+            } else {
+                resize_video(inVid, params, argv[2]);
+            }
+        }
+    } else if (command == "stats") {
+        std::string scope = argc == 5 + offset ? argv[4 + offset] : "";
+        if (scope != "video" && scope != "frames") {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << "stats takes 4 mandatory arguments in the type:"
+            << " input report.json -S/-M(OPTIONAL) stats video|frames"
+            << std::endl;
+            return 1;
+        }
+        if (sameFile(argv[1], argv[2])) {
+            std::cout << "stats needs a report file other than the input."
+            << std::endl;
+            return 1;
+        }
+        // The second path is the report, the frames are never mapped
+        // from it
+        bool streamed = offset == 1 && std::string(argv[3]) == "-M";
+        if (!streamed && loadFrames(&inVid, argv[1]) == 1) {
+            return 1;
+        }
+        videoStats stats = makeStats(inVid, scope == "frames");
+        if (gatherStats(inVid, offset, argv, &stats) == 1 ||
+        writeStats(inVid, stats, argv[2]) == 1) {
+            releaseFrames(&inVid);
+            return 1;
+        }
+    } else if (command == "auto_levels") {
+        float clipPercent = argc == 5 + offset ?
+        std::stof(argv[4 + offset]) : -1.0f;
+        if (!(clipPercent >= 0 && clipPercent < 50)) {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << "auto_levels takes 4 mandatory arguments in the type:"
+            << " input output -S/-M(OPTIONAL) auto_levels percent, "
+            << "with the percent clipped at each end below 50" << std::endl;
+            return 1;
+        }
+        // -M reads the input twice, once to count and once to apply the
+        // levels, the other modes count the frames they then work on
+        bool streamed = offset == 1 && std::string(argv[3]) == "-M";
+        if (!streamed && openFrames(&inVid, argv[1], argv[2]) == 1) {
+            return 1;
+        }
+        videoStats stats = makeStats(inVid, false);
+        if (gatherStats(inVid, offset, argv, &stats) == 1) {
+            releaseFrames(&inVid);
+            return 1;
+        }
+        std::vector<frameOp> ops = autoLevelsOps(stats, clipPercent);
+        if (ops.empty()) {
+            // Every channel already spans the full range, the identity
+            // levels still write the output
+            frameOp identity;
+            identity.code = OP_LEVELS;
+            ops.push_back(identity);
+        }
+        if (streamed) {
+            if (memory_pipeline(inVid, ops, argv[2], argv[1]) == 1) {
+                return 1;
+            }
+        } else if (offset == 1) {
+            speed_pipeline(inVid, ops, argv[2]);
+        } else {
+            run_pipeline(inVid, ops, argv[2]);
+        }
+    } else if (command == "color_matrix") {
+        std::vector<frameOp> ops;
+        if (argc != 5 + offset ||
+        parsePipeline(argc, argv, 3 + offset, inVid, &ops) == 1) {
+            std::cout << "Invalid parameters." << std::endl;
+            std::cout
+            << "color_matrix takes 4 mandatory arguments in the type:"
+            << " input output -S/-M(OPTIONAL) color_matrix c00,c01,...,cNN"
+            << std::endl;
+            return 1;
+        }
+        if (runOps(inVid, ops, offset, argv) == 1) {
+            return 1;
         }
-    } else if (command == "show_video") {
-        loadFrames(&inVid, argv[1]);
-        for (int i=0; i < inVid.numFrames; i++) {
-            std::cout << "FRAME #" << i << std::endl;
-            int initialOffset = (i*inVid.frameSize);
-            printFrame(inVid, initialOffset);
-        }
-    // } else if (command == "sepia") {
-    //     if (argc != 4+offset) {
-    //         std::cout << "Invalid number of parameters." << std::endl;
-    //         std::cout
-    //         << "sepia takes 3 mandatory arguments in the type:"
-    //         << "input output -S/-M(OPTIONAL) sepia"
-    //         << std::endl;
-    //         return 1;
-    //     }
-
-    //     if (inVid.channels < 3) {
-    //         std::cout
-    //         << "Sepia command requires three channels, input video contains "
-    //         << inVid.channels
-    //         << "channels."
-    //         << std::endl;
-    //         return 1;
-    //     }
-
-    //     if (offset == 1) {
-    //         if (std::string(argv[3]) == "-M") {
-    //             memory_sepia(inVid, argv[2], argv[1]);
-    //         } else {
-    //             loadFrames(&inVid, argv[1]);
-    //             speed_sepia(inVid, argv[2]);
-    //         }
-    //     } else {
-    //         loadFrames(&inVid, argv[1]);
-    //         sepia_filter(inVid, argv[2]);
-    //     }
     } else {
         std::cout << "Invalid command." << std::endl;
         std::cout << "Valid commands are:" << std::endl;
         std::cout
         << "reverse, swap_channel, clip_channel, "
-        << "scale_channel"
+        << "scale_channel, sepia, color_matrix, gamma, levels, curves, "
+        << "box_blur, gaussian_blur, resize, frame_average, "
+        << "temporal_denoise, stats, auto_levels, pipeline, trim, convert"
+        << std::endl;
+        return 1;
+    }
+
+    releaseFrames(&inVid);
+    return 0;
+}
+
+// BATCH MODE
+// A manifest line is a regular command line without ./runme, e.g.
+// "in.bin out.bin -S clip_channel 0 [10,200]". Blank lines and lines
+// starting with # are skipped, arguments are split on whitespace
+static std::string batchManifest;
+static int batchJobs = 0;
+// Kept frame buffers, enough for a few clips of one geometry per job
+const int64_t batchPoolBytes = 512 * 1024 * 1024;
+
+struct batchJob {
+    int line;
+    std::vector<std::string> args;
+};
+
+// While a job runs on a thread, everything it prints goes into its own
+// string instead of the terminal, so concurrent jobs never interleave
+static thread_local std::string* jobOutput = nullptr;
+
+class jobOutputBuffer : public std::streambuf {
+ public:
+    explicit jobOutputBuffer(std::streambuf* terminal) : terminal(terminal) {}
+
+ protected:
+    int overflow(int character) override {
+        if (character == traits_type::eof()) {
+            return traits_type::not_eof(character);
+        }
+        if (jobOutput) {
+            jobOutput->push_back(static_cast<char>(character));
+            return character;
+        }
+        return terminal->sputc(static_cast<char>(character));
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize count) override {
+        if (jobOutput) {
+            jobOutput->append(text, count);
+            return count;
+        }
+        return terminal->sputn(text, count);
+    }
+
+    int sync() override {
+        return jobOutput ? 0 : terminal->pubsync();
+    }
+
+ private:
+    std::streambuf* terminal;
+};
+
+int readManifest(const std::string& path, std::vector<batchJob>* jobs) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        std::cout << "Failed to open the batch manifest " << path << std::endl;
+        return 1;
+    }
+    std::string text;
+    int line = 0;
+    while (std::getline(manifest, text)) {
+        line++;
+        std::istringstream words(text);
+        batchJob job = {line, {"runme"}};
+        std::string word;
+        while (words >> word) {
+            job.args.push_back(word);
+        }
+        if (job.args.size() > 1 && job.args[1][0] != '#') {
+            jobs->push_back(job);
+        }
+    }
+    return 0;
+}
+
+// One job through handleFunctions, exactly as if it had been run alone
+int runJob(batchJob& job, std::string* output) {
+    if (job.args.size() < 4) {
+        *output = "Usage: input output -S/-M(OPTIONAL) function [options]\n";
+        return 1;
+    }
+    std::vector<char*> argv;
+    for (std::string& arg : job.args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+    jobOutput = output;
+    int status;
+    try {
+        status = handleFunctions(static_cast<int>(job.args.size()),
+        argv.data());
+    } catch (const std::exception& error) {
+        // Arguments that are not numbers make std::stoi throw
+        *output += std::string("Invalid argument: ") + error.what() + "\n";
+        status = 1;
+    }
+    jobOutput = nullptr;
+    return status;
+}
+
+// One status line, failed jobs add their own messages below it
+std::string jobStatus(const batchJob& job, const char* label, int status,
+double milliseconds, const std::string& output) {
+    std::ostringstream report;
+    report << (status == 1 ? "FAIL" : "ok  ") << " " << label << " "
+    << job.line << " (" << static_cast<int64_t>(milliseconds) << " ms):";
+    for (size_t arg = 1; arg < job.args.size(); arg++) {
+        report << " " << job.args[arg];
+    }
+    report << "\n";
+    if (status == 1) {
+        std::istringstream lines(output);
+        std::string message;
+        while (std::getline(lines, message)) {
+            report << "     " << message << "\n";
+        }
+    }
+    return report.str();
+}
+
+// Runs the manifest on batchJobs threads that take the next job as they
+// finish one. The thread pool, options and kept buffers are set up once
+// for all of them, each job reports one status line when it is done
+int runBatch() {
+    std::vector<batchJob> jobs;
+    if (readManifest(batchManifest, &jobs) == 1) {
+        return 1;
+    }
+    enableBufferPool(batchPoolBytes);
+    int threads = batchJobs > 0 ? batchJobs : poolThreadCount();
+    threads = std::max(1, std::min<int>(threads, jobs.size()));
+
+    std::streambuf* terminal = std::cout.rdbuf();
+    jobOutputBuffer splitter(terminal);
+    std::cout.rdbuf(&splitter);
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> nextJob{0};
+    std::atomic<int> failed{0};
+    std::mutex reportLock;
+    auto runner = [&]() {
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+            batchJob& job = jobs[i];
+            std::string output;
+            auto jobStart = std::chrono::steady_clock::now();
+            int status = runJob(job, &output);
+            double milliseconds = std::chrono::duration<double, std::milli>
+            (std::chrono::steady_clock::now() - jobStart).count();
+            if (status == 1) {
+                failed++;
+            }
+
+            std::string report = jobStatus(job, "line", status,
+            milliseconds, output);
+            std::lock_guard<std::mutex> guard(reportLock);
+            terminal->sputn(report.data(), report.size());
+            terminal->pubsync();
+        }
+    };
+    std::vector<std::thread> runners;
+    for (int i = 1; i < threads; i++) {
+        runners.emplace_back(runner);
+    }
+    runner();
+    for (auto& thread : runners) {
+        thread.join();
+    }
+    std::cout.rdbuf(terminal);
+
+    double seconds = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+    std::cout << "Batch: " << jobs.size() << " jobs, "
+    << jobs.size() - failed << " ok, " << failed << " failed, "
+    << threads << " at a time, " << bufferPoolReuses()
+    << " buffers reused, " << seconds << " s" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// DAEMON MODE
+// runme --serve=socket keeps running and takes commands from clients
+// started as runme --connect=socket input output ... A request is the
+// command's arguments, each ending in a zero byte. The reply is '0' or '1'
+// for the exit code followed by everything the command printed
+static std::string serveSocket;
+static std::string connectSocket;
+static int64_t cacheBytes = 1024ll * 1024 * 1024;
+
+int openSocket(const std::string& path, sockaddr_un* address) {
+    if (path.size() >= sizeof(address->sun_path)) {
+        std::cout << "Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    std::memset(address, 0, sizeof(sockaddr_un));
+    address->sun_family = AF_UNIX;
+    std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        // A client that went away must not take the daemon down with SIGPIPE
+        ssize_t count = send(fd, data.data() + sent, data.size() - sent,
+        MSG_NOSIGNAL);
+        if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+// Reads until the other side shuts down its end
+std::string receiveAll(int fd) {
+    std::string data;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, count);
+    }
+    return data;
+}
+
+void serveClient(int client, int request) {
+    std::string message = receiveAll(client);
+    batchJob job = {request, {"runme"}};
+    size_t start = 0;
+    for (size_t end = message.find('\0'); end != std::string::npos;
+    end = message.find('\0', start)) {
+        job.args.push_back(message.substr(start, end - start));
+        start = end + 1;
+    }
+
+    std::string output;
+    auto jobStart = std::chrono::steady_clock::now();
+    int status = runJob(job, &output);
+    double milliseconds = std::chrono::duration<double, std::milli>
+    (std::chrono::steady_clock::now() - jobStart).count();
+    sendAll(client, std::string(status == 1 ? "1" : "0") + output);
+    close(client);
+
+    int64_t hits, misses, bytes;
+    frameCacheCounts(&hits, &misses, &bytes);
+    std::string report = jobStatus(job, "request", status, milliseconds,
+    output);
+    std::ostringstream cache;
+    cache << "     cache: " << hits << " hits, " << misses << " misses, "
+    << bytes / (1024 * 1024) << " MB held\n";
+    report += cache.str();
+    std::cerr << report << std::flush;
+}
+
+// Every client gets its own thread, the pool, kept buffers and the cache
+// of loaded videos are shared by all of them until the daemon is stopped
+int runDaemon() {
+    sockaddr_un address;
+    int listener = openSocket(serveSocket, &address);
+    if (listener < 0) {
+        return 1;
+    }
+    // A socket file left behind by an earlier daemon would block bind,
+    // anything else at that path is not ours to delete
+    struct stat existing;
+    if (lstat(serveSocket.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cout << serveSocket << " exists and is not a socket."
+            << std::endl;
+            close(listener);
+            return 1;
+        }
+        unlink(serveSocket.c_str());
+    }
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address),
+    sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cout << "Failed to listen on " << serveSocket << std::endl;
+        close(listener);
+        return 1;
+    }
+    // Every op goes through loadFrames, so cached videos are used
+    setIOBackend(IO_STREAM);
+    enableFrameCache(cacheBytes);
+    enableBufferPool(batchPoolBytes);
+    std::cout << "Serving on " << serveSocket << ", caching up to "
+    << cacheBytes / (1024 * 1024) << " MB of videos" << std::endl;
+
+    static jobOutputBuffer splitter(std::cout.rdbuf());
+    std::cout.rdbuf(&splitter);
+    for (int request = 1; ; request++) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        std::thread(serveClient, client, request).detach();
+    }
+}
+
+// Paths are sent absolute, the daemon may run in another directory
+int forwardCommand(int argc, char* argv[]) {
+    sockaddr_un address;
+    int server = openSocket(connectSocket, &address);
+    if (server < 0) {
+        return 1;
+    }
+    if (connect(server, reinterpret_cast<sockaddr*>(&address),
+    sizeof(address)) != 0) {
+        std::cout << "No daemon is listening on " << connectSocket
         << std::endl;
+        close(server);
+        return 1;
+    }
+    std::string request;
+    char directory[PATH_MAX];
+    int paths = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0 && paths++ < 2 && arg[0] != '/' &&
+        getcwd(directory, sizeof(directory))) {
+            arg = std::string(directory) + "/" + arg;
+        }
+        request += arg;
+        request.push_back('\0');
+    }
+    bool sent = sendAll(server, request);
+    shutdown(server, SHUT_WR);
+    std::string reply = receiveAll(server);
+    close(server);
+    if (!sent || reply.empty()) {
+        std::cout << "The daemon closed the connection." << std::endl;
         return 1;
     }
+    std::cout << reply.substr(1) << std::flush;
+    return reply[0] == '1' ? 1 : 0;
+}
 
-    free(inVid.fullFrame);
+// Pulls --name=value options out of argv so the positional arguments keep
+// their usual places, then applies them to the library
+int extractOptions(int* argc, char* argv[]) {
+    int kept = 1;
+    int threads = 0;
+    bool pinThreads = false;
+    int64_t blockBytes = defaultBlockBytes;
+    bool directIO = false;
+    asyncIO asyncMode = ASYNC_SYNC;
+    int queueDepth = defaultQueueDepth;
+    bool printStats = false;
+    std::string tracePath;
+    frameLayout inputLayout = LAYOUT_PLANAR;
+    frameLayout outputLayout = LAYOUT_AUTO;
+    for (int i = 1; i < *argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        size_t equals = arg.find('=');
+        std::string name = arg.substr(0, equals);
+        std::string value =
+        (equals == std::string::npos) ? "" : arg.substr(equals + 1);
+        // --trace also takes its file as the next argument
+        if (name == "--trace" && equals == std::string::npos &&
+        i + 1 < *argc) {
+            value = argv[++i];
+        }
+
+        if (name == "--io" && value == "mmap") {
+            setIOBackend(IO_MMAP);
+        } else if (name == "--io" && value == "stream") {
+            setIOBackend(IO_STREAM);
+        } else if (name == "--threads" && !value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos &&
+        value.size() <= 4 && std::stoi(value) > 0) {
+            threads = std::stoi(value);
+        } else if (name == "--pin" && equals == std::string::npos) {
+            pinThreads = true;
+        } else if (name == "--block-mb" && !value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos &&
+        value.size() <= 6 && std::stoi(value) > 0) {
+            blockBytes = std::stoll(value) * 1024 * 1024;
+        } else if (name == "--direct" && equals == std::string::npos) {
+            directIO = true;
+        } else if (name == "--aio" && (value == "sync" || value == "uring")) {
+            asyncMode = value == "uring" ? ASYNC_URING : ASYNC_SYNC;
+        } else if (name == "--queue-depth" && !value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos &&
+        value.size() <= 4 && std::stoi(value) > 0) {
+            queueDepth = std::stoi(value);
+        } else if (name == "--simd" && (value == "scalar" ||
+        value == "sse2" || value == "avx2" || value == "avx512")) {
+            setSimdLevel(value == "scalar" ? SIMD_SCALAR :
+            value == "sse2" ? SIMD_SSE2 :
+            value == "avx2" ? SIMD_AVX2 : SIMD_AVX512);
+        } else if (name == "--stats" && equals == std::string::npos) {
+            printStats = true;
+        } else if (name == "--trace" && !value.empty()) {
+            tracePath = value;
+        } else if (name == "--batch" && !value.empty()) {
+            batchManifest = value;
+        } else if (name == "--jobs" && !value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos &&
+        value.size() <= 4 && std::stoi(value) > 0) {
+            batchJobs = std::stoi(value);
+        } else if (name == "--format" && value == "raw") {
+            setOutputFormat(FORMAT_RAW);
+        } else if (name == "--format" && value == "compressed") {
+            setOutputFormat(FORMAT_COMPRESSED);
+        } else if ((name == "--input-layout" || name == "--output-layout") &&
+        (value == "planar" || value == "interleaved")) {
+            frameLayout layout =
+            value == "planar" ? LAYOUT_PLANAR : LAYOUT_INTERLEAVED;
+            if (name == "--input-layout") {
+                inputLayout = layout;
+            } else {
+                outputLayout = layout;
+            }
+        } else if (name == "--dedup" && equals == std::string::npos) {
+            setDedup(true);
+        } else if ((name == "--frames" && !value.empty()) ||
+        name == "--fit" || (name == "--fps" && !value.empty()) ||
+        (name == "--combine" && equals == std::string::npos)) {
+            // Left for handleFunctions, the range and the show_video view
+            // belong to the command
+            argv[kept++] = argv[i];
+        } else if (name == "--serve" && !value.empty()) {
+            serveSocket = value;
+        } else if (name == "--connect" && !value.empty()) {
+            connectSocket = value;
+        } else if (name == "--cache-mb" && !value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos &&
+        value.size() <= 7) {
+            cacheBytes = std::stoll(value) * 1024 * 1024;
+        } else {
+            std::cout << "Unknown option " << arg << std::endl;
+            std::cout << "Valid options are: --io=mmap|stream, "
+            << "--threads=N, --pin, --block-mb=N, --direct, "
+            << "--aio=sync|uring, --queue-depth=N, "
+            << "--simd=scalar|sse2|avx2|avx512, --stats, "
+            << "--trace=file.json, --batch=manifest, --jobs=N, "
+            << "--serve=socket, --connect=socket, --cache-mb=N, "
+            << "--frames=a:b[:step], --format=raw|compressed, --dedup, "
+            << "--fit[=COLSxROWS], --combine, --fps=N, "
+            << "--input-layout=planar|interleaved, "
+            << "--output-layout=planar|interleaved" << std::endl;
+            return 1;
+        }
+    }
+    configureThreadPool(threads, pinThreads);
+    setBlockIO(blockBytes, directIO);
+    setAsyncIO(asyncMode, queueDepth);
+    setFrameLayouts(inputLayout, outputLayout);
+    enableStats(printStats, tracePath.empty() ? nullptr : tracePath.c_str());
+    *argc = kept;
     return 0;
 }
 
 int main(int argc, char* argv[]) {
-    if (handleFunctions(argc, argv) == 1) {
+    if (extractOptions(&argc, argv) == 1) {
+        return 1;
+    }
+    if (!serveSocket.empty() && argc == 1) {
+        return runDaemon();
+    }
+    if (!connectSocket.empty() && argc >= 4) {
+        return forwardCommand(argc, argv);
+    }
+    if (!batchManifest.empty() && argc == 1) {
+        int status = runBatch();
+        finishStats();
+        return status;
+    }
+    if (argc < 4) {
+        std::cout
+        << "Usage: ./runme input output -S/-M(OPTIONAL) function [options]"
+        << std::endl
+        << "   or: ./runme --batch=manifest [--jobs=N] [options]"
+        << std::endl
+        << "   or: ./runme --serve=socket [--cache-mb=N] [options]"
+        << std::endl
+        << "   or: ./runme --connect=socket input output ..." << std::endl;
+        return 1;
+    }
+    int status = handleFunctions(argc, argv);
+    finishStats();
+    if (status == 1) {
         return 1;
     } else {
         return 0;
@@ -0,0 +1,390 @@
+#!/bin/bash
+
+# Runs every op in every mode on generated videos past the 2GB mark and
+# compares each output with the hash genvideo's reference code expects
+# Usage: ./scaleTest.sh [sparse size (default: 3G)] [directory (default: /tmp)]
+size=${1:-3G}
+directory=${2:-/tmp}
+
+if [ ! -x ./runme ] || [ ! -x ./genvideo ]; then
+    echo "Error: build first with 'make all generator'."
+    exit 1
+fi
+
+sparse="$directory/fm2000_scale_sparse.bin"
+pattern="$directory/fm2000_scale_pattern.bin"
+few="$directory/fm2000_scale_few.bin"
+small="$directory/fm2000_scale_small.bin"
+thin="$directory/fm2000_scale_thin.bin"
+ramp="$directory/fm2000_scale_ramp.bin"
+deepSparse="$directory/fm2000_scale_deep_sparse.bin"
+deep="$directory/fm2000_scale_deep.bin"
+deep12="$directory/fm2000_scale_deep12.bin"
+packed="$directory/fm2000_scale_packed.bin"
+output="$directory/fm2000_scale_out.bin"
+converted="$directory/fm2000_scale_converted.bin"
+
+# Sparse stays cheap on disk at any size, the pattern file has real pixels.
+# few has too few frames to go round the threads, so -S cuts them into
+# bands, small has sides the filters reach past and thin is one pixel high.
+# Every byte value is equally common in every channel of ramp. The deep
+# files have 16 and 12 bit samples behind the wide header
+./genvideo write "$sparse" "$size" 3 255 255 sparse || exit 1
+./genvideo write "$pattern" 256M 3 200 160 pattern || exit 1
+./genvideo write "$few" 2 3 255 255 pattern || exit 1
+./genvideo write "$small" 5 3 37 53 pattern || exit 1
+./genvideo write "$thin" 4 2 1 9 pattern || exit 1
+./genvideo write "$ramp" 12 3 64 64 ramp || exit 1
+./genvideo write "$deepSparse" "$size" 3 255 255 sparse 16 || exit 1
+./genvideo write "$deep" 64M 3 200 160 pattern 16 || exit 1
+./genvideo write "$deep12" 5 3 37 53 pattern 12 || exit 1
+
+ops=(
+    "reverse"
+    "swap_channel 0,2"
+    "clip_channel 1 [10,200]"
+    "scale_channel 2 1.5"
+    "sepia"
+    "color_matrix 0.299,0.587,0.114,0.299,0.587,0.114,0.299,0.587,0.114"
+    "gamma 0 1.8"
+    "levels 1 [16,235] [0,255]"
+    "curves 1 0:0,64:48,192:208,255:255"
+    "pipeline swap_channel 1,2 clip_channel 1 [10,200] scale_channel 1 1.5 reverse"
+)
+modes=("" "-S" "-M")
+# Whole frame filters, only run on the files with real pixels
+filters=(
+    "box_blur 2"
+    "gaussian_blur 1.5"
+    "resize 100 77 area"
+    "resize 100 77 bilinear"
+    "resize 333 260 bilinear"
+    "frame_average 1"
+    "frame_average 4"
+    "temporal_denoise 5 40"
+    "stats video"
+    "stats frames"
+    "auto_levels 1"
+)
+edgeFilters=(
+    "box_blur 1"
+    "box_blur 40"
+    "gaussian_blur 0.6"
+    "gaussian_blur 20"
+    "resize 300 290 area"
+    "resize 300 290 bilinear"
+    "resize 23 17 area"
+    "resize 23 17 bilinear"
+)
+# Windows reaching past both ends of the video, from a single frame to
+# the largest, and thresholds at both limits
+temporalEdges=(
+    "frame_average 1"
+    "frame_average 9"
+    "frame_average 255"
+    "temporal_denoise 2 0"
+    "temporal_denoise 8 255"
+)
+# Sides down to one pixel, too far a shrink for few
+thinResizes=(
+    "resize 1 1 area"
+    "resize 1 40 bilinear"
+    "resize 70 1 area"
+)
+# What runs on samples deeper than 8 bits, with clips up to the 12 bit
+# maximum and scales that reach past it
+deepOps=(
+    "reverse"
+    "swap_channel 0,2"
+    "clip_channel 1 [300,4000]"
+    "clip_channel 1 [0,4095]"
+    "scale_channel 2 1.5"
+    "scale_channel 0 0.3"
+    "sepia"
+)
+levels=("scalar" "sse2" "avx2" "avx512")
+
+passed=0
+failed=0
+
+# check input op mode [options] [expected hash] [back]: one run, one hash
+# comparison, against genvideo's reference unless the hash is given. With
+# back, the output is first converted with those options and the result
+# hashed, which brings compressed or interleaved outputs back to raw
+check() {
+    local input=$1 op=$2 mode=$3 options=$4 expected=$5 back=$6
+    local actual hashed=$output
+    if [ -z "$expected" ]; then
+        expected=$(./genvideo expect "$input" $op)
+    fi
+    if ! ./runme "$input" "$output" $mode $op $options > /dev/null; then
+        actual="runme failed"
+    elif [ -n "$back" ] &&
+    ! ./runme "$output" "$converted" convert $back > /dev/null; then
+        actual="convert back failed"
+    else
+        [ -n "$back" ] && hashed=$converted
+        actual=$(./genvideo hash "$hashed")
+    fi
+    if [ "$expected" == "$actual" ]; then
+        passed=$((passed + 1))
+        echo "ok   $(basename "$input") $mode $op $options"
+    else
+        failed=$((failed + 1))
+        echo "FAIL $(basename "$input") $mode $op $options ($actual, expected $expected)"
+    fi
+}
+
+# inPlace input op mode options back: runs op on a copy of input with the
+# output written over it, then converts it back with those options and
+# compares with genvideo's reference for the input
+inPlace() {
+    local input=$1 op=$2 mode=$3 options=$4 back=$5
+    local expected actual
+    expected=$(./genvideo expect "$input" $op)
+    cp "$input" "$packed"
+    if ! ./runme "$packed" "$packed" $mode $op $options > /dev/null; then
+        actual="runme failed"
+    elif ! ./runme "$packed" "$converted" convert $back > /dev/null; then
+        actual="convert back failed"
+    else
+        actual=$(./genvideo hash "$converted")
+    fi
+    if [ "$expected" == "$actual" ]; then
+        passed=$((passed + 1))
+        echo "ok   $(basename "$input") in place $mode $op $options"
+    else
+        failed=$((failed + 1))
+        echo "FAIL $(basename "$input") in place $mode $op $options ($actual, expected $expected)"
+    fi
+}
+
+# refused input output mode op [options]: runme has to fail and leave the
+# input as it was
+refused() {
+    local input=$1 target=$2 mode=$3 op=$4 options=$5
+    local before
+    before=$(./genvideo hash "$input")
+    if ! ./runme "$input" "$target" $mode $op $options > /dev/null &&
+    [ "$(./genvideo hash "$input")" == "$before" ]; then
+        passed=$((passed + 1))
+        echo "ok   $(basename "$input") $mode $op $options refused"
+    else
+        failed=$((failed + 1))
+        echo "FAIL $(basename "$input") $mode $op $options not refused"
+    fi
+}
+
+for input in "$sparse" "$pattern"; do
+    for op in "${ops[@]}"; do
+        for mode in "${modes[@]}"; do
+            check "$input" "$op" "$mode" ""
+        done
+    done
+done
+
+# The other I/O paths only run on the pattern file, stream holds it in memory
+for op in "${ops[@]}"; do
+    check "$pattern" "$op" "" "--io=stream"
+    check "$pattern" "$op" "-S" "--threads=3"
+done
+check "$pattern" "reverse" "-M" "--block-mb=1 --direct"
+
+for op in "${filters[@]}"; do
+    for mode in "${modes[@]}"; do
+        check "$pattern" "$op" "$mode" ""
+    done
+done
+# Every kernel width on the edge cases, -S with bands of rows
+edge() {
+    local input=$1 op=$2 level
+    for level in "${levels[@]}"; do
+        check "$input" "$op" "" "--simd=$level"
+        check "$input" "$op" "-S" "--threads=4 --simd=$level"
+        check "$input" "$op" "-M" "--simd=$level"
+    done
+}
+for op in "${edgeFilters[@]}" "${temporalEdges[@]}"; do
+    edge "$few" "$op"
+done
+for op in "${temporalEdges[@]}"; do
+    edge "$small" "$op"
+done
+for op in "${edgeFilters[@]}" "${thinResizes[@]}"; do
+    edge "$small" "$op"
+    edge "$thin" "$op"
+done
+
+# 12 frames of 64x64 ramps hold every value 192 times per channel, so the
+# summary is known and auto_levels 10 clips at 25 and 230 in each channel
+bins="$(printf '192, %.0s' {1..255})192"
+clipped=$(./genvideo expect "$ramp" levels 0 [25,230] [0,255] \
+levels 1 [25,230] [0,255] levels 2 [25,230] [0,255])
+unchanged=$(./genvideo hash "$ramp")
+for mode in "${modes[@]}"; do
+    ./runme "$ramp" "$output" $mode stats frames > /dev/null
+    if [ "$(grep -cF '"min": 0, "max": 255, "mean": 127.500000,' "$output")" \
+    == 3 ] && [ "$(grep -cF "\"histogram\": [$bins]}" "$output")" == 3 ] &&
+    [ "$(grep -oF '{"min": 0, "max": 255, "mean": 127.500000}' "$output" |
+    wc -l)" == 36 ]; then
+        passed=$((passed + 1))
+        echo "ok   ramp $mode stats frames"
+    else
+        failed=$((failed + 1))
+        echo "FAIL ramp $mode stats frames"
+    fi
+    check "$ramp" "auto_levels 10" "$mode" "" "$clipped"
+    check "$ramp" "auto_levels 0" "$mode" "" "$unchanged"
+done
+
+# Raw and compressed convert into each other without loss, and every op
+# reads and writes the container in every mode. Reports stay text
+for input in "$few" "$small" "$ramp"; do
+    check "$input" "convert" "" "--format=compressed" \
+    "$(./genvideo hash "$input")" "--format=raw"
+done
+./runme "$small" "$packed" convert --format=compressed > /dev/null
+for op in "${ops[@]}" "${filters[@]}"; do
+    expected=$(./genvideo expect "$small" $op)
+    back="--format=raw"
+    [[ $op == stats* ]] && back=""
+    for mode in "${modes[@]}"; do
+        check "$packed" "$op" "$mode" "--format=raw" "$expected"
+        # The container holds sides up to 255, larger resizes only go raw
+        [[ $op == "resize 333"* ]] && continue
+        check "$packed" "$op" "$mode" "" "$expected" "$back"
+    done
+done
+# The ramp repeats every 4 frames, so --dedup stores references to them
+./runme "$ramp" "$packed" convert --format=compressed --dedup > /dev/null
+./runme "$ramp" "$output" convert --format=compressed > /dev/null
+if [ "$(wc -c < "$packed")" -lt "$(wc -c < "$output")" ]; then
+    passed=$((passed + 1))
+    echo "ok   ramp convert --format=compressed --dedup is smaller"
+else
+    failed=$((failed + 1))
+    echo "FAIL ramp convert --format=compressed --dedup is smaller"
+fi
+check "$packed" "convert" "" "--format=raw" "$(./genvideo hash "$ramp")"
+for op in "${ops[@]}"; do
+    expected=$(./genvideo expect "$ramp" $op)
+    for mode in "${modes[@]}"; do
+        check "$ramp" "$op" "$mode" "--format=compressed --dedup" \
+        "$expected" "--format=raw"
+        check "$packed" "$op" "$mode" "--dedup" "$expected" "--format=raw"
+    done
+done
+
+# Planar and interleaved convert into each other without loss, thin has
+# two channels. Every op reads interleaved, writes it or both in every
+# mode, and few splits its frames into bands across the -S threads
+planar="--input-layout=interleaved --output-layout=planar"
+for input in "$pattern" "$few" "$small" "$thin" "$ramp"; do
+    check "$input" "convert" "" "--output-layout=interleaved" \
+    "$(./genvideo hash "$input")" "$planar"
+done
+for input in "$few" "$small"; do
+    ./runme "$input" "$packed" convert --output-layout=interleaved > /dev/null
+    for op in "${ops[@]}" "${filters[@]}"; do
+        expected=$(./genvideo expect "$input" $op)
+        for mode in "${modes[@]}" "-S --threads=4"; do
+            check "$packed" "$op" "$mode" "$planar" "$expected"
+            [[ $op == stats* ]] && continue
+            check "$input" "$op" "$mode" "--output-layout=interleaved" \
+            "$expected" "$planar"
+            check "$packed" "$op" "$mode" "--input-layout=interleaved" \
+            "$expected" "$planar"
+        done
+    done
+done
+
+# 16 and 12 bit samples through every mode, every kernel width on the
+# odd sides of the 12 bit file, and both through interleaved frames
+for input in "$deepSparse" "$deep"; do
+    for op in "${deepOps[@]}"; do
+        for mode in "${modes[@]}"; do
+            check "$input" "$op" "$mode" ""
+        done
+    done
+done
+for op in "${deepOps[@]}"; do
+    edge "$deep12" "$op"
+done
+for input in "$deep" "$deep12"; do
+    check "$input" "convert" "" "--output-layout=interleaved" \
+    "$(./genvideo hash "$input")" "$planar"
+    ./runme "$input" "$packed" convert --output-layout=interleaved > /dev/null
+    for op in "${deepOps[@]}"; do
+        expected=$(./genvideo expect "$input" $op)
+        for mode in "${modes[@]}"; do
+            check "$packed" "$op" "$mode" "$planar" "$expected"
+            check "$input" "$op" "$mode" "--output-layout=interleaved" \
+            "$expected" "$planar"
+        done
+    done
+done
+
+# The compressed and interleaved writers truncate the file the frames were
+# read from when the output is the input, which must not lose them
+sameFileOps=("clip_channel 1 [10,200]" "sepia" "gaussian_blur 1.5"
+"pipeline swap_channel 1,2 scale_channel 1 1.5")
+for mode in "" "-S"; do
+    for op in "${sameFileOps[@]}"; do
+        inPlace "$small" "$op" "$mode" "--format=compressed" "--format=raw"
+        inPlace "$small" "$op" "$mode" "--format=compressed --dedup" \
+        "--format=raw"
+        inPlace "$small" "$op" "$mode" "--output-layout=interleaved" \
+        "$planar"
+    done
+done
+
+# -M truncates its output before reading, so it refuses to write over the
+# input and a failed stream shows in the exit code
+for op in "${sameFileOps[@]}"; do
+    cp "$small" "$packed"
+    refused "$packed" "$packed" "-M" "$op"
+    refused "$small" "$directory/fm2000_scale_missing/out.bin" "-M" "$op"
+done
+
+# The daemon only replaces a socket at its path, never another file
+cp "$small" "$packed"
+if ! timeout 10 ./runme --serve="$packed" > /dev/null &&
+[ "$(./genvideo hash "$packed")" == "$(./genvideo hash "$small")" ]; then
+    passed=$((passed + 1))
+    echo "ok   --serve on a video refused"
+else
+    failed=$((failed + 1))
+    echo "FAIL --serve on a video not refused"
+fi
+
+# Ranges outside the samples or upside down are refused, not wrapped
+for mode in "${modes[@]}"; do
+    for op in "clip_channel 1 [10,300]" "clip_channel 1 [-5,20]" \
+    "clip_channel 1 [200,10]" "levels 1 [16,235] [0,256]" \
+    "levels 1 [235,16] [0,255]" "pipeline clip_channel 1 [10,300] reverse"; do
+        refused "$small" "$output" "$mode" "$op"
+    done
+    refused "$deep12" "$output" "$mode" "clip_channel 1 [0,4096]"
+    check "$deep" "clip_channel 1 [1000,65535]" "$mode" ""
+done
+
+# In place reversal, twice gives back the original
+original=$(./genvideo hash "$pattern")
+expected=$(./genvideo expect "$pattern" reverse)
+./runme "$pattern" "$pattern" reverse > /dev/null
+once=$(./genvideo hash "$pattern")
+./runme "$pattern" "$pattern" -M reverse > /dev/null
+twice=$(./genvideo hash "$pattern")
+if [ "$once" == "$expected" ] && [ "$twice" == "$original" ]; then
+    passed=$((passed + 1))
+    echo "ok   in place reverse"
+else
+    failed=$((failed + 1))
+    echo "FAIL in place reverse"
+fi
+
+rm -f "$sparse" "$pattern" "$few" "$small" "$thin" "$ramp" "$deepSparse" \
+"$deep" "$deep12" "$packed" "$output" "$converted"
+echo "=================================================="
+echo "Passed: $passed, failed: $failed"
+[ "$failed" -eq 0 ]
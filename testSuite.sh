@@ -30,6 +30,10 @@ commands=(
 	"./runme ./data/test.bin ./editedFile.bin sepia"
 	"./runme ./data/test.bin ./editedFile.bin -M sepia"
 	"./runme ./data/test.bin ./editedFile.bin -S sepia"
+
+	"./runme ./data/test.bin ./editedFile.bin pipeline swap_channel 1,2 clip_channel 1 [10,200] scale_channel 1 1.5"
+	"./runme ./data/test.bin ./editedFile.bin -M pipeline swap_channel 1,2 clip_channel 1 [10,200] scale_channel 1 1.5"
+	"./runme ./data/test.bin ./editedFile.bin -S pipeline swap_channel 1,2 clip_channel 1 [10,200] scale_channel 1 1.5"
 )
 
 # Initialize results arrays